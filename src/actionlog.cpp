@@ -0,0 +1,536 @@
+#include "actionlog.h"
+
+#include "bytestream.h"
+#include "snapshot.h"
+
+#include <plog/Log.h>
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+using namespace logic;
+
+// Length and crc32 of the payload, both little endian
+#define RECORD_HEADER_SIZE 8
+
+namespace {
+    void putUint32(string& out, uint32_t n)
+    {
+        for (int i = 0; i < 4; i++) {
+            out.push_back(char((n >> (8 * i)) & 0xff));
+        }
+    }
+
+    uint32_t getUint32(const char* p)
+    {
+        uint32_t n = 0;
+        for (int i = 0; i < 4; i++) {
+            n |= uint32_t((unsigned char) p[i]) << (8 * i);
+        }
+        return n;
+    }
+
+    uint32_t checksum(const char* data, size_t size)
+    {
+        return crc32(crc32(0, nullptr, 0), (const Bytef*) data, size);
+    }
+
+    void putRecord(string& out, const string& payload)
+    {
+        putUint32(out, payload.size());
+        putUint32(out, checksum(payload.data(), payload.size()));
+        out.append(payload);
+    }
+
+    // False if the write failed, with errno set. Signals only interrupt it
+    bool writeAll(int fd, const string& data)
+    {
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = write(fd, data.data() + written, data.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            written += n;
+        }
+        return true;
+    }
+
+    // fdatasync, false with errno set if it failed
+    bool syncData(int fd)
+    {
+        int result;
+        do {
+            result = fdatasync(fd);
+        } while (result != 0 and errno == EINTR);
+        return result == 0;
+    }
+
+    // The first size bytes of the file at path, or all of it if size is npos
+    string readFile(const string& path, size_t size = string::npos)
+    {
+        ifstream ifs(path, ios::binary);
+        if (not ifs) {
+            return "";
+        }
+        if (size == string::npos) {
+            stringstream ss;
+            ss << ifs.rdbuf();
+            return ss.str();
+        }
+        string data(size, '\0');
+        ifs.read(data.data(), size);
+        data.resize(ifs.gcount());
+        return data;
+    }
+
+    // Where a game's records are in the log, see ActionLog::compact
+    struct GameRecords
+    {
+        // Its creation or latest snapshot
+        size_t base = 0;
+        // Its actions since then
+        vector<size_t> actions;
+    };
+
+    size_t recordSize(const string& data, size_t pos)
+    {
+        return RECORD_HEADER_SIZE + getUint32(&data[pos]);
+    }
+
+    // Numbers only go up, a compacted log can have a lower one after
+    void noteActionSeq(RecoveredGame& game, const LogRecord& record)
+    {
+        auto& seq = game.actionSeqs[record.clientId];
+        seq = max(seq, record.actionSeq);
+    }
+
+    /* Apply the records in data to games, stopping at the first that is
+     * torn or can't be read. Returns where that one starts, or data.size()
+     * if every record was good. If records is given only the seats are
+     * filled in, and where each game's records are noted in it instead of
+     * the games being played */
+    size_t replay(const string& data, vector<RecoveredGame>& games, 
+            vector<GameRecords>* records = nullptr)
+    {
+        unordered_map<string, size_t> byId;
+        size_t pos = 0;
+        while (pos + RECORD_HEADER_SIZE <= data.size()) {
+            uint32_t size = getUint32(&data[pos]);
+            uint32_t crc = getUint32(&data[pos + 4]);
+            const char* payload = &data[pos + RECORD_HEADER_SIZE];
+            if (size > data.size() - pos - RECORD_HEADER_SIZE or checksum(payload, size) != crc) {
+                break;
+            }
+            LogRecord record;
+            try {
+                record = deserialize<LogRecord>(payload, size);
+            } catch (exception& e) {
+                break;
+            }
+            size_t start = pos;
+            pos += RECORD_HEADER_SIZE + size;
+
+            // A compacted log starts a hibernated game with where it was
+            // hibernated, and a game restored since then with its snapshot
+            auto it = byId.find(record.gameId);
+            if (record.type == LOG_CREATE_GAME or (it == byId.end() 
+                    and (record.type == LOG_GAME_SNAPSHOT or record.type == LOG_HIBERNATED))) {
+                it = byId.insert({record.gameId, games.size()}).first;
+                games.emplace_back();
+                games.back().gameId = record.gameId;
+                if (records) {
+                    records->emplace_back();
+                }
+            }
+            if (it == byId.end()) {
+                LOG_ERROR << "Action log has a record for unknown game " << record.gameId;
+                continue;
+            }
+            auto& game = games[it->second];
+            switch (record.type) {
+                case LOG_CREATE_GAME:
+                case LOG_GAME_SNAPSHOT:
+                    game.hibernated = false;
+                    if (records) {
+                        (*records)[it->second] = {.base = start, .actions = {}};
+                    } else if (record.type == LOG_CREATE_GAME) {
+                        game.state.startGame();
+                    } else {
+                        try {
+                            game.state = FlatGameView(record.game.data(), record.game.size()).toGameState();
+                        } catch (runtime_error& e) {
+                            LOG_ERROR << "Bad snapshot of game " << record.gameId 
+                                << " in the action log: " << e.what();
+                        }
+                    }
+                    break;
+                case LOG_ACTION:
+                case LOG_KEYED_ACTION:
+                    if (records) {
+                        (*records)[it->second].actions.push_back(start);
+                    } else {
+                        game.state.performAction(record.action);
+                    }
+                    game.actions++;
+                    if (record.type == LOG_KEYED_ACTION) {
+                        noteActionSeq(game, record);
+                    }
+                    break;
+                case LOG_ACTION_SEQ:
+                    noteActionSeq(game, record);
+                    break;
+                case LOG_AUTO_PASS:
+                    game.autoPass[record.playerId] = (AutoPass) record.autoPass;
+                    break;
+                case LOG_JOIN_GAME:
+                    game.seats.push_back(record.username);
+                    if (record.username.empty()) {
+                        game.botThinkMs = record.botThinkMs;
+                    }
+                    break;
+                case LOG_HIBERNATED:
+                    game.state = GameState();
+                    game.hibernated = true;
+                    break;
+            }
+        }
+        return pos;
+    }
+}
+
+ActionLog::ActionLog(string path, bool sync, chrono::microseconds commitDelay,
+        size_t compactMinBytes)
+    : path(path), sync(sync), commitDelay(commitDelay), compactMinBytes(compactMinBytes),
+    compactAt(compactMinBytes)
+{
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        throw runtime_error("Could not open action log " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        fileSize = st.st_size;
+    }
+    writer = thread([this]{writerLoop();});
+    compactor = thread([this]{compactorLoop();});
+}
+
+ActionLog::~ActionLog()
+{
+    {
+        lock_guard<mutex> lk(m);
+        stop = true;
+    }
+    pending.notify_one();
+    compactWake.notify_one();
+    compactor.join();
+    writer.join();
+    close(fd);
+}
+
+uint64_t ActionLog::append(const LogRecord& record)
+{
+    auto& payload = threadBuffer();
+    serializeInto(payload, record);
+
+    uint64_t seq;
+    {
+        lock_guard<mutex> lk(m);
+        putRecord(batch, payload);
+        seq = ++appendedSeq;
+    }
+    pending.notify_one();
+    return seq;
+}
+
+uint64_t ActionLog::appendAction(const string& gameId, const Action& action,
+        const string& clientId, uint64_t actionSeq)
+{
+    return append({.type = clientId.size() ? LOG_KEYED_ACTION : LOG_ACTION, .gameId = gameId, 
+            .action = action, .username = "", .botThinkMs = 0, .game = "", 
+            .clientId = clientId, .actionSeq = actionSeq});
+}
+
+uint64_t ActionLog::appendCreateGame(const string& gameId)
+{
+    return append({.type = LOG_CREATE_GAME, .gameId = gameId, .action = {}, 
+            .username = "", .botThinkMs = 0, .game = ""});
+}
+
+uint64_t ActionLog::appendJoinGame(const string& gameId, const string& username, int botThinkMs)
+{
+    return append({.type = LOG_JOIN_GAME, .gameId = gameId, .action = {}, 
+            .username = username, .botThinkMs = botThinkMs, .game = ""});
+}
+
+uint64_t ActionLog::appendSnapshot(const string& gameId, const GameState& state)
+{
+    return append({.type = LOG_GAME_SNAPSHOT, .gameId = gameId, .action = {}, 
+            .username = "", .botThinkMs = 0, .game = flattenGame(state)});
+}
+
+uint64_t ActionLog::appendHibernated(const string& gameId)
+{
+    return append({.type = LOG_HIBERNATED, .gameId = gameId, .action = {}, 
+            .username = "", .botThinkMs = 0, .game = ""});
+}
+
+uint64_t ActionLog::appendAutoPass(const string& gameId, int playerId, AutoPass policy)
+{
+    return append({.type = LOG_AUTO_PASS, .gameId = gameId, .action = {}, 
+            .username = "", .botThinkMs = 0, .game = "", .clientId = "", .actionSeq = 0,
+            .playerId = playerId, .autoPass = policy});
+}
+
+bool ActionLog::waitDurable(uint64_t seq)
+{
+    unique_lock<mutex> lk(m);
+    durable.wait(lk, [this, seq]{return durableSeq >= seq or writeFailed;});
+    return durableSeq >= seq;
+}
+
+void ActionLog::whenDurable(uint64_t seq, function<void(bool)> done)
+{
+    bool ok;
+    {
+        lock_guard<mutex> lk(m);
+        ok = durableSeq >= seq;
+        if (not ok and not writeFailed) {
+            callbacks.insert({seq, move(done)});
+            return;
+        }
+    }
+    done(ok);
+}
+
+void ActionLog::writerLoop()
+{
+    unique_lock<mutex> lk(m);
+    while (true) {
+        pending.wait(lk, [this]{return stop or batch.size();});
+        if (batch.empty()) {
+            break;
+        }
+        if (commitDelay.count() and not stop) {
+            // Give other games a chance to add to this batch
+            lk.unlock();
+            this_thread::sleep_for(commitDelay);
+            lk.lock();
+        }
+        writing.clear();
+        swap(writing, batch);
+        uint64_t seq = appendedSeq;
+        uint64_t nRecords = seq - durableSeq;
+        bool failedBefore = writeFailed;
+        writingBatch = true;
+        lk.unlock();
+
+        // Once a write or sync has failed what is on disk after the last
+        // good batch can't be trusted, so nothing more is written
+        bool ok = not failedBefore;
+        if (ok and not writeAll(fd, writing)) {
+            LOG_ERROR << "Could not write to action log " << path << ": " << strerror(errno);
+            ok = false;
+        }
+        if (ok and sync and not syncData(fd)) {
+            LOG_ERROR << "Could not sync action log " << path << ": " << strerror(errno);
+            ok = false;
+        }
+
+        lk.lock();
+        writingBatch = false;
+        if (ok) {
+            fileSize += writing.size();
+            durableSeq = seq;
+            batches++;
+            records += nRecords;
+        } else if (not failedBefore) {
+            LOG_FATAL << "Action log " << path << " failed, no more records will be written";
+            writeFailed = true;
+        }
+        durable.notify_all();
+        if (fileSize >= compactAt and not compactWanted) {
+            compactWanted = true;
+            compactWake.notify_one();
+        }
+
+        // After a failure everyone waiting is told, their records never
+        // will be durable
+        if (callbacks.size() and (writeFailed or callbacks.begin()->first <= seq)) {
+            vector<function<void(bool)>> done;
+            auto end = writeFailed ? callbacks.end() : callbacks.upper_bound(seq);
+            for (auto it = callbacks.begin(); it != end; it++) {
+                done.push_back(move(it->second));
+            }
+            callbacks.erase(callbacks.begin(), end);
+            lk.unlock();
+            for (auto& f : done) {
+                f(ok);
+            }
+            lk.lock();
+        }
+    }
+}
+
+void ActionLog::compactorLoop()
+{
+    unique_lock<mutex> lk(m);
+    while (true) {
+        compactWake.wait(lk, [this]{return stop or compactWanted;});
+        if (stop) {
+            break;
+        }
+        lk.unlock();
+        try {
+            compact();
+        } catch (runtime_error& e) {
+            LOG_ERROR << "Could not compact action log: " << e.what();
+            lk.lock();
+            // Not again until it has grown some more
+            compactAt = fileSize * 2;
+            lk.unlock();
+        }
+        lk.lock();
+        compactWanted = false;
+    }
+}
+
+void ActionLog::compact()
+{
+    lock_guard<mutex> compacting(compactMutex);
+    size_t upTo;
+    {
+        lock_guard<mutex> lk(m);
+        if (writeFailed) {
+            throw runtime_error(path + " failed and is no longer written");
+        }
+        upTo = fileSize;
+    }
+    string data = readFile(path, upTo);
+    vector<RecoveredGame> games;
+    vector<GameRecords> records;
+    if (data.size() != upTo or replay(data, games, &records) != upTo) {
+        throw runtime_error("Could not read back " + path);
+    }
+
+    // Each game's seats, action numbers and auto-pass policies follow its
+    // first record, they aren't in snapshots. Later keyed actions only
+    // raise the numbers
+    string out, payload;
+    auto add = [&out, &payload](const LogRecord& record) {
+        payload.clear();
+        serializeInto(payload, record);
+        putRecord(out, payload);
+    };
+    for (size_t i = 0; i < games.size(); i++) {
+        auto& game = games[i];
+        if (game.hibernated) {
+            add({.type = LOG_HIBERNATED, .gameId = game.gameId, .action = {}, 
+                    .username = "", .botThinkMs = 0, .game = ""});
+        } else {
+            out.append(data, records[i].base, recordSize(data, records[i].base));
+        }
+        for (auto& seat : game.seats) {
+            add({.type = LOG_JOIN_GAME, .gameId = game.gameId, .action = {}, .username = seat, 
+                    .botThinkMs = seat.empty() ? game.botThinkMs : 0, .game = ""});
+        }
+        for (auto& [clientId, seq] : game.actionSeqs) {
+            add({.type = LOG_ACTION_SEQ, .gameId = game.gameId, .action = {}, .username = "", 
+                    .botThinkMs = 0, .game = "", .clientId = clientId, .actionSeq = seq});
+        }
+        for (auto& [playerId, policy] : game.autoPass) {
+            add({.type = LOG_AUTO_PASS, .gameId = game.gameId, .action = {}, .username = "", 
+                    .botThinkMs = 0, .game = "", .clientId = "", .actionSeq = 0, 
+                    .playerId = playerId, .autoPass = policy});
+        }
+        if (not game.hibernated) {
+            for (size_t action : records[i].actions) {
+                out.append(data, action, recordSize(data, action));
+            }
+        }
+    }
+    data.clear();
+    games.clear();
+
+    string compactPath = path + ".compact";
+    int compactFd = open(compactPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (compactFd < 0) {
+        throw runtime_error("Could not open " + compactPath);
+    }
+    auto fail = [&](const string& what) {
+        close(compactFd);
+        unlink(compactPath.c_str());
+        throw runtime_error(what);
+    };
+    if (not writeAll(compactFd, out) or (sync and not syncData(compactFd))) {
+        fail("Could not write " + compactPath);
+    }
+
+    // Holds up new records until the new file is in place, but only has to
+    // copy what was written while the games were being rebuilt
+    unique_lock<mutex> lk(m);
+    durable.wait(lk, [this]{return not writingBatch;});
+    string tail;
+    if (fileSize > upTo) {
+        ifstream ifs(path, ios::binary);
+        ifs.seekg(upTo);
+        tail.resize(fileSize - upTo);
+        ifs.read(tail.data(), tail.size());
+        if (not ifs) {
+            fail("Could not read the end of " + path);
+        }
+    }
+    if (not writeAll(compactFd, tail) or (sync and not syncData(compactFd))) {
+        fail("Could not write " + compactPath);
+    }
+    if (rename(compactPath.c_str(), path.c_str()) != 0) {
+        fail("Could not move " + compactPath + " over the log");
+    }
+    if (sync) {
+        string dir = std::filesystem::path(path).parent_path();
+        int dirFd = open(dir.size() ? dir.c_str() : ".", O_RDONLY | O_DIRECTORY);
+        if (dirFd >= 0) {
+            fsync(dirFd);
+            close(dirFd);
+        }
+    }
+    close(fd);
+    fd = compactFd;
+    size_t before = fileSize;
+    fileSize = out.size() + tail.size();
+    compactAt = max(compactMinBytes, fileSize * 2);
+    compactCount++;
+    lk.unlock();
+    LOG_INFO << "Compacted action log " << path << " from " << before << " to " << fileSize << " bytes";
+}
+
+vector<RecoveredGame> ActionLog::recover(string path)
+{
+    vector<RecoveredGame> games;
+    string data = readFile(path);
+    size_t pos = replay(data, games);
+
+    if (pos < data.size()) {
+        LOG_WARNING << "Dropping " << data.size() - pos
+            << " bytes of incomplete records from the end of " << path;
+        if (truncate(path.c_str(), pos) != 0) {
+            throw runtime_error("Could not truncate action log " + path);
+        }
+    }
+    return games;
+}
@@ -0,0 +1,219 @@
+#ifndef ACTIONLOG_H
+#define ACTIONLOG_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+
+#include "logic.h"
+
+// Compact the log once it is at least this big, see ActionLog::compact
+#define ACTION_LOG_COMPACT_MIN_BYTES (64 << 20)
+
+/* Write-ahead log of everything needed to rebuild the games on a server: the
+ * creation of each game, who took each seat in it and every action performed
+ * in it, in the order they were performed. Since startGame and performAction
+ * are deterministic, replaying the log rebuilds every game exactly.
+ *
+ * All games share one file so that a single fsync makes a whole batch of
+ * records durable, whichever games they came from (group commit). Records are
+ * added to an in-memory batch under a mutex, and a writer thread writes and
+ * syncs the batch while the next one fills up. Callers only reply to the
+ * client once their record is durable, see whenDurable. If a write or sync
+ * fails the log stops there, and callers are told their records aren't
+ * durable rather than the server stopping.
+ *
+ * So the log doesn't grow forever, it is compacted in the background once it
+ * has doubled in size. Games that have been hibernated are cut down to their
+ * seats, since their state is in the hibernation directory, and the rest
+ * keep their seats and only the records since their creation or their latest
+ * snapshot, which the server logs when it brings a hibernated game back.
+ * Either way the last action number of each client and each player's
+ * auto-pass policy are kept.
+ *
+ * Each record is its length, a crc32 of the payload, and the payload. A crash
+ * part way through a write leaves a record with a bad length or checksum at
+ * the end of the file, which recovery drops along with anything after it.
+ */
+
+enum LogRecordType {
+    LOG_CREATE_GAME,
+    LOG_ACTION,
+    // Someone took the next seat in the game
+    LOG_JOIN_GAME,
+    // The whole game, which replaces what the records before it built
+    LOG_GAME_SNAPSHOT,
+    // The game was written to the hibernation directory, the log no longer
+    // has its state until the next snapshot of it
+    LOG_HIBERNATED,
+    // An action sent with an idempotency key (see IDEMPOTENCY_KEY_HEADER),
+    // so retries of it aren't performed again after a restart
+    LOG_KEYED_ACTION,
+    // The last action number performed for a client, in place of its keyed
+    // actions when they are compacted away
+    LOG_ACTION_SEQ,
+    // A player changed what the server does for them, see setAutoPass
+    LOG_AUTO_PASS,
+};
+
+struct LogRecord
+{
+    LogRecordType type;
+    std::string gameId;
+    logic::Action action;
+    // Joins only: who took the seat, empty for the server's bot, which
+    // thinks for botThinkMs before each move
+    std::string username;
+    int botThinkMs = 0;
+    // Snapshots only: the game as flattenGame writes it, with its history
+    std::string game;
+    // Keyed actions and action numbers only: who sent it and its number
+    std::string clientId;
+    uint64_t actionSeq = 0;
+    // Auto-pass only: the player and their new logic::AutoPass
+    int playerId = 0;
+    int autoPass = 0;
+
+    // Only what the type uses is written, so logs from before seats and
+    // snapshots were logged still read
+    template<class Archive>
+    void serialize(Archive& archive) {
+        archive(type, gameId, action);
+        if (type == LOG_JOIN_GAME) {
+            archive(username, botThinkMs);
+        } else if (type == LOG_GAME_SNAPSHOT) {
+            archive(game);
+        } else if (type == LOG_KEYED_ACTION or type == LOG_ACTION_SEQ) {
+            archive(clientId, actionSeq);
+        } else if (type == LOG_AUTO_PASS) {
+            archive(playerId, autoPass);
+        }
+    }
+};
+
+// A game rebuilt from the log
+struct RecoveredGame
+{
+    std::string gameId;
+    logic::GameState state;
+    int actions = 0;
+    // Who sits in each seat in turn, "" for the bot
+    std::vector<std::string> seats;
+    int botThinkMs = 0;
+    // The last action number performed for each client, and what the
+    // server does for each player, as the server keeps them
+    std::map<std::string, uint64_t> actionSeqs;
+    std::map<int, logic::AutoPass> autoPass;
+    // In the hibernation directory, state is left empty
+    bool hibernated = false;
+};
+
+class ActionLog
+{
+    public:
+        /* Appends to the log at path, creating it if needed. If sync is
+         * false the records are written but never fsynced, which survives
+         * the server crashing but not the machine. commitDelay is how long the
+         * writer waits for more records before writing a batch, zero writes
+         * whatever is there as soon as the previous batch is done */
+        ActionLog(std::string path, bool sync = true,
+                std::chrono::microseconds commitDelay = std::chrono::microseconds(0),
+                size_t compactMinBytes = ACTION_LOG_COMPACT_MIN_BYTES);
+        ~ActionLog();
+
+        /* Add a record to the next batch and return its sequence number.
+         * Records for a game must be appended in the order they are
+         * performed, so call with the game's lock held */
+        uint64_t append(const LogRecord& record);
+        // With a clientId, the action is logged with its number from them
+        uint64_t appendAction(const std::string& gameId, const logic::Action& action,
+                const std::string& clientId = "", uint64_t actionSeq = 0);
+        uint64_t appendCreateGame(const std::string& gameId);
+        uint64_t appendJoinGame(const std::string& gameId, const std::string& username,
+                int botThinkMs = 0);
+        uint64_t appendSnapshot(const std::string& gameId, const logic::GameState& state);
+        uint64_t appendHibernated(const std::string& gameId);
+        uint64_t appendAutoPass(const std::string& gameId, int playerId, logic::AutoPass policy);
+
+        /* Block until every record up to seq has been written (and
+         * synced). False if they never will be, as writing the log failed */
+        bool waitDurable(uint64_t seq);
+
+        /* Call done once every record up to seq has been written (and
+         * synced), with false instead if writing the log failed first. It
+         * is called on the writer thread, so it mustn't block, or straight
+         * away if the outcome is already known */
+        void whenDurable(uint64_t seq, std::function<void(bool)> done);
+
+        /* Rewrite the log without what recovery no longer needs, as of the
+         * end of what is on disk, carrying over anything written after
+         * that. Reading the old log happens on the calling thread alongside
+         * the writer, only copying what was written meanwhile holds up new
+         * records.
+         * Runs on its own thread once the log is at least compactMinBytes
+         * and twice the size it was last compacted to. Throws
+         * std::runtime_error if it can't, leaving the log as it was */
+        void compact();
+
+        // Whether records are synced, see the constructor
+        bool syncing() {return sync;};
+
+        uint64_t batchesWritten() {return batches;};
+        uint64_t recordsWritten() {return records;};
+        uint64_t compactions() {return compactCount;};
+
+        /* Replay the log at path, returning the games in the order they were
+         * created. A torn record at the end of the file is cut off so new
+         * records follow the last good one */
+        static std::vector<RecoveredGame> recover(std::string path);
+
+    private:
+        void writerLoop();
+        void compactorLoop();
+
+        std::string path;
+        int fd;
+        bool sync;
+        std::chrono::microseconds commitDelay;
+        size_t compactMinBytes;
+
+        std::mutex m;
+        std::condition_variable pending;
+        std::condition_variable durable;
+        std::string batch;
+        // The batch being written, kept to reuse its capacity
+        std::string writing;
+        // Set while writing is being written without m
+        bool writingBatch = false;
+        uint64_t appendedSeq = 0;
+        uint64_t durableSeq = 0;
+        // Waiting for their records, by the last sequence number they need
+        std::multimap<uint64_t, std::function<void(bool)>> callbacks;
+        bool stop = false;
+        // A write or sync failed, nothing after durableSeq will be written
+        bool writeFailed = false;
+
+        // Bytes in the file, and how big it may get before it is compacted
+        size_t fileSize = 0;
+        size_t compactAt;
+        bool compactWanted = false;
+        std::condition_variable compactWake;
+        // Only one compaction at a time
+        std::mutex compactMutex;
+
+        std::atomic<uint64_t> batches{0};
+        std::atomic<uint64_t> records{0};
+        std::atomic<uint64_t> compactCount{0};
+
+        std::thread writer;
+        std::thread compactor;
+};
+
+#endif
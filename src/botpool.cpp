@@ -0,0 +1,81 @@
+#include "botpool.h"
+
+using namespace std;
+
+BotPool::BotPool(int nThreads, MetricsRegistry& metrics)
+    : nodes(metrics.counter("spacegame_bot_nodes_total", "",
+                "Game states searched by bots")),
+      decisions(metrics.counter("spacegame_bot_decisions_total", "",
+                "Actions chosen by bots")),
+      cancelled(metrics.counter("spacegame_bot_cancelled_total", "",
+                "Bot searches stopped because the game changed or the server stopped")),
+      decisionSeconds(metrics.histogram("spacegame_bot_decision_seconds", "",
+                "Time from a bot starting to think to choosing an action")),
+      queued(metrics.gauge("spacegame_bot_jobs_queued", "",
+                "Bot moves waiting for a worker"))
+{
+    metrics.gaugeFunction("spacegame_bot_nodes_per_second", [this]{
+                uint64_t micros = searchMicros;
+                return micros ? nodes.get() * 1e6 / micros : 0.0;
+            }, "", "Game states searched per second of bot thinking");
+    for (int i = 0; i < nThreads; i++) {
+        threads.emplace_back([this]{worker();});
+    }
+}
+
+BotPool::~BotPool()
+{
+    {
+        lock_guard<mutex> lk(m);
+        stop = true;
+        queued.add(-(int64_t) jobs.size());
+        jobs.clear();
+    }
+    wake.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+void BotPool::add(function<void()> job)
+{
+    {
+        lock_guard<mutex> lk(m);
+        if (stop) {
+            return;
+        }
+        jobs.push_back(move(job));
+    }
+    queued.add(1);
+    wake.notify_one();
+}
+
+void BotPool::record(const SearchResult& result, double seconds)
+{
+    nodes.add(result.nodes);
+    searchMicros += uint64_t(seconds * 1e6);
+    decisionSeconds.observe(seconds);
+    if (result.cancelled) {
+        cancelled.add();
+    } else {
+        decisions.add();
+    }
+}
+
+void BotPool::worker()
+{
+    while (true) {
+        function<void()> job;
+        {
+            unique_lock<mutex> lk(m);
+            wake.wait(lk, [this]{return stop or jobs.size();});
+            if (stop) {
+                return;
+            }
+            job = move(jobs.front());
+            jobs.pop_front();
+        }
+        queued.add(-1);
+        job();
+    }
+}
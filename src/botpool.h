@@ -0,0 +1,53 @@
+#ifndef BOTPOOL_H
+#define BOTPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "botsearch.h"
+#include "metrics.h"
+#include "nocopy.h"
+
+#define DEFAULT_BOT_THINK_MS 500
+#define MAX_BOT_THINK_MS 10000
+
+/* Worker threads for computer players, kept apart from the request threads
+ * so a bot thinking never holds up a request or another game. Jobs run in
+ * the order they are added.
+ */
+class BotPool : non_copyable
+{
+    public:
+        BotPool(int threads, MetricsRegistry& metrics);
+        // Drops jobs that haven't started, running searches see stopping()
+        ~BotPool();
+
+        void add(std::function<void()> job);
+        bool stopping() const {return stop;};
+
+        // Record a finished search in the pool's metrics
+        void record(const SearchResult& result, double seconds);
+
+    private:
+        void worker();
+
+        std::mutex m;
+        std::condition_variable wake;
+        std::deque<std::function<void()>> jobs;
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> threads;
+
+        std::atomic<uint64_t> searchMicros{0};
+        Counter& nodes;
+        Counter& decisions;
+        Counter& cancelled;
+        Histogram& decisionSeconds;
+        Gauge& queued;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#include "botsearch.h"
+
+#include "mcts.h"
+
+#include <cmath>
+
+using namespace std;
+using namespace logic;
+
+double evaluate(const GameState& state, int playerId)
+{
+    double score = 0;
+    for (auto& player : state.players) {
+        double sign = player.id == playerId ? 1 : -1;
+        double mine = 0.5 * player.hand.size();
+        for (auto [type, amount] : player.resources) {
+            mine += 0.5 * amount;
+        }
+        for (auto& ship : state.ships) {
+            if (ship.controller != player.id) {
+                continue;
+            }
+            double strength = ship.attack + ship.shield + ship.armour;
+            mine += ship.id == player.flagshipId ? 3 * strength : strength;
+        }
+        for (auto& system : state.systems) {
+            if (system.controllerId == player.id) {
+                mine += 3;
+            }
+        }
+        score += sign * mine;
+    }
+    return 1 / (1 + exp(-score / 10));
+}
+
+SearchResult searchAction(const GameState& state, int playerId,
+        const SearchLimits& limits, mt19937& rng)
+{
+    // Each bot thread keeps its tree between moves so the nodes are reused
+    thread_local MctsSearch search;
+
+    MctsConfig config;
+    config.budget = limits.budget;
+    config.playoutDepth = limits.playoutDepth;
+    config.cancelled = limits.cancelled;
+    auto found = search.search(state, playerId, config, rng);
+
+    SearchResult result;
+    result.action = found.action;
+    result.nodes = found.steps;
+    result.playouts = found.iterations;
+    result.cancelled = found.cancelled;
+    return result;
+}
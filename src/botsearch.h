@@ -0,0 +1,44 @@
+#ifndef BOTSEARCH_H
+#define BOTSEARCH_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <random>
+
+#include "logic.h"
+
+/* Picks actions for computer players, by a single threaded Monte Carlo tree
+ * search (see mcts.h) under a time budget. Positions at the end of each
+ * playout are scored with evaluate.
+ */
+
+struct SearchLimits
+{
+    std::chrono::milliseconds budget{200};
+    // Random actions played after leaving the search tree
+    int playoutDepth = 20;
+    // Checked between iterations, the search stops early once it returns true
+    std::function<bool()> cancelled;
+};
+
+struct SearchResult
+{
+    // nullopt if the player has nothing to do
+    std::optional<logic::Action> action;
+    // Actions performed on copies of the game
+    uint64_t nodes = 0;
+    int playouts = 0;
+    bool cancelled = false;
+};
+
+/* How good the state looks for the player, between 0 and 1. Counts ships
+ * (the flagship most), controlled systems, cards in hand and resources,
+ * against the other player's */
+double evaluate(const logic::GameState& state, int playerId);
+
+SearchResult searchAction(const logic::GameState& state, int playerId,
+        const SearchLimits& limits, std::mt19937& rng);
+
+#endif
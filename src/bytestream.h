@@ -0,0 +1,115 @@
+#ifndef BYTESTREAM_H
+#define BYTESTREAM_H
+
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <string>
+
+#include <cereal/archives/portable_binary.hpp>
+
+/* Stream buffers so cereal can read straight from bytes that are already in
+ * memory and write straight onto the end of a string, rather than copying
+ * through a stringstream and then again out of it with str()
+ */
+
+// Reads from bytes owned by someone else, which must outlive it
+class SpanInputBuf : public std::streambuf
+{
+    public:
+        SpanInputBuf(const char* data, size_t size) {
+            char* p = const_cast<char*>(data);
+            setg(p, p, p + size);
+        }
+
+    protected:
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                std::ios_base::openmode which = std::ios_base::in) override {
+            char* target = (dir == std::ios_base::beg ? eback()
+                    : dir == std::ios_base::cur ? gptr() : egptr()) + off;
+            if (target < eback() or target > egptr()) {
+                return pos_type(off_type(-1));
+            }
+            setg(eback(), target, egptr());
+            return pos_type(target - eback());
+        }
+
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in) override {
+            return seekoff(off_type(pos), std::ios_base::beg, which);
+        }
+};
+
+// Appends everything written to the given string
+class StringOutputBuf : public std::streambuf
+{
+    public:
+        StringOutputBuf(std::string& out) : out(out) {};
+
+    protected:
+        std::streamsize xsputn(const char* s, std::streamsize n) override {
+            out.append(s, n);
+            return n;
+        }
+
+        int_type overflow(int_type c) override {
+            if (c != traits_type::eof()) {
+                out.push_back(traits_type::to_char_type(c));
+            }
+            return traits_type::not_eof(c);
+        }
+
+    private:
+        std::string& out;
+};
+
+/* A string per thread that keeps its capacity between uses, for building
+ * replies without allocating every time. The contents are only valid until
+ * the next call on the same thread */
+inline std::string& threadBuffer()
+{
+    thread_local std::string buffer;
+    buffer.clear();
+    return buffer;
+}
+
+// Helpers for the binary format used for all client / server communication
+
+template <class T>
+void serializeInto(std::string& out, const T& obj)
+{
+    StringOutputBuf buf(out);
+    std::ostream os(&buf);
+    {
+        cereal::PortableBinaryOutputArchive oarchive(os);
+        oarchive(obj);
+    }
+}
+
+template <class T>
+std::string serialize(const T& obj)
+{
+    std::string out;
+    serializeInto(out, obj);
+    return out;
+}
+
+template <class T>
+T deserialize(const char* data, size_t size)
+{
+    SpanInputBuf buf(data, size);
+    std::istream is(&buf);
+    T obj;
+    {
+        cereal::PortableBinaryInputArchive iarchive(is);
+        iarchive(obj);
+    }
+    return obj;
+}
+
+template <class T>
+T deserialize(const std::string& data)
+{
+    return deserialize<T>(data.data(), data.size());
+}
+
+#endif
@@ -60,9 +60,13 @@ Ship* createShipIn(GameState& state, logic::Ship ship)
     state.ships.push_back(ship);
     state.changes.push_back({.type = CHANGE_ADD_SHIP, .data = ship});
 
-    if (ship.kind == SHIP_RESOURCE) {
-        auto player = state.getPlayerById(card.playedBy);
+    auto player = state.getPlayerById(card.playedBy);
+    if (ship.kind == SHIP_RESOURCE and not player->playedResourceShipThisTurn) {
         player->playedResourceShipThisTurn = true;
+        state.changes.push_back({
+                .type = CHANGE_RESOURCE_SHIP_PLAYED,
+                .data = pair<int, int>(player->id, 1)
+                });
     }
     return state.getShipById(ship.id);
 }
@@ -73,7 +77,7 @@ void destroyTargetShips(GameState& state)
     for (auto shipId : card.targets) {
         state.changes.push_back({.type = CHANGE_REMOVE_SHIP, .data = shipId});
         state.deleteShipById(shipId);
-        LOG_INFO << "Ship id: " << shipId << " destroyed";
+        GAME_LOG_INFO << "Ship id: " << shipId << " destroyed";
     }
 }
 
@@ -2,49 +2,28 @@
 
 #include <plog/Log.h>
 
+#include <algorithm>
+#include <random>
+
 #include "timer.h"
 
 
 
 using namespace std;
 using namespace logic;
-using namespace curlpp::options;
 
-GameClient::GameClient(string serverAddr, int serverPort) 
+GameClient::GameClient(string serverAddr, int serverPort, bool asyncRequests) 
     : serverAddr(serverAddr), serverPort(serverPort)
 { 
-    RequestThreadData* dataPointer;
-
-    dataPointer = &getActionsData;
-    getActionsThread = thread([this, dataPointer]{requestThreadFunc(dataPointer);});
-
-    dataPointer = &performActionsData;
-    performActionsThread = thread([this, dataPointer]{requestThreadFunc(dataPointer);});
-
-    dataPointer = &getChangesData;
-    getChangesThread = thread([this, dataPointer]{requestThreadFunc(dataPointer);});
-}
-
-void endThread(RequestThreadData& threadData, thread& thread)
-{
-    {
-        lock_guard<mutex> lk(threadData.m);
-        threadData.stop = true;
-    }
-    bool done = false;
-    while (not done) {
-        done = threadData.done;
-        this_thread::yield();
-        threadData.start.notify_all();
+    random_device rd;
+    stringstream id;
+    id << hex << rd() << rd();
+    clientId = id.str();
+    if (asyncRequests) {
+        loop = make_unique<HttpLoop>();
+    } else {
+        connection = make_unique<HttpConnection>();
     }
-    thread.join();
-}
-
-GameClient::~GameClient()
-{
-    endThread(getActionsData, getActionsThread);
-    endThread(performActionsData, performActionsThread);
-    endThread(getChangesData, getChangesThread);
 }
 
 void GameClient::login(string username)
@@ -58,33 +37,33 @@ void GameClient::login(string username)
     }
 }
 
-void GameClient::startGame()
+void GameClient::startGame(bool withBot, int botThinkMs)
 {
     auto path = serverAddr + "/createGame";
-    auto data = makeRequest(path, "");
-    stringstream ss;
-    ss << data;
-    pair<string, int> ret;
-    {
-        cereal::PortableBinaryInputArchive iarchive(ss);
-        iarchive(ret);
+    if (withBot) {
+        path += "?bot=" + (botThinkMs ? to_string(botThinkMs) : "");
     }
+    auto data = makeRequest(path, "");
+    auto ret = deserialize<pair<string, int>>(data);
     gameId = ret.first;
     playerId = ret.second;
     LOG_INFO << "Created game (id: " << gameId << ")";
 }
 
+void GameClient::startLockstepGame()
+{
+    auto data = makeRequest(serverAddr + "/createGame?lockstep", "");
+    auto ret = deserialize<pair<string, int>>(data);
+    gameId = ret.first;
+    playerId = ret.second;
+    LOG_INFO << "Created lockstep game (id: " << gameId << ")";
+}
+
 void GameClient::joinGame(string gameId)
 {
     auto path = serverAddr + "/game/" + gameId + "/join";
     auto data = makeRequest(path, "");
-    stringstream ss;
-    ss << data;
-    pair<string, int> ret;
-    {
-        cereal::PortableBinaryInputArchive iarchive(ss);
-        iarchive(ret);
-    }
+    auto ret = deserialize<pair<string, int>>(data);
     this->gameId = ret.first;
     playerId = ret.second;
     LOG_INFO << "Joined game (id: " << gameId << ")";
@@ -94,101 +73,93 @@ void GameClient::joinUser(string username)
 {
     auto path = serverAddr + "/player/" + username + "/join";
     auto data = makeRequest(path, "");
-    stringstream ss;
-    ss << data;
-    pair<string, int> ret;
-    {
-        cereal::PortableBinaryInputArchive iarchive(ss);
-        iarchive(ret);
-    }
+    auto ret = deserialize<pair<string, int>>(data);
     this->gameId = ret.first;
     playerId = ret.second;
     LOG_INFO << "Joined game (id: " << gameId << ")";
 };
 
-string GameClient::makeRequest(string path, string data) const
+string GameClient::makeRequest(string path, const string& data, long* responseCodeOut) const
 {
-    if (loginToken == "" and path.substr(path.size() - 6, 6) != "/login") {
-        LOG_ERROR << "Attempting to make request without logging in";
-    };
-
-    LOG_INFO << "Making request using token: " << loginToken << " to: " << path;
-    RequestData request = {
-        .loginToken = loginToken,
-        .serializedData = data,
-    };
-    stringstream ss;
-    {
-        cereal::PortableBinaryOutputArchive oarchive(ss);
-        oarchive(request);
+    auto response = makeHttpRequest(path, data);
+    if (responseCodeOut) {
+        *responseCodeOut = response.code;
     }
+    return response.body;
+};
 
-    stringstream os;
-    long responseCode = 0;
-    try {
-        curlpp::Cleanup cleanup;
-        curlpp::Easy request;
+list<string> GameClient::wireFormatHeaders() const
+{
+    if (not compactWire) {
+        return {};
+    }
+    return {string(WIRE_FORMAT_HEADER) + ": " + WIRE_FORMAT_COMPACT};
+}
 
-        char buf[50];
-		std::list<std::string> headers;
-		headers.push_back("Content-Type: application/octet-stream"); 
-		sprintf(buf, "Content-Length: %d", (int) ss.str().size()); 
-		headers.push_back(buf);
+HttpRequest GameClient::buildRequest(string path, const string& data,
+        list<string> extraHeaders) const
+{
+    if (loginToken == "" and path.substr(path.size() - 6, 6) != "/login"
+            and path.find("/spectate/") == string::npos) {
+        LOG_ERROR << "Attempting to make request without logging in";
+    };
 
-        request.setOpt(Url(path));
-        request.setOpt(Port(serverPort));
-        request.setOpt(PostFields(ss.str()));
-        request.setOpt(PostFieldSize(ss.str().size()));
-        request.setOpt(Timeout(1));
-        request.setOpt(WriteStream(&os));
-        //request.setOpt(Verbose(1));
+    LOG_INFO << "Making request using token: " << loginToken << " to: " << path;
 
-        request.perform();
-        curlpp::infos::ResponseCode::get(request, responseCode);
-    } catch (curlpp::LogicError & e) {
-		LOG_ERROR << e.what() << std::endl;
-	} catch (curlpp::RuntimeError & e) {
-		LOG_ERROR << e.what() << std::endl;
+    HttpRequest request;
+    request.url = path;
+    request.port = serverPort;
+    request.body = data;
+    request.headers = extraHeaders;
+    if (loginToken.size()) {
+        request.headers.push_back(string(LOGIN_TOKEN_HEADER) + ": " + loginToken);
     }
-
-    if (responseCode != 200) {
-        LOG_ERROR << "Server did not return OK: " << responseCode;
+    if (acceptCompressed) {
+        request.headers.push_back(string(COMPRESSION_HEADER) + ": " + COMPRESSION_DEFLATE);
     }
+    return request;
+}
 
-    return os.str();
-};
+HttpResponse GameClient::finishResponse(const string& path, HttpResponse response) const
+{
+    if (response.code != 200 and response.code != 304) {
+        LOG_ERROR << "Server did not return OK: " << response.code;
+    }
+    if (response.headers["x-compression"] == COMPRESSION_DEFLATE) {
+        try {
+            response.body = decompress(response.body);
+        } catch (runtime_error& e) {
+            LOG_ERROR << "Could not decompress reply from " << path << ": " << e.what();
+            response.body.clear();
+        }
+    }
+    return response;
+}
 
-template <class T>
-string serialize(T obj)
+HttpResponse GameClient::makeHttpRequest(string path, const string& data,
+        list<string> extraHeaders, int retries) const
 {
-    stringstream ss;
-    {
-        cereal::PortableBinaryOutputArchive oarchive(ss);
-        oarchive(obj);
+    auto request = buildRequest(path, data, extraHeaders);
+    request.retries = retries;
+    if (loop) {
+        return finishResponse(path, loop->request(move(request)).get());
     }
-    return ss.str();
+    return finishResponse(path, connection->perform(request));
 }
 
-template <class T> 
-T deserialize(std::string data)
+long GameClient::connectionsOpened() const
 {
-    stringstream ss;
-    ss << data;
-    T obj;
-    {
-        cereal::PortableBinaryInputArchive iarchive(ss);
-        iarchive(obj);
-    }
-    return obj;
+    return loop ? loop->connectionsOpened() : connection->connectionsOpened();
 }
 
 vector<Action> GameClient::getActions()
 {
     // Check if there is a response ready from a previous request
     // return it if so
-    optional<string> response = getResponseFromThread(&getActionsData);
+    bool compact;
+    optional<string> response = getAsyncResponse(getActionsSlot, &compact);
     if (response) {
-        return deserialize<vector<Action>>(*response);
+        return compact ? decodeActions(*response) : deserialize<vector<Action>>(*response);
     }
 
     // Otherwise we need to make a new request, but not if we're rate limited
@@ -197,32 +168,96 @@ vector<Action> GameClient::getActions()
     }
 
     string path = serverAddr + "/game/" + gameId + "/getactions";
-    bool madeRequest = makeRequestOnThread(&getActionsData, path, "");
+    bool madeRequest = makeAsyncRequest(getActionsSlot, path, "");
     if (madeRequest) {
         actionsLastRequest = timer.get();
     }
     return {};
 }
 
-GameState GameClient::getState()
+list<string> GameClient::stateHeaders() const
 {
+    if (not stateETag.size()) {
+        return {};
+    }
+    return {"If-None-Match: " + stateETag};
+}
+
+GameState GameClient::stateFromResponse(HttpResponse& response)
+{
+    if (response.code == 304) {
+        LOG_DEBUG << "State not modified since " << stateETag;
+    } else {
+        stateData = response.body;
+        stateETag = response.headers["etag"];
+        stateChangeNo = atoi(response.headers["x-change-no"].c_str());
+        lockstep = response.headers["x-lockstep"] == "1";
+    }
+    auto state = deserialize<GameState>(stateData);
+    bindCallbacks(state);
+    return state;
+}
+
+GameState GameClient::getState(bool withHistory)
+{
+    string path = serverAddr + "/game/" + gameId + "/state";
+    if (withHistory) {
+        path += "?history=1";
+    }
+    auto response = makeHttpRequest(path, "", stateHeaders(), REQUEST_RETRIES);
+    return stateFromResponse(response);
+}
+
+optional<GameState> GameClient::pollState()
+{
+    auto response = takeAsyncResponse(stateSlot);
+    if (response and (response->code == 200 or response->code == 304)) {
+        return stateFromResponse(*response);
+    }
+
+    if (response or timer.get() - stateLastRequest < rateLimit) {
+        return {};
+    }
     string path = serverAddr + "/game/" + gameId + "/state";
-    return getObject<GameState>(path);
+    if (makeAsyncRequest(stateSlot, path, "", stateHeaders())) {
+        stateLastRequest = timer.get();
+    }
+    return {};
+}
+
+vector<logic::Change> GameClient::getSpectatorChanges(int changeNo)
+{
+    string path = serverAddr + "/game/" + gameId + "/spectate/" + to_string(changeNo);
+    auto response = makeHttpRequest(path, "", wireFormatHeaders(), REQUEST_RETRIES);
+    if (response.code != 200) {
+        return {};
+    }
+    if (response.headers["x-wire-format"] == WIRE_FORMAT_COMPACT) {
+        return decodeChanges(response.body);
+    }
+    return deserialize<vector<logic::Change>>(response.body);
 }
 
 vector<logic::Change> GameClient::getChangesSince(int changeNo)
 {
-    optional<string> response = getResponseFromThread(&getChangesData);
-    if (response) {
-        return deserialize<vector<logic::Change>>(*response);
+    auto response = takeAsyncResponse(getChangesSlot);
+    if (response and response->code == 200) {
+        changesLatency.add(response->seconds);
+        if (response->body.size()) {
+            bool compact = response->headers["x-wire-format"] == WIRE_FORMAT_COMPACT;
+            return compact ? decodeChanges(response->body) 
+                : deserialize<vector<logic::Change>>(response->body);
+        }
     }
 
     if (timer.get() - changesLastRequest < rateLimit) {
         return {};
     }
 
+    // Only the slowest few requests are sent twice
+    long hedgeAfterMs = hedgeReads ? changesLatency.percentile(0.95) * 1000 : 0;
     string path = serverAddr + "/game/" + gameId + "/changes/" + to_string(changeNo);
-    bool madeRequest = makeRequestOnThread(&getChangesData, path, "");
+    bool madeRequest = makeAsyncRequest(getChangesSlot, path, "", {}, hedgeAfterMs);
     if (madeRequest) {
         changesLastRequest = timer.get();
     }
@@ -230,102 +265,182 @@ vector<logic::Change> GameClient::getChangesSince(int changeNo)
     return {};
 }
 
+void GameClient::setAutoPass(AutoPass policy)
+{
+    string path = serverAddr + "/game/" + gameId + "/autopass/" + to_string(policy);
+    auto response = makeHttpRequest(path, "", {}, REQUEST_RETRIES);
+    if (response.code != 200) {
+        LOG_ERROR << "Could not set auto-pass policy: " << response.body;
+    }
+}
+
+string GameClient::idempotencyKey(const string& channel, uint64_t firstSeq) const
+{
+    return string(IDEMPOTENCY_KEY_HEADER) + ": " + clientId + "-" + channel + ":" + to_string(firstSeq);
+}
+
+void GameClient::checkPerformAction()
+{
+    auto response = takeAsyncResponse(performActionsSlot);
+    if (response and response->failed() and performInFlight) {
+        // Sent again, the server skips it if the first one did arrive
+        LOG_WARNING << "Sending action " << performInFlight->second << " again";
+        pendingPerformActions.push_front(move(*performInFlight));
+    }
+    if (response) {
+        performInFlight.reset();
+    }
+}
+
 void GameClient::performQueuedAction()
 {
+    checkPerformAction();
     if (pendingPerformActions.size()) {
         string path = serverAddr + "/game/" + gameId + "/performaction";
-        string sendData = pendingPerformActions.front();
-        bool madeRequest = makeRequestOnThread(&performActionsData, path, serialize(sendData));
+        auto& [sendData, seq] = pendingPerformActions.front();
+        bool madeRequest = makeAsyncRequest(performActionsSlot, path, sendData,
+                {idempotencyKey("perform", seq)});
         if (madeRequest) {
-            pendingPerformActions.pop();
+            performInFlight = move(pendingPerformActions.front());
+            pendingPerformActions.pop_front();
         }
     }
 }
 
 void GameClient::performAction(Action action)
 {
-    string path = serverAddr + "/game/" + gameId + "/performaction";
-    string sendData = serialize(action);
-    LOG_DEBUG << deserialize<Action>(sendData);
-    bool madeRequest = makeRequestOnThread(&performActionsData, path, sendData);
+    LOG_DEBUG << action;
+    pendingPerformActions.push_back({serialize(action), nextPerformSeq++});
+    performQueuedAction();
+}
 
-    if (not madeRequest) {
-        pendingPerformActions.push(sendData);
+void GameClient::queueAction(Action action)
+{
+    queuedActions.push_back(action);
+    nextSyncSeq++;
+    if (syncSlot.pending) {
+        syncActionsStale = true;
     }
 }
 
-void GameClient::_performAction(Action action) const
+optional<SyncResponse> GameClient::sync(int changeNo)
 {
-    stringstream ss;
-    {
-        cereal::PortableBinaryOutputArchive oarchive(ss);
-        oarchive(action);
+    auto response = takeAsyncResponse(syncSlot);
+    if (response and response->failed()) {
+        // Sent again with the next sync, the server skips any of them it
+        // did get. The changes are asked for from the same changeNo
+        queuedActions.insert(queuedActions.begin(), syncInFlight.begin(), syncInFlight.end());
+        syncInFlight.clear();
+        response.reset();
+    }
+    if (response) {
+        syncInFlight.clear();
+    }
+    if (response and response->body.size()) {
+        SyncResponse ret;
+        if (response->headers["x-wire-format"] == WIRE_FORMAT_COMPACT) {
+            tie(ret.changes, ret.actions) = decodeChangesAndActions(response->body);
+        } else {
+            ret = deserialize<SyncResponse>(response->body);
+        }
+        if (syncActionsStale) {
+            ret.actions.clear();
+            syncActionsStale = false;
+        }
+        return ret;
     }
 
-    stringstream os;
+    if (not queuedActions.size() and timer.get() - syncLastRequest < rateLimit) {
+        return {};
+    }
 
-    string path = serverAddr + "/game/" + gameId + "/performaction";
-    makeRequest(path, ss.str());
+    string path = serverAddr + "/game/" + gameId + "/sync/" + to_string(changeNo);
+    list<string> headers;
+    if (queuedActions.size()) {
+        headers.push_back(idempotencyKey("sync", nextSyncSeq - queuedActions.size()));
+    }
+    bool madeRequest = makeAsyncRequest(syncSlot, path, serialize(queuedActions), headers);
+    if (madeRequest) {
+        syncInFlight = move(queuedActions);
+        queuedActions.clear();
+        syncLastRequest = timer.get();
+    }
+    return {};
 }
 
-void GameClient::requestThreadFunc(RequestThreadData* data)
+optional<LockstepReply> GameClient::lockstepSync(int actionNo,
+        const vector<TurnChecksum>& newChecksums)
 {
-    string path;
-    string sendData;
-
-    while (true) {
-        {
-            unique_lock<mutex> lk(data->m);
-            data->start.wait(lk);
-            if (data->stop) {
-                data->done = true;
-                break;
-            }
-            path = data->path;
-            sendData = data->sendData;
-        }
-        LOG_DEBUG << data->sendData;
-        string responseData = makeRequest(path, sendData);
-        {
-            lock_guard<mutex> lk(data->m);
-            data->sendData = "";
-            data->path = "";
-            data->response = responseData;
-            data->pending = false;
+    queuedChecksums.insert(queuedChecksums.end(), newChecksums.begin(), newChecksums.end());
+    auto response = takeAsyncResponse(lockstepSlot);
+    if (response and response->failed()) {
+        // Sent again, an action the server did get is refused the second
+        // time as it's no longer after actionNo
+        auto& [actions, checksums] = lockstepInFlight;
+        queuedActions.insert(queuedActions.begin(), actions.begin(), actions.end());
+        queuedChecksums.insert(queuedChecksums.begin(), checksums.begin(), checksums.end());
+    }
+    if (response) {
+        lockstepInFlight = {};
+    }
+    if (response and response->code == 200) {
+        try {
+            return decodeLockstepReply(response->body);
+        } catch (runtime_error& e) {
+            LOG_ERROR << "Bad lockstep reply: " << e.what();
+            return {};
         }
     }
+
+    if (not queuedActions.size() and timer.get() - syncLastRequest < rateLimit) {
+        return {};
+    }
+
+    string path = serverAddr + "/game/" + gameId + "/lockstep/" + to_string(actionNo);
+    LockstepRequest toSend = {.actions = queuedActions, .checksums = queuedChecksums};
+    if (makeAsyncRequest(lockstepSlot, path, encodeLockstepRequest(toSend))) {
+        lockstepInFlight = move(toSend);
+        queuedActions.clear();
+        queuedChecksums.clear();
+        syncLastRequest = timer.get();
+    }
+    return {};
 }
 
-bool GameClient::makeRequestOnThread(
-        RequestThreadData* threadData, std::string path, std::string sendData)
+bool GameClient::makeAsyncRequest(RequestSlot& slot, string path, string sendData,
+        list<string> headers, long hedgeAfterMs)
 {
-    bool madeRequest = false;
-    {
-        lock_guard<mutex> lk(threadData->m);
-        if (not threadData->pending) {
-            threadData->path = path;
-            threadData->sendData = sendData;
-            threadData->pending = true;
-            madeRequest = true;
-            LOG_DEBUG << sendData;
-        }
-    }
-    if (madeRequest) {
-        threadData->start.notify_all();
+    if (slot.pending and slot.pending->wait_for(chrono::seconds(0)) != future_status::ready) {
+        return false;
     }
-    return madeRequest;
+    LOG_DEBUG << sendData;
+    slot.path = path;
+    headers.splice(headers.end(), wireFormatHeaders());
+    auto request = buildRequest(path, sendData, headers);
+    request.retries = REQUEST_RETRIES;
+    request.hedgeAfterMs = hedgeAfterMs;
+    slot.pending = loop->request(move(request));
+    return true;
 }
 
-optional<string> GameClient::getResponseFromThread(RequestThreadData* threadData)
+optional<HttpResponse> GameClient::takeAsyncResponse(RequestSlot& slot)
 {
-    optional<string> response;
-    {
-        lock_guard<mutex> lk(threadData->m);
-        if (not threadData->pending and threadData->response.size()) {
-            response = threadData->response;
-            threadData->response = "";
-        }
+    if (not slot.pending or slot.pending->wait_for(chrono::seconds(0)) != future_status::ready) {
+        return {};
     }
+    auto response = finishResponse(slot.path, slot.pending->get());
+    slot.pending.reset();
     return response;
 }
 
+optional<string> GameClient::getAsyncResponse(RequestSlot& slot, bool* compact)
+{
+    auto response = takeAsyncResponse(slot);
+    if (not response or not response->body.size()) {
+        return {};
+    }
+    if (compact) {
+        *compact = response->headers["x-wire-format"] == WIRE_FORMAT_COMPACT;
+    }
+    return response->body;
+}
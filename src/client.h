@@ -3,55 +3,100 @@
 
 #include <memory>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <future>
 #include <sstream>
 #include <optional>
 #include <thread>
-
-#include <curlpp/cURLpp.hpp>
-#include <curlpp/Easy.hpp>
-#include <curlpp/Options.hpp>
-#include <curlpp/Infos.hpp>
+#include <map>
+#include <list>
 
 #include "logic.h"
 #include "timer.h"
+#include "wireformat.h"
+#include "bytestream.h"
+#include "compression.h"
+#include "httpclient.h"
+#include "gameservice.h"
 
-struct RequestData
-{
-    std::string loginToken;
-    std::string serializedData;
-    SERIALIZE(loginToken, serializedData);
-};
+// Request header carrying the token given out at login
+#define LOGIN_TOKEN_HEADER "X-Login-Token"
+/* Request header on logins from the router, with the secret the router and
+ * its shards share. Only then does a shard take the login token the router
+ * chose */
+#define ROUTER_SECRET_HEADER "X-Router-Secret"
+/* Environment variable the router and its shards read the secret from.
+ * Not a command line option, where ps would show it */
+#define ROUTER_SECRET_ENV "SPACEGAME_ROUTER_SECRET"
+// Reply header on the state of a lockstep game, see lockstep.h
+#define LOCKSTEP_HEADER "X-Lockstep"
+/* Request header on requests carrying actions, the client's id and the
+ * number of the first action in the request separated by a colon. Clients
+ * number their actions from 1 in the order they send them, and the server
+ * skips those it has already performed, so requests can be sent again.
+ * Actions that may arrive out of order with each other, eg. those sent to
+ * performaction and to sync, need ids of their own */
+#define IDEMPOTENCY_KEY_HEADER "Idempotency-Key"
+// Times a request that may not have reached the server is tried again
+#define REQUEST_RETRIES 3
 
-struct RequestThreadData
+// One kind of asynchronous request, only one of each is in flight at a time
+struct RequestSlot
 {
-    std::mutex m;
-    bool pending = false;
-    bool done = false;
-    bool stop = false;
-    std::string path; 
-    std::string sendData;
-    std::string response;
-    std::condition_variable start;
+    std::optional<std::future<HttpResponse>> pending;
+    std::string path;
 };
 
 
-class GameClient
+/* The game run by a server, over HTTP */
+class GameClient : public GameService
 {
     public:
-        GameClient(std::string serverAddr, int port);
-        ~GameClient();
+        /* Requests go through an HttpLoop, one I/O thread that keeps the
+         * connections to the server open. If asyncRequests is false there is
+         * no thread and requests are made on the caller's thread over one
+         * kept-alive connection, then only the synchronous calls (login,
+         * startGame, join*, getState) and makeRequest can be used */
+        GameClient(std::string serverAddr, int port, bool asyncRequests = true);
 
         void login(std::string username);
         bool isLoggedIn() { return loginToken.size() > 0;};
 
 
-        void startGame();
-        int getMyPlayerId() {return playerId;};
+        /* Create a new game. With a bot the server takes the other seat
+         * itself, thinking for about botThinkMs per move, 0 for the server's
+         * default */
+        void startGame(bool withBot = false, int botThinkMs = 0);
+        /* Create a lockstep game (see lockstep.h), where each player runs the
+         * game from the state getState returns and uses lockstepSync */
+        void startLockstepGame();
+        // Whether the last state from getState was of a lockstep game
+        bool isLockstepGame() override {return lockstep;};
+        int getMyPlayerId() override {return playerId;};
         void joinGame(std::string gameId);
         void joinUser(std::string username);
-        logic::GameState getState();
+
+        /* Watch a game without joining it as a player. getState and
+         * getSpectatorChanges can then be used to follow it */
+        void spectateGame(std::string gameId) {this->gameId = gameId;};
+
+        /* Changes since changeNo in the game being watched, synchronous */
+        std::vector<logic::Change> getSpectatorChanges(int changeNo);
+
+        /* Get the current state of the game. The change log is only filled
+         * in if withHistory is set. The last state received is kept, and if
+         * the game hasn't changed since then the server only replies to say
+         * so and the kept copy is returned
+         */
+        logic::GameState getState(bool withHistory = false) override;
+
+        /* getState without the change log, asynchronous in the same way as
+         * getActions. Returns the state once a reply arrives */
+        std::optional<logic::GameState> pollState() override;
+
+        /* Number of changes the last state from getState already includes,
+         * changes after this need to be applied on top of it */
+        int getStateChangeNo() override {return stateChangeNo;};
 
         /* Get needed actions from the server. 
          * This is done asynchronously - if there are actions that have already
@@ -78,6 +123,45 @@ class GameClient
          */
         std::vector<logic::Change> getChangesSince(int changeNo);
 
+        /* Queue an action to be sent with the next sync request
+         */
+        void queueAction(logic::Action action) override;
+
+        void setAutoPass(logic::AutoPass policy) override;
+
+        /* Send all queued actions and get back both the changes since 
+         * changeNo and the actions now available, in a single request.
+         * Asynchronous in the same way as getActions. Queued actions are sent
+         * as soon as no other sync is pending, otherwise requests are rate
+         * limited. If an action was queued while a request was in flight the
+         * returned actions are left empty since they may already be stale.
+         */
+        std::optional<SyncResponse> sync(int changeNo) override;
+
+        /* For lockstep games. Send queued actions, taken after performing the
+         * first actionNo, along with checksums of turns that have ended, and
+         * get back every action after actionNo. Asynchronous and rate
+         * limited in the same way as sync. Checksums are kept until they
+         * have been sent */
+        std::optional<LockstepReply> lockstepSync(int actionNo,
+                const std::vector<TurnChecksum>& newChecksums) override;
+
+        /* Ask for changes and actions in the compact encoding from
+         * wireformat.h, on by default. Servers that don't support it reply
+         * with cereal as before */
+        void setCompactWireFormat(bool compact) {compactWire = compact;};
+
+        /* Accept compressed replies (see compression.h), on by default. The
+         * server only compresses replies that are large enough to be worth it */
+        void setAcceptCompressed(bool accept) {acceptCompressed = accept;};
+
+        /* Send a second copy of a getChangesSince request if it takes longer
+         * than 95% of recent ones, off by default */
+        void setHedgedReads(bool hedge) {hedgeReads = hedge;};
+
+        // Connections made to the server so far
+        long connectionsOpened() const;
+
     protected:
         std::string serverAddr;
         long serverPort;
@@ -92,12 +176,33 @@ class GameClient
        
         float actionsLastRequest = 0;
 
-        void _performAction(logic::Action action) const;
-        std::optional<std::future<void>> actionPending;
-
         float changesLastRequest = 0;
 
-        std::string makeRequest(std::string path, std::string data) const;
+        std::string makeRequest(std::string path, const std::string& data,
+                long* responseCode = nullptr) const;
+        HttpResponse makeHttpRequest(std::string path, const std::string& data,
+                std::list<std::string> extraHeaders = {}, int retries = 0) const;
+        HttpRequest buildRequest(std::string path, const std::string& data,
+                std::list<std::string> extraHeaders) const;
+        // Check the reply code and decompress the body
+        HttpResponse finishResponse(const std::string& path, HttpResponse response) const;
+
+        std::unique_ptr<HttpLoop> loop;
+        std::unique_ptr<HttpConnection> connection;
+
+        // Last state received, see getState
+        std::string stateETag;
+        std::string stateData;
+        int stateChangeNo = 0;
+        bool lockstep = false;
+        RequestSlot stateSlot;
+        float stateLastRequest = 0;
+        std::list<std::string> stateHeaders() const;
+        logic::GameState stateFromResponse(HttpResponse& response);
+
+        bool compactWire = true;
+        bool acceptCompressed = true;
+        std::list<std::string> wireFormatHeaders() const;
 
         Timer timer;
 
@@ -108,32 +213,50 @@ class GameClient
         T getObject(std::string path) const
         {
             LOG_DEBUG << "Making server request to: " << path << " port: " << serverPort;
-            auto data = makeRequest(path, "");
-            std::stringstream ss;
-            ss << data;
-
-            T obj;
-            {
-                cereal::PortableBinaryInputArchive iarchive(ss);
-                iarchive(obj);
-            }
-            return obj;
+            return deserialize<T>(makeRequest(path, ""));
         }
 
-        std::thread getActionsThread;
-        RequestThreadData getActionsData;
+        RequestSlot getActionsSlot;
+
+        // Actions are numbered for IDEMPOTENCY_KEY_HEADER, separately for
+        // performAction and queueAction as they go in different requests
+        std::string clientId;
+        uint64_t nextPerformSeq = 1;
+        uint64_t nextSyncSeq = 1;
+        std::string idempotencyKey(const std::string& channel, uint64_t firstSeq) const;
+
+        // Serialized actions and their numbers, waiting to be sent and the
+        // one in flight, which is sent again if it fails
+        std::deque<std::pair<std::string, uint64_t>> pendingPerformActions;
+        std::optional<std::pair<std::string, uint64_t>> performInFlight;
+        RequestSlot performActionsSlot;
+        void checkPerformAction();
+
+        RequestSlot getChangesSlot;
+        bool hedgeReads = false;
+        LatencyWindow changesLatency;
 
-        std::queue<std::string> pendingPerformActions;
-        std::thread performActionsThread;
-        RequestThreadData performActionsData;
+        // Actions in the sync in flight come before those still queued, and
+        // those end at nextSyncSeq
+        std::vector<logic::Action> queuedActions;
+        std::vector<logic::Action> syncInFlight;
+        bool syncActionsStale = false;
+        float syncLastRequest = 0;
+        RequestSlot syncSlot;
 
-        std::thread getChangesThread;
-        RequestThreadData getChangesData;
+        std::vector<TurnChecksum> queuedChecksums;
+        LockstepRequest lockstepInFlight;
+        RequestSlot lockstepSlot;
 
-        std::thread create(std::string path);
-        void requestThreadFunc(RequestThreadData* data);
-        bool makeRequestOnThread(RequestThreadData* threadData, std::string path, std::string sendData);
-        std::optional<std::string> getResponseFromThread(RequestThreadData* threadData);
+        /* Start a request unless the slot already has one in flight, a reply
+         * that was never collected is dropped. Requests are retried if they
+         * fail, so they must be safe to repeat */
+        bool makeAsyncRequest(RequestSlot& slot, std::string path, std::string sendData,
+                std::list<std::string> headers = {}, long hedgeAfterMs = 0);
+        // The reply if the slot's request has finished
+        std::optional<HttpResponse> takeAsyncResponse(RequestSlot& slot);
+        // The reply body if the slot's request has finished with one
+        std::optional<std::string> getAsyncResponse(RequestSlot& slot, bool* compact = nullptr);
 };
 
 #endif
@@ -0,0 +1,119 @@
+#include "logic.h"
+#include "bytestream.h"
+#include "compression.h"
+#include "randomplay.h"
+#include "wireformat.h"
+
+#include <cxxopts.hpp>
+
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+using namespace std;
+using namespace logic;
+
+/* Measures how well the reply bodies the server sends compress, and what it
+ * costs, at a few zlib levels with and without the preset dictionary. Uses
+ * states saved with writeStateToFile, or plays random games if none are given
+ */
+
+struct Result
+{
+    size_t raw = 0;
+    size_t compressed = 0;
+    double compressUs = 0;
+    double decompressUs = 0;
+};
+
+template <class F>
+double timeUs(int iterations, F f)
+{
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        f();
+    }
+    chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+void measure(Result& result, const string& body, int level, bool dictionary, int iterations)
+{
+    string compressed = compress(body, level, dictionary);
+    result.raw += body.size();
+    result.compressed += compressed.size();
+    result.compressUs += timeUs(iterations, [&]{compress(body, level, dictionary);});
+    result.decompressUs += timeUs(iterations, [&]{decompress(compressed);});
+}
+
+int main(int argc, char **argv)
+{
+    cxxopts::Options opts("compressbench", "Compression ratio and cost of reply bodies");
+    opts.add_options()
+        ("state", "Saved game state (JSON) to use", cxxopts::value<vector<string>>())
+        ("g,games", "Random games to play if no states are given", cxxopts::value<int>()->default_value("20"))
+        ("a,actions", "Actions to play in each random game", cxxopts::value<int>()->default_value("300"))
+        ("i,iterations", "Times each body is compressed to time it", cxxopts::value<int>()->default_value("20"))
+        ("tail", "Changes in the change tail case, like a sync after a few turns",
+            cxxopts::value<int>()->default_value("40"))
+        ;
+    auto result = opts.parse(argc, argv);
+    int iterations = result["iterations"].as<int>();
+    int tail = result["tail"].as<int>();
+
+    vector<GameState> states;
+    if (result.count("state")) {
+        for (auto& filename : result["state"].as<vector<string>>()) {
+            GameState state;
+            ifstream ifs(filename);
+            cereal::JSONInputArchive iarchive(ifs);
+            iarchive(state);
+            states.push_back(state);
+        }
+    } else {
+        int nActions = result["actions"].as<int>();
+        for (int game = 0; game < result["games"].as<int>(); game++) {
+            states.push_back(randomGame(game, nActions));
+        }
+    }
+
+    // The bodies as the server builds them: the state without and with its
+    // change log, and the compact encoding of the most recent changes
+    vector<pair<string, vector<string>>> bodies = {{"state", {}}, {"state + history", {}},
+        {"change tail (compact)", {}}};
+    for (auto& state : states) {
+        bodies[1].second.push_back(serialize(state));
+        auto changes = state.getChangesAfter(0);
+        GameState withoutHistory = state;
+        withoutHistory.changes.clear();
+        bodies[0].second.push_back(serialize(withoutHistory));
+        int from = max(0, (int) changes.size() - tail);
+        bodies[2].second.push_back(encodeChanges(
+                    vector<Change>(changes.begin() + from, changes.end())));
+    }
+
+    cout << "dictionary is " << compressionDictionary().size() << " bytes" << endl;
+    cout << left << setw(24) << "body" << setw(7) << "level" << setw(6) << "dict"
+         << right << setw(10) << "avg B" << setw(10) << "avg zB" << setw(9) << "ratio"
+         << setw(12) << "comp us" << setw(12) << "decomp us" << endl;
+    for (auto& [name, list] : bodies) {
+        for (int level : {1, 6, 9}) {
+            for (bool dictionary : {false, true}) {
+                Result r;
+                for (auto& body : list) {
+                    measure(r, body, level, dictionary, iterations);
+                }
+                double n = max<size_t>(list.size(), 1);
+                cout << left << setw(24) << name << setw(7) << level
+                     << setw(6) << (dictionary ? "yes" : "no") << right
+                     << fixed << setprecision(1)
+                     << setw(10) << r.raw / n << setw(10) << r.compressed / n
+                     << setw(8) << 100.0 * r.compressed / max<size_t>(r.raw, 1) << "%"
+                     << setw(12) << r.compressUs / n << setw(12) << r.decompressUs / n
+                     << endl;
+            }
+        }
+    }
+    return 0;
+}
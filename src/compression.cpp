@@ -0,0 +1,104 @@
+#include "compression.h"
+
+#include "logic.h"
+#include "bytestream.h"
+
+#include <stdexcept>
+
+#include <zlib.h>
+
+using namespace std;
+using namespace logic;
+
+/* Serialized definitions with their ids zeroed so every process builds the
+ * same bytes. zlib finds matches near the end of the dictionary most
+ * cheaply, so the cards, which are sent far more often than bare ships, go
+ * last */
+const string& compressionDictionary()
+{
+    static const string dictionary = []{
+        string d;
+        for (auto ship : allShipDefinitions()) {
+            ship.id = 0;
+            serializeInto(d, ship);
+        }
+        for (auto card : allCardDefinitions()) {
+            card.id = 0;
+            if (card.creates) {
+                card.creates->id = 0;
+            }
+            serializeInto(d, card);
+        }
+        return d;
+    }();
+    return dictionary;
+}
+
+string compress(const string& data, int level, bool useDictionary)
+{
+    z_stream strm = {};
+    if (deflateInit(&strm, level) != Z_OK) {
+        throw runtime_error("Could not initialize deflate");
+    }
+    if (useDictionary) {
+        auto& dictionary = compressionDictionary();
+        deflateSetDictionary(&strm, (const Bytef*) dictionary.data(), dictionary.size());
+    }
+
+    string out(deflateBound(&strm, data.size()), '\0');
+    strm.next_in = (Bytef*) data.data();
+    strm.avail_in = data.size();
+    strm.next_out = (Bytef*) &out[0];
+    strm.avail_out = out.size();
+    int ret = deflate(&strm, Z_FINISH);
+    out.resize(strm.total_out);
+    deflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        throw runtime_error("Deflate did not finish");
+    }
+    return out;
+}
+
+string decompress(const string& data, size_t maxSize)
+{
+    z_stream strm = {};
+    if (inflateInit(&strm) != Z_OK) {
+        throw runtime_error("Could not initialize inflate");
+    }
+    strm.next_in = (Bytef*) data.data();
+    strm.avail_in = data.size();
+
+    string out;
+    char chunk[16384];
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+        strm.next_out = (Bytef*) chunk;
+        strm.avail_out = sizeof(chunk);
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_NEED_DICT) {
+            auto& dictionary = compressionDictionary();
+            if (strm.adler != adler32(adler32(0, nullptr, 0),
+                        (const Bytef*) dictionary.data(), dictionary.size())) {
+                inflateEnd(&strm);
+                throw runtime_error("Compressed with a different dictionary");
+            }
+            inflateSetDictionary(&strm, (const Bytef*) dictionary.data(), dictionary.size());
+            continue;
+        }
+        if (ret != Z_OK and ret != Z_STREAM_END) {
+            inflateEnd(&strm);
+            throw runtime_error("Corrupt compressed data");
+        }
+        out.append(chunk, sizeof(chunk) - strm.avail_out);
+        if (out.size() > maxSize) {
+            inflateEnd(&strm);
+            throw runtime_error("Compressed data expands too far");
+        }
+        if (ret == Z_OK and strm.avail_in == 0 and strm.avail_out != 0) {
+            inflateEnd(&strm);
+            throw runtime_error("Compressed data is truncated");
+        }
+    }
+    inflateEnd(&strm);
+    return out;
+}
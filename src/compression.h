@@ -0,0 +1,33 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <string>
+
+/* Optional compression of large replies. Clients that understand it send
+ * "X-Compression: deflate-dict" and the server compresses replies above a
+ * size threshold, marking them with the same header. A custom header is used
+ * in the same way as X-Wire-Format rather than Accept-Encoding, so nothing
+ * along the way tries to decode it.
+ *
+ * It's zlib deflate with a preset dictionary made from the serialized card
+ * and ship definitions, so the names, card text and ship types that fill
+ * states and change logs compress well even in small replies. Both ends
+ * build the dictionary from the same definitions, and the dictionary's
+ * checksum in the zlib header catches a mismatch.
+ */
+
+#define COMPRESSION_HEADER "X-Compression"
+#define COMPRESSION_DEFLATE "deflate-dict"
+
+// Replies smaller than this aren't worth compressing
+#define DEFAULT_COMPRESS_MIN_BYTES 1024
+
+const std::string& compressionDictionary();
+
+std::string compress(const std::string& data, int level = 6, bool useDictionary = true);
+
+/* Throws std::runtime_error if the data is corrupt, was compressed with a
+ * different dictionary, or would decompress to more than maxSize bytes */
+std::string decompress(const std::string& data, size_t maxSize = 64 << 20);
+
+#endif
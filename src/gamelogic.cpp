@@ -254,10 +254,9 @@ void GraphicsObjectHandler::checkEvents()
      if (cardId) {
          for (auto action : actions) {
              if (action.type == logic::ACTION_PLAY_CARD and action.id == get<int>(*cardId)) {
+                // The card is moved to the stack by the play card change,
+                // predicted or from the server
                 selectedAction = action;
-                auto card = dynamic_pointer_cast<Card>(getObject(action.id));
-                hand->removeCard(card);
-                stack->addCard(card);
                 break;
              }
          }
@@ -499,6 +498,13 @@ void GraphicsObjectHandler::updateState(std::vector<logic::Change> changes, Upda
                 delay = shipTargets(change); break;
             case logic::CHANGE_RETURN_CARD_STACK_TO_HAND:
                 delay = returnCardToHand(change); break;
+            case logic::CHANGE_CARD_TARGETS:
+            case logic::CHANGE_SYSTEM_CONTROLLER:
+            case logic::CHANGE_REMOVE_BEACON:
+            case logic::CHANGE_RESOURCE_SHIP_PLAYED:
+            case logic::CHANGE_OBJECT_IDS:
+                // Nothing to show, these keep copies of the state up to date
+                break;
             default:
                 LOG_ERROR << "Received unhandled change from server: " << change;
         }
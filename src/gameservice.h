@@ -0,0 +1,67 @@
+#ifndef GAMESERVICE_H
+#define GAMESERVICE_H
+
+#include <optional>
+#include <vector>
+
+#include "logic.h"
+#include "lockstep.h"
+#include "bytestream.h"
+
+// Reply to a sync request, see GameService::sync
+struct SyncResponse
+{
+    std::vector<logic::Change> changes;
+    std::vector<logic::Action> actions;
+    SERIALIZE(changes, actions);
+};
+
+/* What the game needs from wherever the game is being run, once a game has
+ * been started or joined. GameClient (client.h) talks to a server over HTTP,
+ * LocalGameService (localgame.h) runs the game in the same process.
+ *
+ * The calls returning optional are asynchronous: each call starts a request
+ * if none is in flight and returns a reply once one has arrived. Otherwise
+ * they return nullopt and are called again later, eg. every frame.
+ */
+class GameService
+{
+    public:
+        virtual ~GameService() {};
+
+        virtual int getMyPlayerId() = 0;
+
+        /* Get the current state of the game, synchronously. The change log
+         * is only filled in if withHistory is set */
+        virtual logic::GameState getState(bool withHistory = false) = 0;
+
+        // getState without the change log, asynchronously
+        virtual std::optional<logic::GameState> pollState() = 0;
+
+        /* Number of changes the last state from getState already includes,
+         * changes after this need to be applied on top of it */
+        virtual int getStateChangeNo() = 0;
+
+        // Queue an action to be sent with the next sync
+        virtual void queueAction(logic::Action action) = 0;
+
+        /* Leave actions to the game as policy allows (see
+         * GameState::autoAction), they won't be offered by sync. Not for
+         * lockstep games. Synchronous */
+        virtual void setAutoPass(logic::AutoPass policy) = 0;
+
+        /* Perform the queued actions and get both the changes since changeNo
+         * and the actions now available to us */
+        virtual std::optional<SyncResponse> sync(int changeNo) = 0;
+
+        // Whether the game is a lockstep game, see lockstep.h
+        virtual bool isLockstepGame() {return false;};
+
+        /* For lockstep games. Send the queued actions, taken after
+         * performing the first actionNo, along with checksums of turns that
+         * have ended, and get back every action after actionNo */
+        virtual std::optional<LockstepReply> lockstepSync(int actionNo,
+                const std::vector<TurnChecksum>& newChecksums) {return {};};
+};
+
+#endif
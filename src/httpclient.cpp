@@ -0,0 +1,332 @@
+#include "httpclient.h"
+
+#include <plog/Log.h>
+
+#include <algorithm>
+
+using namespace std;
+
+static void globalInit()
+{
+    // Never cleaned up, handles may be in use until the process exits
+    static once_flag once;
+    call_once(once, []{curl_global_init(CURL_GLOBAL_DEFAULT);});
+}
+
+static size_t writeBody(char* buffer, size_t size, size_t n, void* data)
+{
+    static_cast<HttpResponse*>(data)->body.append(buffer, size * n);
+    return size * n;
+}
+
+static size_t writeHeader(char* buffer, size_t size, size_t n, void* data)
+{
+    auto response = static_cast<HttpResponse*>(data);
+    string line(buffer, size * n);
+    auto colon = line.find(':');
+    if (colon != string::npos) {
+        string name = line.substr(0, colon);
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        auto value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" "));
+        value.erase(value.find_last_not_of("\r\n") + 1);
+        response->headers[name] = value;
+    }
+    return size * n;
+}
+
+/* Set easy up for request, writing the reply to response. The returned
+ * header list has to be freed once the request is done */
+static curl_slist* setup(CURL* easy, const HttpRequest& request, HttpResponse* response)
+{
+    curl_slist* headers = curl_slist_append(nullptr, "Content-Type: application/octet-stream");
+    for (auto& header : request.headers) {
+        headers = curl_slist_append(headers, header.c_str());
+    }
+    curl_easy_setopt(easy, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(easy, CURLOPT_PORT, request.port);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDS, request.body.data());
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long) request.body.size());
+    curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, request.timeoutMs);
+    curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, writeBody);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, response);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, writeHeader);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, response);
+    return headers;
+}
+
+// Fill in the reply code once easy is done, returns connections it opened
+static long complete(CURL* easy, CURLcode result, const HttpRequest& request,
+        HttpResponse& response)
+{
+    if (result == CURLE_OK) {
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &response.code);
+    } else {
+        LOG_ERROR << "Request to " << request.url << " failed: " << curl_easy_strerror(result);
+        response.code = 0;
+    }
+    curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &response.seconds);
+    long connects = 0;
+    curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+    return connects;
+}
+
+long backoffDelayMs(const HttpRequest& request, int failures, mt19937& rng)
+{
+    long limit = request.backoffMs << min(max(failures - 1, 0), 20);
+    limit = min(limit, request.maxBackoffMs);
+    return uniform_int_distribution<long>(0, max(limit, 0L))(rng);
+}
+
+void LatencyWindow::add(double seconds)
+{
+    times.push_back(seconds);
+    if (times.size() > size) {
+        times.pop_front();
+    }
+}
+
+double LatencyWindow::percentile(double p) const
+{
+    if (not times.size() or times.size() < size) {
+        return 0;
+    }
+    vector<double> sorted(times.begin(), times.end());
+    auto nth = sorted.begin() + min(sorted.size() - 1, (size_t) (p * sorted.size()));
+    nth_element(sorted.begin(), nth, sorted.end());
+    return *nth;
+}
+
+HttpConnection::HttpConnection()
+{
+    globalInit();
+    easy = curl_easy_init();
+}
+
+HttpConnection::~HttpConnection()
+{
+    curl_easy_cleanup(easy);
+}
+
+HttpResponse HttpConnection::perform(const HttpRequest& request)
+{
+    for (int failures = 0;; failures++) {
+        HttpResponse response;
+        curl_easy_reset(easy);
+        auto headers = setup(easy, request, &response);
+        auto result = curl_easy_perform(easy);
+        opened += complete(easy, result, request, response);
+        curl_slist_free_all(headers);
+        if (not response.failed() or failures >= request.retries) {
+            return response;
+        }
+        this_thread::sleep_for(chrono::milliseconds(backoffDelayMs(request, failures + 1, rng)));
+    }
+}
+
+HttpLoop::HttpLoop(long maxConnections)
+{
+    globalInit();
+    multi = curl_multi_init();
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, maxConnections);
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, maxConnections);
+    thread = std::thread([this]{run();});
+}
+
+HttpLoop::~HttpLoop()
+{
+    {
+        lock_guard<mutex> lk(m);
+        stop = true;
+    }
+    curl_multi_wakeup(multi);
+    thread.join();
+
+    for (auto& [easy, attempt] : running) {
+        curl_multi_remove_handle(multi, easy);
+        curl_easy_cleanup(easy);
+        curl_slist_free_all(attempt->headers);
+        resolve(*attempt->transfer, {});
+    }
+    for (auto& transfer : queued) {
+        resolve(*transfer, {});
+    }
+    for (auto& [due, transfer] : waiting) {
+        resolve(*transfer, {});
+    }
+    for (auto easy : idle) {
+        curl_easy_cleanup(easy);
+    }
+    curl_multi_cleanup(multi);
+}
+
+future<HttpResponse> HttpLoop::request(HttpRequest request,
+        function<void(const HttpResponse&)> done)
+{
+    auto transfer = make_shared<Transfer>();
+    transfer->request = move(request);
+    transfer->done = move(done);
+    auto ret = transfer->promise.get_future();
+    {
+        lock_guard<mutex> lk(m);
+        queued.push_back(move(transfer));
+    }
+    curl_multi_wakeup(multi);
+    return ret;
+}
+
+void HttpLoop::start(shared_ptr<Transfer> transfer)
+{
+    CURL* easy;
+    if (idle.size()) {
+        easy = idle.back();
+        idle.pop_back();
+        curl_easy_reset(easy);
+    } else {
+        easy = curl_easy_init();
+    }
+    auto attempt = make_unique<Attempt>();
+    attempt->headers = setup(easy, transfer->request, &attempt->response);
+    transfer->running++;
+    transfer->started = Clock::now();
+    attempt->transfer = move(transfer);
+    running[easy] = move(attempt);
+    curl_multi_add_handle(multi, easy);
+}
+
+void HttpLoop::finish(CURL* easy, CURLcode result)
+{
+    auto it = running.find(easy);
+    if (it == running.end()) {
+        // Cancelled after it had finished
+        return;
+    }
+    auto attempt = move(it->second);
+    running.erase(it);
+
+    auto transfer = attempt->transfer;
+    opened += complete(easy, result, transfer->request, attempt->response);
+    curl_multi_remove_handle(multi, easy);
+    curl_slist_free_all(attempt->headers);
+    // The connection stays in the multi handle's cache, the easy handle is
+    // kept to save setting up a new one
+    idle.push_back(easy);
+    transfer->running--;
+
+    if (attempt->response.failed()) {
+        // The other copy may still get through
+        if (transfer->running) {
+            return;
+        }
+        if (transfer->failures < transfer->request.retries) {
+            transfer->failures++;
+            transfer->hedged = false;
+            retried++;
+            auto delay = backoffDelayMs(transfer->request, transfer->failures, rng);
+            waiting.insert({Clock::now() + chrono::milliseconds(delay), transfer});
+            return;
+        }
+    }
+
+    // The first copy to reply is used
+    for (auto other = running.begin(); other != running.end();) {
+        auto next = std::next(other);
+        if (other->second->transfer == transfer) {
+            cancel(other->first);
+        }
+        other = next;
+    }
+    resolve(*transfer, move(attempt->response));
+}
+
+void HttpLoop::cancel(CURL* easy)
+{
+    auto it = running.find(easy);
+    curl_multi_remove_handle(multi, easy);
+    curl_slist_free_all(it->second->headers);
+    it->second->transfer->running--;
+    running.erase(it);
+    idle.push_back(easy);
+}
+
+void HttpLoop::resolve(Transfer& transfer, HttpResponse response)
+{
+    if (transfer.resolved) {
+        return;
+    }
+    transfer.resolved = true;
+    if (transfer.done) {
+        transfer.done(response);
+    }
+    transfer.promise.set_value(move(response));
+}
+
+long HttpLoop::startDue()
+{
+    auto now = Clock::now();
+    while (waiting.size() and waiting.begin()->first <= now) {
+        auto transfer = waiting.begin()->second;
+        waiting.erase(waiting.begin());
+        start(transfer);
+    }
+
+    auto untilMs = [now](Clock::time_point due) {
+        return (long) chrono::duration_cast<chrono::milliseconds>(due - now).count() + 1;
+    };
+    long wait = 1000;
+    if (waiting.size()) {
+        wait = min(wait, untilMs(waiting.begin()->first));
+    }
+    vector<shared_ptr<Transfer>> hedging;
+    for (auto& [easy, attempt] : running) {
+        auto& transfer = attempt->transfer;
+        if (not transfer->request.hedgeAfterMs or transfer->hedged) {
+            continue;
+        }
+        auto due = transfer->started + chrono::milliseconds(transfer->request.hedgeAfterMs);
+        if (due <= now) {
+            transfer->hedged = true;
+            hedging.push_back(transfer);
+        } else {
+            wait = min(wait, untilMs(due));
+        }
+    }
+    for (auto& transfer : hedging) {
+        hedged++;
+        start(transfer);
+    }
+    return wait;
+}
+
+void HttpLoop::run()
+{
+    while (true) {
+        deque<shared_ptr<Transfer>> starting;
+        {
+            lock_guard<mutex> lk(m);
+            if (stop) {
+                return;
+            }
+            swap(starting, queued);
+        }
+        for (auto& transfer : starting) {
+            start(move(transfer));
+        }
+
+        int stillRunning;
+        curl_multi_perform(multi, &stillRunning);
+        int nMessages;
+        while (CURLMsg* message = curl_multi_info_read(multi, &nMessages)) {
+            if (message->msg == CURLMSG_DONE) {
+                finish(message->easy_handle, message->data.result);
+            }
+        }
+
+        // Woken early by curl_multi_wakeup when there's a new request, and
+        // straight away by curl if a retry or hedge was just added
+        int waitMs = startDue();
+        curl_multi_poll(multi, nullptr, 0, waitMs, nullptr);
+    }
+}
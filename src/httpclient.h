@@ -0,0 +1,175 @@
+#ifndef HTTPCLIENT_H
+#define HTTPCLIENT_H
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "nocopy.h"
+
+/* HTTP for the game client. HttpLoop runs every request on one I/O thread
+ * with a curl multi handle, which keeps connections to the server open and
+ * reuses them, so most requests skip the TCP handshake. HttpConnection does
+ * the same for callers that want to block, with a single kept-alive
+ * connection and no thread.
+ *
+ * Requests that are safe to repeat can be retried when they fail, after a
+ * random wait that doubles each time so that clients that lost the server
+ * together don't all come back at once. HttpLoop can also hedge a request,
+ * sending a second copy if the first is slow and using whichever replies
+ * first, which bounds the wait when one packet or connection is lost.
+ */
+
+struct HttpRequest
+{
+    // Full url, the port is given separately
+    std::string url;
+    long port = 80;
+    std::list<std::string> headers;
+    // Sent as a POST
+    std::string body;
+    long timeoutMs = 1000;
+
+    // Attempts that get no reply or a 5xx are tried again up to this many
+    // times, after a random wait of up to backoffMs, doubling each time up
+    // to maxBackoffMs
+    int retries = 0;
+    long backoffMs = 50;
+    long maxBackoffMs = 1000;
+    // If set a second copy is sent when there's no reply after this long,
+    // HttpLoop only
+    long hedgeAfterMs = 0;
+};
+
+// Reply from the server, header names are lower case. A code of 0 means the
+// request failed before getting a reply
+struct HttpResponse
+{
+    long code = 0;
+    std::string body;
+    std::map<std::string, std::string> headers;
+    // Of the attempt that replied
+    double seconds = 0;
+
+    // Worth trying again, the server may not have seen the request at all
+    bool failed() const {return code == 0 or code >= 500;};
+};
+
+// How long to wait before trying a request again after failures attempts
+long backoffDelayMs(const HttpRequest& request, int failures, std::mt19937& rng);
+
+/* Times of recent requests, to hedge those that take longer than most */
+class LatencyWindow
+{
+    public:
+        LatencyWindow(size_t size = 100) : size(size) {};
+
+        void add(double seconds);
+        // 0 until the window is full
+        double percentile(double p) const;
+
+    private:
+        size_t size;
+        std::deque<double> times;
+};
+
+class HttpConnection : non_copyable
+{
+    public:
+        HttpConnection();
+        ~HttpConnection();
+
+        HttpResponse perform(const HttpRequest& request);
+        long connectionsOpened() const {return opened;};
+
+    private:
+        CURL* easy;
+        long opened = 0;
+        std::mt19937 rng{std::random_device{}()};
+};
+
+class HttpLoop : non_copyable
+{
+    public:
+        // Opens at most maxConnections connections to each host
+        HttpLoop(long maxConnections = 4);
+        // Stops straight away, requests still in flight complete with code 0
+        ~HttpLoop();
+
+        /* Queue a request. done, if given, is called on the I/O thread with
+         * the reply before the future is ready, so it should be quick */
+        std::future<HttpResponse> request(HttpRequest request,
+                std::function<void(const HttpResponse&)> done = {});
+
+        // New connections made so far, requests that reused one don't count
+        long connectionsOpened() const {return opened;};
+        // Attempts made again after failing, and second copies sent
+        long retriesMade() const {return retried;};
+        long hedgesMade() const {return hedged;};
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct Transfer
+        {
+            HttpRequest request;
+            std::promise<HttpResponse> promise;
+            std::function<void(const HttpResponse&)> done;
+            int failures = 0;
+            // Attempts in flight, two once hedged
+            int running = 0;
+            bool hedged = false;
+            bool resolved = false;
+            Clock::time_point started;
+        };
+
+        // One try at a transfer on an easy handle
+        struct Attempt
+        {
+            std::shared_ptr<Transfer> transfer;
+            HttpResponse response;
+            curl_slist* headers = nullptr;
+        };
+
+        void run();
+        void start(std::shared_ptr<Transfer> transfer);
+        void finish(CURL* easy, CURLcode result);
+        // Drop an attempt without waiting for its reply
+        void cancel(CURL* easy);
+        void resolve(Transfer& transfer, HttpResponse response);
+        // Start waiting retries and hedges that are due, returns how long
+        // until the next one
+        long startDue();
+
+        CURLM* multi;
+        std::atomic<long> opened{0};
+        std::atomic<long> retried{0};
+        std::atomic<long> hedged{0};
+
+        std::mutex m;
+        std::deque<std::shared_ptr<Transfer>> queued;
+        bool stop = false;
+
+        // Only used on the I/O thread
+        std::map<CURL*, std::unique_ptr<Attempt>> running;
+        std::vector<CURL*> idle;
+        // Failed transfers waiting to be tried again
+        std::multimap<Clock::time_point, std::shared_ptr<Transfer>> waiting;
+        std::mt19937 rng{std::random_device{}()};
+
+        std::thread thread;
+};
+
+#endif
@@ -0,0 +1,413 @@
+#include "client.h"
+#include "httpclient.h"
+#include "metrics.h"
+#include "randomplay.h"
+#include "util.h"
+
+#include <plog/Log.h>
+#include <cxxopts.hpp>
+
+#include <algorithm>
+#include <condition_variable>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+
+using namespace std;
+using namespace logic;
+
+/* Latencies in seconds and error count for a single endpoint */
+struct EndpointStats
+{
+    vector<double> latencies;
+    int errors = 0;
+};
+
+typedef map<string, EndpointStats> Stats;
+
+/* A simulated player or spectator. Sets up its game with synchronous
+ * requests, then plays turns with requests on a shared HttpLoop so that a
+ * bot waiting for a reply doesn't hold up the others. Times every request
+ * it makes
+ */
+class Bot : public GameClient
+{
+    public:
+        Bot(string serverAddr, int port, string username, string joinUsername,
+                bool spectator = false)
+            : GameClient(serverAddr, port, false),
+              myUsername(username), joinUsername(joinUsername), spectator(spectator)
+        { }
+
+        /* Log in, then either create a game or join the other player's game.
+         * Spectators only log in, and are given a game to watch later */
+        bool setup(Stats& stats)
+        {
+            if (not timed(stats, "/login", [this]{
+                        login(myUsername);
+                        return isLoggedIn();})) {
+                return false;
+            }
+            if (spectator) {
+                return true;
+            } else if (joinUsername.size()) {
+                return timed(stats, "/join", [this]{
+                        joinUser(joinUsername);
+                        return gameId.size() > 0;});
+            } else {
+                return timed(stats, "/createGame", [this]{
+                        startGame();
+                        return gameId.size() > 0;});
+            }
+        }
+
+        string getGameId() {return gameId;};
+
+        /* Make the requests for one turn of the game. When using sync this
+         * is a single request, otherwise it's getting changes and actions
+         * and then performing an action. Spectators just get the changes.
+         * Requests are made on loop and done is called on its I/O thread
+         * with the number of actions performed once the turn is over, stats
+         * and rng are only used there
+         */
+        void step(HttpLoop& loop, Stats& stats, bool useSync, mt19937& rng,
+                function<void(int)> done)
+        {
+            string gamePath = serverAddr + "/game/" + gameId;
+
+            if (spectator) {
+                timedRequest(loop, stats, "/spectate",
+                        gamePath + "/spectate/" + to_string(changeNo), "",
+                        [this, done](optional<string> data) {
+                    if (data) {
+                        auto changes = deserialize<vector<Change>>(*data);
+                        if (changes.size()) {
+                            changeNo = changes.back().changeNo;
+                        }
+                    }
+                    done(0);
+                });
+            } else if (useSync) {
+                timedRequest(loop, stats, "/sync",
+                        gamePath + "/sync/" + to_string(changeNo), serialize(toPerform),
+                        [this, &rng, done](optional<string> data) {
+                    int performed = data ? toPerform.size() : 0;
+                    toPerform.clear();
+                    if (not data) {
+                        done(0);
+                        return;
+                    }
+                    auto response = deserialize<SyncResponse>(*data);
+                    if (response.changes.size()) {
+                        changeNo = response.changes.back().changeNo;
+                    }
+                    if (response.actions.size()) {
+                        toPerform.push_back(randomAction(response.actions, rng));
+                    }
+                    done(performed);
+                });
+            } else {
+                timedRequest(loop, stats, "/changes",
+                        gamePath + "/changes/" + to_string(changeNo), "",
+                        [this, &loop, &stats, &rng, gamePath, done](optional<string> changes) {
+                    if (changes) {
+                        auto c = deserialize<vector<Change>>(*changes);
+                        if (c.size()) {
+                            changeNo = c.back().changeNo;
+                        }
+                    }
+                    timedRequest(loop, stats, "/getactions", gamePath + "/getactions", "",
+                            [this, &loop, &stats, &rng, gamePath, done](optional<string> data) {
+                        if (not data) {
+                            done(0);
+                            return;
+                        }
+                        auto actions = deserialize<vector<Action>>(*data);
+                        if (not actions.size()) {
+                            done(0);
+                            return;
+                        }
+                        auto action = randomAction(actions, rng);
+                        timedRequest(loop, stats, "/performaction",
+                                gamePath + "/performaction", serialize(action),
+                                [done](optional<string> data) {
+                            done(data ? 1 : 0);
+                        });
+                    });
+                });
+            }
+        }
+
+    private:
+        string myUsername;
+        string joinUsername;
+        bool spectator;
+        int changeNo = 0;
+        vector<Action> toPerform;
+
+        bool timed(Stats& stats, string endpoint, function<bool()> f)
+        {
+            StageTimer timer;
+            bool ok = false;
+            try {
+                ok = f();
+            } catch (exception& e) {
+                LOG_ERROR << "Request to " << endpoint << " failed: " << e.what();
+            }
+            stats[endpoint].latencies.push_back(timer.total());
+            if (not ok) {
+                stats[endpoint].errors++;
+            }
+            return ok;
+        }
+
+        /* Time taken is that of the attempt that replied, so it doesn't
+         * include waiting for one of the loop's connections to be free */
+        void timedRequest(HttpLoop& loop, Stats& stats, string endpoint,
+                string path, string data, function<void(optional<string>)> then)
+        {
+            loop.request(buildRequest(path, data, {}),
+                    [this, &stats, endpoint, path, then](const HttpResponse& reply) {
+                auto response = finishResponse(path, reply);
+                stats[endpoint].latencies.push_back(response.seconds);
+                if (response.code != 200) {
+                    stats[endpoint].errors++;
+                    then({});
+                    return;
+                }
+                then(response.body);
+            });
+        }
+};
+
+/* Plays the turns of a share of the bots. Turns are started from the thread
+ * calling run when they're due and their requests complete on the runner's
+ * own HttpLoop, so any number of bots can be waiting on the server at once.
+ * If the loadgen itself can't keep up turns start late, which is recorded
+ * in lateness rather than showing up as server latency
+ */
+class BotRunner
+{
+    public:
+        typedef chrono::steady_clock Clock;
+
+        BotRunner(long maxConnections, int seed) : loop(maxConnections), rng(seed) { }
+
+        void run(vector<Bot*> bots, bool useSync, chrono::milliseconds think,
+                Clock::time_point start, Clock::time_point deadline)
+        {
+            unique_lock<mutex> lk(m);
+            for (auto bot : bots) {
+                due.push({start + thinkTime(think), bot});
+            }
+            while (Clock::now() < deadline) {
+                if (due.empty() or due.top().first > Clock::now()) {
+                    changed.wait_until(lk, due.empty() ? deadline
+                            : min(due.top().first, deadline));
+                    continue;
+                }
+                auto scheduled = due.top().first;
+                Bot* bot = due.top().second;
+                due.pop();
+                chrono::duration<double> late = Clock::now() - scheduled;
+                lateness.push_back(late.count());
+                running++;
+                lk.unlock();
+                bot->step(loop, stats, useSync, rng, [this, bot, think](int performed) {
+                    lock_guard<mutex> lk(m);
+                    actionsPerformed += performed;
+                    running--;
+                    due.push({Clock::now() + thinkTime(think), bot});
+                    changed.notify_one();
+                });
+                lk.lock();
+            }
+            // Let the turns in flight finish so that stats are complete
+            changed.wait(lk, [this]{return running == 0;});
+        }
+
+        Stats stats;
+        int actionsPerformed = 0;
+        // Seconds each turn started after it was due
+        vector<double> lateness;
+
+    private:
+        Clock::duration thinkTime(chrono::milliseconds think)
+        {
+            return chrono::duration_cast<chrono::milliseconds>(think * jitter(rng));
+        }
+
+        HttpLoop loop;
+        mt19937 rng;
+        uniform_real_distribution<double> jitter{0.5, 1.5};
+
+        mutex m;
+        condition_variable changed;
+        priority_queue<pair<Clock::time_point, Bot*>, vector<pair<Clock::time_point, Bot*>>,
+            greater<pair<Clock::time_point, Bot*>>> due;
+        int running = 0;
+};
+
+double percentile(vector<double>& sorted, double p)
+{
+    if (not sorted.size()) {
+        return 0;
+    }
+    int i = min<int>(sorted.size() - 1, p * sorted.size());
+    return sorted[i];
+}
+
+void printReport(Stats& stats, int totalActions, double seconds)
+{
+    cout << left << setw(16) << "endpoint" << right
+         << setw(10) << "requests" << setw(8) << "errors"
+         << setw(10) << "p50 ms" << setw(10) << "p95 ms" << setw(10) << "p99 ms"
+         << endl;
+    for (auto& [endpoint, endpointStats] : stats) {
+        auto& l = endpointStats.latencies;
+        sort(l.begin(), l.end());
+        cout << left << setw(16) << endpoint << right
+             << setw(10) << l.size() << setw(8) << endpointStats.errors
+             << fixed << setprecision(2)
+             << setw(10) << percentile(l, 0.50) * 1000
+             << setw(10) << percentile(l, 0.95) * 1000
+             << setw(10) << percentile(l, 0.99) * 1000
+             << endl;
+    }
+    cout << "Performed " << totalActions << " actions in " << seconds << "s: "
+         << totalActions / seconds << " actions/s" << endl;
+}
+
+/* Turns that start late mean the loadgen is short of threads or
+ * connections, and the server is under less load than asked for */
+void printLateness(vector<double>& lateness, chrono::milliseconds think)
+{
+    sort(lateness.begin(), lateness.end());
+    double p95 = percentile(lateness, 0.95);
+    cout << "Turns started late by p50 " << percentile(lateness, 0.50) * 1000
+         << " ms, p95 " << p95 * 1000
+         << " ms, p99 " << percentile(lateness, 0.99) * 1000 << " ms" << endl;
+    if (p95 * 1000 > think.count() / 10) {
+        cout << "Warning: turns are not starting on time, add threads or "
+             << "connections for the think time to hold" << endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    cxxopts::Options opts("loadgen", "Simulate many players against a game server");
+    opts.add_options()
+        ("host", "Server address", cxxopts::value<string>()->default_value("localhost"))
+        ("p,port", "Server port", cxxopts::value<int>()->default_value("40000"))
+        ("n,players", "Number of simulated players", cxxopts::value<int>()->default_value("1000"))
+        ("s,spectators", "Number of spectators, all watching the first game", cxxopts::value<int>()->default_value("0"))
+        ("t,threads", "Threads to set up the players on and start their turns from", cxxopts::value<int>()->default_value("16"))
+        ("c,connections", "Connections to the server for each thread's turns", cxxopts::value<int>()->default_value("16"))
+        ("think", "Average time between turns for each player in ms", cxxopts::value<int>()->default_value("500"))
+        ("d,duration", "Seconds to play for after setting up games", cxxopts::value<int>()->default_value("30"))
+        ("classic", "Use separate changes/getactions/performaction requests rather than sync")
+        ("l,logfile", "Log output location", cxxopts::value<string>()->default_value("loadgen.log"))
+        ;
+    auto result = opts.parse(argc, argv);
+
+    plog::init(plog::warning, result["logfile"].as<string>().c_str());
+
+    string host = result["host"].as<string>();
+    int port = result["port"].as<int>();
+    int nPlayers = result["players"].as<int>();
+    int nSpectators = result["spectators"].as<int>();
+    int nThreads = result["threads"].as<int>();
+    long connections = result["connections"].as<int>();
+    auto think = chrono::milliseconds(result["think"].as<int>());
+    auto duration = chrono::seconds(result["duration"].as<int>());
+    bool useSync = not result.count("classic");
+
+    // Pairs of players share a game, the first creates it and the second
+    // joins by username. Pairs are split between the threads
+    string runId = randString(4);
+    vector<vector<unique_ptr<Bot>>> botsByThread(nThreads);
+    for (int i = 0; i < nPlayers; i++) {
+        string username = "bot" + runId + "_" + to_string(i);
+        string joinUsername;
+        if (i % 2) {
+            joinUsername = "bot" + runId + "_" + to_string(i - 1);
+        }
+        botsByThread[(i / 2) % nThreads].push_back(
+                make_unique<Bot>(host, port, username, joinUsername));
+    }
+    vector<Bot*> spectators;
+    for (int i = 0; i < nSpectators; i++) {
+        auto& bots = botsByThread[i % nThreads];
+        bots.push_back(make_unique<Bot>(host, port,
+                    "spectator" + runId + "_" + to_string(i), "", true));
+        spectators.push_back(bots.back().get());
+    }
+
+    vector<Stats> setupStats(nThreads);
+    vector<thread> workers;
+
+    cout << "Setting up " << nPlayers << " players and " << nSpectators 
+         << " spectators on " << nThreads << " threads" << endl;
+    for (int i = 0; i < nThreads; i++) {
+        workers.push_back(thread([&, i]{
+            for (auto& bot : botsByThread[i]) {
+                bot->setup(setupStats[i]);
+            }
+        }));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    workers.clear();
+
+    if (nSpectators) {
+        string watchedGame = botsByThread[0].front()->getGameId();
+        for (auto spectator : spectators) {
+            spectator->spectateGame(watchedGame);
+        }
+    }
+
+    cout << "Playing for " << duration.count() << "s" << endl;
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + duration;
+    vector<unique_ptr<BotRunner>> runners;
+    for (int i = 0; i < nThreads; i++) {
+        runners.push_back(make_unique<BotRunner>(connections, i));
+        vector<Bot*> bots;
+        for (auto& bot : botsByThread[i]) {
+            bots.push_back(bot.get());
+        }
+        workers.push_back(thread([&, i, bots]{
+            runners[i]->run(bots, useSync, think, start, deadline);
+        }));
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+    Stats allStats;
+    int totalActions = 0;
+    vector<double> lateness;
+    for (int i = 0; i < nThreads; i++) {
+        for (auto stats : {&setupStats[i], &runners[i]->stats}) {
+            for (auto& [endpoint, endpointStats] : *stats) {
+                auto& all = allStats[endpoint];
+                all.latencies.insert(all.latencies.end(),
+                        endpointStats.latencies.begin(), endpointStats.latencies.end());
+                all.errors += endpointStats.errors;
+            }
+        }
+        totalActions += runners[i]->actionsPerformed;
+        lateness.insert(lateness.end(),
+                runners[i]->lateness.begin(), runners[i]->lateness.end());
+    }
+    printReport(allStats, totalActions, elapsed.count());
+    printLateness(lateness, think);
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include "localgame.h"
+
+#include <plog/Log.h>
+
+#include <algorithm>
+#include <random>
+
+#include "botsearch.h"
+
+using namespace std;
+using namespace logic;
+
+LocalGameService::LocalGameService(int botThinkMs)
+    : botThinkMs(clamp(botThinkMs, 1, MAX_BOT_THINK_MS))
+{
+    state.startGame();
+    myId = state.players.front().id;
+    botId = state.otherPlayer(myId);
+    botThread = thread(&LocalGameService::botWorker, this);
+    LOG_INFO << "Started a local game against a bot";
+}
+
+LocalGameService::~LocalGameService()
+{
+    {
+        lock_guard<mutex> lk(m);
+        stop = true;
+    }
+    wake.notify_all();
+    botThread.join();
+}
+
+GameState LocalGameService::getState(bool withHistory)
+{
+    lock_guard<mutex> lk(m);
+    stateChangeNo = state.changes.size();
+    // Move the change log out of the way rather than copying it
+    vector<Change> changes;
+    if (not withHistory) {
+        swap(changes, state.changes);
+    }
+    GameState ret = state;
+    if (not withHistory) {
+        swap(changes, state.changes);
+    }
+    return ret;
+}
+
+void LocalGameService::setAutoPass(AutoPass policy)
+{
+    lock_guard<mutex> lk(m);
+    autoPass = policy;
+    autoResolve();
+}
+
+void LocalGameService::autoResolve()
+{
+    // Bounded in case neither of us has anything to do but pass
+    for (int i = 0; i < 64; i++) {
+        auto action = state.autoAction(myId, autoPass);
+        if (not action) {
+            action = state.autoAction(botId, AUTO_PASS_FORCED);
+        }
+        if (not action) {
+            break;
+        }
+        state.performAction(*action);
+        version++;
+    }
+    wake.notify_all();
+}
+
+optional<GameState> LocalGameService::pollState()
+{
+    return getState();
+}
+
+void LocalGameService::queueAction(Action action)
+{
+    queuedActions.push_back(move(action));
+}
+
+optional<SyncResponse> LocalGameService::sync(int changeNo)
+{
+    lock_guard<mutex> lk(m);
+    if (queuedActions.size()) {
+        for (auto& action : queuedActions) {
+            if (not state.canPerform(action)) {
+                LOG_WARNING << "Ignoring " << action << " which isn't allowed";
+                continue;
+            }
+            state.performAction(action);
+            version++;
+        }
+        queuedActions.clear();
+        autoResolve();
+    }
+    if (version == syncedVersion) {
+        return {};
+    }
+    syncedVersion = version;
+
+    SyncResponse ret;
+    ret.changes = state.getChangesAfter(changeNo);
+    ret.actions = state.getPossibleActions(myId);
+    return ret;
+}
+
+void LocalGameService::botWorker()
+{
+    mt19937 rng(random_device{}());
+    unique_lock<mutex> lk(m);
+    while (not stop) {
+        if (not state.getPossibleActions(botId).size()) {
+            wake.wait(lk);
+            continue;
+        }
+
+        // Think about a copy without holding the lock
+        GameState copy = state;
+        uint64_t seen = version;
+        lk.unlock();
+        SearchLimits limits;
+        limits.budget = chrono::milliseconds(botThinkMs);
+        limits.cancelled = [this, seen]{
+            lock_guard<mutex> lk(m);
+            return stop or version != seen;
+        };
+        auto result = searchAction(copy, botId, limits, rng);
+        lk.lock();
+
+        if (result.action and not result.cancelled and version == seen) {
+            LOG_DEBUG << "Bot performing: " << *result.action;
+            state.performAction(*result.action);
+            version++;
+            autoResolve();
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef LOCALGAME_H
+#define LOCALGAME_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "gameservice.h"
+#include "botpool.h"
+#include "nocopy.h"
+
+/* A game against a computer player run in this process, for playing offline
+ * without a server. Nothing is serialized or sent anywhere, calls act on the
+ * game directly under a lock and always reply straight away.
+ *
+ * The bot thinks on its own thread in the same way as the server's bots do
+ * (see GameEndpoint::botMove in server.cxx), starting again if the game
+ * changes while it's thinking.
+ */
+class LocalGameService : public GameService, non_copyable
+{
+    public:
+        // We take the first seat, the bot thinks for about botThinkMs a move
+        LocalGameService(int botThinkMs = DEFAULT_BOT_THINK_MS);
+        ~LocalGameService();
+
+        int getMyPlayerId() override {return myId;};
+        logic::GameState getState(bool withHistory = false) override;
+        std::optional<logic::GameState> pollState() override;
+        int getStateChangeNo() override {return stateChangeNo;};
+        void queueAction(logic::Action action) override;
+        void setAutoPass(logic::AutoPass policy) override;
+
+        /* Nothing is returned while the game is the same as at the last
+         * call. No change carries a checksum since the copy of the game
+         * being kept up to date can't be out of step with this one */
+        std::optional<SyncResponse> sync(int changeNo) override;
+
+    private:
+        void botWorker();
+        // Take the actions left to the game, the bot leaves it any forced
+        // ones. Call with m held
+        void autoResolve();
+
+        std::mutex m;
+        std::condition_variable wake;
+        logic::GameState state;
+        // Goes up with every action, a bot that sees it change gives up
+        uint64_t version = 0;
+        bool stop = false;
+
+        int myId;
+        int botId;
+        int botThinkMs;
+        logic::AutoPass autoPass = logic::AUTO_PASS_NEVER;
+
+        std::vector<logic::Action> queuedActions;
+        // Version at the last sync that returned something
+        uint64_t syncedVersion = -1;
+        int stateChangeNo = 0;
+
+        std::thread botThread;
+};
+
+#endif
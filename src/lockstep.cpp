@@ -0,0 +1,148 @@
+#include "lockstep.h"
+
+#include "wireformat.h"
+
+using namespace std;
+using namespace logic;
+
+// Turns a checksum is kept for, peers are rarely more than one apart
+#define LOCKSTEP_CHECKSUM_TURNS 16
+
+string encodeLockstepRequest(const LockstepRequest& request)
+{
+    WireWriter w;
+    w.varint(request.actions.size());
+    for (auto& action : request.actions) {
+        writeBriefAction(w, action);
+    }
+    w.varint(request.checksums.size());
+    for (auto& checksum : request.checksums) {
+        w.varint(checksum.turn);
+        w.varint(checksum.checksum);
+    }
+    return w.data;
+}
+
+LockstepRequest decodeLockstepRequest(const string& data)
+{
+    WireReader r(data);
+    LockstepRequest request;
+    request.actions.resize(r.count());
+    for (auto& action : request.actions) {
+        action = readBriefAction(r);
+    }
+    request.checksums.resize(r.count());
+    for (auto& checksum : request.checksums) {
+        checksum.turn = r.varint();
+        checksum.checksum = r.varint();
+    }
+    return request;
+}
+
+LockstepReply decodeLockstepReply(const string& data)
+{
+    WireReader r(data);
+    LockstepReply reply;
+    reply.rejected = r.boolean();
+    reply.desyncTurn = r.varint();
+    reply.actions.resize(r.count());
+    for (auto& action : reply.actions) {
+        action = readBriefAction(r);
+    }
+    return reply;
+}
+
+LockstepPeer::LockstepPeer(GameState state) : state(move(state))
+{
+    this->state.changes.clear();
+}
+
+vector<Change> LockstepPeer::perform(const Action& action)
+{
+    int whoseTurn = state.turnInfo.whoseTurn;
+    state.performAction(action);
+    actionNo++;
+    if (state.turnInfo.whoseTurn != whoseTurn) {
+        turn++;
+        checksums.push_back({turn, stateChecksum(state)});
+    }
+    vector<Change> changes;
+    swap(changes, state.changes);
+    return changes;
+}
+
+vector<TurnChecksum> LockstepPeer::takeChecksums()
+{
+    vector<TurnChecksum> ret;
+    swap(ret, checksums);
+    return ret;
+}
+
+vector<Action> LockstepPeer::getPossibleActions(int playerId)
+{
+    return state.getPossibleActions(playerId);
+}
+
+bool LockstepPeer::canPerform(const Action& action)
+{
+    return state.canPerform(action);
+}
+
+LockstepLog::LockstepLog(const GameState& initial, bool validate)
+{
+    if (validate) {
+        referee.emplace(initial);
+    }
+}
+
+bool LockstepLog::append(int playerId, int actionNo, const vector<Action>& toAppend)
+{
+    if (actionNo != getActionCount()) {
+        return false;
+    }
+    WireWriter w(actions);
+    for (auto& action : toAppend) {
+        if (action.playerId != playerId) {
+            LOG_WARNING << "Player " << playerId << " sent an action for " << action.playerId;
+            return false;
+        }
+        if (referee) {
+            if (not referee->canPerform(action)) {
+                LOG_WARNING << "Player " << playerId << " sent " << action << " which isn't allowed";
+                return false;
+            }
+            referee->perform(action);
+            check(referee->takeChecksums());
+        }
+        offsets.push_back(actions.size());
+        writeBriefAction(w, action);
+    }
+    return true;
+}
+
+void LockstepLog::check(const vector<TurnChecksum>& newChecksums)
+{
+    for (auto& checksum : newChecksums) {
+        auto [it, inserted] = checksums.insert({checksum.turn, checksum.checksum});
+        if (not inserted and it->second != checksum.checksum
+                and (not desyncTurn or checksum.turn < desyncTurn)) {
+            LOG_WARNING << "Peers are out of step from turn " << checksum.turn;
+            desyncTurn = checksum.turn;
+        }
+    }
+    while (checksums.size() > LOCKSTEP_CHECKSUM_TURNS) {
+        checksums.erase(checksums.begin());
+    }
+}
+
+void LockstepLog::writeReply(string& out, int actionNo, bool rejected) const
+{
+    WireWriter w(out);
+    w.boolean(rejected);
+    w.varint(desyncTurn);
+    actionNo = max(0, min(actionNo, getActionCount()));
+    w.varint(getActionCount() - actionNo);
+    if (actionNo < getActionCount()) {
+        out.append(actions, offsets[actionNo], string::npos);
+    }
+}
@@ -0,0 +1,122 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "logic.h"
+
+/* Lockstep games. The game logic is deterministic (new objects get ids from
+ * the game's own counter and nothing is random), so instead of the server
+ * performing actions and sending everyone the changes, every peer runs the
+ * game itself from the starting state and the server only passes the actions
+ * on, in the brief encoding from wireformat.h which is a few bytes each.
+ *
+ * Whenever a turn ends each peer sends the server a checksum of its state
+ * (stateChecksum) for that turn, and the server compares them to catch peers
+ * that have gone out of step. Most games the server doesn't run at all, it
+ * only checks that players send their own actions. A sample of games is run
+ * on the server as well, which then also refuses actions that aren't
+ * allowed and has its own checksum of each turn for the peers to match.
+ */
+
+struct TurnChecksum
+{
+    int turn;
+    uint32_t checksum;
+};
+
+// Sent by a peer, actions it took and checksums of turns that have ended
+struct LockstepRequest
+{
+    std::vector<logic::Action> actions;
+    std::vector<TurnChecksum> checksums;
+};
+
+struct LockstepReply
+{
+    // Every action after the action number the peer asked from
+    std::vector<logic::Action> actions;
+    // Some of the actions sent weren't taken, see LockstepLog::append
+    bool rejected = false;
+    // The first turn peers had different checksums for, 0 if none
+    int desyncTurn = 0;
+};
+
+std::string encodeLockstepRequest(const LockstepRequest& request);
+LockstepRequest decodeLockstepRequest(const std::string& data);
+LockstepReply decodeLockstepReply(const std::string& data);
+
+/* A lockstep game as one peer sees it */
+class LockstepPeer
+{
+    public:
+        // state is the game before any actions, as sent by the server
+        LockstepPeer(logic::GameState state);
+
+        // Perform the next action, returning the changes it made
+        std::vector<logic::Change> perform(const logic::Action& action);
+
+        // Checksums of the turns that ended since the last call
+        std::vector<TurnChecksum> takeChecksums();
+
+        std::vector<logic::Action> getPossibleActions(int playerId);
+        // See GameState::canPerform
+        bool canPerform(const logic::Action& action);
+
+        // The change log is left empty, changes are only returned by perform
+        const logic::GameState& getState() const {return state;};
+        // Actions performed so far
+        int getActionNo() const {return actionNo;};
+        // Turns ended so far
+        int getTurn() const {return turn;};
+
+    private:
+        logic::GameState state;
+        int actionNo = 0;
+        int turn = 0;
+        std::vector<TurnChecksum> checksums;
+};
+
+/* The server's side of a lockstep game: the actions so far, already encoded,
+ * and the checksums peers have sent for recent turns */
+class LockstepLog
+{
+    public:
+        /* initial is the game before any actions. If validate is set the
+         * game is also run here and actions that aren't allowed are refused */
+        LockstepLog(const logic::GameState& initial, bool validate);
+
+        /* Add actions playerId took after seeing the first actionNo. None
+         * are added if another action got in first, the player has to see
+         * it before choosing again. Otherwise they're added in order up to
+         * one that isn't playerId's own or, when validating, isn't allowed.
+         * Returns whether all of them were added */
+        bool append(int playerId, int actionNo, const std::vector<logic::Action>& actions);
+
+        // Compare checksums from a peer with those already known
+        void check(const std::vector<TurnChecksum>& checksums);
+
+        // Write the reply to a peer that has seen the first actionNo actions
+        void writeReply(std::string& out, int actionNo, bool rejected) const;
+
+        int getActionCount() const {return offsets.size();};
+        int getDesyncTurn() const {return desyncTurn;};
+        bool isValidated() const {return referee.has_value();};
+
+    private:
+        // The actions in the brief encoding, one after another, and where
+        // each one starts
+        std::string actions;
+        std::vector<uint32_t> offsets;
+
+        std::optional<LockstepPeer> referee;
+        // The first checksum heard for each recent turn
+        std::map<int, uint32_t> checksums;
+        int desyncTurn = 0;
+};
+
+#endif
@@ -1,15 +1,118 @@
 #include "logic.h"
 
 #include "carddefinitions.h"
+#include "bytestream.h"
+
+#include <zlib.h>
 
 #include <fstream>
 #include <algorithm>
 #include <queue>
+#include <unordered_map>
 
 using namespace logic;
 using namespace std;
 
 int GameObject::curId = 1;
+thread_local int* GameObject::idCounter = nullptr;
+thread_local bool quietLogging = false;
+
+const vector<Card>& logic::allCardDefinitions()
+{
+    static const vector<Card> definitions = {
+        CardDefinitions::sample_ship,
+        CardDefinitions::sample_ship2,
+        CardDefinitions::resource_ship,
+        CardDefinitions::ai_coreship,
+        CardDefinitions::droneSwarm,
+        CardDefinitions::subtle_hack,
+        CardDefinitions::am_gatherer,
+        CardDefinitions::diplomaticVessal,
+        CardDefinitions::am_laser,
+    };
+    return definitions;
+}
+
+const vector<Ship>& logic::allShipDefinitions()
+{
+    static const vector<Ship> definitions = {
+        ShipDefinitions::sampleShip,
+        ShipDefinitions::sampleShip2,
+        ShipDefinitions::defaultFlagship,
+        ShipDefinitions::miningShip,
+        ShipDefinitions::aiCore,
+        ShipDefinitions::drone,
+        ShipDefinitions::amGatherer,
+        ShipDefinitions::diplomaticVessal,
+    };
+    return definitions;
+}
+
+void logic::bindCallbacks(Ship& ship)
+{
+    static auto byType = []{
+        unordered_map<string, const Ship*> m;
+        for (auto& s : allShipDefinitions()) {
+            m[s.type] = &s;
+        }
+        return m;
+    }();
+    auto it = byType.find(ship.type);
+    if (it != byType.end()) {
+        ship.upkeep = it->second->upkeep;
+        ship.kind = it->second->kind;
+    }
+}
+
+void logic::bindCallbacks(Card& card)
+{
+    static auto byName = []{
+        unordered_map<string, const Card*> m;
+        for (auto& c : allCardDefinitions()) {
+            m[c.name] = &c;
+        }
+        return m;
+    }();
+    auto it = byName.find(card.name);
+    if (it != byName.end()) {
+        card.resolve = it->second->resolve;
+        card.getValidTargets = it->second->getValidTargets;
+        card.canPlay = it->second->canPlay;
+    }
+    if (card.creates) {
+        bindCallbacks(*card.creates);
+    }
+}
+
+void logic::bindCallbacks(GameState& state)
+{
+    for (auto& ship : state.ships) {
+        bindCallbacks(ship);
+    }
+    for (auto& player : state.players) {
+        for (auto cards : {&player.deck, &player.hand, &player.discard}) {
+            for (auto& card : *cards) {
+                bindCallbacks(card);
+            }
+        }
+    }
+    for (auto& card : state.stack) {
+        bindCallbacks(card);
+    }
+}
+
+uint32_t logic::stateChecksum(const GameState& state)
+{
+    string data;
+    {
+        StringOutputBuf buf(data);
+        ostream os(&buf);
+        cereal::PortableBinaryOutputArchive archive(os);
+        archive(state.turnInfo, state.players, state.ships, state.systems, state.beacons,
+                state.stack, state.nextObjectId);
+    }
+    return crc32(crc32(0, nullptr, 0), (const Bytef*) data.data(), data.size());
+}
 
 int totalCost(const ResourceAmount& r)
 {
@@ -207,12 +310,13 @@ list<logic::System> createSystems(int n)
 
 void GameState::startGame()
 {
-    LOG_INFO << "Setting up game";
+    IdScope ids(nextObjectId);
+    GAME_LOG_INFO << "Setting up game";
 
-    LOG_INFO << "Initilializing systems";
+    GAME_LOG_INFO << "Initilializing systems";
     systems = createSystems(SPACEGRID_SIZE);
 
-    LOG_INFO << "Creating player objects";
+    GAME_LOG_INFO << "Creating player objects";
     for (int i = 0; i < 2; i++) {
         // Create player objects
 
@@ -244,10 +348,10 @@ void GameState::startGame()
         for (int i = 0; i < 7; i++) {
             p.draw();
         }
-        LOG_INFO << "Adding player " << p.name;
+        GAME_LOG_INFO << "Adding player " << p.name;
 
         // Give them flagships TODO load chosen flagshipss
-        LOG_INFO << "Added flagship for " << p.name;
+        GAME_LOG_INFO << "Added flagship for " << p.name;
         logic::Ship flagship = ShipDefinitions::defaultFlagship;
         flagship.controller = p.id;
         flagship.owner = p.id;
@@ -587,6 +691,66 @@ vector<Action> GameState::getPossibleActions(int playerId)
     }
 }
 
+bool GameState::canPerform(const Action& action)
+{
+    for (auto& possible : getPossibleActions(action.playerId)) {
+        if (possible.type != action.type or possible.id != action.id) {
+            continue;
+        }
+        if (possible.type == ACTION_SELECT_SHIPS or possible.type == ACTION_SELECT_SYSTEM) {
+            set<int> picked(action.targets.begin(), action.targets.end());
+            if (picked.size() != action.targets.size() 
+                    or (int) picked.size() < possible.minTargets
+                    or (int) picked.size() > possible.maxTargets) {
+                continue;
+            }
+            bool offered = all_of(picked.begin(), picked.end(), [&possible](int target) {
+                return find(possible.targets.begin(), possible.targets.end(), target) 
+                    != possible.targets.end();
+            });
+            if (not offered) {
+                continue;
+            }
+        }
+        if (possible.type == ACTION_PLAY_CARD and possible.needToPickCost) {
+            auto player = getPlayerById(action.playerId);
+            auto card = find_if(player->hand.begin(), player->hand.end(),
+                    [&action] (Card& c) {return c.id == action.id;});
+            if (not (player->resources >= action.payWith and action.payWith >= card->cost)) {
+                continue;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+optional<Action> GameState::autoAction(int playerId, AutoPass policy)
+{
+    if (policy == AUTO_PASS_NEVER) {
+        return {};
+    }
+    auto actions = getPossibleActions(playerId);
+    if (actions.size() != 1) {
+        return {};
+    }
+    auto& action = actions.front();
+    if (policy == AUTO_PASS_PRIORITY) {
+        if (action.type != ACTION_NONE or turnInfo.phase.back() != PHASE_RESOLVE_STACK) {
+            return {};
+        }
+        return action;
+    }
+    // Targets are already filled in when every one of them has to be picked
+    bool pickTargets = action.targets.size() 
+        and not (action.minTargets == action.maxTargets
+                and action.maxTargets == (int) action.targets.size());
+    if (pickTargets or action.needToPickCost) {
+        return {};
+    }
+    return action;
+}
+
 void GameState::upkeep(bool firstTurn)
 {
     auto player = getPlayerById(turnInfo.whoseTurn);
@@ -605,7 +769,13 @@ void GameState::upkeep(bool firstTurn)
             .data=pair<int, ResourceAmount>(player->id, player->resources)
             });
 
-    player->playedResourceShipThisTurn = false;
+    if (player->playedResourceShipThisTurn) {
+        player->playedResourceShipThisTurn = false;
+        changes.push_back({
+                .type = CHANGE_RESOURCE_SHIP_PLAYED,
+                .data = pair<int, int>(player->id, 0)
+                });
+    }
 }
 
 void GameState::drawCard(int playerId) {
@@ -615,21 +785,41 @@ void GameState::drawCard(int playerId) {
 
 void GameState::updateSystemControllers()
 {
+    map<int, int> before;
     for (auto& sys : systems) {
+        before[sys.id] = sys.controllerId;
         sys.controllerId = 0;
     }
     for (auto ship : ships) {
         auto sys = getSystemById(ship.curSystemId);
         sys->controllerId = ship.controller;
     }
+    for (auto& sys : systems) {
+        if (sys.controllerId != before[sys.id]) {
+            changes.push_back({
+                    .type = CHANGE_SYSTEM_CONTROLLER,
+                    .data = pair<int, int>(sys.id, sys.controllerId)
+                    });
+        }
+    }
+}
+
+static bool sameTurnInfo(const TurnInfo& a, const TurnInfo& b)
+{
+    return a.whoseTurn == b.whoseTurn and a.activePlayer == b.activePlayer
+        and a.phase == b.phase;
 }
 
 void GameState::performAction(Action action)
 {
+    IdScope ids(nextObjectId);
+    int changesBefore = changes.size();
+    int idsBefore = nextObjectId;
+    TurnInfo turnInfoBefore = turnInfo;
     switch (turnInfo.phase.back()) {
         case PHASE_UPKEEP: {
             // TODO handle fast actions
-            LOG_INFO << "End upkeep, start main phase";
+            GAME_LOG_INFO << "End upkeep, start main phase";
             turnInfo.phase[0] = PHASE_MAIN;
             changes.push_back({.type = CHANGE_PHASE_CHANGE, .data = turnInfo});
             break;
@@ -649,7 +839,7 @@ void GameState::performAction(Action action)
                     break;
                 case ACTION_SELECT_SHIPS:
                 case ACTION_SELECT_SYSTEM:
-                    LOG_ERROR << "Cannot select ships / system from main phase";
+                    GAME_LOG_ERROR << "Cannot select ships / system from main phase";
                     break;
             }
             break;
@@ -680,19 +870,215 @@ void GameState::performAction(Action action)
                         break;
                     }
                 default:
-                    LOG_ERROR << "Invalid action type when resolving stack";
+                    GAME_LOG_ERROR << "Invalid action type when resolving stack";
             }
             break;
         case PHASE_SELECT_CARD_TARGETS:
             stack.back().targets = action.targets;
+            changes.push_back({.type = CHANGE_CARD_TARGETS, .data = stack.back()});
             turnInfo.phase.pop_back();
             break;
         case PHASE_SELECT_BEACON_TARGETS:
             turnInfo.phase.pop_back();
             moveShipsToBeacon(beacons.back().id, action.targets);
+            changes.push_back({.type = CHANGE_REMOVE_BEACON, .data = beacons.back().id});
             beacons.pop_back();
             break;
     }
+
+    /* Not every step above says where the turn has got to, and a copy of the
+     * game built from the changes needs to know, along with which ids new
+     * objects will get */
+    const TurnInfo* lastSent = &turnInfoBefore;
+    for (int i = changes.size() - 1; i >= changesBefore; i--) {
+        if (changes[i].type == CHANGE_PHASE_CHANGE) {
+            lastSent = &get<TurnInfo>(changes[i].data);
+            break;
+        }
+    }
+    if (not sameTurnInfo(*lastSent, turnInfo)) {
+        changes.push_back({.type = CHANGE_PHASE_CHANGE, .data = turnInfo});
+    }
+    if (nextObjectId != idsBefore) {
+        changes.push_back({.type = CHANGE_OBJECT_IDS, .data = nextObjectId});
+    }
+}
+
+// Finds a card by id in cards, moving it onto the end of to
+static bool moveCard(int cardId, list<Card>& cards, list<Card>& to)
+{
+    auto it = find_if(cards.begin(), cards.end(), [cardId] (Card& c) {return c.id == cardId;});
+    if (it == cards.end()) {
+        return false;
+    }
+    to.splice(to.end(), cards, it);
+    return true;
+}
+
+bool GameState::apply(const Change& change)
+{
+    switch (change.type) {
+        case CHANGE_ADD_SHIP: {
+            auto ship = get_if<Ship>(&change.data);
+            if (not ship or getShipById(ship->id)) {
+                return false;
+            }
+            ships.push_back(*ship);
+            bindCallbacks(ships.back());
+            return true;
+        }
+        case CHANGE_SHIP_CHANGE: {
+            auto ship = get_if<Ship>(&change.data);
+            auto existing = ship ? getShipById(ship->id) : nullptr;
+            if (not existing) {
+                return false;
+            }
+            *existing = *ship;
+            bindCallbacks(*existing);
+            return true;
+        }
+        case CHANGE_REMOVE_SHIP: {
+            auto shipId = get_if<int>(&change.data);
+            if (not shipId or not getShipById(*shipId)) {
+                return false;
+            }
+            deleteShipById(*shipId);
+            return true;
+        }
+        case CHANGE_PLAY_CARD: {
+            auto cardId = get_if<int>(&change.data);
+            if (not cardId) {
+                return false;
+            }
+            for (auto& player : players) {
+                if (moveCard(*cardId, player.hand, stack)) {
+                    stack.back().playedBy = player.id;
+                    return true;
+                }
+            }
+            return false;
+        }
+        case CHANGE_CARD_TARGETS: {
+            auto card = get_if<Card>(&change.data);
+            if (not card) {
+                return false;
+            }
+            for (auto& c : stack) {
+                if (c.id == card->id) {
+                    c.targets = card->targets;
+                    return true;
+                }
+            }
+            return false;
+        }
+        case CHANGE_RESOLVE_CARD:
+        case CHANGE_RETURN_CARD_STACK_TO_HAND: {
+            auto cardId = get_if<int>(&change.data);
+            auto it = find_if(stack.begin(), stack.end(),
+                    [cardId] (Card& c) {return cardId and c.id == *cardId;});
+            auto player = it != stack.end() ? getPlayerById(it->playedBy) : nullptr;
+            if (not player) {
+                return false;
+            }
+            // A resolved card's effects follow as changes of their own, none
+            // of which look at the card, so it can go to the discard now
+            auto& to = change.type == CHANGE_RESOLVE_CARD ? player->discard : player->hand;
+            to.splice(to.end(), stack, it);
+            return true;
+        }
+        case CHANGE_DRAW_CARD: {
+            auto drawInfo = get_if<pair<int, Card>>(&change.data);
+            auto player = drawInfo ? getPlayerById(drawInfo->first) : nullptr;
+            if (not player) {
+                return false;
+            }
+            // Drawing from an empty deck draws nothing
+            if (player->deck.size()) {
+                if (player->deck.back().id != drawInfo->second.id) {
+                    return false;
+                }
+                player->hand.splice(player->hand.end(), player->deck, prev(player->deck.end()));
+            }
+            return true;
+        }
+        case CHANGE_PHASE_CHANGE: {
+            auto info = get_if<TurnInfo>(&change.data);
+            if (not info) {
+                return false;
+            }
+            turnInfo = *info;
+            return true;
+        }
+        case CHANGE_PLACE_BEACON: {
+            auto beacon = get_if<WarpBeacon>(&change.data);
+            if (not beacon) {
+                return false;
+            }
+            beacons.push_back(*beacon);
+            return true;
+        }
+        case CHANGE_REMOVE_BEACON: {
+            auto beaconId = get_if<int>(&change.data);
+            auto it = find_if(beacons.begin(), beacons.end(),
+                    [beaconId] (WarpBeacon& b) {return beaconId and b.id == *beaconId;});
+            if (it == beacons.end()) {
+                return false;
+            }
+            beacons.erase(it);
+            return true;
+        }
+        case CHANGE_PLAYER_RESOURCES: {
+            auto resources = get_if<pair<int, ResourceAmount>>(&change.data);
+            auto player = resources ? getPlayerById(resources->first) : nullptr;
+            if (not player) {
+                return false;
+            }
+            player->resources = resources->second;
+            return true;
+        }
+        case CHANGE_RESOURCE_SHIP_PLAYED: {
+            auto played = get_if<pair<int, int>>(&change.data);
+            auto player = played ? getPlayerById(played->first) : nullptr;
+            if (not player) {
+                return false;
+            }
+            player->playedResourceShipThisTurn = played->second;
+            return true;
+        }
+        case CHANGE_MOVE_SHIP: {
+            auto move = get_if<pair<int, int>>(&change.data);
+            auto ship = move ? getShipById(move->first) : nullptr;
+            if (not ship) {
+                return false;
+            }
+            ship->curSystemId = move->second;
+            return true;
+        }
+        case CHANGE_SYSTEM_CONTROLLER: {
+            auto controller = get_if<pair<int, int>>(&change.data);
+            auto sys = controller ? getSystemById(controller->first) : nullptr;
+            if (not sys) {
+                return false;
+            }
+            sys->controllerId = controller->second;
+            return true;
+        }
+        case CHANGE_OBJECT_IDS: {
+            auto id = get_if<int>(&change.data);
+            if (not id) {
+                return false;
+            }
+            nextObjectId = *id;
+            return true;
+        }
+        case CHANGE_SHIP_TARGETS:
+        case CHANGE_COMBAT_START:
+        case CHANGE_COMBAT_ROUND_END:
+        case CHANGE_COMBAT_END:
+            // Only there to be shown, the damage done follows as ship changes
+            return true;
+    }
+    return false;
 }
 
 void GameState::playCard(int cardId, int playerId, ResourceAmount payWith)
@@ -702,16 +1088,18 @@ void GameState::playCard(int cardId, int playerId, ResourceAmount payWith)
             [cardId] (Card& c) {return c.id == cardId;});
     card->playedBy = playerId;
 
-    if (card->cost[RESOURCE_ANY] == 0) {
+    // Looked up without operator[], which would add to the card's cost
+    auto any = card->cost.find(RESOURCE_ANY);
+    if (any == card->cost.end() or any->second == 0) {
         payWith = card->cost;
     } else if (totalCost(payWith) == 0) {
-        LOG_ERROR << "Did not specify how to pay for card";
+        GAME_LOG_ERROR << "Did not specify how to pay for card";
     }
 
     if (player->resources >= payWith and payWith >= card->cost) {
         player->resources = player->resources - payWith;
     } else {
-        LOG_ERROR << "Amount specified to play card is either not enough or the player does not have enough";
+        GAME_LOG_ERROR << "Amount specified to play card is either not enough or the player does not have enough";
     }
 
     changes.push_back({
@@ -733,7 +1121,7 @@ void GameState::playCard(int cardId, int playerId, ResourceAmount payWith)
     stack.push_back(*card);
     player->hand.erase(card);
 
-    LOG_INFO << "Played card: " << card->name;
+    GAME_LOG_INFO << "Played card: " << stack.back().name;
 
 }
 
@@ -782,7 +1170,7 @@ void GameState::moveShipsToBeacon(int beaconId, vector<int> ships)
     };
     resolveCombats();
     updateSystemControllers();
-    LOG_INFO << "Moving ship ids: " << ships << " to system id: " << beacon->systemId;
+    GAME_LOG_INFO << "Moving ship ids: " << ships << " to system id: " << beacon->systemId;
 }
 
 void GameState::endTurn()
@@ -790,7 +1178,7 @@ void GameState::endTurn()
     // Advance the turn to the next player
     auto it = find_if(players.begin(), players.end(), 
             [this] (Player& p) {return p.id == turnInfo.whoseTurn;});
-    LOG_INFO << "Turn ending for playerid " << it->id;
+    GAME_LOG_INFO << "Turn ending for playerid " << it->id;
     it++;
     if (it == players.end()) {
         it = players.begin();
@@ -801,7 +1189,7 @@ void GameState::endTurn()
 
     changes.push_back({.type = CHANGE_PHASE_CHANGE, .data = turnInfo});
 
-    LOG_INFO << "It is now player id " << nextPlayerId << "'s turn" << endl;
+    GAME_LOG_INFO << "It is now player id " << nextPlayerId << "'s turn" << endl;
     turnInfo.phase[0] = PHASE_UPKEEP;
 };
 
@@ -846,7 +1234,7 @@ void GameState::resolveCombats()
             }
         }
         changes.push_back({.type = CHANGE_COMBAT_START, .data = sys.id});
-        LOG_INFO << "Combat starting in system: " << sys.id;
+        GAME_LOG_INFO << "Combat starting in system: " << sys.id;
 
         // Sort ships by "impressiveness"
         for (auto player : players) {
@@ -863,6 +1251,7 @@ void GameState::resolveCombats()
             // Each players ships deal damage to each other players ships
             
             vector<pair<int, int>> shipTargets;
+            int damageDealt = 0;
             for (auto player : players) {
                 auto myShips = playerShips[player.id];
                 int otherPlayer = find_if(players.begin(), players.end(), 
@@ -876,6 +1265,7 @@ void GameState::resolveCombats()
                     }
                     shipTargets.push_back({myShip->id, (*enemyShipIt)->id});
                     (*enemyShipIt)->applyDamage(myShip->attack);
+                    damageDealt += myShip->attack;
                     enemyShipIt++;
                     if (enemyShipIt == enemyShips.end()) {
                         enemyShipIt = enemyShips.begin();
@@ -890,8 +1280,8 @@ void GameState::resolveCombats()
                 for (auto ship : playerShips[player.id]) {
                     if (ship->isDestroyed()) {
                         changes.push_back({.type = CHANGE_REMOVE_SHIP, .data = ship->id});
+                        GAME_LOG_INFO << "Ship id: " << ship->id << " destroyed";
                         deleteShipById(ship->id);
-                        LOG_INFO << "Ship id: " << ship->id << " destroyed";
                     } else {
                         changes.push_back({.type = CHANGE_SHIP_CHANGE, .data = *ship});
                         newShipList.push_back(ship);
@@ -904,6 +1294,12 @@ void GameState::resolveCombats()
             }
 
             changes.push_back({.type = CHANGE_COMBAT_ROUND_END});
+
+            // Ships that can't hurt each other would fight forever, call it
+            // a draw and leave them where they are
+            if (damageDealt == 0) {
+                break;
+            }
         }
         changes.push_back({.type = CHANGE_COMBAT_END});
 
@@ -917,12 +1313,12 @@ pair<int, Card> Player::draw()
         // TODO handle drawing from empty deck
         // probably instant loss
         return {id, Card()};
-        LOG_INFO << "Player " << name << " drew from an empty deck";
+        GAME_LOG_INFO << "Player " << name << " drew from an empty deck";
     };
     auto card = deck.back();
     deck.pop_back();
     hand.push_back(card);
-    LOG_INFO << "Player " << name << " drew a card: " << card.name;
+    GAME_LOG_INFO << "Player " << name << " drew a card: " << card.name;
     return {id, card};
 };
 
@@ -1,6 +1,7 @@
 #ifndef LOGIC_H
 #define LOGIC_H
 
+#include <cstdint>
 #include <vector>
 #include <list>
 #include <string>
@@ -9,6 +10,7 @@
 #include <functional>
 #include <variant>
 #include <tuple>
+#include <optional>
 
 #include <cereal/archives/json.hpp>
 #include <cereal/archives/portable_binary.hpp>
@@ -32,6 +34,20 @@
 
 #include <backward.hpp>
 
+/* Searches play out thousands of moves that never happen, which shouldn't be
+ * logged. The game rules log with GAME_LOG, which is skipped on a thread
+ * while it has a QuietLogging alive, before anything is formatted
+ */
+extern thread_local bool quietLogging;
+struct QuietLogging {
+    QuietLogging() : previous(quietLogging) {quietLogging = true;};
+    ~QuietLogging() {quietLogging = previous;};
+    bool previous;
+};
+#define GAME_LOG(severity) if (quietLogging) {;} else LOG(severity)
+#define GAME_LOG_INFO GAME_LOG(plog::info)
+#define GAME_LOG_ERROR GAME_LOG(plog::error)
+
 #define SERIALIZE(...) \
 template<class Archive> \
 void serialize(Archive & archive) \
@@ -74,16 +90,38 @@ namespace logic {
      * */
     struct GameObject {
         GameObject() {
-            id = curId++;
+            id = nextId();
         };
         
         /* Call after copying game object if the copy needs to be a new object
          */
         void newId() {
-            id = curId++;
+            id = nextId();
         };
         int id;
         static int curId;
+
+        /* While an IdScope is active on this thread ids come from its
+         * counter rather than the global one */
+        static thread_local int* idCounter;
+        static int nextId() {
+            return idCounter ? (*idCounter)++ : curId++;
+        };
+    };
+
+    /* Gives objects created on this thread ids from the given counter until
+     * it goes out of scope. GameState uses one so that a game's ids only
+     * depend on the actions performed in it, not on what other games on the
+     * server did in between, which lets a game be rebuilt by replaying its
+     * actions */
+    struct IdScope {
+        IdScope(int& counter) : previous(GameObject::idCounter) {
+            GameObject::idCounter = &counter;
+        };
+        ~IdScope() {
+            GameObject::idCounter = previous;
+        };
+        int* previous;
     };
 
     /* System object, representing a valid location for ship, structures
@@ -163,7 +201,7 @@ namespace logic {
     };
 
     inline void DEFAULT_CARD_RESOLVE(GameState& state) {
-        LOG_ERROR << "Resolving a card with a default resolve function";
+        GAME_LOG_ERROR << "Resolving a card with a default resolve function";
     }
 
     inline bool DEFAULT_CARD_CAN_PLAY(GameState& state) {
@@ -264,6 +302,16 @@ namespace logic {
         ACTION_SELECT_SYSTEM,
     };
 
+    /* Actions a player leaves to whoever runs the game, see
+     * GameState::autoAction. Each includes the ones before it */
+    enum AutoPass {
+        AUTO_PASS_NEVER,
+        // Pass priority on the stack when there's nothing to respond with
+        AUTO_PASS_PRIORITY,
+        // Any action that is the only choice, with only one way to take it
+        AUTO_PASS_FORCED,
+    };
+
     struct Action
     {
         ActionType type;
@@ -303,6 +351,11 @@ namespace logic {
         CHANGE_COMBAT_ROUND_END,  // no data, indicates combat round ended
         CHANGE_COMBAT_END,  // no data, indicated current combat finished
         CHANGE_RETURN_CARD_STACK_TO_HAND,  // cardId of card to return to it's owners hand
+        CHANGE_CARD_TARGETS,  // data will be the card on the stack with its targets chosen
+        CHANGE_SYSTEM_CONTROLLER,  // data will be pair of systemId, new controllerId
+        CHANGE_REMOVE_BEACON,  // data will be id of the beacon that was used up
+        CHANGE_RESOURCE_SHIP_PLAYED,  // data will be pair of playerId, 1 if played this turn else 0
+        CHANGE_OBJECT_IDS,  // data will be the id the next new object gets
     };
 
     struct Change
@@ -321,7 +374,25 @@ namespace logic {
             pair<int, int>,
             vector<pair<int, int>>
             > data;
-        SERIALIZE(changeNo, type, data);
+        // The RollingChecksum (rollingchecksum.h) of the game just after
+        // this change, which the server puts on a change now and then
+        optional<uint32_t> checksum;
+
+        /* Versioned, see CEREAL_CLASS_VERSION below, so fields can be added
+         * without breaking what was written before. Changes written before
+         * the checksum carry no version at all and can't be read: JSON
+         * states saved then are refused for the missing version, the
+         * compact encoding they were snapshotted and hibernated in is
+         * refused by SNAPSHOT_VERSION, and clients must be updated along
+         * with the server */
+        template<class Archive>
+        void serialize(Archive& archive, const uint32_t version)
+        {
+            archive(changeNo, type, data);
+            if (version >= 1) {
+                archive(checksum);
+            }
+        }
         friend ostream & operator << (ostream &out, const Change &c) {
             out << "(Change: no " << c.changeNo << " type: " << c.type << ")";
             return out;
@@ -334,9 +405,25 @@ namespace logic {
         vector<Action> getPossibleActions(int playerId = 0);
         void performAction(Action);
 
+        /* Whether action is one of getPossibleActions for its player, with
+         * targets picked from those offered and, if the player has to pick
+         * how to pay, a payment that covers the cost */
+        bool canPerform(const Action& action);
+
+        /* The action to take for playerId without asking them, if policy
+         * leaves the choice they have to the game */
+        optional<Action> autoAction(int playerId, AutoPass policy);
+
+        /* Make a change performAction made on another copy of the game, so
+         * that a copy kept up to date with the changes ends up the same as
+         * the original (as far as serialization goes). The change isn't added
+         * to changes. Returns false if the change refers to something this
+         * copy doesn't have, in which case it has already gone wrong */
+        bool apply(const Change& change);
+
         void writeStateToFile(string filename);
         void print();
-        SERIALIZE(turnInfo, players, ships, systems, beacons, stack, changes);
+        SERIALIZE(turnInfo, players, ships, systems, beacons, stack, changes, nextObjectId);
 
         friend ostream & operator << (ostream &out, const GameState &c);
 
@@ -363,6 +450,9 @@ namespace logic {
 
         vector<Change> changes;
 
+        // Ids for objects created by startGame and performAction, see IdScope
+        int nextObjectId = 1;
+
         void playCard(int cardId, int playerId, ResourceAmount payWith);
         void resolveStackTop();
         void placeBeacon(int systemId, int ownerId);
@@ -380,6 +470,27 @@ namespace logic {
 
         set<int> shipCanReach(int shipId);
     };
+
+    /* Every card and ship definition there is, always in the same order so
+     * that a definition can be referred to by its position. New definitions
+     * go on the end */
+    const vector<Card>& allCardDefinitions();
+    const vector<Ship>& allShipDefinitions();
+
+    /* Callbacks can't be serialized, so cards and ships that have been
+     * through serialization get them back from their definitions, found by
+     * card name or ship type. Ship kinds aren't serialized either and are
+     * put back the same way */
+    void bindCallbacks(Ship& ship);
+    void bindCallbacks(Card& card);
+    void bindCallbacks(GameState& state);
+
+    /* crc32 of everything serialized about state except the change log, for
+     * checking that a copy built with apply still matches */
+    uint32_t stateChecksum(const GameState& state);
 };
 
+// 1: added checksum
+CEREAL_CLASS_VERSION(logic::Change, 1);
+
 #endif
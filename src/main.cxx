@@ -25,6 +25,10 @@
 #include "logic.h"
 #include "gamelogic.h"
 #include "client.h"
+#include "localgame.h"
+#include "prediction.h"
+#include "lockstep.h"
+#include "replay.h"
 #include "camera2.h"
 
 
@@ -89,6 +93,12 @@ int main(int argc, char **argv)
         ("u,username", "set username", cxxopts::value<string>()->default_value("AckbarsRevenge"))
         ("j,joingame", "join a game rather than starting one", cxxopts::value<string>())
         ("joinuser", "join a game by user rather than starting one", cxxopts::value<string>())
+        ("bot", "start a game against a bot run by the server")
+        ("lockstep", "start a lockstep game, where each player runs the game and the server only passes actions on")
+        ("offline", "play against a bot run in this process, without a server")
+        ("replay", "watch a recorded game rather than playing", cxxopts::value<string>())
+        ("replay-from", "change number to start watching the replay at", cxxopts::value<int>()->default_value("0"))
+        ("replay-step", "seconds between the actions of a replay", cxxopts::value<float>()->default_value("1"))
         ;
     auto result = opts.parse(argc, argv);
 
@@ -120,21 +130,60 @@ int main(int argc, char **argv)
 
     Renderer renderer(options, camera);
 
-    GameClient client("localhost", 40000);
-    client.login(result["username"].as<string>());
-    if (result.count("joingame")) {
-        client.joinGame(result["joingame"].as<string>());
-    }else if (result.count("joinuser")) {
-        client.joinUser(result["joinuser"].as<string>());
+    // Where the game is run, the server or here for offline games. Replays
+    // are played back here with no service
+    unique_ptr<GameService> service;
+    optional<ReplayPlayer> replay;
+    if (result.count("replay")) {
+        replay.emplace(ReplayPlayer::load(result["replay"].as<string>()));
+        replay->seekToChange(result["replay-from"].as<int>());
+    } else if (result.count("offline")) {
+        service = make_unique<LocalGameService>();
     } else {
-        client.startGame();
+        auto client = make_unique<GameClient>("localhost", 40000);
+        client->login(result["username"].as<string>());
+        if (result.count("joingame")) {
+            client->joinGame(result["joingame"].as<string>());
+        }else if (result.count("joinuser")) {
+            client->joinUser(result["joinuser"].as<string>());
+        } else if (result.count("lockstep")) {
+            client->startLockstepGame();
+        } else {
+            client->startGame(result.count("bot") > 0);
+        }
+        service = move(client);
     }
 
     // Animation updater
     ObjectUpdater updater(1); // Using 1 other thread for updating objects
 
-    GraphicsObjectHandler graphicsObjectHandler(camera);
-    graphicsObjectHandler.startGame(client.getState(), client.getMyPlayerId());
+    auto graphicsObjectHandler = make_unique<GraphicsObjectHandler>(camera);
+    auto initialState = replay ? replay->getState() : service->getState();
+    // A replay is watched from the first player's side
+    int myPlayerId = replay ? initialState.players.front().id : service->getMyPlayerId();
+    // Moves with only one choice are made for us, without a round trip
+    if (service and not service->isLockstepGame()) {
+        service->setAutoPass(logic::AUTO_PASS_FORCED);
+    }
+    graphicsObjectHandler->startGame(initialState, myPlayerId);
+
+    // A copy of the game kept up to date from the changes, and our own
+    // actions shown as soon as they're picked, see prediction.h
+    Prediction prediction;
+    if (service) {
+        prediction.reset(initialState, service->getStateChangeNo());
+    }
+    float replayStep = result["replay-step"].as<float>();
+    float nextReplayStep = 0;
+
+    // In lockstep games the game is run here from the actions alone, see
+    // lockstep.h. Nothing is predicted, our own actions are shown once
+    // the server has passed them back in order
+    optional<LockstepPeer> lockstep;
+    bool waitingForAction = false;
+    if (service and service->isLockstepGame()) {
+        lockstep.emplace(initialState);
+    }
 
     // TODO create this somewhere else
     shared_ptr<Skybox> skybox(new Skybox("./res/textures/lightblue/"));
@@ -148,7 +197,9 @@ int main(int argc, char **argv)
     info.projection = renderer.getProjection();
 
     vector<logic::Action> actions;
-    int lastChangeNo = 0;
+    if (lockstep) {
+        actions = lockstep->getPossibleActions(myPlayerId);
+    }
 
     Timer::global = Timer("global"); // restart global timer
     while(not glfwWindowShouldClose(window))
@@ -160,48 +211,100 @@ int main(int argc, char **argv)
         frameTimes.push_back(info.deltaTime);
         LOG_VERBOSE << "Frametime: " << info.deltaTime;
 
+        // This will trigger animations and iterface for selecting
+        // an action
+        graphicsObjectHandler->setPossibleActions(actions);
         if (actions.size()) {
-            // This will trigger animations and iterface for selecting
-            // an action
-            graphicsObjectHandler.setPossibleActions(actions);
-            if (actions.size()) {
-                LOG_DEBUG << actions;
-            }
-        } else {
-            // If there are no current actions get pending ones from the 
-            // server This might return an empty list, in which case we will
-            // ask again
-            graphicsObjectHandler.setPossibleActions(actions);
-            actions = client.getActions();
+            LOG_DEBUG << actions;
         }
 
-        // Once the player selects an action send it to the client and clear 
-        // the actions list
-        graphicsObjectHandler.checkEvents();
-        auto selectedAction = graphicsObjectHandler.getSelectedAction();
-        client.performQueuedAction();
+        // Once the player selects an action queue it to be sent to the server
+        // and clear the actions list
+        graphicsObjectHandler->checkEvents();
+        auto selectedAction = graphicsObjectHandler->getSelectedAction();
+        vector<logic::Change> changes;
         if (selectedAction) {
-            client.performAction(*selectedAction);
+            service->queueAction(*selectedAction);
             actions.clear();
+            if (lockstep) {
+                waitingForAction = true;
+            } else {
+                changes = prediction.predict(*selectedAction);
+            }
         }
 
-        // Get a list of changes to state from the server and queue game updates
-        // accordingly 
-        auto changes = client.getChangesSince(lastChangeNo);
-        if (changes.size()) {
-            lastChangeNo = changes.back().changeNo;
+        if (replay) {
+            // Nothing can be picked, the recorded actions are played out at
+            // a steady pace
+            if (info.curTime >= nextReplayStep and not replay->atEnd()) {
+                changes = replay->step();
+                nextReplayStep = info.curTime + replayStep;
+            }
+        } else if (lockstep) {
+            // Send our action and the checksums of turns that ended, and
+            // perform every action since the last reply, our own included
+            auto reply = service->lockstepSync(lockstep->getActionNo(), lockstep->takeChecksums());
+            if (reply) {
+                if (reply->desyncTurn) {
+                    LOG_ERROR << "Players' games are out of step since turn " << reply->desyncTurn;
+                }
+                for (auto& action : reply->actions) {
+                    auto performed = lockstep->perform(action);
+                    changes.insert(changes.end(), performed.begin(), performed.end());
+                    if (action.playerId == myPlayerId) {
+                        waitingForAction = false;
+                    }
+                }
+                // Another action got in first, we pick again
+                if (reply->rejected) {
+                    waitingForAction = false;
+                }
+                if (not waitingForAction) {
+                    actions = lockstep->getPossibleActions(myPlayerId);
+                }
+            }
+        } else {
+            // Send queued actions and get both the resulting changes to state
+            // and our next actions from the server in one request, then queue
+            // game updates accordingly. Changes that were predicted have been
+            // shown already
+            auto syncResponse = service->sync(prediction.getChangeNo());
+            if (syncResponse) {
+                auto checked = prediction.reconcile(syncResponse->changes);
+                actions = syncResponse->actions;
+                if (checked.mispredicted and prediction.getState()) {
+                    // Show the server's version of the game instead
+                    graphicsObjectHandler = make_unique<GraphicsObjectHandler>(camera);
+                    graphicsObjectHandler->startGame(*prediction.getState(), myPlayerId);
+                    changes.clear();
+                } else {
+                    changes.insert(changes.end(), checked.unpredicted.begin(), checked.unpredicted.end());
+                }
+            }
+        }
+        graphicsObjectHandler->updateState(changes, info);
+
+        // Our copy of the game is kept up to date from the changes alone.
+        // Only if it stops matching the server's is the whole state fetched
+        // again, in the background
+        if (service and not lockstep and not prediction.canPredict()) {
+            auto state = service->pollState();
+            if (state) {
+                graphicsObjectHandler = make_unique<GraphicsObjectHandler>(camera);
+                graphicsObjectHandler->startGame(*state, myPlayerId);
+                prediction.reset(*state, service->getStateChangeNo());
+            }
         }
-        graphicsObjectHandler.updateState(changes, info);
 
         // Update objects
-        updater.updateObjects(info, graphicsObjectHandler.getObjects());
+        updater.updateObjects(info, graphicsObjectHandler->getObjects());
         updater.waitForUpdates(); // Cannot overlap with render yet
 
         // Update camera
         camera.update(info);
 
         // Render a frame
-        renderer.setToRender(graphicsObjectHandler.getRenderables());
+        renderer.setToRender(graphicsObjectHandler->getRenderables());
         renderer.renderFrame();
         glfwSwapBuffers(window);
 
@@ -0,0 +1,292 @@
+#include "mcts.h"
+
+#include "botsearch.h"
+#include "randomplay.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <thread>
+
+using namespace std;
+using namespace logic;
+
+static uint64_t mix(uint64_t h, uint64_t v)
+{
+    h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+    return h;
+}
+
+uint64_t actionKey(const Action& action)
+{
+    uint64_t h = mix(action.type, action.playerId);
+    h = mix(h, (uint32_t) action.id);
+    h = mix(h, action.targets.size());
+    for (auto target : action.targets) {
+        h = mix(h, (uint32_t) target);
+    }
+    return h;
+}
+
+void determinize(GameState& state, int observerId, mt19937& rng)
+{
+    vector<Card> unseen;
+    for (auto& player : state.players) {
+        bool hidden = player.id != observerId;
+        size_t handSize = hidden ? player.hand.size() : 0;
+        unseen.assign(player.deck.begin(), player.deck.end());
+        if (hidden) {
+            unseen.insert(unseen.end(), player.hand.begin(), player.hand.end());
+        }
+        shuffle(unseen.begin(), unseen.end(), rng);
+        if (hidden) {
+            player.hand.assign(unseen.begin(), unseen.begin() + handSize);
+        }
+        player.deck.assign(unseen.begin() + handSize, unseen.end());
+    }
+}
+
+Action playoutAction(PlayoutPolicy policy, const vector<Action>& actions, mt19937& rng)
+{
+    if (policy == PLAYOUT_EAGER) {
+        vector<Action> active;
+        copy_if(actions.begin(), actions.end(), back_inserter(active),
+                [](const Action& a) {return a.type != ACTION_NONE and not a.needToPickCost;});
+        if (active.size()) {
+            return randomAction(active, rng);
+        }
+    }
+    return randomAction(actions, rng);
+}
+
+MctsNodePool::MctsNodePool(size_t capacity)
+    : capacity(capacity)
+{
+    nodes.reserve(capacity);
+}
+
+int MctsNodePool::add(int parent, uint64_t action, int playerId)
+{
+    if (full()) {
+        return -1;
+    }
+    int i = nodes.size();
+    nodes.push_back({
+        .action = action,
+        .playerId = playerId,
+        .firstChild = -1,
+        .nextSibling = -1,
+        .visits = 0,
+        .available = 0,
+        .reward = 0,
+    });
+    if (parent >= 0) {
+        nodes[i].nextSibling = nodes[parent].firstChild;
+        nodes[parent].firstChild = i;
+    }
+    return i;
+}
+
+int MctsNodePool::findChild(int parent, uint64_t action) const
+{
+    for (int i = nodes[parent].firstChild; i >= 0; i = nodes[i].nextSibling) {
+        if (nodes[i].action == action) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+MctsSearch::MctsSearch(size_t maxNodes)
+    : maxNodes(maxNodes)
+{ }
+
+void MctsSearch::iterate(Tree& tree, const GameState& root, int playerId,
+        const MctsConfig& config, mt19937& rng, Scratch& scratch, MctsResult& stats)
+{
+    GameState state = root;
+    determinize(state, playerId, rng);
+
+    auto& nodes = tree.nodes;
+    auto& path = scratch.path;
+    path.clear();
+    path.push_back(0);
+    int node = 0;
+    bool expanded = false;
+    while (not expanded) {
+        auto actions = concreteActions(state.getPossibleActions());
+        if (not actions.size()) {
+            break;
+        }
+        auto& keys = scratch.keys;
+        keys.clear();
+        for (auto& action : actions) {
+            keys.push_back(actionKey(action));
+        }
+
+        int chosen = -1;
+        int child = -1;
+        {
+            lock_guard<mutex> lk(tree.m);
+            auto& untried = scratch.untried;
+            untried.clear();
+            double bestScore = -1;
+            for (size_t i = 0; i < actions.size(); i++) {
+                int c = nodes.findChild(node, keys[i]);
+                if (c < 0) {
+                    untried.push_back(i);
+                    continue;
+                }
+                auto& n = nodes[c];
+                n.available++;
+                double score = n.visits
+                    ? n.reward / n.visits + config.exploration * sqrt(log(n.available) / n.visits)
+                    : numeric_limits<double>::infinity();
+                if (score > bestScore) {
+                    bestScore = score;
+                    chosen = i;
+                    child = c;
+                }
+            }
+            if (untried.size() and not nodes.full()) {
+                uniform_int_distribution<int> pick(0, untried.size() - 1);
+                chosen = untried[pick(rng)];
+                child = nodes.add(node, keys[chosen], actions[chosen].playerId);
+                nodes[child].available = 1;
+                expanded = true;
+            }
+            if (child < 0) {
+                // Only untried actions here and no room left to add them
+                break;
+            }
+            // Counted now rather than in backpropagation, so until the
+            // reward arrives other threads see it as a loss and look elsewhere
+            nodes[child].visits++;
+        }
+        node = child;
+        path.push_back(node);
+        state.performAction(actions[chosen]);
+        stats.steps++;
+    }
+
+    for (int depth = 0; depth < config.playoutDepth; depth++) {
+        auto actions = state.getPossibleActions();
+        if (not actions.size()) {
+            break;
+        }
+        state.performAction(playoutAction(config.playout, actions, rng));
+        stats.steps++;
+    }
+
+    double reward = evaluate(state, playerId);
+    lock_guard<mutex> lk(tree.m);
+    nodes[0].visits++;
+    for (size_t i = 1; i < path.size(); i++) {
+        auto& n = nodes[path[i]];
+        n.reward += n.playerId == playerId ? reward : 1 - reward;
+    }
+    stats.iterations++;
+}
+
+MctsResult MctsSearch::search(const GameState& state, int playerId,
+        const MctsConfig& config, mt19937& rng)
+{
+    QuietLogging quiet;
+    auto start = chrono::steady_clock::now();
+    MctsResult result;
+
+    // getPossibleActions isn't const, but doesn't change anything
+    auto possible = const_cast<GameState&>(state).getPossibleActions(playerId);
+    if (not possible.size()) {
+        return result;
+    }
+    auto candidates = concreteActions(possible);
+    if (candidates.size() < 2) {
+        result.action = candidates.size() ? candidates.front() : randomAction(possible, rng);
+        return result;
+    }
+
+    // Nothing reads the change log, so the copies don't need it
+    GameState root = state;
+    root.changes.clear();
+
+    int nThreads = max(config.threads, 1);
+    int nTrees = config.parallelism == MCTS_TREE_PARALLEL ? 1 : nThreads;
+    while ((int) trees.size() < nTrees) {
+        trees.push_back(make_unique<Tree>(maxNodes));
+    }
+    for (int i = 0; i < nTrees; i++) {
+        trees[i]->nodes.clear();
+        trees[i]->nodes.add(-1, 0, 0);
+    }
+
+    auto deadline = start + config.budget;
+    atomic<bool> stop{false};
+    atomic<bool> cancelled{false};
+    atomic<uint64_t> started{0};
+    vector<MctsResult> stats(nThreads);
+    vector<uint32_t> seeds;
+    for (int i = 0; i < nThreads; i++) {
+        seeds.push_back(rng());
+    }
+
+    auto worker = [&](int i) {
+        QuietLogging quiet;
+        mt19937 threadRng(seeds[i]);
+        Scratch scratch;
+        Tree& tree = *trees[nTrees == 1 ? 0 : i];
+        while (not stop) {
+            if (config.cancelled and config.cancelled()) {
+                cancelled = true;
+                stop = true;
+                break;
+            }
+            if (chrono::steady_clock::now() >= deadline
+                    or (config.maxIterations and started++ >= config.maxIterations)) {
+                stop = true;
+                break;
+            }
+            iterate(tree, root, playerId, config, threadRng, scratch, stats[i]);
+        }
+    };
+    vector<thread> threads;
+    for (int i = 1; i < nThreads; i++) {
+        threads.emplace_back(worker, i);
+    }
+    worker(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // Root parallel trees are combined by adding up the root's children
+    map<uint64_t, uint64_t> visits;
+    for (int i = 0; i < nTrees; i++) {
+        auto& nodes = trees[i]->nodes;
+        for (int c = nodes[0].firstChild; c >= 0; c = nodes[c].nextSibling) {
+            visits[nodes[c].action] += nodes[c].visits;
+        }
+        result.treeNodes += nodes.size();
+    }
+    for (auto& s : stats) {
+        result.iterations += s.iterations;
+        result.steps += s.steps;
+    }
+
+    // The most visited action the player can take in the real game
+    size_t best = 0;
+    uint64_t bestVisits = 0;
+    for (size_t i = 0; i < candidates.size(); i++) {
+        auto it = visits.find(actionKey(candidates[i]));
+        if (it != visits.end() and it->second > bestVisits) {
+            best = i;
+            bestVisits = it->second;
+        }
+    }
+    result.action = candidates[best];
+    result.cancelled = cancelled;
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    result.seconds = elapsed.count();
+    return result;
+}
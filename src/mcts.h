@@ -0,0 +1,159 @@
+#ifndef MCTS_H
+#define MCTS_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include "logic.h"
+#include "nocopy.h"
+
+/* Monte Carlo tree search over GameState, for bots and for tooling.
+ *
+ * The searching player can't see the other player's hand or either deck, so
+ * every iteration plays on a determinization: a copy of the game with the
+ * unseen cards dealt out again at random. The tree is shared between
+ * determinizations (information set MCTS), children are keyed by actionKey
+ * and a child is only considered when its action is possible in the current
+ * determinization. UCB uses how often a child was available rather than its
+ * parent's visits.
+ *
+ * Several threads can search at once, either each in its own tree with the
+ * root statistics added up at the end (root parallel), or all in one tree
+ * under a lock, with virtual loss to spread them out (tree parallel). The
+ * lock is only held while picking a child, the game is stepped outside it.
+ *
+ * Nodes live in pools that are allocated once and reused by every search
+ * made with the same MctsSearch, so growing the tree never allocates.
+ */
+
+enum MctsParallelism {
+    MCTS_ROOT_PARALLEL,
+    MCTS_TREE_PARALLEL,
+};
+
+enum PlayoutPolicy {
+    // Uniformly random actions, as randomAction
+    PLAYOUT_RANDOM,
+    // Random, but only passes when there's nothing else to do
+    PLAYOUT_EAGER,
+};
+
+#define DEFAULT_MCTS_NODES (1 << 16)
+
+struct MctsConfig
+{
+    std::chrono::milliseconds budget{200};
+    // Stop after this many iterations, 0 for no limit
+    uint64_t maxIterations = 0;
+    int threads = 1;
+    MctsParallelism parallelism = MCTS_ROOT_PARALLEL;
+    PlayoutPolicy playout = PLAYOUT_RANDOM;
+    // Actions played by the playout policy after leaving the tree
+    int playoutDepth = 20;
+    double exploration = 0.7;
+    // Checked before every iteration, the search stops once it returns true
+    std::function<bool()> cancelled;
+};
+
+struct MctsResult
+{
+    // nullopt if the player has nothing to do
+    std::optional<logic::Action> action;
+    uint64_t iterations = 0;
+    // Actions performed on copies of the game, in the tree and in playouts
+    uint64_t steps = 0;
+    // Nodes in the tree, or all the trees when root parallel
+    uint64_t treeNodes = 0;
+    double seconds = 0;
+    bool cancelled = false;
+
+    double iterationsPerSecond() const {
+        return seconds > 0 ? iterations / seconds : 0;
+    }
+};
+
+// Identifies an action in the tree, the same action gets the same key in
+// every determinization
+uint64_t actionKey(const logic::Action& action);
+
+/* Deal the cards observerId can't see out again at random: every other
+ * player's hand and deck are shuffled together and the hand refilled to the
+ * same size, and the observer's own deck is shuffled */
+void determinize(logic::GameState& state, int observerId, std::mt19937& rng);
+
+logic::Action playoutAction(PlayoutPolicy policy,
+        const std::vector<logic::Action>& actions, std::mt19937& rng);
+
+struct MctsNode
+{
+    uint64_t action;
+    // Who performed the action leading here, rewards are from their side
+    int playerId;
+    int firstChild;
+    int nextSibling;
+    uint32_t visits;
+    uint32_t available;
+    double reward;
+};
+
+/* Fixed size store of tree nodes, children are linked through indexes */
+class MctsNodePool : non_copyable
+{
+    public:
+        MctsNodePool(size_t capacity);
+
+        // Returns -1 once the pool is full
+        int add(int parent, uint64_t action, int playerId);
+        int findChild(int parent, uint64_t action) const;
+        void clear() {nodes.clear();};
+
+        MctsNode& operator[](int i) {return nodes[i];};
+        const MctsNode& operator[](int i) const {return nodes[i];};
+        size_t size() const {return nodes.size();};
+        bool full() const {return nodes.size() == capacity;};
+
+    private:
+        size_t capacity;
+        std::vector<MctsNode> nodes;
+};
+
+class MctsSearch : non_copyable
+{
+    public:
+        // maxNodes is the size of each tree
+        MctsSearch(size_t maxNodes = DEFAULT_MCTS_NODES);
+
+        MctsResult search(const logic::GameState& state, int playerId,
+                const MctsConfig& config, std::mt19937& rng);
+
+    private:
+        struct Tree
+        {
+            Tree(size_t maxNodes) : nodes(maxNodes) {};
+            MctsNodePool nodes;
+            std::mutex m;
+        };
+
+        // Per thread working space, kept so iterations don't allocate it
+        struct Scratch
+        {
+            std::vector<int> path;
+            std::vector<uint64_t> keys;
+            std::vector<int> untried;
+        };
+
+        void iterate(Tree& tree, const logic::GameState& root, int playerId,
+                const MctsConfig& config, std::mt19937& rng, Scratch& scratch,
+                MctsResult& stats);
+
+        size_t maxNodes;
+        std::vector<std::unique_ptr<Tree>> trees;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "logic.h"
+#include "mcts.h"
+#include "randomplay.h"
+
+#include <cxxopts.hpp>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+
+using namespace std;
+using namespace logic;
+
+/* Times how fast the game can be copied and stepped, then runs the tree search
+ * on the same position with each parallelism and a growing number of threads
+ * and reports iterations per second
+ */
+
+template <class F>
+double timeSeconds(F f)
+{
+    auto start = chrono::steady_clock::now();
+    f();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+    cxxopts::Options opts("mctsbench", "Tree search iterations per second");
+    opts.add_options()
+        ("a,actions", "Random actions played before searching", cxxopts::value<int>()->default_value("15"))
+        ("s,seed", "Seed for the position", cxxopts::value<int>()->default_value("1"))
+        ("b,budget", "Milliseconds for each search", cxxopts::value<int>()->default_value("1000"))
+        ("t,threads", "Most threads to try", cxxopts::value<int>()->default_value(to_string(max(1u, thread::hardware_concurrency()))))
+        ("eager", "Use the eager playout policy rather than random")
+        ("d,depth", "Playout depth", cxxopts::value<int>()->default_value("20"))
+        ;
+    auto result = opts.parse(argc, argv);
+
+    GameState state;
+    {
+        QuietLogging quiet;
+        state = randomGame(result["seed"].as<int>(), result["actions"].as<int>());
+    }
+    state.changes.clear();
+    int playerId = state.turnInfo.activePlayer;
+
+    int nCopies = 20000;
+    double copySeconds = timeSeconds([&]{
+        for (int i = 0; i < nCopies; i++) {
+            GameState copy = state;
+        }
+    });
+    mt19937 rng(0);
+    int nSteps = 0;
+    double stepSeconds = timeSeconds([&]{
+        QuietLogging quiet;
+        for (int i = 0; i < 2000; i++) {
+            GameState copy = state;
+            nSteps += playRandomActions(copy, 20, rng);
+        }
+    }) - copySeconds * 2000 / nCopies;
+
+    cout << fixed << setprecision(0);
+    cout << "copies/s " << nCopies / copySeconds << ", steps/s " << nSteps / stepSeconds << endl;
+
+    MctsConfig config;
+    config.budget = chrono::milliseconds(result["budget"].as<int>());
+    config.playoutDepth = result["depth"].as<int>();
+    config.playout = result.count("eager") ? PLAYOUT_EAGER : PLAYOUT_RANDOM;
+
+    cout << left << setw(8) << "mode" << right << setw(8) << "threads" << setw(14) << "iterations/s"
+         << setw(12) << "steps/s" << setw(12) << "tree nodes" << "  action" << endl;
+    MctsSearch search;
+    for (auto parallelism : {MCTS_ROOT_PARALLEL, MCTS_TREE_PARALLEL}) {
+        for (int threads = 1; threads <= result["threads"].as<int>(); threads *= 2) {
+            config.threads = threads;
+            config.parallelism = parallelism;
+            auto found = search.search(state, playerId, config, rng);
+            cout << left << setw(8) << (parallelism == MCTS_ROOT_PARALLEL ? "root" : "tree")
+                 << right << setw(8) << threads << setw(14) << found.iterationsPerSecond()
+                 << setw(12) << found.steps / found.seconds << setw(12) << found.treeNodes
+                 << "  " << *found.action << endl;
+        }
+    }
+    return 0;
+}
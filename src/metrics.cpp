@@ -0,0 +1,210 @@
+#include "metrics.h"
+
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+const vector<double> LATENCY_BUCKETS = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+    0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5
+};
+
+int metricSlot()
+{
+    static atomic<int> nextSlot{0};
+    thread_local int slot = nextSlot++ % METRIC_SLOTS;
+    return slot;
+}
+
+uint64_t Counter::get() const
+{
+    uint64_t total = 0;
+    for (auto& slot : slots) {
+        total += slot.value.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+int64_t Gauge::get() const
+{
+    int64_t total = 0;
+    for (auto& slot : slots) {
+        total += slot.value.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+Histogram::Histogram(vector<double> bounds)
+    : bounds(bounds), slots(new Slot[METRIC_SLOTS])
+{
+    for (int i = 0; i < METRIC_SLOTS; i++) {
+        // Extra bucket at the end for +Inf
+        slots[i].buckets.reset(new atomic<uint64_t>[bounds.size() + 1]);
+        for (size_t j = 0; j < bounds.size() + 1; j++) {
+            slots[i].buckets[j] = 0;
+        }
+    }
+}
+
+void Histogram::observe(double value)
+{
+    int bucket = lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+    auto& slot = slots[metricSlot()];
+    slot.buckets[bucket].fetch_add(1, memory_order_relaxed);
+    slot.count.fetch_add(1, memory_order_relaxed);
+    slot.sumMicros.fetch_add(max(value, 0.0) * 1e6, memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::get() const
+{
+    Snapshot snapshot;
+    snapshot.bounds = bounds;
+    snapshot.cumulativeCounts.resize(bounds.size() + 1);
+
+    uint64_t sumMicros = 0;
+    for (int i = 0; i < METRIC_SLOTS; i++) {
+        for (size_t j = 0; j < bounds.size() + 1; j++) {
+            snapshot.cumulativeCounts[j] +=
+                slots[i].buckets[j].load(memory_order_relaxed);
+        }
+        snapshot.count += slots[i].count.load(memory_order_relaxed);
+        sumMicros += slots[i].sumMicros.load(memory_order_relaxed);
+    }
+    for (size_t j = 1; j < snapshot.cumulativeCounts.size(); j++) {
+        snapshot.cumulativeCounts[j] += snapshot.cumulativeCounts[j - 1];
+    }
+    snapshot.sum = sumMicros / 1e6;
+    return snapshot;
+}
+
+MetricsRegistry::Family& MetricsRegistry::getFamily(
+        const string& name, MetricType type, const string& help)
+{
+    auto& family = families[name];
+    family.type = type;
+    if (help.size()) {
+        family.help = help;
+    }
+    return family;
+}
+
+Counter& MetricsRegistry::counter(string name, string labels, string help)
+{
+    lock_guard<mutex> lk(m);
+    auto& family = getFamily(name, METRIC_COUNTER, help);
+    auto& counter = family.counters[labels];
+    if (not counter) {
+        counter.reset(new Counter);
+    }
+    return *counter;
+}
+
+Gauge& MetricsRegistry::gauge(string name, string labels, string help)
+{
+    lock_guard<mutex> lk(m);
+    auto& family = getFamily(name, METRIC_GAUGE, help);
+    auto& gauge = family.gauges[labels];
+    if (not gauge) {
+        gauge.reset(new Gauge);
+    }
+    return *gauge;
+}
+
+Histogram& MetricsRegistry::histogram(string name, string labels,
+        string help, vector<double> bounds)
+{
+    lock_guard<mutex> lk(m);
+    auto& family = getFamily(name, METRIC_HISTOGRAM, help);
+    auto& histogram = family.histograms[labels];
+    if (not histogram) {
+        histogram.reset(new Histogram(bounds));
+    }
+    return *histogram;
+}
+
+void MetricsRegistry::gaugeFunction(string name, function<double()> f,
+        string labels, string help)
+{
+    lock_guard<mutex> lk(m);
+    auto& family = getFamily(name, METRIC_GAUGE, help);
+    family.gaugeFunctions[labels] = f;
+}
+
+// Join label strings, eg. {route="/state"} and le="0.1" into
+// {route="/state",le="0.1"}
+string labelString(string labels, string extra = "")
+{
+    if (labels.size() and extra.size()) {
+        labels += ",";
+    }
+    labels += extra;
+    if (labels.size()) {
+        return "{" + labels + "}";
+    }
+    return "";
+}
+
+string MetricsRegistry::render()
+{
+    lock_guard<mutex> lk(m);
+    stringstream ss;
+    for (auto& [name, family] : families) {
+        if (family.help.size()) {
+            ss << "# HELP " << name << " " << family.help << "\n";
+        }
+        switch (family.type) {
+            case METRIC_COUNTER:
+                ss << "# TYPE " << name << " counter\n";
+                for (auto& [labels, counter] : family.counters) {
+                    ss << name << labelString(labels) << " " << counter->get() << "\n";
+                }
+                break;
+            case METRIC_GAUGE:
+                ss << "# TYPE " << name << " gauge\n";
+                for (auto& [labels, gauge] : family.gauges) {
+                    ss << name << labelString(labels) << " " << gauge->get() << "\n";
+                }
+                for (auto& [labels, f] : family.gaugeFunctions) {
+                    ss << name << labelString(labels) << " " << f() << "\n";
+                }
+                break;
+            case METRIC_HISTOGRAM:
+                ss << "# TYPE " << name << " histogram\n";
+                for (auto& [labels, histogram] : family.histograms) {
+                    auto snapshot = histogram->get();
+                    for (size_t i = 0; i < snapshot.bounds.size(); i++) {
+                        stringstream le;
+                        le << "le=\"" << snapshot.bounds[i] << "\"";
+                        ss << name << "_bucket" << labelString(labels, le.str())
+                           << " " << snapshot.cumulativeCounts[i] << "\n";
+                    }
+                    ss << name << "_bucket" << labelString(labels, "le=\"+Inf\"")
+                       << " " << snapshot.cumulativeCounts.back() << "\n";
+                    ss << name << "_sum" << labelString(labels) << " " << snapshot.sum << "\n";
+                    ss << name << "_count" << labelString(labels) << " " << snapshot.count << "\n";
+                }
+                break;
+        }
+    }
+    return ss.str();
+}
+
+StageTimer::StageTimer()
+{
+    start = last = chrono::steady_clock::now();
+}
+
+double StageTimer::lap()
+{
+    auto now = chrono::steady_clock::now();
+    chrono::duration<double> elapsed = now - last;
+    last = now;
+    return elapsed.count();
+}
+
+double StageTimer::total()
+{
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
@@ -0,0 +1,147 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nocopy.h"
+
+/* Metrics are split into a fixed number of slots. Each thread is given its
+ * own slot the first time it updates a metric, so updates are a single
+ * uncontended relaxed atomic add. Reading a metric sums over all the slots.
+ */
+#define METRIC_SLOTS 32
+
+int metricSlot();
+
+class Counter : non_copyable
+{
+    public:
+        void add(uint64_t n = 1) {
+            slots[metricSlot()].value.fetch_add(n, std::memory_order_relaxed);
+        }
+        uint64_t get() const;
+
+    private:
+        struct alignas(64) Slot
+        {
+            std::atomic<uint64_t> value{0};
+        };
+        Slot slots[METRIC_SLOTS];
+};
+
+/* Like a counter but can go down as well
+ */
+class Gauge : non_copyable
+{
+    public:
+        void add(int64_t n) {
+            slots[metricSlot()].value.fetch_add(n, std::memory_order_relaxed);
+        }
+        int64_t get() const;
+
+    private:
+        struct alignas(64) Slot
+        {
+            std::atomic<int64_t> value{0};
+        };
+        Slot slots[METRIC_SLOTS];
+};
+
+/* Bucket boundaries in seconds used for request latencies
+ */
+extern const std::vector<double> LATENCY_BUCKETS;
+
+class Histogram : non_copyable
+{
+    public:
+        Histogram(std::vector<double> bounds = LATENCY_BUCKETS);
+
+        void observe(double value);
+
+        struct Snapshot
+        {
+            std::vector<double> bounds;
+            std::vector<uint64_t> cumulativeCounts; // one per bound, then +Inf
+            uint64_t count = 0;
+            double sum = 0;
+        };
+        Snapshot get() const;
+
+    private:
+        struct alignas(64) Slot
+        {
+            std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+            std::atomic<uint64_t> count{0};
+            std::atomic<uint64_t> sumMicros{0};
+        };
+        std::vector<double> bounds;
+        std::unique_ptr<Slot[]> slots;
+};
+
+/* Owns all metrics and renders them in the Prometheus text format.
+ *
+ * Creating a metric takes a lock, so callers should look metrics up once and
+ * keep the returned reference. Labels are given preformatted,
+ * eg. route="/state"
+ */
+class MetricsRegistry : non_copyable
+{
+    public:
+        Counter& counter(std::string name, std::string labels = "",
+                std::string help = "");
+        Gauge& gauge(std::string name, std::string labels = "",
+                std::string help = "");
+        Histogram& histogram(std::string name, std::string labels = "",
+                std::string help = "", std::vector<double> bounds = LATENCY_BUCKETS);
+
+        /* A gauge whose value is computed when metrics are read */
+        void gaugeFunction(std::string name, std::function<double()> f,
+                std::string labels = "", std::string help = "");
+
+        std::string render();
+
+    private:
+        enum MetricType { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM };
+
+        struct Family
+        {
+            MetricType type;
+            std::string help;
+            std::map<std::string, std::unique_ptr<Counter>> counters;
+            std::map<std::string, std::unique_ptr<Gauge>> gauges;
+            std::map<std::string, std::function<double()>> gaugeFunctions;
+            std::map<std::string, std::unique_ptr<Histogram>> histograms;
+        };
+
+        Family& getFamily(const std::string& name, MetricType type,
+                const std::string& help);
+
+        std::mutex m;
+        std::map<std::string, Family> families;
+};
+
+/* Measures the time spent in consecutive stages of some work,
+ * eg. waiting for a lock, then computing, then serializing
+ */
+class StageTimer
+{
+    public:
+        StageTimer();
+        // Seconds since the last call to lap or since the timer was created
+        double lap();
+        // Seconds since the timer was created
+        double total();
+
+    private:
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point last;
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include "prediction.h"
+
+#include "bytestream.h"
+
+using namespace std;
+using namespace logic;
+
+static bool sameChange(Change a, Change b)
+{
+    a.changeNo = b.changeNo = 0;
+    a.checksum = b.checksum = nullopt;
+    return serialize(a) == serialize(b);
+}
+
+void Prediction::reset(GameState state, int changeNo)
+{
+    pending.clear();
+    predictedState.reset();
+    // The copy is built from changes, it doesn't need the old ones
+    state.changes.clear();
+    checksum.reset(state);
+    confirmedState = move(state);
+    this->changeNo = changeNo;
+}
+
+const GameState* Prediction::getState() const
+{
+    return confirmedState ? &*confirmedState : nullptr;
+}
+
+void Prediction::diverge()
+{
+    pending.clear();
+    predictedState.reset();
+    confirmedState.reset();
+    diverged++;
+}
+
+vector<Change> Prediction::predict(const Action& action)
+{
+    if (not canPredict()) {
+        return {};
+    }
+    if (not pending.size()) {
+        predictedState = confirmedState;
+    }
+    {
+        QuietLogging quiet;
+        predictedState->performAction(action);
+    }
+    vector<Change> predicted = move(predictedState->changes);
+    predictedState->changes.clear();
+    int n = changeNo + pending.size();
+    for (auto& change : predicted) {
+        change.changeNo = ++n;
+        pending.push_back(change);
+    }
+    return predicted;
+}
+
+PredictionCheck Prediction::reconcile(const vector<Change>& changes)
+{
+    PredictionCheck ret;
+    for (auto& change : changes) {
+        if (change.changeNo <= changeNo) {
+            continue;
+        }
+        bool missedSome = change.changeNo != changeNo + 1;
+        changeNo = change.changeNo;
+        if (not confirmedState) {
+            ret.unpredicted.push_back(change);
+            continue;
+        }
+
+        bool wasPredicted = false;
+        if (pending.size()) {
+            if (pending.front().changeNo == change.changeNo
+                    and sameChange(pending.front(), change)) {
+                pending.pop_front();
+                confirmed++;
+                wasPredicted = true;
+            } else {
+                LOG_WARNING << "Predicted " << pending.front() << " but server sent " << change;
+                pending.clear();
+                ret.mispredicted = true;
+                mispredicted++;
+            }
+            if (not pending.size()) {
+                predictedState.reset();
+            }
+        }
+
+        if (missedSome or not confirmedState->apply(change)) {
+            LOG_WARNING << "Copy of the game no longer matches the server's at " << change;
+            diverge();
+            ret.diverged = true;
+        } else if (not checksum.check(*confirmedState, change)) {
+            LOG_WARNING << "Copy of the game doesn't match the server's checksum at " << change;
+            diverge();
+            ret.diverged = true;
+        }
+        if (not wasPredicted) {
+            ret.unpredicted.push_back(change);
+        }
+    }
+    return ret;
+}
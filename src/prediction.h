@@ -0,0 +1,85 @@
+#ifndef PREDICTION_H
+#define PREDICTION_H
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <vector>
+
+#include "logic.h"
+#include "rollingchecksum.h"
+
+/* Result of checking changes from the server against the predictions */
+struct PredictionCheck
+{
+    // Changes from the server that weren't predicted, to be shown as usual
+    std::vector<logic::Change> unpredicted;
+    // The server did something other than what was predicted and shown, so
+    // what's on screen has to be rebuilt, see Prediction::getState
+    bool mispredicted = false;
+    // The copy of the game stopped matching the server's, nothing can be
+    // predicted until a fresh state is given to reset
+    bool diverged = false;
+};
+
+/* Keeps a copy of the game in step with the server by applying the changes
+ * it sends (see GameState::apply), so after the first state only changes
+ * need to be fetched, and shows the local player's own actions before the
+ * server confirms them. An action is performed on a second copy, the copy
+ * from the server plus any predictions still waiting, and the changes it
+ * makes are shown straight away. When the server's changes arrive they're
+ * checked off against the predicted ones, which have already been shown.
+ *
+ * Now and then a change from the server carries a checksum of its game
+ * (see RollingChecksum), which is compared against the copy as the change
+ * is applied. A copy that no longer matches is dropped and a fresh state is
+ * needed.
+ */
+class Prediction
+{
+    public:
+        /* Start again from state, which includes the server's first changeNo
+         * changes, dropping any predictions. Used when what's shown has been
+         * rebuilt from state */
+        void reset(logic::GameState state, int changeNo);
+
+        // Whether there is a copy of the game to predict with
+        bool canPredict() const {return confirmedState.has_value();};
+
+        /* Perform the local player's action, returning the changes it made
+         * numbered as the server will number them. Empty if there is no copy
+         * of the game */
+        std::vector<logic::Change> predict(const logic::Action& action);
+
+        PredictionCheck reconcile(const std::vector<logic::Change>& changes);
+
+        // The game with every change from the server and no predictions,
+        // null after the copy has been dropped
+        const logic::GameState* getState() const;
+
+        // Number of the last change received from the server
+        int getChangeNo() const {return changeNo;};
+        int getConfirmed() const {return confirmed;};
+        int getMispredicted() const {return mispredicted;};
+        int getDiverged() const {return diverged;};
+
+    private:
+        void diverge();
+
+        // The game with every change received applied
+        std::optional<logic::GameState> confirmedState;
+        // confirmedState with the pending predictions performed on top, only
+        // kept while there are some
+        std::optional<logic::GameState> predictedState;
+        int changeNo = 0;
+        // Predicted changes the server hasn't confirmed yet, oldest first
+        std::deque<logic::Change> pending;
+        // Of confirmedState
+        RollingChecksum checksum;
+
+        int confirmed = 0;
+        int mispredicted = 0;
+        int diverged = 0;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "randomplay.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace logic;
+
+vector<Action> logic::concreteActions(const vector<Action>& actions)
+{
+    vector<Action> concrete;
+    for (auto& action : actions) {
+        if (action.needToPickCost) {
+            continue;
+        }
+        if (not action.targets.size()) {
+            concrete.push_back(action);
+        } else if (action.maxTargets == 1) {
+            for (auto target : action.targets) {
+                Action single = action;
+                single.targets = {target};
+                concrete.push_back(single);
+            }
+        } else {
+            concrete.push_back(action);
+            if (action.minTargets == 0) {
+                Action none = action;
+                none.targets = {};
+                concrete.push_back(none);
+            }
+        }
+    }
+    return concrete;
+}
+
+Action logic::randomAction(const vector<Action>& actions, mt19937& rng)
+{
+    vector<Action> choices;
+    for (auto& action : actions) {
+        if (not action.needToPickCost) {
+            choices.push_back(action);
+        }
+    }
+    if (not choices.size()) {
+        choices = actions;
+    }
+
+    uniform_int_distribution<int> pickAction(0, choices.size() - 1);
+    Action action = choices[pickAction(rng)];
+
+    if (action.targets.size()) {
+        int maxTargets = min<int>(action.maxTargets, action.targets.size());
+        int minTargets = min(action.minTargets, maxTargets);
+        uniform_int_distribution<int> pickNumber(minTargets, maxTargets);
+        shuffle(action.targets.begin(), action.targets.end(), rng);
+        action.targets.resize(pickNumber(rng));
+    }
+    return action;
+}
+
+int logic::playRandomActions(GameState& state, int n, mt19937& rng,
+        const function<void(const Action&, int)>& performed)
+{
+    for (int i = 0; i < n; i++) {
+        auto actions = state.getPossibleActions();
+        if (not actions.size()) {
+            return i;
+        }
+        auto action = randomAction(actions, rng);
+        int before = state.changes.size();
+        state.performAction(action);
+        if (performed) {
+            performed(action, before);
+        }
+    }
+    return n;
+}
+
+GameState logic::randomGame(int seed, int nActions)
+{
+    GameState state;
+    state.startGame();
+    mt19937 rng(seed);
+    playRandomActions(state, nActions, rng);
+    return state;
+}
@@ -0,0 +1,39 @@
+#ifndef RANDOMPLAY_H
+#define RANDOMPLAY_H
+
+#include <random>
+#include <vector>
+#include <functional>
+
+#include "logic.h"
+
+namespace logic {
+
+    /* Expand the actions returned by getPossibleActions into concrete choices.
+     * Actions that select targets come back from the server with every valid
+     * target in them, this splits single target selections into one action
+     * per target, and for multiple targets offers all or none of them.
+     * Actions where the payment still needs to be picked are dropped.
+     */
+    std::vector<Action> concreteActions(const std::vector<Action>& actions);
+
+    /* Pick one of the given actions at random. Target selections are given a
+     * random valid subset of their targets
+     */
+    Action randomAction(const std::vector<Action>& actions, std::mt19937& rng);
+
+    /* Play up to n random actions, stopping early if there is nothing left
+     * that can be done. If performed is given it is called after each
+     * action with the action and the number of changes before it. Returns
+     * the number of actions performed
+     */
+    int playRandomActions(GameState& state, int n, std::mt19937& rng,
+            const std::function<void(const Action&, int before)>& performed = {});
+
+    /* A new game played for up to nActions random actions, always the same
+     * one for the same seed. For tests and benchmarks
+     */
+    GameState randomGame(int seed, int nActions);
+};
+
+#endif
@@ -0,0 +1,303 @@
+#include "replay.h"
+
+#include "snapshot.h"
+#include "wireformat.h"
+
+#include <plog/Log.h>
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+using namespace logic;
+
+// Magic and version
+#define REPLAY_HEADER_SIZE 12
+// Length and crc32 of the payload, both little endian
+#define RECORD_HEADER_SIZE 8
+
+namespace {
+    void putUint32(string& out, uint32_t n)
+    {
+        for (int i = 0; i < 4; i++) {
+            out.push_back(char((n >> (8 * i)) & 0xff));
+        }
+    }
+
+    uint32_t getUint32(const char* p)
+    {
+        uint32_t n = 0;
+        for (int i = 0; i < 4; i++) {
+            n |= uint32_t((unsigned char) p[i]) << (8 * i);
+        }
+        return n;
+    }
+
+    uint32_t checksum(const char* data, size_t size)
+    {
+        return crc32(crc32(0, nullptr, 0), (const Bytef*) data, size);
+    }
+
+    string readFile(const string& path)
+    {
+        ifstream ifs(path, ios::binary);
+        if (not ifs) {
+            return "";
+        }
+        stringstream ss;
+        ss << ifs.rdbuf();
+        return ss.str();
+    }
+
+    /* Calls onRecord with a reader over each whole record's payload and
+     * returns where the last one ends. Throws std::runtime_error if data
+     * doesn't start like a replay */
+    template <class F>
+    size_t readRecords(const string& data, F onRecord)
+    {
+        if (data.size() < REPLAY_HEADER_SIZE or data.compare(0, 8, REPLAY_MAGIC) != 0) {
+            throw runtime_error("Not a replay");
+        }
+        if (getUint32(&data[8]) != REPLAY_VERSION) {
+            throw runtime_error("Replay is from another version");
+        }
+        size_t pos = REPLAY_HEADER_SIZE;
+        string payload;
+        while (pos + RECORD_HEADER_SIZE <= data.size()) {
+            uint32_t size = getUint32(&data[pos]);
+            uint32_t crc = getUint32(&data[pos + 4]);
+            const char* p = &data[pos + RECORD_HEADER_SIZE];
+            if (size > data.size() - pos - RECORD_HEADER_SIZE or checksum(p, size) != crc) {
+                break;
+            }
+            payload.assign(p, size);
+            WireReader r(payload);
+            onRecord(r);
+            pos += RECORD_HEADER_SIZE + size;
+        }
+        return pos;
+    }
+}
+
+ReplayWriter::ReplayWriter(const string& path, const GameState& state, int snapshotInterval)
+    : snapshotInterval(max(snapshotInterval, 1))
+{
+    out.open(path, ios::binary | ios::trunc);
+    if (not out) {
+        throw runtime_error("Could not write replay " + path);
+    }
+    string header = REPLAY_MAGIC;
+    putUint32(header, REPLAY_VERSION);
+    out.write(header.data(), header.size());
+    changeNo = state.changes.size();
+    addSnapshot(state);
+    flush();
+    if (not out) {
+        throw runtime_error("Could not write replay " + path);
+    }
+}
+
+unique_ptr<ReplayWriter> ReplayWriter::resume(const string& path, int snapshotInterval)
+{
+    string data = readFile(path);
+    if (data.empty()) {
+        return nullptr;
+    }
+
+    unique_ptr<ReplayWriter> writer(new ReplayWriter(max(snapshotInterval, 1)));
+    bool started = false;
+    size_t end;
+    try {
+        end = readRecords(data, [&](WireReader& r) {
+            if (r.varint() == REPLAY_SNAPSHOT) {
+                writer->actionNo = r.varint();
+                writer->changeNo = r.varint();
+                started = true;
+            } else {
+                readBriefAction(r);
+                writer->actionNo++;
+                writer->changeNo += r.varint();
+            }
+        });
+    } catch (runtime_error& e) {
+        LOG_ERROR << "Could not carry on replay " << path << ": " << e.what();
+        return nullptr;
+    }
+    if (not started) {
+        return nullptr;
+    }
+
+    if (end < data.size()) {
+        LOG_WARNING << "Dropping " << data.size() - end
+            << " bytes of incomplete records from the end of " << path;
+        if (truncate(path.c_str(), end) != 0) {
+            LOG_ERROR << "Could not truncate replay " << path;
+            return nullptr;
+        }
+    }
+    writer->out.open(path, ios::binary | ios::app);
+    if (not writer->out) {
+        return nullptr;
+    }
+    return writer;
+}
+
+void ReplayWriter::add(const Action& action, int changesMade, const GameState& state)
+{
+    payload.clear();
+    WireWriter w(payload);
+    w.varint(REPLAY_ACTION);
+    writeBriefAction(w, action);
+    w.varint(changesMade);
+    writeRecord();
+
+    actionNo++;
+    changeNo += changesMade;
+    if (actionNo % snapshotInterval == 0) {
+        addSnapshot(state);
+        flush();
+    }
+}
+
+void ReplayWriter::flush()
+{
+    out.flush();
+}
+
+void ReplayWriter::addSnapshot(const GameState& state)
+{
+    payload.clear();
+    WireWriter w(payload);
+    w.varint(REPLAY_SNAPSHOT);
+    w.varint(actionNo);
+    w.varint(changeNo);
+    w.str(flattenGame(state, false));
+    writeRecord();
+}
+
+void ReplayWriter::writeRecord()
+{
+    string header;
+    putUint32(header, payload.size());
+    putUint32(header, checksum(payload.data(), payload.size()));
+    out.write(header.data(), header.size());
+    out.write(payload.data(), payload.size());
+    if (not out and not writeFailed) {
+        LOG_ERROR << "Could not write to a replay, the rest of it is lost";
+        writeFailed = true;
+    }
+}
+
+ReplayPlayer::ReplayPlayer(const string& data)
+{
+    size_t end = readRecords(data, [this](WireReader& r) {
+        auto type = r.varint();
+        if (type == REPLAY_SNAPSHOT) {
+            Snapshot s;
+            s.actionNo = r.varint();
+            s.changeNo = r.varint();
+            s.flat = r.str();
+            if (snapshots.empty()) {
+                changeCounts.push_back(s.changeNo);
+            }
+            if (s.actionNo != getActionCount() or s.changeNo != changeCounts.back()) {
+                throw runtime_error("Replay has a snapshot out of place");
+            }
+            snapshots.push_back(move(s));
+        } else if (type == REPLAY_ACTION) {
+            if (snapshots.empty()) {
+                throw runtime_error("Replay doesn't start with a snapshot");
+            }
+            actions.push_back(readBriefAction(r));
+            changeCounts.push_back(changeCounts.back() + r.varint());
+        } else {
+            throw runtime_error("Replay has an unknown record");
+        }
+    });
+    if (snapshots.empty()) {
+        throw runtime_error("Replay is empty");
+    }
+    if (end < data.size()) {
+        LOG_WARNING << "Ignoring " << data.size() - end << " bytes of incomplete records at the end of a replay";
+    }
+    state = loadSnapshot(snapshots.front());
+}
+
+ReplayPlayer ReplayPlayer::load(const string& path)
+{
+    string data = readFile(path);
+    if (data.empty()) {
+        throw runtime_error("Could not read replay " + path);
+    }
+    return ReplayPlayer(data);
+}
+
+GameState ReplayPlayer::loadSnapshot(const Snapshot& snapshot) const
+{
+    return FlatGameView(snapshot.flat.data(), snapshot.flat.size()).toGameState(false);
+}
+
+void ReplayPlayer::seekToChange(int changeNo)
+{
+    auto it = lower_bound(changeCounts.begin(), changeCounts.end(), changeNo);
+    seekToAction(it - changeCounts.begin());
+}
+
+void ReplayPlayer::seekToAction(int to)
+{
+    to = clamp(to, 0, getActionCount());
+    // The last snapshot at or before to
+    auto nearest = prev(upper_bound(snapshots.begin(), snapshots.end(), to,
+            [](int actionNo, const Snapshot& s) {return actionNo < s.actionNo;}));
+    // Carry on from here if going forwards and no snapshot is closer
+    if (actionNo > to or actionNo < nearest->actionNo) {
+        state = loadSnapshot(*nearest);
+        actionNo = nearest->actionNo;
+    }
+    QuietLogging quiet;
+    for (; actionNo < to; actionNo++) {
+        state.performAction(actions[actionNo]);
+        state.changes.clear();
+    }
+}
+
+vector<Change> ReplayPlayer::step()
+{
+    vector<Change> made;
+    if (atEnd()) {
+        return made;
+    }
+    state.performAction(actions[actionNo]);
+    swap(made, state.changes);
+    for (size_t i = 0; i < made.size(); i++) {
+        made[i].changeNo = changeCounts[actionNo] + i + 1;
+    }
+    actionNo++;
+    return made;
+}
+
+int ReplayPlayer::verify() const
+{
+    QuietLogging quiet;
+    GameState game = loadSnapshot(snapshots.front());
+    size_t nextSnapshot = 1;
+    for (int i = 0; i < getActionCount(); i++) {
+        game.performAction(actions[i]);
+        // Cleared rather than swapped out so the space is reused
+        if (int(game.changes.size()) != changeCounts[i + 1] - changeCounts[i]) {
+            return i + 1;
+        }
+        game.changes.clear();
+        if (nextSnapshot < snapshots.size() and snapshots[nextSnapshot].actionNo == i + 1) {
+            if (flattenGame(game, false) != snapshots[nextSnapshot].flat) {
+                return i + 1;
+            }
+            nextSnapshot++;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,143 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "logic.h"
+#include "nocopy.h"
+
+/* A recording of a game for watching it again or finding out where it went
+ * wrong: the game as it was when recording started, every action performed
+ * since, and every REPLAY_SNAPSHOT_INTERVAL actions a flattened copy of the
+ * game (see snapshot.h). Since performAction is deterministic any point can
+ * be reached from the closest snapshot before it, performing at most an
+ * interval's worth of actions.
+ *
+ * The file is REPLAY_MAGIC and the version, then records written as the
+ * game is played. As in the action log (actionlog.h) each record is its
+ * length, a crc32 of the payload and the payload, so a torn record at the
+ * end is dropped when reading. A payload is a varint ReplayRecordType
+ * followed by
+ *  - REPLAY_SNAPSHOT: varint action number, varint change number, then the
+ *    game flattened without its change log
+ *  - REPLAY_ACTION: the action in the brief wire encoding (wireformat.h) and
+ *    a varint of how many changes it made
+ * The first record is the snapshot of the starting point. Change numbers
+ * carry on from the game's own, so they match those a client was sent.
+ */
+
+#define REPLAY_MAGIC "SGREPLY\n"
+#define REPLAY_VERSION 1
+#define REPLAY_SNAPSHOT_INTERVAL 100
+
+enum ReplayRecordType {
+    REPLAY_SNAPSHOT,
+    REPLAY_ACTION,
+};
+
+class ReplayWriter : non_copyable
+{
+    public:
+        /* Start recording state to path, replacing any file there. Throws
+         * std::runtime_error if it can't be written */
+        ReplayWriter(const std::string& path, const logic::GameState& state,
+                int snapshotInterval = REPLAY_SNAPSHOT_INTERVAL);
+
+        /* Carry on the recording at path, which must have been made with
+         * the same snapshot interval. A torn record at the end is cut off.
+         * Returns nullptr if there's no usable recording there */
+        static std::unique_ptr<ReplayWriter> resume(const std::string& path,
+                int snapshotInterval = REPLAY_SNAPSHOT_INTERVAL);
+
+        /* Record an action that has just been performed on state and made
+         * changesMade changes */
+        void add(const logic::Action& action, int changesMade, const logic::GameState& state);
+
+        // Write out anything buffered
+        void flush();
+
+        int getActionCount() const {return actionNo;};
+        // The change number the game is at, including those before recording
+        int getChangeCount() const {return changeNo;};
+
+    private:
+        ReplayWriter(int snapshotInterval) : snapshotInterval(snapshotInterval) {};
+        void addSnapshot(const logic::GameState& state);
+        void writeRecord();
+
+        std::ofstream out;
+        int snapshotInterval;
+        int actionNo = 0;
+        int changeNo = 0;
+        // Reused for each record's payload
+        std::string payload;
+        bool writeFailed = false;
+};
+
+/* Plays back a recording made by ReplayWriter. The actions are all decoded
+ * up front, the snapshots are only turned into games when they're needed */
+class ReplayPlayer
+{
+    public:
+        /* Starts at the beginning of the recording in data. Throws
+         * std::runtime_error if it isn't a replay */
+        ReplayPlayer(const std::string& data);
+        static ReplayPlayer load(const std::string& path);
+
+        int getActionCount() const {return actions.size();};
+        int getFirstChangeNo() const {return changeCounts.front();};
+        int getLastChangeNo() const {return changeCounts.back();};
+        int getSnapshotCount() const {return snapshots.size();};
+
+        // Where the replay is up to
+        const logic::GameState& getState() const {return state;};
+        int getActionNo() const {return actionNo;};
+        int getChangeNo() const {return changeCounts[actionNo];};
+        bool atEnd() const {return actionNo == getActionCount();};
+
+        /* Go to just after the action that made change changeNo, or to the
+         * start if changeNo is before the first action's changes. Actions
+         * can make several changes, getChangeNo says where it ended up */
+        void seekToChange(int changeNo);
+        // Go to just after the first actionNo actions
+        void seekToAction(int actionNo);
+
+        /* Perform the next action and return the changes it made, numbered
+         * as in the game, ready for GraphicsObjectHandler::updateState.
+         * Nothing at the end */
+        std::vector<logic::Change> step();
+
+        /* Play the whole recording from the start on a separate copy,
+         * checking the number of changes each action makes and the game
+         * against every snapshot. Flattening the game and comparing bytes
+         * costs a third of what stateChecksum does, which would otherwise
+         * take most of the time. Returns how many actions had been
+         * performed when they first didn't match, or -1 if they all do */
+        int verify() const;
+
+    private:
+        struct Snapshot
+        {
+            int actionNo;
+            int changeNo;
+            // The flattened game. Heap allocated, so 8 byte aligned as
+            // FlatGameView needs
+            std::string flat;
+        };
+
+        logic::GameState loadSnapshot(const Snapshot& snapshot) const;
+
+        std::vector<logic::Action> actions;
+        // Change number after each number of actions, from 0 to all of them
+        std::vector<int> changeCounts;
+        std::vector<Snapshot> snapshots;
+
+        logic::GameState state;
+        int actionNo = 0;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "logic.h"
+#include "randomplay.h"
+#include "replay.h"
+
+#include <cxxopts.hpp>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+/* Plays back a replay without the graphics: checks it by playing it through
+ * from the start, times going to random points in it and shows the game at
+ * a given change number. With --record it first records random games to try
+ * it on
+ */
+
+double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Record up to nActions random actions, starting new games as each one ends
+void recordRandomGames(const string& path, int nActions, int interval, int seed)
+{
+    GameState state;
+    state.startGame();
+    ReplayWriter writer(path, state, interval);
+    mt19937 rng(seed);
+    QuietLogging quiet;
+    for (int i = 0; i < nActions; i++) {
+        auto actions = concreteActions(state.getPossibleActions());
+        if (not actions.size()) {
+            break;
+        }
+        int before = state.changes.size();
+        auto action = randomAction(actions, rng);
+        state.performAction(action);
+        writer.add(action, state.changes.size() - before, state);
+    }
+    cout << "Recorded " << writer.getActionCount() << " actions and "
+         << writer.getChangeCount() << " changes to " << path << endl;
+}
+
+int main(int argc, char **argv)
+{
+    cxxopts::Options opts("replayer", "Check, time and look into game replays");
+    opts.add_options()
+        ("f,file", "The replay", cxxopts::value<string>()->default_value("game.replay"))
+        ("record", "First record this many random actions to the file", cxxopts::value<int>())
+        ("interval", "Actions between snapshots when recording",
+            cxxopts::value<int>()->default_value(to_string(REPLAY_SNAPSHOT_INTERVAL)))
+        ("seed", "Random seed when recording", cxxopts::value<int>()->default_value("1"))
+        ("c,change", "Show the game after this change number", cxxopts::value<int>())
+        ("seeks", "Random seeks to time", cxxopts::value<int>()->default_value("1000"))
+        ;
+    auto result = opts.parse(argc, argv);
+    string path = result["file"].as<string>();
+
+    if (result.count("record")) {
+        recordRandomGames(path, result["record"].as<int>(), result["interval"].as<int>(),
+                result["seed"].as<int>());
+    }
+
+    auto start = chrono::steady_clock::now();
+    auto replay = ReplayPlayer::load(path);
+    cout << "Loaded " << replay.getActionCount() << " actions, changes "
+         << replay.getFirstChangeNo() << " to " << replay.getLastChangeNo() << " and "
+         << replay.getSnapshotCount() << " snapshots in " << fixed << setprecision(3)
+         << secondsSince(start) << "s" << endl;
+
+    start = chrono::steady_clock::now();
+    int mismatch = replay.verify();
+    double elapsed = secondsSince(start);
+    if (mismatch >= 0) {
+        cout << "Replay doesn't match the game after " << mismatch << " actions" << endl;
+    } else {
+        cout << "Verified in " << elapsed << "s, " << setprecision(0)
+             << replay.getActionCount() / elapsed << " actions/s" << endl;
+    }
+
+    int nSeeks = result["seeks"].as<int>();
+    mt19937 rng(0);
+    uniform_int_distribution<int> changeNo(replay.getFirstChangeNo(), replay.getLastChangeNo());
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < nSeeks; i++) {
+        replay.seekToChange(changeNo(rng));
+    }
+    cout << nSeeks << " random seeks took " << setprecision(1)
+         << secondsSince(start) * 1e6 / max(nSeeks, 1) << "us each" << endl;
+
+    if (result.count("change")) {
+        replay.seekToChange(result["change"].as<int>());
+        cout << "After action " << replay.getActionNo() << ", change "
+             << replay.getChangeNo() << ":" << endl << replay.getState() << endl;
+    }
+    return mismatch >= 0;
+}
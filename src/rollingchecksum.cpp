@@ -0,0 +1,349 @@
+#include "rollingchecksum.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace logic;
+
+namespace {
+    enum PartKind : uint64_t {
+        PART_TURN,
+        PART_OBJECT_IDS,
+        PART_PLAYER,
+        PART_ZONE,
+        PART_SHIP,
+        PART_SYSTEM,
+        PART_BEACON,
+    };
+
+    uint64_t partKey(PartKind kind, int id = 0)
+    {
+        return kind << 32 | (uint32_t) id;
+    }
+
+    PartKind keyKind(uint64_t key)
+    {
+        return (PartKind) (key >> 32);
+    }
+
+    int keyId(uint64_t key)
+    {
+        return (int) (uint32_t) key;
+    }
+
+    /* Hashes the values of one part in turn, starting from its key so equal
+     * parts of different kinds don't cancel out. Each value is mixed in
+     * with the splitmix64 finaliser, which is the same everywhere, unlike
+     * std::hash */
+    struct PartHasher
+    {
+        uint64_t h;
+
+        PartHasher(uint64_t key) : h(key) {};
+
+        void add(uint64_t value) {
+            h ^= value;
+            h ^= h >> 30;
+            h *= 0xbf58476d1ce4e5b9;
+            h ^= h >> 27;
+            h *= 0x94d049bb133111eb;
+            h ^= h >> 31;
+        }
+
+        void add(const string& s) {
+            add(s.size());
+            for (size_t i = 0; i < s.size(); i += 8) {
+                uint64_t word = 0;
+                for (size_t j = i; j < min(i + 8, s.size()); j++) {
+                    word = word << 8 | (unsigned char) s[j];
+                }
+                add(word);
+            }
+        }
+
+        void add(const ResourceAmount& resources) {
+            add(resources.size());
+            for (auto& [type, amount] : resources) {
+                add(type);
+                add(amount);
+            }
+        }
+    };
+
+    template<typename T>
+    const T* findById(const list<T>& items, int id)
+    {
+        auto it = find_if(items.begin(), items.end(), [id](const T& item) {return item.id == id;});
+        return it != items.end() ? &*it : nullptr;
+    }
+
+    // The zones in the order they're numbered in
+    vector<const list<Card>*> cardZones(const GameState& state)
+    {
+        vector<const list<Card>*> zones;
+        for (auto& player : state.players) {
+            zones.push_back(&player.deck);
+            zones.push_back(&player.hand);
+            zones.push_back(&player.discard);
+        }
+        zones.push_back(&state.stack);
+        return zones;
+    }
+
+    uint64_t hashZone(uint64_t key, const list<Card>& zone)
+    {
+        PartHasher h(key);
+        h.add(zone.size());
+        for (auto& card : zone) {
+            h.add(card.id);
+            h.add(card.name);
+            h.add(card.type);
+            h.add(card.playedBy);
+            h.add(card.ownerId);
+            h.add(card.howManyCreated);
+            h.add(card.targets.size());
+            for (int target : card.targets) {
+                h.add(target);
+            }
+        }
+        return h.h;
+    }
+
+    // Hash of the part with the given key, nullopt if state doesn't have it
+    optional<uint64_t> hashPart(const GameState& state, uint64_t key)
+    {
+        PartHasher h(key);
+        int id = keyId(key);
+        switch (keyKind(key)) {
+            case PART_TURN:
+                h.add(state.turnInfo.whoseTurn);
+                h.add(state.turnInfo.activePlayer);
+                h.add(state.turnInfo.phase.size());
+                for (auto phase : state.turnInfo.phase) {
+                    h.add(phase);
+                }
+                return h.h;
+            case PART_OBJECT_IDS:
+                h.add(state.nextObjectId);
+                return h.h;
+            case PART_PLAYER: {
+                auto player = findById(state.players, id);
+                if (not player) {
+                    return nullopt;
+                }
+                h.add(player->resources);
+                h.add(player->flagshipId);
+                h.add(player->playedResourceShipThisTurn);
+                return h.h;
+            }
+            case PART_SHIP: {
+                auto ship = findById(state.ships, id);
+                if (not ship) {
+                    return nullopt;
+                }
+                h.add(ship->type);
+                h.add(ship->attack);
+                h.add(ship->shield);
+                h.add(ship->armour);
+                h.add(ship->movement);
+                h.add(ship->controller);
+                h.add(ship->curSystemId);
+                return h.h;
+            }
+            case PART_SYSTEM: {
+                auto system = findById(state.systems, id);
+                if (not system) {
+                    return nullopt;
+                }
+                h.add(system->controllerId);
+                return h.h;
+            }
+            case PART_BEACON: {
+                auto beacon = findById(state.beacons, id);
+                if (not beacon) {
+                    return nullopt;
+                }
+                h.add(beacon->ownerId);
+                h.add(beacon->systemId);
+                return h.h;
+            }
+            case PART_ZONE: {
+                auto zones = cardZones(state);
+                if (id < 0 or id >= (int) zones.size()) {
+                    return nullopt;
+                }
+                return hashZone(key, *zones[id]);
+            }
+        }
+        return nullopt;
+    }
+}
+
+void RollingChecksum::reset(const GameState& state)
+{
+    parts.clear();
+    total = 0;
+    marked.clear();
+    zonesMarked = allMarked = false;
+
+    rehash(state, partKey(PART_TURN));
+    rehash(state, partKey(PART_OBJECT_IDS));
+    for (auto& player : state.players) {
+        rehash(state, partKey(PART_PLAYER, player.id));
+    }
+    rehashZones(state);
+    for (auto& ship : state.ships) {
+        rehash(state, partKey(PART_SHIP, ship.id));
+    }
+    for (auto& system : state.systems) {
+        rehash(state, partKey(PART_SYSTEM, system.id));
+    }
+    for (auto& beacon : state.beacons) {
+        rehash(state, partKey(PART_BEACON, beacon.id));
+    }
+}
+
+void RollingChecksum::rehash(const GameState& state, uint64_t key)
+{
+    auto it = parts.find(key);
+    if (it != parts.end()) {
+        total -= it->second;
+    }
+    auto hash = hashPart(state, key);
+    if (not hash) {
+        if (it != parts.end()) {
+            parts.erase(it);
+        }
+        return;
+    }
+    total += *hash;
+    if (it != parts.end()) {
+        it->second = *hash;
+    } else {
+        parts[key] = *hash;
+    }
+}
+
+void RollingChecksum::rehashZones(const GameState& state)
+{
+    auto zones = cardZones(state);
+    for (int i = 0; i < (int) zones.size(); i++) {
+        uint64_t key = partKey(PART_ZONE, i);
+        uint64_t& hash = parts[key];
+        total -= hash;
+        hash = hashZone(key, *zones[i]);
+        total += hash;
+    }
+}
+
+void RollingChecksum::mark(const Change& change)
+{
+    auto markId = [this](PartKind kind, optional<int> id) {
+        if (id) {
+            marked.push_back(partKey(kind, *id));
+        } else {
+            // Not the data it should have, so don't guess what it touched
+            allMarked = true;
+        }
+    };
+    auto shipId = [&change]() -> optional<int> {
+        auto ship = get_if<Ship>(&change.data);
+        return ship ? optional(ship->id) : nullopt;
+    };
+    auto intData = [&change]() -> optional<int> {
+        auto value = get_if<int>(&change.data);
+        return value ? optional(*value) : nullopt;
+    };
+    auto pairFirst = [&change]() -> optional<int> {
+        if (auto p = get_if<pair<int, int>>(&change.data)) {
+            return p->first;
+        }
+        if (auto p = get_if<pair<int, ResourceAmount>>(&change.data)) {
+            return p->first;
+        }
+        return nullopt;
+    };
+
+    switch (change.type) {
+        case CHANGE_ADD_SHIP:
+        case CHANGE_SHIP_CHANGE:
+            markId(PART_SHIP, shipId());
+            break;
+        case CHANGE_REMOVE_SHIP:
+            markId(PART_SHIP, intData());
+            break;
+        case CHANGE_MOVE_SHIP:
+            markId(PART_SHIP, pairFirst());
+            break;
+        case CHANGE_PLAY_CARD:
+        case CHANGE_RESOLVE_CARD:
+        case CHANGE_DRAW_CARD:
+        case CHANGE_RETURN_CARD_STACK_TO_HAND:
+        case CHANGE_CARD_TARGETS:
+            zonesMarked = true;
+            break;
+        case CHANGE_PHASE_CHANGE:
+            marked.push_back(partKey(PART_TURN));
+            break;
+        case CHANGE_OBJECT_IDS:
+            marked.push_back(partKey(PART_OBJECT_IDS));
+            break;
+        case CHANGE_PLACE_BEACON: {
+            auto beacon = get_if<WarpBeacon>(&change.data);
+            markId(PART_BEACON, beacon ? optional(beacon->id) : nullopt);
+            break;
+        }
+        case CHANGE_REMOVE_BEACON:
+            markId(PART_BEACON, intData());
+            break;
+        case CHANGE_PLAYER_RESOURCES:
+        case CHANGE_RESOURCE_SHIP_PLAYED:
+            markId(PART_PLAYER, pairFirst());
+            break;
+        case CHANGE_SYSTEM_CONTROLLER:
+            markId(PART_SYSTEM, pairFirst());
+            break;
+        case CHANGE_SHIP_TARGETS:
+        case CHANGE_COMBAT_START:
+        case CHANGE_COMBAT_ROUND_END:
+        case CHANGE_COMBAT_END:
+            // Nothing a copy keeps
+            break;
+        default:
+            allMarked = true;
+            break;
+    }
+}
+
+uint32_t RollingChecksum::get(const GameState& state)
+{
+    if (allMarked) {
+        reset(state);
+    }
+    for (auto key : marked) {
+        rehash(state, key);
+    }
+    marked.clear();
+    if (zonesMarked) {
+        rehashZones(state);
+        zonesMarked = false;
+    }
+    return (uint32_t) (total ^ total >> 32);
+}
+
+void RollingChecksum::stamp(GameState& state, int before)
+{
+    int after = state.changes.size();
+    for (int i = before; i < after; i++) {
+        mark(state.changes[i]);
+    }
+    if (after > before and after / ROLLING_CHECKSUM_INTERVAL != before / ROLLING_CHECKSUM_INTERVAL) {
+        state.changes.back().checksum = get(state);
+    }
+}
+
+bool RollingChecksum::check(const GameState& state, const Change& change)
+{
+    mark(change);
+    return not change.checksum or get(state) == *change.checksum;
+}
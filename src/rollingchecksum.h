@@ -0,0 +1,66 @@
+#ifndef ROLLINGCHECKSUM_H
+#define ROLLINGCHECKSUM_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "logic.h"
+
+// About how many changes apart checksums are put on changes, see stamp
+#define ROLLING_CHECKSUM_INTERVAL 16
+
+/* A checksum of a game that is kept up to date as changes are made, cheap
+ * enough to keep for every change, so that the server can put it on a
+ * change now and then and a client keeping its own copy of the game (see
+ * Prediction) can check the copy as the changes arrive.
+ *
+ * The game is split into parts: the turn, the next object id, each player,
+ * each zone of cards (every player's deck, hand and discard, then the
+ * stack) and each ship, system and beacon. Each part is hashed on its own
+ * and the checksum is the sum of the hashes, so after a change only the
+ * parts it touched are hashed again. Only what a copy built with
+ * GameState::apply has is hashed, eg. not ship owners or card text.
+ *
+ * Both sides must mark every change, so parts are hashed again at the same
+ * points, and the result only depends on the game, not on when reset was
+ * called.
+ */
+class RollingChecksum
+{
+    public:
+        // Hash all of state, forgetting what was marked
+        void reset(const logic::GameState& state);
+
+        /* Note the parts change touches, to be hashed again by the next get.
+         * The state doesn't need to have the change yet */
+        void mark(const logic::Change& change);
+
+        // The checksum of state, hashing again whatever was marked
+        uint32_t get(const logic::GameState& state);
+
+        /* Mark the changes state made after its first before, eg. by
+         * performing an action, and if they passed a multiple of
+         * ROLLING_CHECKSUM_INTERVAL put the checksum on the last of them.
+         * Only the last change of an action is stamped, as a copy catching
+         * up with the changes has only then made all of them */
+        void stamp(logic::GameState& state, int before);
+
+        /* Mark a change that has just been applied to state, returning
+         * false if it carries a checksum and state doesn't match it */
+        bool check(const logic::GameState& state, const logic::Change& change);
+
+    private:
+        void rehash(const logic::GameState& state, uint64_t key);
+        void rehashZones(const logic::GameState& state);
+
+        // Hash of each part, by kind and id
+        std::unordered_map<uint64_t, uint64_t> parts;
+        uint64_t total = 0;
+
+        std::vector<uint64_t> marked;
+        bool zonesMarked = false;
+        bool allMarked = false;
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include "util.h"
+#include "client.h"
+#include "httpclient.h"
+#include "sharding.h"
+#include "sessions.h"
+
+#include "pistache/endpoint.h"
+#include "pistache/router.h"
+
+#include <plog/Log.h>
+#include <cxxopts.hpp>
+#include <subprocess.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+using namespace std;
+using namespace Pistache;
+
+// Connections kept open to each shard
+#define SHARD_CONNECTIONS 32
+#define SHARD_TIMEOUT_MS 5000
+
+// Request headers that are passed on to the shards
+const vector<string> FORWARDED_HEADERS = {
+    "Content-Type",
+    LOGIN_TOKEN_HEADER,
+    "If-None-Match",
+    WIRE_FORMAT_HEADER,
+    COMPRESSION_HEADER,
+    IDEMPOTENCY_KEY_HEADER,
+};
+
+// Response headers that belong to a single connection and are not passed
+// back to the client
+const vector<string> HOP_BY_HOP_HEADERS = {
+    "connection", "content-length", "transfer-encoding", "keep-alive",
+};
+
+/* Sits in front of several server processes. Every game lives on exactly
+ * one shard, chosen by a consistent hash of its id, so requests for a game
+ * are passed straight to that shard. Logins are sent to every shard with
+ * the same token so the user can play on any of them, and the router
+ * remembers which game each user is in so joining by username works across
+ * shards. It forgets users after the same idle time as the shards do. The
+ * shards only take the router's choice of token along with the secret they
+ * were started with, see ROUTER_SECRET_ENV.
+ *
+ * Requests go to the shards through an HttpLoop, which keeps connections
+ * to them open. Replies are sent from the loop's thread once the shards
+ * have replied, so the handler threads never wait on a shard and a slow
+ * one doesn't hold up requests for the others.
+ */
+class ShardRouter
+{
+    public:
+        ShardRouter(Address addr, vector<int> shardPorts, string secret)
+            : httpEndpoint(std::make_shared<Http::Endpoint>(addr)),
+              shardPorts(shardPorts), ring(shardPorts.size()), secret(secret),
+              http(SHARD_CONNECTIONS * shardPorts.size())
+        { }
+
+		void init(size_t thr = 2) {
+			auto opts = Http::Endpoint::options()
+				.threads(thr);
+			httpEndpoint->init(opts);
+			setupRoutes();
+		}
+
+		void start() {
+			httpEndpoint->setHandler(router.handler());
+			httpEndpoint->serve();
+		}
+
+		void shutdown() {
+			httpEndpoint->shutdown();
+		}
+
+	private:
+		void setupRoutes() {
+			using namespace Rest;
+
+			Routes::Post(router, "/createGame", Routes::bind(&ShardRouter::createGame, this));
+			Routes::Post(router, "/player/:username/login", Routes::bind(&ShardRouter::login, this));
+			Routes::Post(router, "/player/:username/join", Routes::bind(&ShardRouter::joinGameByPlayer, this));
+			Routes::Post(router, "/game/:gameid/join", Routes::bind(&ShardRouter::joinGame, this));
+			Routes::Post(router, "/game/:gameid/state", Routes::bind(&ShardRouter::toGameShard, this));
+			Routes::Post(router, "/game/:gameid/getactions", Routes::bind(&ShardRouter::toGameShard, this));
+			Routes::Post(router, "/game/:gameid/performaction", Routes::bind(&ShardRouter::toGameShard, this));
+			Routes::Post(router, "/game/:gameid/changes/:changeNo", Routes::bind(&ShardRouter::toGameShard, this));
+			Routes::Post(router, "/game/:gameid/sync/:changeNo", Routes::bind(&ShardRouter::toGameShard, this));
+			Routes::Post(router, "/game/:gameid/spectate/:changeNo", Routes::bind(&ShardRouter::toGameShard, this));
+			Routes::Post(router, "/game/:gameid/lockstep/:actionNo", Routes::bind(&ShardRouter::toGameShard, this));
+			Routes::Post(router, "/game/:gameid/autopass/:policy", Routes::bind(&ShardRouter::toGameShard, this));
+		}
+
+        HttpRequest shardRequest(int shard, const Rest::Request& request,
+                list<string> headers = {})
+        {
+            // Headers given by the caller replace the client's
+            for (auto& name : FORWARDED_HEADERS) {
+                bool replaced = any_of(headers.begin(), headers.end(),
+                        [&name](const string& h) {return h.rfind(name + ":", 0) == 0;});
+                auto header = request.headers().tryGetRaw(name);
+                if (not header.isEmpty() and not replaced) {
+                    headers.push_back(name + ": " + header.get().value());
+                }
+            }
+
+            HttpRequest ret;
+            ret.url = "localhost" + request.resource() + request.query().as_str();
+            ret.port = shardPorts[shard];
+            ret.headers = move(headers);
+            ret.body = request.body();
+            ret.timeoutMs = SHARD_TIMEOUT_MS;
+            return ret;
+        }
+
+        /* Pass the request on to the shard and reply with whatever it
+         * replies, without waiting for it. then, if given, sees the reply
+         * first, on the HttpLoop's thread */
+        void forward(int shard, const Rest::Request& request, Http::ResponseWriter& response,
+                function<void(const HttpResponse&)> then = {})
+        {
+            auto writer = make_shared<Http::ResponseWriter>(move(response));
+            http.request(shardRequest(shard, request),
+                    [this, shard, writer, then](const HttpResponse& shardResponse) {
+                        if (not shardResponse.code) {
+                            LOG_ERROR << "No reply from shard " << shard;
+                        }
+                        if (then) {
+                            then(shardResponse);
+                        }
+                        reply(*writer, shardResponse);
+                    });
+        }
+
+        void reply(Http::ResponseWriter& response, const HttpResponse& shardResponse)
+        {
+            if (not shardResponse.code) {
+                response.send(Http::Code::Bad_Gateway, "");
+                return;
+            }
+            // Names are already lower case
+            for (auto& [name, value] : shardResponse.headers) {
+                if (find(HOP_BY_HOP_HEADERS.begin(), HOP_BY_HOP_HEADERS.end(), name)
+                        == HOP_BY_HOP_HEADERS.end()) {
+                    response.headers().addRaw(Http::Header::Raw(name, value));
+                }
+            }
+            response.send(static_cast<Http::Code>(shardResponse.code), shardResponse.body);
+        }
+
+        /* The session of the user making the request, if they logged in
+         * through the router. Counts as activity, as on the shards */
+        optional<Session> sessionForRequest(const Rest::Request& request)
+        {
+            auto header = request.headers().tryGetRaw(LOGIN_TOKEN_HEADER);
+            if (header.isEmpty()) {
+                return nullopt;
+            }
+            return sessions.getByToken(header.get().value());
+        }
+
+        // Remember the game a user is in from a create or join reply
+        void recordGame(const optional<Session>& session, const HttpResponse& shardResponse)
+        {
+            if (not session or shardResponse.code != 200) {
+                return;
+            }
+            auto gameInfo = deserialize<pair<string, int>>(shardResponse.body);
+            sessions.joinedGame(session->sessionId, gameInfo.first, gameInfo.second);
+        }
+
+        void login(const Rest::Request& request, Http::ResponseWriter response) {
+            auto username = request.param(":username").as<string>();
+            string loginToken = randString(8);
+
+            // Sent to every shard at once, the reply goes once they all have
+            // it. The callbacks all run on the HttpLoop's thread
+            struct Replies {
+                int waiting;
+                bool failed = false;
+            };
+            auto replies = make_shared<Replies>(Replies{.waiting = ring.size()});
+            auto writer = make_shared<Http::ResponseWriter>(move(response));
+            for (int shard = 0; shard < ring.size(); shard++) {
+                auto loginRequest = shardRequest(shard, request,
+                        {string(LOGIN_TOKEN_HEADER) + ": " + loginToken,
+                         string(ROUTER_SECRET_HEADER) + ": " + secret});
+                http.request(loginRequest, [this, shard, username, loginToken, replies, writer]
+                        (const HttpResponse& shardResponse) {
+                    if (shardResponse.code != 200 or shardResponse.body != loginToken) {
+                        LOG_ERROR << "Shard " << shard << " did not accept login for " << username;
+                        replies->failed = true;
+                    }
+                    if (--replies->waiting) {
+                        return;
+                    }
+                    if (replies->failed) {
+                        writer->send(Http::Code::Service_Unavailable, "");
+                        return;
+                    }
+                    sessions.login(username, loginToken);
+                    LOG_INFO << "Player " << username << " logged in";
+                    writer->send(Http::Code::Ok, loginToken);
+                });
+            }
+        }
+
+        void createGame(const Rest::Request& request, Http::ResponseWriter response) {
+            int shard = nextShard++ % ring.size();
+            auto session = sessionForRequest(request);
+            forward(shard, request, response, [this, session](const HttpResponse& shardResponse) {
+                recordGame(session, shardResponse);
+            });
+        }
+
+        void joinGame(const Rest::Request& request, Http::ResponseWriter response) {
+            auto gameId = request.param(":gameid").as<string>();
+            auto session = sessionForRequest(request);
+            forward(ring.shardFor(gameId), request, response, 
+                    [this, session](const HttpResponse& shardResponse) {
+                        recordGame(session, shardResponse);
+                    });
+        }
+
+        void joinGameByPlayer(const Rest::Request& request, Http::ResponseWriter response) {
+            auto usernameToJoin = request.param(":username").as<string>();
+            auto otherUser = sessions.getByUsername(usernameToJoin);
+
+            // The shard holding the game also knows which game the user is
+            // in, if we don't know then ask them in turn
+            auto session = sessionForRequest(request);
+            auto record = [this, session](const HttpResponse& shardResponse) {
+                recordGame(session, shardResponse);
+            };
+            if (otherUser and otherUser->currentGame.size()) {
+                forward(ring.shardFor(otherUser->currentGame), request, response, record);
+                return;
+            }
+            auto shardRequests = make_shared<vector<HttpRequest>>();
+            for (int shard = 0; shard < ring.size(); shard++) {
+                shardRequests->push_back(shardRequest(shard, request));
+            }
+            auto writer = make_shared<Http::ResponseWriter>(move(response));
+            askShards(shardRequests, 0, [this, writer, record](const HttpResponse& shardResponse) {
+                record(shardResponse);
+                reply(*writer, shardResponse);
+            });
+        }
+
+        /* Send the requests one after another from the shard'th until one
+         * gets a 200, then give done that reply or the last one */
+        void askShards(shared_ptr<vector<HttpRequest>> requests, int shard,
+                function<void(const HttpResponse&)> done)
+        {
+            http.request((*requests)[shard], [this, requests, shard, done]
+                    (const HttpResponse& shardResponse) {
+                if (shardResponse.code == 200 or shard + 1 == (int) requests->size()) {
+                    done(shardResponse);
+                } else {
+                    askShards(requests, shard + 1, done);
+                }
+            });
+        }
+
+        void toGameShard(const Rest::Request& request, Http::ResponseWriter response) {
+            auto gameId = request.param(":gameid").as<string>();
+            // Keeps the user from being forgotten while they play
+            sessionForRequest(request);
+            forward(ring.shardFor(gameId), request, response);
+        }
+
+	    std::shared_ptr<Http::Endpoint> httpEndpoint;
+		Rest::Router router;
+
+        vector<int> shardPorts;
+        ShardRing ring;
+        atomic<int> nextShard{0};
+        // Sent with logins, see ROUTER_SECRET_HEADER
+        string secret;
+
+        // Who has logged in through the router and the game they are in
+        SessionService sessions;
+
+        // Declared last so it's stopped, and its replies sent, first
+        HttpLoop http;
+};
+
+// Not from rand(), which is predictable
+string randomSecret()
+{
+    random_device rd;
+    string charset = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+    string ret;
+    for (int i = 0; i < 32; i++) {
+        ret.push_back(charset[uniform_int_distribution<int>(0, charset.size() - 1)(rd)]);
+    }
+    return ret;
+}
+
+vector<int> spawnedPids;
+
+void killShards(int signal)
+{
+    for (auto pid : spawnedPids) {
+        kill(pid, SIGTERM);
+    }
+    _exit(0);
+}
+
+int main(int argc, char **argv) {
+    cxxopts::Options opts("router", "Routes requests to several game server shards");
+    opts.add_options()
+        ("p,port", "Port to listen on", cxxopts::value<int>()->default_value("40000"))
+        ("t,threads", "Number of request handling threads", cxxopts::value<int>()->default_value("4"))
+        ("n,shards", "Number of server shards", cxxopts::value<int>()->default_value("2"))
+        ("shard-port", "Port of the first shard, the others follow it", cxxopts::value<int>()->default_value("40001"))
+        ("spawn", "Start the shard server processes locally. The secret shared with them, see "
+            ROUTER_SECRET_ENV ", is random unless it is set")
+        ("l,logfile", "Log output location", cxxopts::value<string>()->default_value("router.log"))
+        ;
+    auto result = opts.parse(argc, argv);
+
+    string logfile = result["logfile"].as<string>();
+    remove(logfile.c_str());
+    plog::init(plog::debug, logfile.c_str());
+    LOG_INFO << "Starting router";
+
+    int nShards = result["shards"].as<int>();
+    vector<int> shardPorts;
+    for (int i = 0; i < nShards; i++) {
+        shardPorts.push_back(result["shard-port"].as<int>() + i);
+    }
+
+    const char* secretEnv = getenv(ROUTER_SECRET_ENV);
+    string secret = secretEnv ? secretEnv : "";
+    if (secret.empty() and result.count("spawn")) {
+        secret = randomSecret();
+        // Spawned shards inherit it
+        setenv(ROUTER_SECRET_ENV, secret.c_str(), 1);
+    }
+    if (secret.empty()) {
+        LOG_WARNING << "No " << ROUTER_SECRET_ENV << " set, the shards won't accept logins";
+    }
+
+    vector<unique_ptr<subprocess::Popen>> shards;
+    if (result.count("spawn")) {
+        for (int i = 0; i < nShards; i++) {
+            stringstream cmd;
+            cmd << "./server --port " << shardPorts[i]
+                << " --shard " << i << " --shards " << nShards
+                << " --logfile server" << i << ".log";
+            LOG_INFO << "Starting shard: " << cmd.str();
+            shards.push_back(make_unique<subprocess::Popen>(cmd.str()));
+            spawnedPids.push_back(shards.back()->pid());
+        }
+        signal(SIGINT, killShards);
+        signal(SIGTERM, killShards);
+        usleep(1e5);
+    }
+
+    Address addr(Ipv4::any(), Port(result["port"].as<int>()));
+    ShardRouter shardRouter(addr, shardPorts, secret);
+    shardRouter.init(result["threads"].as<int>());
+    shardRouter.start();
+
+    shardRouter.shutdown();
+}
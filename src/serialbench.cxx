@@ -0,0 +1,151 @@
+#include "logic.h"
+#include "bytestream.h"
+#include "randomplay.h"
+
+#include <cxxopts.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+using namespace std;
+using namespace logic;
+
+/* Compares the old request / reply serialization path, which went through
+ * stringstreams and wrapped every request body in a second envelope, with
+ * the span and per thread buffer path. Counts heap allocations by replacing
+ * the global operator new
+ */
+
+atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(size)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+// What requests used to be wrapped in before the token moved to a header
+struct Envelope
+{
+    string loginToken;
+    string serializedData;
+    SERIALIZE(loginToken, serializedData);
+};
+
+template <class T>
+string oldSerialize(T obj)
+{
+    stringstream ss;
+    {
+        cereal::PortableBinaryOutputArchive oarchive(ss);
+        oarchive(obj);
+    }
+    return ss.str();
+}
+
+template <class T>
+T oldDeserialize(string data)
+{
+    stringstream ss;
+    ss << data;
+    T obj;
+    {
+        cereal::PortableBinaryInputArchive iarchive(ss);
+        iarchive(obj);
+    }
+    return obj;
+}
+
+struct SyncReply
+{
+    vector<Change> changes;
+    vector<Action> actions;
+    SERIALIZE(changes, actions);
+};
+
+template <class F>
+void bench(string name, int iterations, F f)
+{
+    f();
+    uint64_t before = allocations;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        f();
+    }
+    chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+    double allocs = double(allocations - before) / iterations;
+    cout << left << setw(36) << name << right << fixed << setprecision(2)
+         << setw(12) << elapsed.count() / iterations
+         << setw(12) << allocs << endl;
+}
+
+int main(int argc, char **argv)
+{
+    cxxopts::Options opts("serialbench", "Compare request and reply serialization paths");
+    opts.add_options()
+        ("i,iterations", "Iterations of each case", cxxopts::value<int>()->default_value("20000"))
+        ("a,actions", "Random actions played to build the game used", cxxopts::value<int>()->default_value("100"))
+        ;
+    auto result = opts.parse(argc, argv);
+    int iterations = result["iterations"].as<int>();
+
+    // Back off until the game still has something to do, for the actions
+    // in the sync reply
+    int nActions = result["actions"].as<int>();
+    GameState state = randomGame(1, nActions);
+    while (not state.getPossibleActions().size() and nActions > 0) {
+        state = randomGame(1, --nActions);
+    }
+    vector<Action> actions = state.getPossibleActions();
+    Action action = actions.front();
+    SyncReply reply = {state.getChangesAfter(0), actions};
+
+    cout << left << setw(36) << "case" << right << setw(12) << "us/op"
+         << setw(12) << "allocs/op" << endl;
+
+    string oldBody = oldSerialize(Envelope{"ABCDEFGH", oldSerialize(action)});
+    bench("performaction body, old", iterations, [&]{
+        auto envelope = oldDeserialize<Envelope>(oldBody);
+        auto a = oldDeserialize<Action>(envelope.serializedData);
+    });
+    string body = serialize(action);
+    bench("performaction body, span", iterations, [&]{
+        auto a = deserialize<Action>(body);
+    });
+
+    bench("sync reply, old", iterations / 10, [&]{
+        auto data = oldSerialize(reply);
+    });
+    bench("sync reply, thread buffer", iterations / 10, [&]{
+        auto& data = threadBuffer();
+        serializeInto(data, reply);
+    });
+
+    string replyData = serialize(reply);
+    bench("sync reply decode, old", iterations / 10, [&]{
+        auto r = oldDeserialize<SyncReply>(replyData);
+    });
+    bench("sync reply decode, span", iterations / 10, [&]{
+        auto r = deserialize<SyncReply>(replyData);
+    });
+    cout << "Sync reply is " << replyData.size() << " bytes" << endl;
+
+    return 0;
+}
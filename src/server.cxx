@@ -7,38 +7,278 @@
 
 #include <plog/Log.h>
 #include <backward.hpp>
+#include <cxxopts.hpp>
 
 #include <iostream>
 #include <vector>
 #include <sstream>
 #include <iterator>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <set>
+#include <thread>
+#include <filesystem>
+#include <condition_variable>
+
+#include <malloc.h>
+#include <unistd.h>
 
 #include "client.h"
+#include "sessions.h"
+#include "metrics.h"
+#include "sharding.h"
+#include "wireformat.h"
+#include "compression.h"
+#include "actionlog.h"
+#include "snapshot.h"
+#include "botpool.h"
+#include "lockstep.h"
+#include "replay.h"
+#include "rollingchecksum.h"
 
 using namespace std;
 using namespace Pistache;
 using namespace logic;
 
-struct User
+// Lockstep games run on the server to check them, one in this many
+#define DEFAULT_LOCKSTEP_VALIDATE_EVERY 10
+// Actions performed for players in a row before giving them back, in case
+// neither player has anything to do but pass
+#define MAX_AUTO_ACTIONS 64
+
+/* A reply body shared between requests. The compressed copy is made by the
+ * first request that can use it and kept alongside */
+struct CachedBody
+{
+    string data;
+
+    const string& compressed() const {
+        call_once(compressOnce, [this]{compressedData = compress(data);});
+        return compressedData;
+    }
+
+    private:
+        mutable once_flag compressOnce;
+        mutable string compressedData;
+};
+
+/* Serialized copy of a game's state at one version, shared by every request
+ * for the state until the game changes again */
+struct StateSnapshot : public CachedBody
+{
+    uint64_t version;
+    int changeNo;
+    string etag;
+};
+
+/* Serialized changes from one change number up to another, built once and
+ * sent as is to every spectator asking for changes after from */
+struct ChangeFrame : public CachedBody
 {
-    string username;
-    string loginToken;
-    int playerId;
-    string currentGame;
+    int from;
+    int to;
+};
+
+// A frame kept for reuse, with when it was last used to pick which to drop
+struct CachedFrame
+{
+    shared_ptr<const ChangeFrame> frame;
+    uint64_t lastUsed;
 };
 
 struct ActiveGame
 {
+    mutex m;
     GameState state;
-    vector<User> players;
+    // Username of whoever sits in each seat in turn, "" for the bot
+    vector<string> seats;
+
+    // Bumped under m whenever state changes
+    atomic<uint64_t> version{0};
+    // Latest snapshots without and with the change log. Read and replaced
+    // with atomic_load / atomic_store so an unchanged game can be served
+    // without taking m
+    shared_ptr<const StateSnapshot> snapshot;
+    shared_ptr<const StateSnapshot> historySnapshot;
+
+    // Length of the change log, kept up to date under m
+    atomic<int> changeCount{0};
+    // Spectator frames by the change number they start after, one set for
+    // cereal and one for the compact format, at most MAX_SPECTATOR_FRAMES
+    // of the most recently used in each. Most spectators are caught up so
+    // the newest frame is also kept in latest to be found without
+    // feedMutex
+    mutex feedMutex;
+    map<int, CachedFrame> frames[2];
+    uint64_t frameUses = 0;
+    shared_ptr<const ChangeFrame> latest[2];
+
+    // steady_clock time of the last request for the game, for hibernation
+    atomic<int64_t> lastUsed{0};
+
+    // Of state, put on its changes every so often, see RollingChecksum.
+    // Under m
+    RollingChecksum checksum;
+
+    // Only for lockstep games (see lockstep.h), set when the game is created
+    // and used under m. The peers run the game, state stays as it started
+    unique_ptr<LockstepLog> lockstep;
+
+    // The player the server plays for, 0 if there is no bot. botThinking
+    // is set under m while a move for it is queued or being searched
+    int botPlayerId = 0;
+    int botThinkMs = 0;
+    bool botThinking = false;
+
+    // The last action number performed for each client id, see
+    // IDEMPOTENCY_KEY_HEADER. Under m
+    map<string, uint64_t> actionSeqs;
+
+    // What each player leaves to the server, see GameState::autoAction.
+    // Players not in it are always asked. Under m
+    map<int, AutoPass> autoPass;
+
+    // Where the game is being recorded, see setReplayDir. Under m
+    unique_ptr<ReplayWriter> replay;
+};
+
+// What is kept in memory of a game that has been hibernated to disk
+struct HibernatedGame
+{
+    vector<string> seats;
+    uint64_t version;
+    int botThinkMs;
+    map<string, uint64_t> actionSeqs;
+    map<int, AutoPass> autoPass;
+};
+
+int64_t steadyNow()
+{
+    return chrono::steady_clock::now().time_since_epoch().count();
+}
+
+size_t residentBytes()
+{
+    size_t pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+const int MAX_SPECTATOR_FRAMES = 64;
+
+// Whether the client asked for the compact encoding from wireformat.h
+bool wantsCompact(const Rest::Request& request)
+{
+    auto header = request.headers().tryGetRaw(WIRE_FORMAT_HEADER);
+    return not header.isEmpty() and header.get().value() == WIRE_FORMAT_COMPACT;
+}
+
+void markCompact(Http::ResponseWriter& response)
+{
+    response.headers().addRaw(Http::Header::Raw(WIRE_FORMAT_HEADER, WIRE_FORMAT_COMPACT));
+}
+
+bool acceptsCompressed(const Rest::Request& request)
+{
+    auto header = request.headers().tryGetRaw(COMPRESSION_HEADER);
+    return not header.isEmpty() and header.get().value() == COMPRESSION_DEFLATE;
+}
+
+/* The client id and the number of the first action in the request from
+ * IDEMPOTENCY_KEY_HEADER, an empty id if there isn't one */
+pair<string, uint64_t> idempotencyKey(const Rest::Request& request)
+{
+    auto header = request.headers().tryGetRaw(IDEMPOTENCY_KEY_HEADER);
+    if (header.isEmpty()) {
+        return {"", 0};
+    }
+    auto value = header.get().value();
+    auto colon = value.rfind(':');
+    if (colon == string::npos) {
+        return {"", 0};
+    }
+    try {
+        return {value.substr(0, colon), stoull(value.substr(colon + 1))};
+    } catch (logic_error& e) {
+        return {"", 0};
+    }
+}
+
+// Compares in the same time however much of the secrets match. An empty
+// secret matches nothing
+bool sameSecret(const string& given, const string& secret)
+{
+    if (secret.empty() or given.size() != secret.size()) {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < secret.size(); i++) {
+        diff |= given[i] ^ secret[i];
+    }
+    return diff == 0;
+}
+
+/* Versions start again from 0 when a game is rebuilt by another run of the
+ * server, from the action log or a hibernated game, so ETags also carry
+ * when this run started. Otherwise a client holding an ETag from before a
+ * restart could be told its old state is still current */
+const string serverEpoch = to_string(chrono::system_clock::now().time_since_epoch().count());
+
+string stateETag(const string& gameId, uint64_t version, bool withHistory)
+{
+    return "\"" + gameId + "-" + serverEpoch + "-" + to_string(version) 
+        + (withHistory ? "h" : "") + "\"";
+}
+
+/* Request count, bytes sent and the time spent in each stage of handling a
+ * request for a single route */
+struct RouteMetrics
+{
+    RouteMetrics(MetricsRegistry& registry, string route)
+        : requests(registry.counter("spacegame_requests_total", 
+                    "route=\"" + route + "\"", "Requests handled")),
+          bytesSent(registry.counter("spacegame_response_bytes_total", 
+                    "route=\"" + route + "\"", "Response body bytes sent")),
+          total(registry.histogram("spacegame_request_seconds", 
+                    "route=\"" + route + "\",stage=\"total\"", 
+                    "Time spent handling requests, by stage")),
+          lockWait(registry.histogram("spacegame_request_seconds", 
+                    "route=\"" + route + "\",stage=\"lock_wait\"")),
+          compute(registry.histogram("spacegame_request_seconds", 
+                    "route=\"" + route + "\",stage=\"compute\"")),
+          serialize(registry.histogram("spacegame_request_seconds", 
+                    "route=\"" + route + "\",stage=\"serialize\"")),
+          compress(registry.histogram("spacegame_request_seconds", 
+                    "route=\"" + route + "\",stage=\"compress\"")),
+          logWait(registry.histogram("spacegame_request_seconds", 
+                    "route=\"" + route + "\",stage=\"log_wait\""))
+    { }
+
+    Counter& requests;
+    Counter& bytesSent;
+    Histogram& total;
+    Histogram& lockWait;
+    Histogram& compute;
+    Histogram& serialize;
+    Histogram& compress;
+    Histogram& logWait;
 };
 
 class GameEndpoint
 {
     public:
-        GameEndpoint(Address addr) 
-            : httpEndpoint(std::make_shared<Http::Endpoint>(addr))
+        /* When running as one of several shards, only game ids that hash to
+         * this shard are handed out */
+        GameEndpoint(Address addr, int shard = 0, int nShards = 1) 
+            : httpEndpoint(std::make_shared<Http::Endpoint>(addr)),
+              shard(shard), ring(nShards)
         { }
 
 		void init(size_t thr = 2) {
@@ -48,6 +288,141 @@ class GameEndpoint
 			setupRoutes();
 		}
 
+        /* Replies of at least this many bytes are compressed for clients that
+         * accept it, negative turns compression off */
+        void setCompressMinBytes(int n) {
+            compressMinBytes = n;
+        }
+
+        /* Let games be created with a computer player, which searches for
+         * thinkMs by default before each of its moves on one of threads
+         * threads. With no threads, requests for a bot are ignored */
+        void setBots(int threads, int thinkMs) {
+            botThinkMs = clamp(thinkMs, 1, MAX_BOT_THINK_MS);
+            if (threads > 0) {
+                botPool = make_unique<BotPool>(threads, metrics);
+            }
+        }
+
+        /* Run one in every validateEvery lockstep games on the server as well
+         * to check the actions in it, 0 for none. Which games are picked
+         * only depends on the game id */
+        void setLockstepValidation(int validateEvery) {
+            lockstepValidateEvery = validateEvery;
+        }
+
+        /* Record every game the server runs to a replay (see replay.h) in
+         * dir named after the game. Games that come back from the action log
+         * or hibernation carry on their recording. Lockstep games aren't
+         * recorded, the server doesn't run them. Call before setActionLog */
+        void setReplayDir(string dir) {
+            replayDir = dir;
+            std::filesystem::create_directories(dir);
+        }
+
+        // Shared with the router, see ROUTER_SECRET_HEADER
+        void setRouterSecret(string secret) {
+            routerSecret = secret;
+        }
+
+        /* Rebuild the games in the action log at path, then log every game
+         * created, seat taken, action performed and auto-pass policy set to
+         * it from now on. Players need to log in and join their games again,
+         * which gives them back their seats, and retries of actions that
+         * were performed before the restart are still skipped. Games the log
+         * has as hibernated are left to setHibernation, call it after this,
+         * see hasHibernatedGames */
+        void setActionLog(string path, bool sync) {
+            Timer timer;
+            auto recovered = ActionLog::recover(path);
+            int nActions = 0, nHibernated = 0;
+            for (auto& r : recovered) {
+                if (r.hibernated) {
+                    // The bot's player is found when it is restored
+                    hibernated[r.gameId] = {.seats = r.seats, .version = 0, 
+                        .botThinkMs = r.botThinkMs, .actionSeqs = r.actionSeqs, 
+                        .autoPass = r.autoPass};
+                    nHibernated++;
+                    continue;
+                }
+                auto game = make_shared<ActiveGame>();
+                game->state = move(r.state);
+                game->seats = move(r.seats);
+                game->botThinkMs = r.botThinkMs;
+                game->actionSeqs = move(r.actionSeqs);
+                game->autoPass = move(r.autoPass);
+                seatBot(*game);
+                // Carries on from about where it was rather than from 0,
+                // ETags from before the restart can't match anyway
+                game->version = game->state.changes.size();
+                game->lastUsed = steadyNow();
+                game->changeCount = game->state.changes.size();
+                game->checksum.reset(game->state);
+                changeLogEntries.add(game->state.changes.size());
+                openReplay(r.gameId, *game);
+                games[r.gameId] = game;
+                nActions += r.actions;
+            }
+            activeGames.add(recovered.size() - nHibernated);
+            LOG_INFO << "Recovered " << recovered.size() - nHibernated << " games (" << nActions 
+                << " actions) and " << nHibernated << " hibernated games from " << path 
+                << " in " << timer.get() << "s";
+            actionLog = make_unique<ActionLog>(path, sync);
+            // Only once there is a log for their moves to go to
+            for (auto& [gameId, game] : games) {
+                lock_guard<mutex> lk(game->m);
+                wakeBot(gameId, game);
+            }
+        }
+
+        /* Whether any games are only on disk, so the server can't go without
+         * setHibernation */
+        bool hasHibernatedGames() {
+            return hibernated.size();
+        }
+
+        /* Write games that haven't been used for idleSeconds to files in dir
+         * and drop them from memory, they come back on the next request for
+         * them. If maxResidentBytes isn't zero, the least recently used games
+         * are also hibernated early while the process is using more than
+         * that. Games hibernated by an earlier run are picked up from dir */
+        void setHibernation(string dir, int idleSeconds, size_t maxResidentBytes) {
+            hibernationDir = dir;
+            hibernateAfter = chrono::seconds(idleSeconds);
+            this->maxResidentBytes = maxResidentBytes;
+            std::filesystem::create_directories(dir);
+
+            for (auto& entry : std::filesystem::directory_iterator(dir)) {
+                if (entry.path().extension() != ".snap") {
+                    continue;
+                }
+                string gameId = entry.path().stem();
+                if (games.count(gameId)) {
+                    // Already rebuilt from the action log, which is newer
+                    std::filesystem::remove(entry.path());
+                    continue;
+                }
+                // The action log, if there is one, already has it with its
+                // seats
+                hibernated.insert({gameId, {.seats = {}, .version = 0, 
+                    .botThinkMs = 0, .actionSeqs = {}, .autoPass = {}}});
+            }
+            for (auto it = hibernated.begin(); it != hibernated.end();) {
+                if (not std::filesystem::exists(hibernationPath(it->first))) {
+                    LOG_ERROR << "Lost game " << it->first << ", the action log has it as hibernated but "
+                        << hibernationPath(it->first) << " is missing";
+                    lostGames.insert(it->first);
+                    it = hibernated.erase(it);
+                } else {
+                    it++;
+                }
+            }
+            hibernatedGames.add(hibernated.size());
+            LOG_INFO << "Found " << hibernated.size() << " hibernated games in " << dir;
+
+            hibernator = thread([this]{hibernateLoop();});
+        }
+
 		void start() {
 			httpEndpoint->setHandler(router.handler());
 			httpEndpoint->serve();
@@ -55,6 +430,14 @@ class GameEndpoint
 
 		void shutdown() {
 			httpEndpoint->shutdown();
+            if (hibernator.joinable()) {
+                {
+                    lock_guard<mutex> lk(gamesMutex);
+                    stopHibernating = true;
+                }
+                hibernateWake.notify_one();
+                hibernator.join();
+            }
 		}
 
 	private:
@@ -69,91 +452,344 @@ class GameEndpoint
 			Routes::Post(router, "/game/:gameid/getactions", Routes::bind(&GameEndpoint::getActions, this));
 			Routes::Post(router, "/game/:gameid/performaction", Routes::bind(&GameEndpoint::performAction, this));
 			Routes::Post(router, "/game/:gameid/changes/:changeNo", Routes::bind(&GameEndpoint::getChangesSince, this));
+			Routes::Post(router, "/game/:gameid/sync/:changeNo", Routes::bind(&GameEndpoint::sync, this));
+			Routes::Post(router, "/game/:gameid/spectate/:changeNo", Routes::bind(&GameEndpoint::spectate, this));
+			Routes::Post(router, "/game/:gameid/lockstep/:actionNo", Routes::bind(&GameEndpoint::lockstep, this));
+			Routes::Post(router, "/game/:gameid/autopass/:policy", Routes::bind(&GameEndpoint::setAutoPass, this));
+			Routes::Get(router, "/metrics", Routes::bind(&GameEndpoint::getMetrics, this));
+
+            metrics.gaugeFunction("spacegame_logged_in_users", 
+                    [this]{return sessions.size();}, "", "Sessions currently logged in");
 		}
 
-        pair<User&, string> getRequestData(string requestBody)
+        /* Sends data, compressed if it's large enough and the client accepts
+         * it. Shared replies pass in their cached body so they are only
+         * compressed once */
+        void sendAndRecord(const Rest::Request& request, Http::ResponseWriter& response,
+                RouteMetrics& routeMetrics, StageTimer& timer, const string& data,
+                const CachedBody* cached = nullptr)
+        {
+            string compressed;
+            auto& body = replyBody(request, response, routeMetrics, timer, data, compressed, cached);
+            sendRecorded(response, routeMetrics, timer, body);
+        }
+
+        /* The first half of sendAndRecord, for replies sent later: returns
+         * data or, having set the header, its compressed version, which is
+         * kept in compressed unless it is cached */
+        const string& replyBody(const Rest::Request& request, Http::ResponseWriter& response,
+                RouteMetrics& routeMetrics, StageTimer& timer, const string& data,
+                string& compressed, const CachedBody* cached = nullptr)
         {
-            stringstream ss;
-            ss << requestBody;
+            const string* body = &data;
+            if (compressMinBytes >= 0 and data.size() >= (size_t) compressMinBytes
+                    and acceptsCompressed(request)) {
+                const string* packed;
+                if (cached) {
+                    packed = &cached->compressed();
+                } else {
+                    compressed = compress(data);
+                    packed = &compressed;
+                }
+                routeMetrics.compress.observe(timer.lap());
+                // Data that doesn't compress is sent as it is
+                if (packed->size() < data.size()) {
+                    body = packed;
+                    response.headers().addRaw(Http::Header::Raw(COMPRESSION_HEADER, COMPRESSION_DEFLATE));
+                    compressedReplies.add();
+                    compressedSaved.add(data.size() - body->size());
+                }
+            }
+            return *body;
+        }
 
-            RequestData requestData;
-            {
-                cereal::PortableBinaryInputArchive iarchive(ss);
-                iarchive(requestData);
+        // The second half of sendAndRecord
+        void sendRecorded(Http::ResponseWriter& response, RouteMetrics& routeMetrics, 
+                StageTimer& timer, const string& body)
+        {
+            response.send(Http::Code::Ok, body);
+            routeMetrics.requests.add();
+            routeMetrics.bytesSent.add(body.size());
+            routeMetrics.total.observe(timer.total());
+        }
+
+        /* Reply once every action log record up to logSeq is on disk. So
+         * handler threads aren't held up by fsync, if it has to wait the
+         * reply is sent from the log's writer thread, which mustn't block,
+         * and it can't use the request. Without a log, or with nothing to
+         * wait for, it is sent straight away. If the log can't be written
+         * the client gets an error instead, what it did may not survive a
+         * restart */
+        void replyWhenDurable(uint64_t logSeq, Http::ResponseWriter response,
+                function<void(Http::ResponseWriter&)> reply)
+        {
+            if (not actionLog or not logSeq) {
+                reply(response);
+                return;
+            }
+            auto writer = make_shared<Http::ResponseWriter>(move(response));
+            actionLog->whenDurable(logSeq, [writer, reply](bool durable) {
+                if (durable) {
+                    reply(*writer);
+                } else {
+                    writer->send(Http::Code::Internal_Server_Error, "Could not save to the action log");
+                }
+            });
+        }
+
+        /* Returns the session of the user making the request, or nothing if
+         * the login token is unknown or expired */
+        optional<Session> getSession(const Rest::Request& request)
+        {
+            auto header = request.headers().tryGetRaw(LOGIN_TOKEN_HEADER);
+            string loginToken = header.isEmpty() ? "" : header.get().value();
+            auto session = sessions.getByToken(loginToken);
+            if (not session) {
+                LOG_ERROR << "Request with unknown login token: " << loginToken;
             }
-            // TODO handle incorrect token
-            auto& user = users[requestData.loginToken];
-            return {user, requestData.serializedData};
+            return session;
         };
 
-        void createGame(const Rest::Request& request, Http::ResponseWriter response) {
-            auto r = getRequestData(request.body());
-            auto& user = r.first;
+        /* Games that are being or have been hibernated are brought back
+         * here. Restoring happens under gamesMutex so two requests can't
+         * both restore the same game, it takes well under a millisecond */
+        shared_ptr<ActiveGame> findGame(const string& gameId)
+        {
+            lock_guard<mutex> lk(gamesMutex);
+            auto it = games.find(gameId);
+            if (it == games.end()) {
+                it = restoreGame(gameId);
+                if (it == games.end()) {
+                    return nullptr;
+                }
+            }
+            it->second->lastUsed = steadyNow();
+            return it->second;
+        }
 
-            string gameId = randString(8);
+        // Call with gamesMutex held
+        map<string, shared_ptr<ActiveGame>>::iterator restoreGame(const string& gameId)
+        {
+            auto evicting = hibernating.find(gameId);
+            if (evicting != hibernating.end()) {
+                // Still being written out, hibernateGame will notice it's
+                // back and remove the file
+                auto it = games.insert({gameId, evicting->second}).first;
+                hibernating.erase(evicting);
+                activeGames.add(1);
+                return it;
+            }
+            auto hibernatedIt = hibernated.find(gameId);
+            if (hibernatedIt == hibernated.end()) {
+                return games.end();
+            }
 
-            gameLocks[gameId];
-            {
-                lock_guard<mutex> lk(gameLocks[gameId]);
+            StageTimer timer;
+            auto path = hibernationPath(gameId);
+            optional<GameState> state;
+            try {
+                state = SnapshotArchive(path).load(gameId);
+            } catch (runtime_error& e) {
+                LOG_ERROR << "Could not restore game " << gameId << ": " << e.what();
+            }
+            if (not state) {
+                return games.end();
+            }
+            auto game = make_shared<ActiveGame>();
+            game->state = move(*state);
+            game->seats = hibernatedIt->second.seats;
+            game->version = hibernatedIt->second.version;
+            game->botThinkMs = hibernatedIt->second.botThinkMs;
+            game->actionSeqs = hibernatedIt->second.actionSeqs;
+            game->autoPass = hibernatedIt->second.autoPass;
+            seatBot(*game);
+            game->changeCount = game->state.changes.size();
+            game->checksum.reset(game->state);
+            changeLogEntries.add(game->state.changes.size());
+            openReplay(gameId, *game);
+            hibernated.erase(hibernatedIt);
+            if (actionLog) {
+                // The log carries on from here. The file is left until it is
+                // replaced by the next hibernation or a restart, in case the
+                // server dies before the snapshot is on disk
+                actionLog->appendSnapshot(gameId, game->state);
+            } else {
+                std::filesystem::remove(path);
+            }
 
-                ActiveGame newGame;
-                newGame.state.startGame();
-                games[gameId] = newGame;
+            activeGames.add(1);
+            hibernatedGames.add(-1);
+            gamesRestored.add();
+            restoreSeconds.observe(timer.total());
+            LOG_INFO << "Restored hibernated game " << gameId;
+            {
+                lock_guard<mutex> lk(game->m);
+                wakeBot(gameId, game);
+            }
+            return games.insert({gameId, game}).first;
+        }
 
-                addPlayerToGame(user, gameId);
+        void createGame(const Rest::Request& request, Http::ResponseWriter response) {
+            auto session = getSession(request);
+            if (not session) {
+                response.send(Http::Code::Forbidden, "");
+                return;
+            }
+            auto& user = *session;
+            bool lockstep = request.query().has("lockstep");
+            if (lockstep and request.query().has("bot")) {
+                response.send(Http::Code::Bad_Request, "Lockstep games can't have a bot");
+                return;
             }
 
-            pair<string, int> ret = {gameId, user.playerId};
-            stringstream ss;
+            auto game = make_shared<ActiveGame>();
+            game->lastUsed = steadyNow();
+            uint64_t logSeq = 0;
+            string gameId;
             {
-                cereal::PortableBinaryOutputArchive oarchive(ss);
-                oarchive(ret);
+                // The id is taken before anything is logged under it, and
+                // requests that find the game wait until it is set up
+                lock_guard<mutex> lk(game->m);
+                {
+                    lock_guard<mutex> gamesLock(gamesMutex);
+                    gameId = newGameId();
+                    games[gameId] = game;
+                }
+                game->state.startGame();
+                if (lockstep) {
+                    bool validate = lockstepValidateEvery > 0 
+                        and stableHash(gameId) % lockstepValidateEvery == 0;
+                    game->lockstep = make_unique<LockstepLog>(game->state, validate);
+                } else if (actionLog) {
+                    logSeq = actionLog->appendCreateGame(gameId);
+                }
+                game->changeCount = game->state.changes.size();
+                game->checksum.reset(game->state);
+                changeLogEntries.add(game->state.changes.size());
+                openReplay(gameId, *game);
+                logSeq = max(logSeq, addPlayerToGame(user, gameId, *game));
+                if (botPool and request.query().has("bot")) {
+                    logSeq = max(logSeq, addBotToGame(gameId, *game, request.query().get("bot").get()));
+                    wakeBot(gameId, game);
+                }
             }
+            activeGames.add(1);
+
+            pair<string, int> ret = {gameId, user.playerId};
 
             LOG_INFO << "Create new game with id: " << gameId;
-            response.send(Http::Code::Ok, ss.str());
+            replyWhenDurable(logSeq, move(response), [ret](Http::ResponseWriter& response) {
+                response.send(Http::Code::Ok, serialize(ret));
+            });
          }
 
-        void addPlayerToGame(User& user, string gameId) {
-            auto& game = games[gameId];
-            user.playerId = next(game.state.players.begin(), game.players.size())->id;
+        /* An id on this shard that no game has, in memory, hibernated or
+         * lost. Call with gamesMutex held */
+        string newGameId() {
+            string gameId = randString(8);
+            while (ring.shardFor(gameId) != shard or games.count(gameId) 
+                    or hibernating.count(gameId) or hibernated.count(gameId) 
+                    or lostGames.count(gameId)) {
+                gameId = randString(8);
+            }
+            return gameId;
+        }
+
+        /* The bot takes the next seat, which is marked with an empty
+         * username. thinkMs is how long it searches for each move, empty for
+         * the default. Call with game.m held, returns the sequence number of
+         * the seat in the action log, 0 if there is none */
+        uint64_t addBotToGame(const string& gameId, ActiveGame& game, const string& thinkMs) {
+            game.seats.push_back("");
+            seatBot(game);
+            game.botThinkMs = botThinkMs;
+            try {
+                if (thinkMs.size()) {
+                    game.botThinkMs = clamp(stoi(thinkMs), 1, MAX_BOT_THINK_MS);
+                }
+            } catch (logic_error& e) {
+                LOG_WARNING << "Ignoring bad bot think time: " << thinkMs;
+            }
+            if (actionLog and not game.lockstep) {
+                return actionLog->appendJoinGame(gameId, "", game.botThinkMs);
+            }
+            return 0;
+        }
+
+        // Find the bot's player from its seat, if the game has one
+        void seatBot(ActiveGame& game) {
+            auto seat = find(game.seats.begin(), game.seats.end(), "");
+            if (seat == game.seats.end() 
+                    or seat - game.seats.begin() >= (int) game.state.players.size()) {
+                return;
+            }
+            game.botPlayerId = next(game.state.players.begin(), seat - game.seats.begin())->id;
+            // No need to think when there is only one thing to do
+            game.autoPass[game.botPlayerId] = AUTO_PASS_FORCED;
+        }
+
+        /* A user joining again gets the seat they had, anyone else the next
+         * one. Call with game.m held, returns the sequence number of the
+         * seat in the action log, 0 if there is none or it was already
+         * taken */
+        uint64_t addPlayerToGame(Session& user, string gameId, ActiveGame& game) {
+            auto seat = find(game.seats.begin(), game.seats.end(), user.username);
+            uint64_t logSeq = 0;
+            if (seat == game.seats.end()) {
+                seat = game.seats.insert(seat, user.username);
+                if (actionLog and not game.lockstep) {
+                    logSeq = actionLog->appendJoinGame(gameId, user.username);
+                }
+            }
+            user.playerId = next(game.state.players.begin(), seat - game.seats.begin())->id;
             user.currentGame = gameId;
-            game.players.push_back(user);
+            sessions.joinedGame(user.sessionId, gameId, user.playerId);
+            return logSeq;
         }
 
         void joinGame(const Rest::Request& request, Http::ResponseWriter response) {
-            auto r = getRequestData(request.body());
-            auto& user = r.first;
+            auto session = getSession(request);
+            if (not session) {
+                response.send(Http::Code::Forbidden, "");
+                return;
+            }
+            auto& user = *session;
              auto gameId = request.param(":gameid").as<string>();
-            lock_guard<mutex> lk(gameLocks[gameId]);
+            auto game = findGame(gameId);
+            if (not game) {
+                response.send(Http::Code::Not_Found, "");
+                return;
+            }
+            lock_guard<mutex> lk(game->m);
 
-             addPlayerToGame(user, gameId);
+             uint64_t logSeq = addPlayerToGame(user, gameId, *game);
 
             pair<string, int> ret = {gameId, user.playerId};
-            stringstream ss;
-            {
-                cereal::PortableBinaryOutputArchive oarchive(ss);
-                oarchive(ret);
-            }
 
             LOG_INFO << "Player " << user.username << " joined game with id: " << gameId;
-            response.send(Http::Code::Ok, ss.str());
+            replyWhenDurable(logSeq, move(response), [ret](Http::ResponseWriter& response) {
+                response.send(Http::Code::Ok, serialize(ret));
+            });
          }
 
         void joinGameByPlayer(const Rest::Request& request, Http::ResponseWriter response) {
-            auto r = getRequestData(request.body());
-            auto& user = r.first;
+            auto session = getSession(request);
+            if (not session) {
+                response.send(Http::Code::Forbidden, "");
+                return;
+            }
+            auto& user = *session;
              auto usernameToJoin = request.param(":username").as<string>();
 
              string gameId;
-             for (auto pair : users) {
-                 auto userToken = pair.first;
-                 auto otherUser = pair.second;
-                 if (otherUser.username == usernameToJoin) {
-                     gameId = otherUser.currentGame;
-                    lock_guard<mutex> lk(gameLocks[gameId]);
-                     addPlayerToGame(user, gameId);
-                     break;
+             uint64_t logSeq = 0;
+             auto otherUser = sessions.getByUsername(usernameToJoin);
+             if (otherUser and otherUser->currentGame.size()) {
+                 auto game = findGame(otherUser->currentGame);
+                 if (game) {
+                     gameId = otherUser->currentGame;
+                     lock_guard<mutex> lk(game->m);
+                     logSeq = addPlayerToGame(user, gameId, *game);
                  }
              }
              if (not gameId.size()) {
@@ -165,74 +801,327 @@ class GameEndpoint
              }
 
             pair<string, int> ret = {gameId, user.playerId};
-            stringstream ss;
-            {
-                cereal::PortableBinaryOutputArchive oarchive(ss);
-                oarchive(ret);
-            }
 
             LOG_INFO << "Player " << user.username << " joined game with id: " << gameId;
-            response.send(Http::Code::Ok, ss.str());
+            replyWhenDurable(logSeq, move(response), [ret](Http::ResponseWriter& response) {
+                response.send(Http::Code::Ok, serialize(ret));
+            });
          }
 
          void getLoginToken(const Rest::Request& request, Http::ResponseWriter response) {
              // TODO some kind of auth check not currently logged in
              auto username = request.param(":username").as<string>();
              string playerToken = randString(8);
+
+             // When sharded the router picks the token and logs the user in
+             // on every shard with it. Clients can't pick their own, they
+             // don't know the secret
+             auto requestedToken = request.headers().tryGetRaw(LOGIN_TOKEN_HEADER);
+             auto secret = request.headers().tryGetRaw(ROUTER_SECRET_HEADER);
+             if (ring.size() > 1 and not requestedToken.isEmpty() and not secret.isEmpty()
+                     and sameSecret(secret.get().value(), routerSecret)) {
+                 auto token = requestedToken.get().value();
+                 if (token.size() and not sessions.getByToken(token)) {
+                     playerToken = token;
+                 }
+             }
              LOG_INFO << "Player " << username << " logged in";
-             User user = {
-                 .username = username,
-                 .loginToken = playerToken,
-             };
-             users[playerToken] = user;
+             sessions.login(username, playerToken);
              response.send(Http::Code::Ok, playerToken);
          }
 
+         /* Replies with the serialized state, leaving out the change log
+          * unless the history query parameter is given. The snapshot is only
+          * rebuilt when the game has changed since it was last requested, and
+          * a client that sends the ETag it already has in If-None-Match gets
+          * Not Modified back. X-Change-No gives the number of changes the
+          * snapshot includes, so changes after it can be applied on top */
          void getState(const Rest::Request& request, Http::ResponseWriter response) {
+            StageTimer timer;
             auto gameId = request.param(":gameid").as<string>();
-            lock_guard<mutex> lk(gameLocks[gameId]);
+            auto game = findGame(gameId);
+            if (not game) {
+                response.send(Http::Code::Not_Found, "");
+                return;
+            }
+            bool withHistory = request.query().has("history");
             LOG_INFO << "Got request for state for game id: " << gameId;
-            stringstream ss;
-            {
-                cereal::PortableBinaryOutputArchive oarchive(ss);
-                oarchive(games[gameId].state);
+
+            auto etag = stateETag(gameId, game->version, withHistory);
+            auto ifNoneMatch = request.headers().tryGetRaw("If-None-Match");
+            if (not ifNoneMatch.isEmpty() and ifNoneMatch.get().value() == etag) {
+                stateNotModified.add();
+                response.headers().addRaw(Http::Header::Raw("ETag", etag));
+                response.send(Http::Code::Not_Modified, "");
+                stateMetrics.requests.add();
+                stateMetrics.total.observe(timer.total());
+                return;
+            }
+
+            auto snapshot = getSnapshot(gameId, *game, withHistory, timer);
+            response.headers()
+                .addRaw(Http::Header::Raw("ETag", snapshot->etag))
+                .addRaw(Http::Header::Raw("X-Change-No", to_string(snapshot->changeNo)));
+            if (game->lockstep) {
+                response.headers().addRaw(Http::Header::Raw(LOCKSTEP_HEADER, "1"));
+            }
+            sendAndRecord(request, response, stateMetrics, timer, snapshot->data, snapshot.get());
+         }
+
+         shared_ptr<const StateSnapshot> getSnapshot(const string& gameId, ActiveGame& game,
+                 bool withHistory, StageTimer& timer) {
+            auto& cached = withHistory ? game.historySnapshot : game.snapshot;
+            auto snapshot = atomic_load(&cached);
+            if (snapshot and snapshot->version == game.version) {
+                stateCacheHits.add();
+                return snapshot;
+            }
+
+            lock_guard<mutex> lk(game.m);
+            stateMetrics.lockWait.observe(timer.lap());
+            // Another request may have rebuilt it while we waited
+            snapshot = atomic_load(&cached);
+            if (snapshot and snapshot->version == game.version) {
+                stateCacheHits.add();
+                return snapshot;
+            }
+            stateCacheMisses.add();
+
+            auto newSnapshot = make_shared<StateSnapshot>();
+            newSnapshot->version = game.version;
+            newSnapshot->changeNo = game.state.changes.size();
+            newSnapshot->etag = stateETag(gameId, newSnapshot->version, withHistory);
+
+            // Move the change log out of the way rather than copying the state
+            vector<Change> changes;
+            if (not withHistory) {
+                swap(changes, game.state.changes);
+            }
+            serializeInto(newSnapshot->data, game.state);
+            if (not withHistory) {
+                swap(changes, game.state.changes);
             }
-            response.send(Http::Code::Ok, ss.str());
+            stateMetrics.serialize.observe(timer.lap());
+
+            snapshot = newSnapshot;
+            atomic_store(&cached, snapshot);
+            return snapshot;
          }
 
          void getActions(const Rest::Request& request, Http::ResponseWriter response) {
-            auto r = getRequestData(request.body());
-            auto user = r.first;
+            auto session = getSession(request);
+            if (not session) {
+                response.send(Http::Code::Forbidden, "");
+                return;
+            }
+            auto& user = *session;
             auto gameId = request.param(":gameid").as<string>();
-            lock_guard<mutex> lk(gameLocks[gameId]);
+            auto game = findGame(gameId);
+            if (not game) {
+                response.send(Http::Code::Not_Found, "");
+                return;
+            }
+            StageTimer timer;
+            lock_guard<mutex> lk(game->m);
+            getActionsMetrics.lockWait.observe(timer.lap());
             LOG_INFO << "Got request for actions for game id: " << gameId << " from user: " << user.username;
 
-            vector<Action> actions = games[gameId].state.getPossibleActions(user.playerId);
-            stringstream ss;
-            {
-                cereal::PortableBinaryOutputArchive oarchive(ss);
-                oarchive(actions);
+            vector<Action> actions = game->state.getPossibleActions(user.playerId);
+            getActionsMetrics.compute.observe(timer.lap());
+            auto& data = threadBuffer();
+            if (wantsCompact(request)) {
+                encodeActions(data, actions);
+                markCompact(response);
+            } else {
+                serializeInto(data, actions);
             }
-            response.send(Http::Code::Ok, ss.str());
+            getActionsMetrics.serialize.observe(timer.lap());
+            sendAndRecord(request, response, getActionsMetrics, timer, data);
          }
 
+        /* Whether the action numbered seq from clientId hasn't been
+         * performed yet, if so it is marked as performed. Retried requests
+         * carry actions already performed. Call with game.m held */
+        bool newAction(ActiveGame& game, const string& clientId, uint64_t seq) {
+            if (not clientId.size()) {
+                return true;
+            }
+            auto& last = game.actionSeqs[clientId];
+            if (seq <= last) {
+                duplicateActions.add();
+                return false;
+            }
+            last = seq;
+            return true;
+        }
+
+        /* Perform an action, log it and bump the game's version. Actions
+         * from a client with an idempotency key are logged with their
+         * number from it. Call with game.m held. Returns the action's
+         * sequence number in the action log, to wait on before
+         * acknowledging it, or 0 if there is no log */
+        uint64_t applyAction(const string& gameId, ActiveGame& game, const Action& action,
+                const string& clientId = "", uint64_t actionSeq = 0) {
+            auto& state = game.state;
+            int nChanges = state.changes.size();
+            state.performAction(action);
+            game.checksum.stamp(state, nChanges);
+            if (game.replay) {
+                game.replay->add(action, state.changes.size() - nChanges, state);
+            }
+            uint64_t logSeq = actionLog ? actionLog->appendAction(gameId, action, clientId, actionSeq) : 0;
+            autoResolve(gameId, game, logSeq);
+            game.version++;
+            game.changeCount = state.changes.size();
+            changeLogEntries.add(state.changes.size() - nChanges);
+            return logSeq;
+        }
+
+        /* Perform the actions players have left to the server (see
+         * GameState::autoAction) until one of them has a choice to make.
+         * Each is logged as if the player had sent it, updating logSeq. Call
+         * with game.m held, returns how many were performed */
+        int autoResolve(const string& gameId, ActiveGame& game, uint64_t& logSeq) {
+            for (int performed = 0; performed < MAX_AUTO_ACTIONS; performed++) {
+                optional<Action> action;
+                for (auto& [playerId, policy] : game.autoPass) {
+                    action = game.state.autoAction(playerId, policy);
+                    if (action) {
+                        break;
+                    }
+                }
+                if (not action) {
+                    return performed;
+                }
+                LOG_DEBUG << "Performing: " << *action << " for the player";
+                int nChanges = game.state.changes.size();
+                game.state.performAction(*action);
+                game.checksum.stamp(game.state, nChanges);
+                if (game.replay) {
+                    game.replay->add(*action, game.state.changes.size() - nChanges, game.state);
+                }
+                if (actionLog) {
+                    logSeq = actionLog->appendAction(gameId, *action);
+                }
+                autoActions.add();
+            }
+            LOG_WARNING << "Game " << gameId << " is still going after " 
+                << MAX_AUTO_ACTIONS << " automatic actions";
+            return MAX_AUTO_ACTIONS;
+        }
+
+        /* Start or carry on recording a game if replays are on. A recording
+         * that doesn't end where the game is, eg. because replays were off
+         * for a while, is started again from here. Call with game.m held or
+         * before the game is shared */
+        void openReplay(const string& gameId, ActiveGame& game) {
+            if (replayDir.empty() or game.lockstep) {
+                return;
+            }
+            string path = replayDir + "/" + gameId + ".replay";
+            game.replay = ReplayWriter::resume(path);
+            if (game.replay and game.replay->getChangeCount() == (int) game.state.changes.size()) {
+                return;
+            }
+            if (game.replay) {
+                LOG_WARNING << "Replay of game " << gameId << " is out of date, starting it again";
+            }
+            try {
+                game.replay = make_unique<ReplayWriter>(path, game.state);
+            } catch (runtime_error& e) {
+                game.replay = nullptr;
+                LOG_ERROR << "Not recording game " << gameId << ": " << e.what();
+            }
+        }
+
+        /* Queue a move for the game's bot if it has something to do and
+         * isn't already thinking. Call with game->m held */
+        void wakeBot(const string& gameId, const shared_ptr<ActiveGame>& game) {
+            if (not game->botPlayerId or game->botThinking or not botPool
+                    or not game->state.getPossibleActions(game->botPlayerId).size()) {
+                return;
+            }
+            game->botThinking = true;
+            botPool->add([this, gameId, game]{botMove(gameId, game);});
+        }
+
+        /* Runs on the bot pool. Searches a copy of the game without holding
+         * its lock, and gives up if anything else changes the game in the
+         * meantime, then thinks again about the new state */
+        void botMove(const string& gameId, shared_ptr<ActiveGame> game) {
+            StageTimer timer;
+            GameState state;
+            uint64_t version;
+            {
+                lock_guard<mutex> lk(game->m);
+                state = game->state;
+                version = game->version;
+            }
+
+            SearchLimits limits;
+            limits.budget = chrono::milliseconds(game->botThinkMs);
+            limits.cancelled = [this, &game, version]{
+                return botPool->stopping() or game->version != version;
+            };
+            mt19937 rng(stableHash(gameId) + version);
+            auto result = searchAction(state, game->botPlayerId, limits, rng);
+            botPool->record(result, timer.total());
+
+            lock_guard<mutex> lk(game->m);
+            game->botThinking = false;
+            if (botPool->stopping()) {
+                return;
+            }
+            if (result.action and not result.cancelled and game->version == version) {
+                LOG_DEBUG << "Bot performing: " << *result.action << " in game: " << gameId;
+                applyAction(gameId, *game, *result.action);
+            }
+            wakeBot(gameId, game);
+        }
+
          void performAction(const Rest::Request& request, Http::ResponseWriter response) {
-            auto r = getRequestData(request.body());
-            auto user = r.first;
-            string serializedData = r.second;
+            auto session = getSession(request);
+            if (not session) {
+                response.send(Http::Code::Forbidden, "");
+                return;
+            }
+            auto& user = *session;
             auto gameId = request.param(":gameid").as<string>();
-            lock_guard<mutex> lk(gameLocks[gameId]);
-             LOG_INFO << "Got request from user: " << user.username << " to perform action for game id: " << gameId;
-            stringstream ss;
-            ss << serializedData;
-            Action action;
+            auto game = findGame(gameId);
+            if (not game) {
+                response.send(Http::Code::Not_Found, "");
+                return;
+            }
+            if (game->lockstep) {
+                response.send(Http::Code::Conflict, "Lockstep game, see /lockstep");
+                return;
+            }
+            StageTimer timer;
+            auto action = deserialize<Action>(request.body());
+            auto [clientId, actionSeq] = idempotencyKey(request);
+            performActionMetrics.serialize.observe(timer.lap());
+            uint64_t logSeq = 0;
             {
-                cereal::PortableBinaryInputArchive iarchive(ss);
-                iarchive(action);
+                lock_guard<mutex> lk(game->m);
+                performActionMetrics.lockWait.observe(timer.lap());
+                LOG_INFO << "Got request from user: " << user.username << " to perform action for game id: " << gameId;
+                if (newAction(*game, clientId, actionSeq)) {
+                    LOG_DEBUG << "Performing: " << action;
+                    logSeq = applyAction(gameId, *game, action, clientId, actionSeq);
+                    wakeBot(gameId, game);
+                }
+                performActionMetrics.compute.observe(timer.lap());
             }
-             LOG_DEBUG << "Performing: " << action;
-            games[gameId].state.performAction(action);
-            response.send(Http::Code::Ok, "");
+            // Only acknowledge the action once it is on disk
+            string compressed;
+            string body = replyBody(request, response, performActionMetrics, timer, "", compressed);
+            replyWhenDurable(logSeq, move(response), 
+                    [this, timer, body](Http::ResponseWriter& response) mutable {
+                if (actionLog) {
+                    performActionMetrics.logWait.observe(timer.lap());
+                }
+                sendRecorded(response, performActionMetrics, timer, body);
+            });
          }
 
          void getChangesSince(const Rest::Request& request, Http::ResponseWriter response) {
@@ -241,41 +1130,543 @@ class GameEndpoint
             LOG_INFO << "Got request for changes for game id: " << gameId 
                 << " since changeNo: " << changeNo;
 
-            lock_guard<mutex> lk(gameLocks[gameId]);
-            auto changes = games[gameId].state.getChangesAfter(changeNo);
+            auto game = findGame(gameId);
+            if (not game) {
+                response.send(Http::Code::Not_Found, "");
+                return;
+            }
+            StageTimer timer;
+            lock_guard<mutex> lk(game->m);
+            changesMetrics.lockWait.observe(timer.lap());
+            if (changeNo < 0 or changeNo > (int) game->state.changes.size()) {
+                response.send(Http::Code::Bad_Request, "No such change number");
+                return;
+            }
+            auto changes = game->state.getChangesAfter(changeNo);
             for (auto change : changes) {
                 LOG_DEBUG << "Sending: " << change;
             }
+            changesMetrics.compute.observe(timer.lap());
+
+            auto& data = threadBuffer();
+            if (wantsCompact(request)) {
+                encodeChanges(data, changes);
+                markCompact(response);
+            } else {
+                serializeInto(data, changes);
+            }
+            changesMetrics.serialize.observe(timer.lap());
+            sendAndRecord(request, response, changesMetrics, timer, data);
+         }
+
+         /* Perform any number of actions (possibly none), then return the
+          * changes since the given change number and the actions now
+          * available to the user, all under a single lock so the reply is
+          * consistent with the actions just taken. Some of the changes carry
+          * a checksum of the game (see RollingChecksum), so a client keeping
+          * its own copy of the game can check it */
+         void sync(const Rest::Request& request, Http::ResponseWriter response) {
+            auto session = getSession(request);
+            if (not session) {
+                response.send(Http::Code::Forbidden, "");
+                return;
+            }
+            auto& user = *session;
+            auto gameId = request.param(":gameid").as<string>();
+            auto changeNo = request.param(":changeNo").as<int>();
+            auto game = findGame(gameId);
+            if (not game) {
+                response.send(Http::Code::Not_Found, "");
+                return;
+            }
+            if (game->lockstep) {
+                response.send(Http::Code::Conflict, "Lockstep game, see /lockstep");
+                return;
+            }
 
-            // TODO actually implement this
-            stringstream ss;
+            StageTimer timer;
+            auto toPerform = deserialize<vector<Action>>(request.body());
+            auto [clientId, actionSeq] = idempotencyKey(request);
+            double deserializeTime = timer.lap();
+
+            SyncResponse ret;
+            uint64_t logSeq = 0;
             {
-                cereal::PortableBinaryOutputArchive oarchive(ss);
-                oarchive(changes);
+                lock_guard<mutex> lk(game->m);
+                syncMetrics.lockWait.observe(timer.lap());
+                auto& state = game->state;
+                if (changeNo < 0 or changeNo > (int) state.changes.size()) {
+                    response.send(Http::Code::Bad_Request, "No such change number");
+                    return;
+                }
+                for (auto& action : toPerform) {
+                    uint64_t seq = actionSeq++;
+                    if (not newAction(*game, clientId, seq)) {
+                        continue;
+                    }
+                    LOG_DEBUG << "Performing: " << action << " for user: " << user.username;
+                    logSeq = applyAction(gameId, *game, action, clientId, seq);
+                }
+                if (toPerform.size()) {
+                    wakeBot(gameId, game);
+                }
+                ret.changes = state.getChangesAfter(changeNo);
+                ret.actions = state.getPossibleActions(user.playerId);
+                syncMetrics.compute.observe(timer.lap());
             }
-            response.send(Http::Code::Ok, ss.str());
+
+            auto& data = threadBuffer();
+            if (wantsCompact(request)) {
+                encodeChangesAndActions(data, ret.changes, ret.actions);
+                markCompact(response);
+            } else {
+                serializeInto(data, ret);
+            }
+            syncMetrics.serialize.observe(deserializeTime + timer.lap());
+            // The reply is built while the actions are being written out
+            string compressed;
+            string body = replyBody(request, response, syncMetrics, timer, data, compressed);
+            replyWhenDurable(logSeq, move(response), 
+                    [this, timer, body, logSeq](Http::ResponseWriter& response) mutable {
+                if (logSeq) {
+                    syncMetrics.logWait.observe(timer.lap());
+                }
+                sendRecorded(response, syncMetrics, timer, body);
+            });
+         }
+
+         /* Lockstep games only, see lockstep.h. Adds the actions in the body,
+          * which the player took after seeing the first actionNo actions,
+          * compares the turn checksums sent with them, and replies with
+          * every action after actionNo. The game itself isn't touched unless
+          * it is one of those validated on the server */
+         void lockstep(const Rest::Request& request, Http::ResponseWriter response) {
+            auto session = getSession(request);
+            if (not session) {
+                response.send(Http::Code::Forbidden, "");
+                return;
+            }
+            auto gameId = request.param(":gameid").as<string>();
+            auto actionNo = request.param(":actionNo").as<int>();
+            auto game = findGame(gameId);
+            if (not game) {
+                response.send(Http::Code::Not_Found, "");
+                return;
+            }
+            if (not game->lockstep) {
+                response.send(Http::Code::Conflict, "Not a lockstep game");
+                return;
+            }
+
+            StageTimer timer;
+            LockstepRequest toAdd;
+            try {
+                toAdd = decodeLockstepRequest(request.body());
+            } catch (runtime_error& e) {
+                response.send(Http::Code::Bad_Request, e.what());
+                return;
+            }
+            double decodeTime = timer.lap();
+
+            auto& data = threadBuffer();
+            {
+                lock_guard<mutex> lk(game->m);
+                lockstepMetrics.lockWait.observe(timer.lap());
+                auto& log = *game->lockstep;
+                bool rejected = toAdd.actions.size() 
+                    and not log.append(session->playerId, actionNo, toAdd.actions);
+                log.check(toAdd.checksums);
+                log.writeReply(data, actionNo, rejected);
+                lockstepMetrics.compute.observe(timer.lap());
+            }
+            lockstepMetrics.serialize.observe(decodeTime);
+            sendAndRecord(request, response, lockstepMetrics, timer, data);
+         }
+
+         /* Set what the server does for the player without asking them, the
+          * policy is a logic::AutoPass. Anything it now covers is done
+          * straight away */
+         void setAutoPass(const Rest::Request& request, Http::ResponseWriter response) {
+            auto session = getSession(request);
+            auto gameId = request.param(":gameid").as<string>();
+            if (not session or session->currentGame != gameId) {
+                response.send(Http::Code::Forbidden, "");
+                return;
+            }
+            auto policy = request.param(":policy").as<int>();
+            if (policy < AUTO_PASS_NEVER or policy > AUTO_PASS_FORCED) {
+                response.send(Http::Code::Bad_Request, "Unknown policy");
+                return;
+            }
+            auto game = findGame(gameId);
+            if (not game) {
+                response.send(Http::Code::Not_Found, "");
+                return;
+            }
+            if (game->lockstep) {
+                response.send(Http::Code::Conflict, "Lockstep games are run by the players");
+                return;
+            }
+
+            uint64_t logSeq = 0;
+            {
+                lock_guard<mutex> lk(game->m);
+                game->autoPass[session->playerId] = (AutoPass) policy;
+                if (actionLog) {
+                    logSeq = actionLog->appendAutoPass(gameId, session->playerId, (AutoPass) policy);
+                }
+                int nChanges = game->state.changes.size();
+                if (autoResolve(gameId, *game, logSeq)) {
+                    game->version++;
+                    game->changeCount = game->state.changes.size();
+                    changeLogEntries.add(game->state.changes.size() - nChanges);
+                    wakeBot(gameId, game);
+                }
+            }
+            replyWhenDurable(logSeq, move(response), [](Http::ResponseWriter& response) {
+                response.send(Http::Code::Ok, "");
+            });
+         }
+
+         /* Changes since changeNo for someone watching the game, no login is
+          * needed. Every spectator at the same change number is sent the same
+          * frame. The first request that needs it serializes it, and
+          * concurrent requests for it wait and then share it. X-Change-No
+          * gives the change number the reply goes up to */
+         void spectate(const Rest::Request& request, Http::ResponseWriter response) {
+            StageTimer timer;
+            auto gameId = request.param(":gameid").as<string>();
+            auto changeNo = request.param(":changeNo").as<int>();
+            auto game = findGame(gameId);
+            if (not game) {
+                response.send(Http::Code::Not_Found, "");
+                return;
+            }
+            // Checked before making a frame, each from leaves one behind
+            if (changeNo < 0 or changeNo > game->changeCount) {
+                response.send(Http::Code::Bad_Request, "No such change number");
+                return;
+            }
+
+            bool compact = wantsCompact(request);
+            auto frame = getFrame(*game, changeNo, compact, timer);
+            response.headers().addRaw(Http::Header::Raw("X-Change-No", to_string(frame->to)));
+            if (compact) {
+                markCompact(response);
+            }
+            sendAndRecord(request, response, spectateMetrics, timer, frame->data, frame.get());
+         }
+
+         shared_ptr<const ChangeFrame> getFrame(ActiveGame& game, int from, bool compact,
+                 StageTimer& timer) {
+            auto& frames = game.frames[compact];
+            auto& latestFrame = game.latest[compact];
+            int to = max<int>(from, game.changeCount);
+            auto latest = atomic_load(&latestFrame);
+            if (latest and latest->from == from and latest->to == to) {
+                return latest;
+            }
+
+            lock_guard<mutex> lk(game.feedMutex);
+            spectateMetrics.lockWait.observe(timer.lap());
+            auto& cached = frames[from];
+            cached.lastUsed = ++game.frameUses;
+            to = max<int>(from, game.changeCount);
+            if (cached.frame and cached.frame->to >= to) {
+                return cached.frame;
+            }
+
+            auto newFrame = make_shared<ChangeFrame>();
+            newFrame->from = from;
+            vector<Change> changes;
+            {
+                lock_guard<mutex> gameLock(game.m);
+                if (from < game.state.changes.size()) {
+                    changes = game.state.getChangesAfter(from);
+                }
+            }
+            newFrame->to = from + changes.size();
+            newFrame->data = compact ? encodeChanges(changes) : serialize(changes);
+            spectateMetrics.serialize.observe(timer.lap());
+            spectatorFrames.add();
+
+            cached.frame = newFrame;
+            latest = atomic_load(&latestFrame);
+            if (not latest or newFrame->to >= latest->to) {
+                atomic_store(&latestFrame, cached.frame);
+            }
+            // Every from has a frame of its own up to the newest change, so
+            // without a limit spectators asking for many of them would keep
+            // them all. The one just made is the most recently used
+            if (frames.size() > MAX_SPECTATOR_FRAMES) {
+                frames.erase(min_element(frames.begin(), frames.end(), 
+                            [](auto& a, auto& b) {return a.second.lastUsed < b.second.lastUsed;}));
+            }
+            return newFrame;
+         }
+
+        string hibernationPath(const string& gameId) {
+            return hibernationDir + "/" + gameId + ".snap";
+        }
+
+        void hibernateLoop() {
+            auto interval = min<chrono::steady_clock::duration>(hibernateAfter / 4, 
+                    chrono::seconds(10));
+            unique_lock<mutex> lk(gamesMutex);
+            while (not stopHibernating) {
+                hibernateWake.wait_for(lk, interval);
+                if (stopHibernating) {
+                    break;
+                }
+                lk.unlock();
+                hibernateIdleGames();
+                lk.lock();
+            }
+        }
+
+        void hibernateIdleGames() {
+            int64_t idleBefore = steadyNow() 
+                - chrono::duration_cast<chrono::steady_clock::duration>(hibernateAfter).count();
+            vector<pair<int64_t, string>> byLastUse;
+            {
+                lock_guard<mutex> lk(gamesMutex);
+                for (auto& [gameId, game] : games) {
+                    byLastUse.push_back({game->lastUsed, gameId});
+                }
+            }
+            sort(byLastUse.begin(), byLastUse.end());
+
+            size_t i = 0;
+            for (; i < byLastUse.size() and byLastUse[i].first < idleBefore; i++) {
+                hibernateGame(byLastUse[i].second);
+            }
+            if (i) {
+                malloc_trim(0);
+            }
+
+            // Over the high-watermark, hibernate the least recently used
+            // games a tenth at a time until back under it
+            while (maxResidentBytes and i < byLastUse.size() 
+                    and residentBytes() > maxResidentBytes) {
+                size_t batchEnd = min(byLastUse.size(), i + max<size_t>(byLastUse.size() / 10, 1));
+                for (; i < batchEnd; i++) {
+                    hibernateGame(byLastUse[i].second);
+                }
+                malloc_trim(0);
+                memoryHibernations.add();
+            }
+        }
+
+        void hibernateGame(const string& gameId) {
+            shared_ptr<ActiveGame> game;
+            {
+                lock_guard<mutex> lk(gamesMutex);
+                auto it = games.find(gameId);
+                // Games are left alone while a request is using them, the
+                // map holds the only other reference. Lockstep games stay in
+                // memory, snapshots have nowhere to keep their actions
+                if (it == games.end() or it->second.use_count() > 1 or it->second->lockstep) {
+                    return;
+                }
+                game = it->second;
+                hibernating[gameId] = game;
+                games.erase(it);
+                activeGames.add(-1);
+            }
+
+            StageTimer timer;
+            HibernatedGame info;
+            bool written = false;
+            {
+                lock_guard<mutex> lk(game->m);
+                info = {
+                    .seats = game->seats, 
+                    .version = game->version,
+                    .botThinkMs = game->botThinkMs,
+                    .actionSeqs = game->actionSeqs,
+                    .autoPass = game->autoPass,
+                };
+                try {
+                    SnapshotWriter writer;
+                    writer.add(gameId, game->state);
+                    // On disk before the action log says it is
+                    writer.write(hibernationPath(gameId), actionLog and actionLog->syncing());
+                    written = true;
+                } catch (runtime_error& e) {
+                    LOG_ERROR << "Could not hibernate game " << gameId << ": " << e.what();
+                }
+            }
+
+            lock_guard<mutex> lk(gamesMutex);
+            auto it = hibernating.find(gameId);
+            if (it == hibernating.end()) {
+                // Requested while it was being written, it's back in games
+                std::filesystem::remove(hibernationPath(gameId));
+                return;
+            }
+            hibernating.erase(it);
+            if (not written) {
+                games[gameId] = game;
+                activeGames.add(1);
+                return;
+            }
+            // Closed here so the recording is all on disk before the game
+            // can be restored and carry it on
+            game->replay.reset();
+            hibernated[gameId] = info;
+            if (actionLog) {
+                actionLog->appendHibernated(gameId);
+            }
+            changeLogEntries.add(-(int64_t) game->changeCount);
+            hibernatedGames.add(1);
+            gamesHibernated.add();
+            hibernateSeconds.observe(timer.total());
+        }
+
+         void getMetrics(const Rest::Request& request, Http::ResponseWriter response) {
+            response.send(Http::Code::Ok, metrics.render());
          }
 
 	    std::shared_ptr<Http::Endpoint> httpEndpoint;
 		Rest::Router router;
 
-        map<string, mutex> gameLocks;
-        map<string, ActiveGame> games;
-        map<string, User> users;
+        int shard;
+        ShardRing ring;
+        string routerSecret;
+        int compressMinBytes = DEFAULT_COMPRESS_MIN_BYTES;
+        int botThinkMs = DEFAULT_BOT_THINK_MS;
+        int lockstepValidateEvery = DEFAULT_LOCKSTEP_VALIDATE_EVERY;
+        string replayDir;
+
+        string hibernationDir;
+        chrono::seconds hibernateAfter{0};
+        size_t maxResidentBytes = 0;
+        thread hibernator;
+        condition_variable hibernateWake;
+        bool stopHibernating = false;
+
+        // Guards the maps only, each game has its own lock
+        mutex gamesMutex;
+        map<string, shared_ptr<ActiveGame>> games;
+        // Games being written out to disk, and games only on disk
+        map<string, shared_ptr<ActiveGame>> hibernating;
+        map<string, HibernatedGame> hibernated;
+        // Games the action log has that couldn't be brought back, their ids
+        // aren't given out again
+        set<string> lostGames;
+        SessionService sessions;
+
+        MetricsRegistry metrics;
+        RouteMetrics stateMetrics{metrics, "/state"};
+        RouteMetrics getActionsMetrics{metrics, "/getactions"};
+        RouteMetrics performActionMetrics{metrics, "/performaction"};
+        RouteMetrics changesMetrics{metrics, "/changes"};
+        RouteMetrics syncMetrics{metrics, "/sync"};
+        RouteMetrics spectateMetrics{metrics, "/spectate"};
+        RouteMetrics lockstepMetrics{metrics, "/lockstep"};
+        Counter& compressedReplies = metrics.counter("spacegame_compressed_replies_total", 
+                "", "Replies sent compressed");
+        Counter& compressedSaved = metrics.counter("spacegame_compression_saved_bytes_total", 
+                "", "Bytes saved by compressing replies");
+        Counter& spectatorFrames = metrics.counter("spacegame_spectator_frames_total", 
+                "", "Change frames serialized for spectators");
+        Counter& duplicateActions = metrics.counter("spacegame_duplicate_actions_total", 
+                "", "Actions skipped as they had already been performed");
+        Counter& autoActions = metrics.counter("spacegame_auto_actions_total", 
+                "", "Actions performed for players by their auto-pass policy");
+        Counter& stateCacheHits = metrics.counter("spacegame_state_snapshots_total", 
+                "result=\"hit\"", "State requests by how the snapshot was found");
+        Counter& stateCacheMisses = metrics.counter("spacegame_state_snapshots_total", 
+                "result=\"miss\"");
+        Counter& stateNotModified = metrics.counter("spacegame_state_snapshots_total", 
+                "result=\"not_modified\"");
+        Gauge& activeGames = metrics.gauge("spacegame_active_games", 
+                "", "Games currently held in memory");
+        Gauge& changeLogEntries = metrics.gauge("spacegame_change_log_entries", 
+                "", "Total length of the change logs of all active games");
+        Gauge& hibernatedGames = metrics.gauge("spacegame_hibernated_games", 
+                "", "Games written to disk and dropped from memory");
+        Counter& gamesHibernated = metrics.counter("spacegame_hibernations_total", 
+                "", "Games hibernated");
+        Counter& gamesRestored = metrics.counter("spacegame_restores_total", 
+                "", "Hibernated games brought back into memory");
+        Counter& memoryHibernations = metrics.counter("spacegame_memory_hibernations_total", 
+                "", "Batches of games hibernated early for being over the memory high-watermark");
+        Histogram& hibernateSeconds = metrics.histogram("spacegame_hibernate_seconds", 
+                "", "Time to write a game to disk");
+        Histogram& restoreSeconds = metrics.histogram("spacegame_restore_seconds", 
+                "", "Time to bring a hibernated game back");
+
+        // Replies waiting for it use the metrics, so it goes before them
+        unique_ptr<ActionLog> actionLog;
+        // Declared last so it's stopped before anything its jobs use goes away
+        unique_ptr<BotPool> botPool;
 };
 
-int main() {
-    remove("server.log");
-    plog::init(plog::debug, "server.log");
+int main(int argc, char **argv) {
+    cxxopts::Options opts("server", "Spacegame server");
+    opts.add_options()
+        ("p,port", "Port to listen on", cxxopts::value<int>()->default_value("40000"))
+        ("t,threads", "Number of request handling threads", cxxopts::value<int>()->default_value("2"))
+        ("shard", "Which shard this server is when running behind a router", cxxopts::value<int>()->default_value("0"))
+        ("shards", "Total number of shards", cxxopts::value<int>()->default_value("1"))
+        ("compress-min-bytes", "Compress replies of at least this size for clients that accept it, -1 to turn off", 
+            cxxopts::value<int>()->default_value(to_string(DEFAULT_COMPRESS_MIN_BYTES)))
+        ("action-log", "Log actions to this file, and recover the games in it on startup", 
+            cxxopts::value<string>()->default_value(""))
+        ("action-log-no-sync", "Don't fsync the action log, only survives the server crashing")
+        ("hibernate-dir", "Write idle games to this directory and drop them from memory", 
+            cxxopts::value<string>()->default_value(""))
+        ("hibernate-after", "Seconds a game must be idle before it is hibernated", 
+            cxxopts::value<int>()->default_value("600"))
+        ("max-rss-mb", "Hibernate the least recently used games early while using more memory than this, 0 for no limit", 
+            cxxopts::value<size_t>()->default_value("0"))
+        ("bot-threads", "Threads for computer players, 0 to turn them off", 
+            cxxopts::value<int>()->default_value("2"))
+        ("bot-think-ms", "How long computer players think about each move, unless the game asks for something else", 
+            cxxopts::value<int>()->default_value(to_string(DEFAULT_BOT_THINK_MS)))
+        ("lockstep-validate-every", "Run one in this many lockstep games on the server too, to check their actions, 0 for none", 
+            cxxopts::value<int>()->default_value(to_string(DEFAULT_LOCKSTEP_VALIDATE_EVERY)))
+        ("replay-dir", "Record every game to a replay in this directory", 
+            cxxopts::value<string>()->default_value(""))
+        ("l,logfile", "Log output location", cxxopts::value<string>()->default_value("server.log"))
+        ;
+    auto result = opts.parse(argc, argv);
+
+    string logfile = result["logfile"].as<string>();
+    remove(logfile.c_str());
+    plog::init(plog::debug, logfile.c_str());
     LOG_INFO << "Starting server";
 
-    Port port(40000);
+    Port port(result["port"].as<int>());
 
-    int thr = 2;
+    int thr = result["threads"].as<int>();
 
     Address addr(Ipv4::any(), port);
 
-    GameEndpoint games(addr);
+    GameEndpoint games(addr, result["shard"].as<int>(), result["shards"].as<int>());
+    const char* routerSecret = getenv(ROUTER_SECRET_ENV);
+    games.setRouterSecret(routerSecret ? routerSecret : "");
+    games.setCompressMinBytes(result["compress-min-bytes"].as<int>());
+    games.setBots(result["bot-threads"].as<int>(), result["bot-think-ms"].as<int>());
+    games.setLockstepValidation(result["lockstep-validate-every"].as<int>());
+    if (result["replay-dir"].as<string>().size()) {
+        games.setReplayDir(result["replay-dir"].as<string>());
+    }
+    if (result["action-log"].as<string>().size()) {
+        games.setActionLog(result["action-log"].as<string>(), 
+                not result.count("action-log-no-sync"));
+    }
+    if (result["hibernate-dir"].as<string>().empty() and games.hasHibernatedGames()) {
+        string error = "The action log has hibernated games, start with the --hibernate-dir they are in";
+        LOG_FATAL << error;
+        cerr << error << endl;
+        return 1;
+    }
+    if (result["hibernate-dir"].as<string>().size()) {
+        games.setHibernation(result["hibernate-dir"].as<string>(),
+                result["hibernate-after"].as<int>(), result["max-rss-mb"].as<size_t>() << 20);
+    }
     games.init(thr);
     games.start();
     
@@ -0,0 +1,114 @@
+#include "sessions.h"
+
+#include <plog/Log.h>
+
+using namespace std;
+
+SessionService::SessionService(chrono::steady_clock::duration timeout,
+        Clock clock)
+    : timeout(timeout), clock(clock), lastCollection(clock())
+{ }
+
+Session SessionService::login(string username, string loginToken)
+{
+    lock_guard<mutex> lk(m);
+    auto now = clock();
+    collectExpiredIfDue(now);
+
+    Session session = {
+        .sessionId = nextSessionId++,
+        .username = username,
+        .loginToken = loginToken,
+        .lastSeen = now,
+    };
+    // Still in the game the old session was in
+    auto previous = byUsername.find(username);
+    if (previous != byUsername.end()) {
+        auto& old = sessions.at(previous->second);
+        session.playerId = old.playerId;
+        session.currentGame = old.currentGame;
+    }
+    sessions[session.sessionId] = session;
+    byToken[loginToken] = session.sessionId;
+    byUsername[username] = session.sessionId;
+    return session;
+}
+
+optional<Session> SessionService::getByToken(const string& loginToken)
+{
+    lock_guard<mutex> lk(m);
+    auto it = byToken.find(loginToken);
+    if (it == byToken.end()) {
+        return {};
+    }
+    auto& session = sessions.at(it->second);
+    session.lastSeen = clock();
+    return session;
+}
+
+optional<Session> SessionService::getByUsername(const string& username)
+{
+    lock_guard<mutex> lk(m);
+    auto it = byUsername.find(username);
+    if (it == byUsername.end()) {
+        return {};
+    }
+    auto& session = sessions.at(it->second);
+    session.lastSeen = clock();
+    return session;
+}
+
+void SessionService::joinedGame(int sessionId, string gameId, int playerId)
+{
+    lock_guard<mutex> lk(m);
+    auto it = sessions.find(sessionId);
+    if (it == sessions.end()) {
+        LOG_ERROR << "Session " << sessionId << " joined a game after expiring";
+        return;
+    }
+    it->second.currentGame = gameId;
+    it->second.playerId = playerId;
+}
+
+void SessionService::collectExpired()
+{
+    lock_guard<mutex> lk(m);
+    lastCollection = {};
+    collectExpiredIfDue(clock());
+}
+
+size_t SessionService::size()
+{
+    lock_guard<mutex> lk(m);
+    return sessions.size();
+}
+
+// Only scan for expired sessions every so often so that logins stay O(1)
+// amortized. Must be called with the lock held.
+void SessionService::collectExpiredIfDue(chrono::steady_clock::time_point now)
+{
+    if (now - lastCollection < timeout / 4) {
+        return;
+    }
+    lastCollection = now;
+
+    int nCollected = 0;
+    for (auto it = sessions.begin(); it != sessions.end(); ) {
+        auto& session = it->second;
+        if (now - session.lastSeen < timeout) {
+            it++;
+            continue;
+        }
+        byToken.erase(session.loginToken);
+        // The username may have logged in again since, keep the newer session
+        auto userIt = byUsername.find(session.username);
+        if (userIt != byUsername.end() and userIt->second == session.sessionId) {
+            byUsername.erase(userIt);
+        }
+        it = sessions.erase(it);
+        nCollected++;
+    }
+    if (nCollected) {
+        LOG_INFO << "Collected " << nCollected << " expired sessions";
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef SESSIONS_H
+#define SESSIONS_H
+
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <optional>
+#include <functional>
+#include <unordered_map>
+
+/* A logged in user. Sessions are referred to internally by their sessionId,
+ * the loginToken and username are only used to look them up
+ */
+struct Session
+{
+    int sessionId = 0;
+    std::string username;
+    std::string loginToken;
+    int playerId = 0;
+    std::string currentGame;
+    std::chrono::steady_clock::time_point lastSeen;
+};
+
+/* Keeps track of all logged in users, indexed both by login token and by
+ * username so that neither lookup needs to scan every session.
+ *
+ * Sessions that have not been used for longer than the timeout are dropped.
+ * Time is read from clock, which tests can replace to expire sessions without
+ * sleeping.
+ * All functions are safe to call from multiple server threads, and lookups
+ * return copies so callers never hold references into the index.
+ */
+class SessionService
+{
+    public:
+        using Clock = std::function<std::chrono::steady_clock::time_point()>;
+
+        SessionService(std::chrono::steady_clock::duration timeout
+                = std::chrono::hours(2),
+                Clock clock = std::chrono::steady_clock::now);
+
+        /* Create a new session. If the user was already logged in the old
+         * token stays valid until it expires, but username lookups will
+         * return the new session, which carries on in the same game as the
+         * same player */
+        Session login(std::string username, std::string loginToken);
+
+        /* Lookups count as activity and keep the session alive */
+        std::optional<Session> getByToken(const std::string& loginToken);
+        std::optional<Session> getByUsername(const std::string& username);
+
+        /* Record that a session has joined a game as the given player */
+        void joinedGame(int sessionId, std::string gameId, int playerId);
+
+        /* Remove all sessions that have been idle for longer than the timeout
+         */
+        void collectExpired();
+
+        size_t size();
+
+    private:
+        void collectExpiredIfDue(std::chrono::steady_clock::time_point now);
+
+        std::mutex m;
+        std::chrono::steady_clock::duration timeout;
+        Clock clock;
+        std::chrono::steady_clock::time_point lastCollection;
+
+        int nextSessionId = 1;
+        std::unordered_map<int, Session> sessions;
+        std::unordered_map<std::string, int> byToken;
+        std::unordered_map<std::string, int> byUsername;
+};
+
+#endif
@@ -0,0 +1,45 @@
+#include "sharding.h"
+
+#include <algorithm>
+
+using namespace std;
+
+uint64_t stableHash(const string& s)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : s) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    // Finish by mixing the bits, FNV alone spreads similar short keys badly
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+ShardRing::ShardRing(int nShards, int pointsPerShard) : nShards(nShards)
+{
+    for (int shard = 0; shard < nShards; shard++) {
+        for (int i = 0; i < pointsPerShard; i++) {
+            auto position = stableHash("shard" + to_string(shard) + "-" + to_string(i));
+            points.push_back({position, shard});
+        }
+    }
+    sort(points.begin(), points.end());
+}
+
+int ShardRing::shardFor(const string& key) const
+{
+    if (nShards <= 1) {
+        return 0;
+    }
+    pair<uint64_t, int> position = {stableHash(key), 0};
+    auto it = lower_bound(points.begin(), points.end(), position);
+    if (it == points.end()) {
+        it = points.begin();
+    }
+    return it->second;
+}
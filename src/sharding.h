@@ -0,0 +1,32 @@
+#ifndef SHARDING_H
+#define SHARDING_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+/* FNV-1a with a final mix, used wherever a hash needs to be the same in
+ * every process
+ */
+uint64_t stableHash(const std::string& s);
+
+/* Consistent hash ring mapping game ids to shards. Each shard is placed on
+ * the ring many times so games are spread evenly, and growing the number
+ * of shards only moves the games that land on the new shard.
+ */
+class ShardRing
+{
+    public:
+        ShardRing(int nShards, int pointsPerShard = 64);
+
+        int shardFor(const std::string& key) const;
+        int size() const {return nShards;};
+
+    private:
+        int nShards;
+        // Sorted by position on the ring, pairs of position, shard
+        std::vector<std::pair<uint64_t, int>> points;
+};
+
+#endif
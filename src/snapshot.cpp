@@ -0,0 +1,564 @@
+#include "snapshot.h"
+
+#include "wireformat.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+using namespace logic;
+
+#define BYTE_ORDER_MARK 0x01020304
+
+namespace {
+    size_t align8(size_t n)
+    {
+        return (n + 7) & ~size_t(7);
+    }
+
+    uint32_t checksum(const char* data, size_t size)
+    {
+        return crc32(crc32(0, nullptr, 0), (const Bytef*) data, size);
+    }
+
+    // Collects the arrays of one game while it is being flattened
+    struct GameBuilder
+    {
+        vector<FlatPlayer> players;
+        vector<FlatShip> ships;
+        vector<FlatSystem> systems;
+        vector<FlatBeacon> beacons;
+        vector<FlatCard> cards;
+        vector<int32_t> ints;
+        string chars;
+
+        FlatRange addString(const string& s)
+        {
+            FlatRange r = {uint32_t(chars.size()), uint32_t(s.size())};
+            chars += s;
+            return r;
+        }
+
+        template <class C>
+        FlatRange addInts(const C& values)
+        {
+            FlatRange r = {uint32_t(ints.size()), uint32_t(values.size())};
+            for (auto v : values) {
+                ints.push_back(v);
+            }
+            return r;
+        }
+
+        FlatResources resources(const ResourceAmount& amount)
+        {
+            FlatResources r = {};
+            for (auto [type, n] : amount) {
+                r.present |= 1 << type;
+                r.amount[type] = n;
+            }
+            return r;
+        }
+
+        FlatShip ship(const Ship& s)
+        {
+            return {
+                .id = s.id,
+                .type = addString(s.type),
+                .attack = s.attack,
+                .shield = s.shield,
+                .armour = s.armour,
+                .movement = s.movement,
+                .owner = s.owner,
+                .controller = s.controller,
+                .curSystemId = s.curSystemId,
+                .kind = s.kind,
+            };
+        }
+
+        FlatCard card(const Card& c)
+        {
+            FlatCard f = {
+                .id = c.id,
+                .name = addString(c.name),
+                .cardText = addString(c.cardText),
+                .cost = resources(c.cost),
+                .provides = resources(c.provides),
+                .type = c.type,
+                .playedBy = c.playedBy,
+                .ownerId = c.ownerId,
+                .targets = addInts(c.targets),
+                .hasCreates = c.creates.has_value(),
+                .creates = {},
+                .howManyCreated = c.howManyCreated,
+            };
+            if (c.creates) {
+                f.creates = ship(*c.creates);
+            }
+            return f;
+        }
+
+        // Cards added together are next to each other in the card array
+        FlatRange addCards(const list<Card>& toAdd)
+        {
+            FlatRange r = {uint32_t(cards.size()), uint32_t(toAdd.size())};
+            for (auto& c : toAdd) {
+                cards.push_back(card(c));
+            }
+            return r;
+        }
+    };
+
+    template <class T>
+    FlatRange placeArray(string& out, const T* items, size_t count)
+    {
+        size_t offset = align8(out.size());
+        out.resize(offset + count * sizeof(T));
+        if (count) {
+            memcpy(&out[offset], items, count * sizeof(T));
+        }
+        return {uint32_t(offset), uint32_t(count)};
+    }
+
+    template <class T>
+    FlatRange placeArray(string& out, const vector<T>& items)
+    {
+        return placeArray(out, items.data(), items.size());
+    }
+
+    void checkRange(FlatRange r, uint32_t limit, const char* what)
+    {
+        if (r.begin > limit or r.count > limit - r.begin) {
+            throw runtime_error(string("Snapshot has a bad range of ") + what);
+        }
+    }
+}
+
+string flattenGame(const GameState& state, bool withHistory)
+{
+    GameBuilder b;
+    FlatGame game = {};
+    game.whoseTurn = state.turnInfo.whoseTurn;
+    game.activePlayer = state.turnInfo.activePlayer;
+    game.phase = b.addInts(state.turnInfo.phase);
+    game.nextObjectId = state.nextObjectId;
+    game.nChanges = withHistory ? state.changes.size() : 0;
+
+    for (auto& p : state.players) {
+        FlatPlayer f = {
+            .id = p.id,
+            .name = b.addString(p.name),
+            .resources = b.resources(p.resources),
+            .deck = b.addCards(p.deck),
+            .hand = b.addCards(p.hand),
+            .discard = b.addCards(p.discard),
+            .flagshipId = p.flagshipId,
+            .playedResourceShipThisTurn = p.playedResourceShipThisTurn,
+        };
+        b.players.push_back(f);
+    }
+    game.players = {0, uint32_t(b.players.size())};
+    for (auto& s : state.ships) {
+        b.ships.push_back(b.ship(s));
+    }
+    game.ships = {0, uint32_t(b.ships.size())};
+    for (auto& s : state.systems) {
+        b.systems.push_back({
+            .id = s.id,
+            .controllerId = s.controllerId,
+            .home = s.home,
+            .i = s.i,
+            .j = s.j,
+            .adjacent = b.addInts(s.adjacent),
+        });
+    }
+    game.systems = {0, uint32_t(b.systems.size())};
+    for (auto& w : state.beacons) {
+        b.beacons.push_back({.id = w.id, .ownerId = w.ownerId, .systemId = w.systemId});
+    }
+    game.beacons = {0, uint32_t(b.beacons.size())};
+    game.stack = b.addCards(state.stack);
+
+    string out(sizeof(FlatGame), '\0');
+    game.playerArray = placeArray(out, b.players);
+    game.shipArray = placeArray(out, b.ships);
+    game.systemArray = placeArray(out, b.systems);
+    game.beaconArray = placeArray(out, b.beacons);
+    game.cardArray = placeArray(out, b.cards);
+    game.intArray = placeArray(out, b.ints);
+    game.charArray = placeArray(out, b.chars.data(), b.chars.size());
+    string changes = withHistory ? encodeChanges(state.changes) : "";
+    game.changeBytes = placeArray(out, changes.data(), changes.size());
+    out.resize(align8(out.size()));
+
+    game.size = out.size();
+    memcpy(&out[0], &game, sizeof(FlatGame));
+    game.crc = checksum(&out[8], out.size() - 8);
+    memcpy(&out[0], &game, sizeof(FlatGame));
+    return out;
+}
+
+FlatGameView::FlatGameView(const char* data, size_t size)
+    : data(data), header(reinterpret_cast<const FlatGame*>(data))
+{
+    validate(size);
+}
+
+void FlatGameView::validate(size_t size) const
+{
+    if (size < sizeof(FlatGame) or header->size != size) {
+        throw runtime_error("Snapshot game has the wrong size");
+    }
+    if (checksum(data + 8, size - 8) != header->crc) {
+        throw runtime_error("Snapshot game is corrupt");
+    }
+
+    // Each array must be aligned for its records and inside the game
+    auto checkArray = [&](FlatRange r, size_t itemSize, size_t align, const char* what) {
+        if (r.begin % align or r.begin < sizeof(FlatGame)
+                or r.begin > size or r.count > (size - r.begin) / itemSize) {
+            throw runtime_error(string("Snapshot has a bad array of ") + what);
+        }
+    };
+    auto& g = *header;
+    checkArray(g.playerArray, sizeof(FlatPlayer), alignof(FlatPlayer), "players");
+    checkArray(g.shipArray, sizeof(FlatShip), alignof(FlatShip), "ships");
+    checkArray(g.systemArray, sizeof(FlatSystem), alignof(FlatSystem), "systems");
+    checkArray(g.beaconArray, sizeof(FlatBeacon), alignof(FlatBeacon), "beacons");
+    checkArray(g.cardArray, sizeof(FlatCard), alignof(FlatCard), "cards");
+    checkArray(g.intArray, sizeof(int32_t), alignof(int32_t), "ints");
+    checkArray(g.charArray, 1, 1, "chars");
+    checkArray(g.changeBytes, 1, 1, "changes");
+
+    uint32_t nChars = g.charArray.count;
+    uint32_t nInts = g.intArray.count;
+    uint32_t nCards = g.cardArray.count;
+    checkRange(g.phase, nInts, "phases");
+    checkRange(g.players, g.playerArray.count, "players");
+    checkRange(g.ships, g.shipArray.count, "ships");
+    checkRange(g.systems, g.systemArray.count, "systems");
+    checkRange(g.beacons, g.beaconArray.count, "beacons");
+    checkRange(g.stack, nCards, "cards");
+
+    auto phases = array<int32_t>(g.intArray) + g.phase.begin;
+    for (uint32_t i = 0; i < g.phase.count; i++) {
+        if (phases[i] < PHASE_UPKEEP or phases[i] > PHASE_RESOLVE_STACK) {
+            throw runtime_error("Snapshot has an unknown phase");
+        }
+    }
+    auto checkShip = [&](const FlatShip& s) {
+        checkRange(s.type, nChars, "chars");
+        if (s.kind < SHIP_NORMAL or s.kind > SHIP_FLAGSHIP) {
+            throw runtime_error("Snapshot has an unknown ship kind");
+        }
+    };
+    auto ships = array<FlatShip>(g.shipArray);
+    for (uint32_t i = 0; i < g.shipArray.count; i++) {
+        checkShip(ships[i]);
+    }
+    auto cards = array<FlatCard>(g.cardArray);
+    for (uint32_t i = 0; i < nCards; i++) {
+        auto& c = cards[i];
+        checkRange(c.name, nChars, "chars");
+        checkRange(c.cardText, nChars, "chars");
+        checkRange(c.targets, nInts, "ints");
+        if (c.type < CARD_SHIP or c.type > CARD_STRUCTURE) {
+            throw runtime_error("Snapshot has an unknown card type");
+        }
+        if (c.hasCreates) {
+            checkShip(c.creates);
+        }
+    }
+    auto players = array<FlatPlayer>(g.playerArray);
+    for (uint32_t i = 0; i < g.playerArray.count; i++) {
+        checkRange(players[i].name, nChars, "chars");
+        checkRange(players[i].deck, nCards, "cards");
+        checkRange(players[i].hand, nCards, "cards");
+        checkRange(players[i].discard, nCards, "cards");
+    }
+    auto systems = array<FlatSystem>(g.systemArray);
+    for (uint32_t i = 0; i < g.systemArray.count; i++) {
+        checkRange(systems[i].adjacent, nInts, "ints");
+    }
+}
+
+GameState FlatGameView::toGameState(bool withHistory) const
+{
+    auto& g = *header;
+    auto ints = array<int32_t>(g.intArray);
+    auto allCards = array<FlatCard>(g.cardArray);
+
+    auto resources = [](const FlatResources& r) {
+        ResourceAmount amount;
+        for (int type = 0; type <= RESOURCE_INFLUENCE; type++) {
+            if (r.present & (1 << type)) {
+                amount[ResourceType(type)] = r.amount[type];
+            }
+        }
+        return amount;
+    };
+    auto intVector = [&](FlatRange r) {
+        return vector<int>(ints + r.begin, ints + r.begin + r.count);
+    };
+    auto ship = [&](const FlatShip& f) {
+        Ship s;
+        s.id = f.id;
+        s.type = str(f.type);
+        s.attack = f.attack;
+        s.shield = f.shield;
+        s.armour = f.armour;
+        s.movement = f.movement;
+        s.owner = f.owner;
+        s.controller = f.controller;
+        s.curSystemId = f.curSystemId;
+        s.kind = ShipKind(f.kind);
+        bindCallbacks(s);
+        return s;
+    };
+    auto cards = [&](FlatRange r) {
+        list<Card> out;
+        for (uint32_t i = r.begin; i < r.begin + r.count; i++) {
+            auto& f = allCards[i];
+            Card c;
+            c.id = f.id;
+            c.name = str(f.name);
+            c.cardText = str(f.cardText);
+            c.cost = resources(f.cost);
+            c.provides = resources(f.provides);
+            c.type = CardType(f.type);
+            c.playedBy = f.playedBy;
+            c.ownerId = f.ownerId;
+            c.targets = intVector(f.targets);
+            if (f.hasCreates) {
+                c.creates = ship(f.creates);
+            }
+            c.howManyCreated = f.howManyCreated;
+            bindCallbacks(c);
+            out.push_back(move(c));
+        }
+        return out;
+    };
+
+    GameState state;
+    state.turnInfo.whoseTurn = g.whoseTurn;
+    state.turnInfo.activePlayer = g.activePlayer;
+    for (auto phase : intVector(g.phase)) {
+        state.turnInfo.phase.push_back(TurnPhases(phase));
+    }
+    state.nextObjectId = g.nextObjectId;
+
+    auto players = array<FlatPlayer>(g.playerArray);
+    for (uint32_t i = g.players.begin; i < g.players.begin + g.players.count; i++) {
+        auto& f = players[i];
+        Player p;
+        p.id = f.id;
+        p.name = str(f.name);
+        p.resources = resources(f.resources);
+        p.deck = cards(f.deck);
+        p.hand = cards(f.hand);
+        p.discard = cards(f.discard);
+        p.flagshipId = f.flagshipId;
+        p.playedResourceShipThisTurn = f.playedResourceShipThisTurn;
+        state.players.push_back(move(p));
+    }
+    auto ships = array<FlatShip>(g.shipArray);
+    for (uint32_t i = g.ships.begin; i < g.ships.begin + g.ships.count; i++) {
+        state.ships.push_back(ship(ships[i]));
+    }
+    auto systems = array<FlatSystem>(g.systemArray);
+    for (uint32_t i = g.systems.begin; i < g.systems.begin + g.systems.count; i++) {
+        auto& f = systems[i];
+        System s;
+        s.id = f.id;
+        s.controllerId = f.controllerId;
+        s.home = f.home;
+        s.i = f.i;
+        s.j = f.j;
+        s.adjacent = intVector(f.adjacent);
+        state.systems.push_back(move(s));
+    }
+    auto beacons = array<FlatBeacon>(g.beaconArray);
+    for (uint32_t i = g.beacons.begin; i < g.beacons.begin + g.beacons.count; i++) {
+        WarpBeacon w;
+        w.id = beacons[i].id;
+        w.ownerId = beacons[i].ownerId;
+        w.systemId = beacons[i].systemId;
+        state.beacons.push_back(w);
+    }
+    state.stack = cards(g.stack);
+
+    if (withHistory) {
+        state.changes = decodeChanges(string(array<char>(g.changeBytes), g.changeBytes.count));
+    }
+    return state;
+}
+
+void SnapshotWriter::add(const string& gameId, const GameState& state)
+{
+    if (gameId.size() > SNAPSHOT_MAX_ID) {
+        throw runtime_error("Game id too long for a snapshot: " + gameId);
+    }
+    games.push_back({gameId, flattenGame(state)});
+}
+
+void SnapshotWriter::write(const string& path, bool sync)
+{
+    // Later games replace earlier ones with the same id
+    stable_sort(games.begin(), games.end(),
+            [](auto& a, auto& b) {return a.first < b.first;});
+    vector<pair<string, string>*> unique;
+    for (auto& game : games) {
+        if (unique.size() and unique.back()->first == game.first) {
+            unique.back() = &game;
+        } else {
+            unique.push_back(&game);
+        }
+    }
+
+    vector<SnapshotIndexEntry> index;
+    uint64_t offset = align8(sizeof(SnapshotHeader));
+    for (auto game : unique) {
+        SnapshotIndexEntry entry = {};
+        strncpy(entry.gameId, game->first.c_str(), SNAPSHOT_MAX_ID);
+        entry.offset = offset;
+        entry.size = game->second.size();
+        index.push_back(entry);
+        offset += align8(entry.size);
+    }
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.nGames = index.size();
+    header.indexOffset = offset;
+    header.fileSize = offset + index.size() * sizeof(SnapshotIndexEntry);
+
+    // Written beside the old archive and moved over it, so readers that
+    // have the old one mapped keep a complete copy
+    string tmpPath = path + ".tmp";
+    {
+        ofstream ofs(tmpPath, ios::binary | ios::trunc);
+        const string padding(8, '\0');
+        ofs.write((const char*) &header, sizeof(header));
+        ofs.write(padding.data(), align8(sizeof(header)) - sizeof(header));
+        for (auto game : unique) {
+            ofs.write(game->second.data(), game->second.size());
+            ofs.write(padding.data(), align8(game->second.size()) - game->second.size());
+        }
+        ofs.write((const char*) index.data(), index.size() * sizeof(SnapshotIndexEntry));
+        if (not ofs) {
+            throw runtime_error("Could not write snapshot " + tmpPath);
+        }
+    }
+    if (sync) {
+        int fd = open(tmpPath.c_str(), O_RDONLY);
+        if (fd < 0 or fsync(fd) != 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw runtime_error("Could not sync snapshot " + tmpPath);
+        }
+        close(fd);
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        throw runtime_error("Could not move snapshot into place at " + path);
+    }
+    if (sync) {
+        string dir = path.substr(0, path.find_last_of('/') + 1);
+        int fd = open(dir.size() ? dir.c_str() : ".", O_RDONLY | O_DIRECTORY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+}
+
+SnapshotArchive::SnapshotArchive(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("Could not open snapshot " + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 or st.st_size < (off_t) sizeof(SnapshotHeader)) {
+        close(fd);
+        throw runtime_error("Snapshot " + path + " is too small");
+    }
+    mappedSize = st.st_size;
+    void* mapped = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        throw runtime_error("Could not map snapshot " + path);
+    }
+    data = (const char*) mapped;
+    header = reinterpret_cast<const SnapshotHeader*>(data);
+    index = reinterpret_cast<const SnapshotIndexEntry*>(data + header->indexOffset);
+
+    auto fail = [&](string why) {
+        munmap((void*) data, mappedSize);
+        throw runtime_error("Snapshot " + path + " " + why);
+    };
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        fail("is not a snapshot");
+    }
+    if (header->version != SNAPSHOT_VERSION) {
+        fail("is version " + to_string(header->version) + ", expected "
+                + to_string(SNAPSHOT_VERSION));
+    }
+    if (header->byteOrder != BYTE_ORDER_MARK) {
+        fail("was written on a machine with a different byte order");
+    }
+    if (header->fileSize != mappedSize or header->indexOffset % 8
+            or header->indexOffset > mappedSize
+            or header->nGames != (mappedSize - header->indexOffset) / sizeof(SnapshotIndexEntry)) {
+        fail("is truncated or has a bad index");
+    }
+    for (size_t i = 0; i < header->nGames; i++) {
+        auto& entry = index[i];
+        if (entry.gameId[SNAPSHOT_MAX_ID] != '\0' or entry.offset % 8
+                or entry.offset < sizeof(SnapshotHeader) or entry.offset > header->indexOffset
+                or entry.size > header->indexOffset - entry.offset
+                or (i and strcmp(index[i - 1].gameId, entry.gameId) >= 0)) {
+            fail("has a bad index entry");
+        }
+    }
+}
+
+SnapshotArchive::~SnapshotArchive()
+{
+    munmap((void*) data, mappedSize);
+}
+
+FlatGameView SnapshotArchive::game(size_t i) const
+{
+    return FlatGameView(data + index[i].offset, index[i].size);
+}
+
+optional<FlatGameView> SnapshotArchive::find(const string& gameId) const
+{
+    auto end = index + header->nGames;
+    auto it = lower_bound(index, end, gameId,
+            [](const SnapshotIndexEntry& e, const string& id) {return e.gameId < id;});
+    if (it == end or it->gameId != gameId) {
+        return nullopt;
+    }
+    return game(it - index);
+}
+
+optional<GameState> SnapshotArchive::load(const string& gameId, bool withHistory) const
+{
+    auto view = find(gameId);
+    if (not view) {
+        return nullopt;
+    }
+    return view->toGameState(withHistory);
+}
@@ -0,0 +1,227 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <utility>
+#include <optional>
+
+#include "logic.h"
+#include "nocopy.h"
+
+/* A binary save format for whole game states, made to be memory mapped.
+ *
+ * An archive holds any number of games. It starts with a header, then the
+ * games one after another, then an index of game ids sorted so a game can be
+ * found by binary search without touching the others. Each game is a
+ * FlatGame header followed by arrays of fixed size records (players, ships,
+ * cards, ...). Records refer to each other and to their strings and id lists
+ * by position in those arrays rather than by pointer, so a game can be read
+ * in place straight out of the mapping. Opening an archive only checks the
+ * header and index, each game is checked (sizes, ranges, crc32) when a view
+ * of it is made.
+ *
+ * Unlike the cereal archives this keeps everything performAction needs: ship
+ * kind and owner are stored, and the card and ship callbacks, which can't be
+ * saved, are taken from the definition of the same name when loading. The
+ * change log is stored in the compact wire encoding.
+ *
+ * Numbers are stored in host byte order, the header records which that is
+ * and archives from a machine with the other order are rejected. Bump
+ * SNAPSHOT_VERSION whenever a record changes.
+ */
+
+#define SNAPSHOT_MAGIC "SGSNAP\r\n"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_MAX_ID 23
+
+// Position and length of a run of items in one of a game's arrays
+struct FlatRange
+{
+    uint32_t begin;
+    uint32_t count;
+};
+
+// Which resource types are present, and their amounts
+struct FlatResources
+{
+    uint32_t present;
+    int32_t amount[RESOURCE_INFLUENCE + 1];
+};
+
+struct FlatShip
+{
+    int32_t id;
+    FlatRange type;     // in chars
+    int32_t attack;
+    int32_t shield;
+    int32_t armour;
+    int32_t movement;
+    int32_t owner;
+    int32_t controller;
+    int32_t curSystemId;
+    int32_t kind;
+};
+
+struct FlatCard
+{
+    int32_t id;
+    FlatRange name;     // in chars
+    FlatRange cardText; // in chars
+    FlatResources cost;
+    FlatResources provides;
+    int32_t type;
+    int32_t playedBy;
+    int32_t ownerId;
+    FlatRange targets;  // in ints
+    int32_t hasCreates;
+    FlatShip creates;
+    int32_t howManyCreated;
+};
+
+struct FlatPlayer
+{
+    int32_t id;
+    FlatRange name;     // in chars
+    FlatResources resources;
+    FlatRange deck;     // in cards
+    FlatRange hand;     // in cards
+    FlatRange discard;  // in cards
+    int32_t flagshipId;
+    int32_t playedResourceShipThisTurn;
+};
+
+struct FlatSystem
+{
+    int32_t id;
+    int32_t controllerId;
+    int32_t home;
+    int32_t i;
+    int32_t j;
+    FlatRange adjacent; // in ints
+};
+
+struct FlatBeacon
+{
+    int32_t id;
+    int32_t ownerId;
+    int32_t systemId;
+};
+
+/* Start of each game. The arrays' ranges are byte offsets from the start of
+ * the FlatGame and item counts */
+struct FlatGame
+{
+    uint32_t size;      // of the whole game in bytes
+    uint32_t crc;       // of everything after this field
+    int32_t whoseTurn;
+    int32_t activePlayer;
+    FlatRange phase;    // in ints
+    int32_t nextObjectId;
+    uint32_t nChanges;
+    FlatRange players;  // in players
+    FlatRange ships;    // in ships
+    FlatRange systems;  // in systems
+    FlatRange beacons;  // in beacons
+    FlatRange stack;    // in cards
+
+    // The arrays
+    FlatRange playerArray;
+    FlatRange shipArray;
+    FlatRange systemArray;
+    FlatRange beaconArray;
+    FlatRange cardArray;
+    FlatRange intArray;
+    FlatRange charArray;
+    FlatRange changeBytes;
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder; // 0x01020304 as written
+    uint64_t nGames;
+    uint64_t indexOffset;
+    uint64_t fileSize;
+};
+
+struct SnapshotIndexEntry
+{
+    char gameId[SNAPSHOT_MAX_ID + 1];
+    uint64_t offset;
+    uint64_t size;
+};
+
+/* Flatten a game into the bytes that go into an archive, the change log is
+ * left out unless withHistory is set */
+std::string flattenGame(const logic::GameState& state, bool withHistory = true);
+
+/* A game in the flat format, read in place. The bytes must outlive it and
+ * stay 8 byte aligned. The constructor checks the game is complete and
+ * consistent and throws std::runtime_error if not */
+class FlatGameView
+{
+    public:
+        FlatGameView(const char* data, size_t size);
+
+        const FlatGame& game() const {return *header;};
+
+        template <class T>
+        const T* array(FlatRange r) const {
+            return reinterpret_cast<const T*>(data + r.begin);
+        };
+        std::string str(FlatRange r) const {
+            return std::string(array<char>(header->charArray) + r.begin, r.count);
+        };
+
+        /* Build a GameState from the view. The change log is only decoded
+         * if withHistory is set */
+        logic::GameState toGameState(bool withHistory = true) const;
+
+    private:
+        void validate(size_t size) const;
+
+        const char* data;
+        const FlatGame* header;
+};
+
+// Writes a new archive to path, replacing any that is there
+class SnapshotWriter
+{
+    public:
+        void add(const std::string& gameId, const logic::GameState& state);
+        // If sync is set the archive is on disk, not just written, on return
+        void write(const std::string& path, bool sync = false);
+
+    private:
+        std::vector<std::pair<std::string, std::string>> games;
+};
+
+// A memory mapped archive
+class SnapshotArchive : non_copyable
+{
+    public:
+        // Throws std::runtime_error if the file isn't a usable archive
+        SnapshotArchive(const std::string& path);
+        ~SnapshotArchive();
+
+        size_t size() const {return header->nGames;};
+        std::string gameId(size_t i) const {return index[i].gameId;};
+
+        std::optional<FlatGameView> find(const std::string& gameId) const;
+        FlatGameView game(size_t i) const;
+
+        // Load a game, nullopt if the archive doesn't have it
+        std::optional<logic::GameState> load(const std::string& gameId,
+                bool withHistory = true) const;
+
+    private:
+        const char* data = nullptr;
+        size_t mappedSize = 0;
+        const SnapshotHeader* header;
+        const SnapshotIndexEntry* index;
+};
+
+#endif
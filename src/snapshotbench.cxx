@@ -0,0 +1,127 @@
+#include "logic.h"
+#include "bytestream.h"
+#include "randomplay.h"
+#include "snapshot.h"
+
+#include <cxxopts.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+using namespace logic;
+
+/* Saves many random games to a snapshot archive and times opening it and
+ * loading games from it, next to loading the same games from cereal's binary
+ * and JSON archives
+ */
+
+template <class F>
+double timeUs(F f)
+{
+    auto start = chrono::steady_clock::now();
+    f();
+    chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+    cxxopts::Options opts("snapshotbench", "Snapshot archive load times");
+    opts.add_options()
+        ("g,games", "Games in the archive", cxxopts::value<int>()->default_value("2000"))
+        ("a,actions", "Random actions played in each game", cxxopts::value<int>()->default_value("20"))
+        ("f,file", "Where to put the archive", cxxopts::value<string>()->default_value("snapshotbench.snap"))
+        ;
+    auto result = opts.parse(argc, argv);
+    int nGames = result["games"].as<int>();
+    string path = result["file"].as<string>();
+
+    vector<string> ids;
+    vector<GameState> states;
+    for (int i = 0; i < nGames; i++) {
+        states.push_back(randomGame(i, result["actions"].as<int>()));
+        ids.push_back("game" + to_string(i));
+    }
+
+    double writeUs = timeUs([&]{
+        SnapshotWriter writer;
+        for (int i = 0; i < nGames; i++) {
+            writer.add(ids[i], states[i]);
+        }
+        writer.write(path);
+    });
+
+    optional<SnapshotArchive> archive;
+    double openUs = timeUs([&]{archive.emplace(path);});
+
+    double findUs = timeUs([&]{
+        for (auto& id : ids) {
+            archive->find(id);
+        }
+    });
+    double loadUs = timeUs([&]{
+        for (auto& id : ids) {
+            archive->load(id);
+        }
+    });
+    double loadNoHistoryUs = timeUs([&]{
+        for (auto& id : ids) {
+            archive->load(id, false);
+        }
+    });
+
+    vector<string> binary, json;
+    size_t binaryBytes = 0, jsonBytes = 0;
+    for (auto& state : states) {
+        binary.push_back(serialize(state));
+        binaryBytes += binary.back().size();
+        stringstream ss;
+        {
+            cereal::JSONOutputArchive oarchive(ss);
+            oarchive(state);
+        }
+        json.push_back(ss.str());
+        jsonBytes += json.back().size();
+    }
+    double binaryUs = timeUs([&]{
+        for (auto& data : binary) {
+            deserialize<GameState>(data);
+        }
+    });
+    double jsonUs = timeUs([&]{
+        for (auto& data : json) {
+            stringstream ss(data);
+            cereal::JSONInputArchive iarchive(ss);
+            GameState state;
+            iarchive(state);
+        }
+    });
+
+    FILE* f = fopen(path.c_str(), "rb");
+    fseek(f, 0, SEEK_END);
+    long snapshotBytes = ftell(f);
+    fclose(f);
+
+    cout << fixed << setprecision(2);
+    cout << nGames << " games, archive " << snapshotBytes / 1024 << " KiB (cereal binary "
+         << binaryBytes / 1024 << " KiB, JSON " << jsonBytes / 1024 << " KiB)" << endl;
+    cout << "write archive           " << setw(10) << writeUs / 1000 << " ms" << endl;
+    cout << "open archive            " << setw(10) << openUs << " us" << endl;
+    cout << left << setw(24) << "per game" << right << setw(10) << "us" << endl;
+    auto row = [&](string name, double us) {
+        cout << left << setw(24) << name << right << setw(10) << us / nGames << endl;
+    };
+    row("find + validate", findUs);
+    row("load", loadUs);
+    row("load, no history", loadNoHistoryUs);
+    row("cereal binary", binaryUs);
+    row("cereal JSON", jsonUs);
+
+    archive.reset();
+    remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,508 @@
+#include "statediff.h"
+
+#include "wireformat.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+using namespace logic;
+
+namespace {
+    bool sameResources(const ResourceAmount& a, const ResourceAmount& b)
+    {
+        return a.size() == b.size() and equal(a.begin(), a.end(), b.begin());
+    }
+
+    // Unlike the wire format's, owner and kind count too
+    bool sameShip(const Ship& a, const Ship& b)
+    {
+        return a.id == b.id and a.type == b.type and a.attack == b.attack
+            and a.shield == b.shield and a.armour == b.armour
+            and a.movement == b.movement and a.owner == b.owner
+            and a.controller == b.controller and a.curSystemId == b.curSystemId
+            and a.kind == b.kind;
+    }
+
+    bool sameSystem(const System& a, const System& b)
+    {
+        return a.id == b.id and a.controllerId == b.controllerId and a.home == b.home
+            and a.i == b.i and a.j == b.j and a.adjacent == b.adjacent;
+    }
+
+    bool sameBeacon(const WarpBeacon& a, const WarpBeacon& b)
+    {
+        return a.id == b.id and a.ownerId == b.ownerId and a.systemId == b.systemId;
+    }
+
+    bool sameCard(const Card& a, const Card& b)
+    {
+        return a.id == b.id and a.name == b.name and a.cardText == b.cardText
+            and sameResources(a.cost, b.cost) and sameResources(a.provides, b.provides)
+            and a.type == b.type and a.playedBy == b.playedBy and a.ownerId == b.ownerId
+            and a.targets == b.targets and a.howManyCreated == b.howManyCreated
+            and a.creates.has_value() == b.creates.has_value()
+            and (not a.creates or sameShip(*a.creates, *b.creates));
+    }
+
+    // Each player's deck, hand and discard, then the stack. See ZoneEdit
+    template <class G>
+    auto cardZones(G& state)
+    {
+        vector<decltype(&state.stack)> zones;
+        for (auto& player : state.players) {
+            zones.push_back(&player.deck);
+            zones.push_back(&player.hand);
+            zones.push_back(&player.discard);
+        }
+        zones.push_back(&state.stack);
+        return zones;
+    }
+
+    template <class T>
+    vector<int> ids(const list<T>& objects)
+    {
+        vector<int> ret;
+        for (auto& o : objects) {
+            ret.push_back(o.id);
+        }
+        return ret;
+    }
+
+    template <class T, class Same>
+    void diffObjects(const list<T>& from, const list<T>& to, Same same,
+            vector<T>& changed, vector<int>& removed, vector<int>& order)
+    {
+        unordered_map<int, const T*> before;
+        for (auto& o : from) {
+            before[o.id] = &o;
+        }
+        unordered_set<int> after;
+        for (auto& o : to) {
+            after.insert(o.id);
+            auto it = before.find(o.id);
+            if (it == before.end() or not same(*it->second, o)) {
+                changed.push_back(o);
+            }
+        }
+
+        // Patching keeps the objects that are left in place and adds new
+        // ones on the end. Only if that isn't the target's order is it sent
+        vector<int> patched;
+        for (auto& o : from) {
+            if (after.count(o.id)) {
+                patched.push_back(o.id);
+            } else {
+                removed.push_back(o.id);
+            }
+        }
+        for (auto& o : to) {
+            if (not before.count(o.id)) {
+                patched.push_back(o.id);
+            }
+        }
+        auto target = ids(to);
+        if (patched != target) {
+            order = target;
+        }
+    }
+
+    template <class T>
+    bool patchObjects(list<T>& objects, const vector<T>& changed,
+            const vector<int>& removed, const vector<int>& order)
+    {
+        auto byId = [&objects](int id) {
+            return find_if(objects.begin(), objects.end(), [id](const T& o) {return o.id == id;});
+        };
+        for (int id : removed) {
+            auto it = byId(id);
+            if (it == objects.end()) {
+                return false;
+            }
+            objects.erase(it);
+        }
+        for (auto& o : changed) {
+            auto it = byId(o.id);
+            if (it == objects.end()) {
+                objects.push_back(o);
+            } else {
+                *it = o;
+            }
+        }
+        if (order.size()) {
+            if (order.size() != objects.size()) {
+                return false;
+            }
+            // Moving each to the end in turn leaves them in order
+            for (int id : order) {
+                auto it = byId(id);
+                if (it == objects.end()) {
+                    return false;
+                }
+                objects.splice(objects.end(), objects, it);
+            }
+        }
+        return true;
+    }
+
+    void writeIds(WireWriter& w, const vector<int>& ids)
+    {
+        w.varint(ids.size());
+        for (auto id : ids) {
+            w.integer(id);
+        }
+    }
+
+    vector<int> readIds(WireReader& r)
+    {
+        vector<int> ids(r.count());
+        for (auto& id : ids) {
+            id = r.integer();
+        }
+        return ids;
+    }
+
+    template <class T, class F>
+    void writeList(WireWriter& w, const vector<T>& items, F writeItem)
+    {
+        w.varint(items.size());
+        for (auto& item : items) {
+            writeItem(w, item);
+        }
+    }
+
+    template <class T, class F>
+    vector<T> readList(WireReader& r, F readItem)
+    {
+        vector<T> items;
+        int n = r.count();
+        for (int i = 0; i < n; i++) {
+            items.push_back(readItem(r));
+        }
+        return items;
+    }
+}
+
+bool GamePatch::empty() const
+{
+    return not turnInfo and not nextObjectId and players.empty() and ships.empty()
+        and removedShips.empty() and shipOrder.empty() and systems.empty()
+        and removedSystems.empty() and systemOrder.empty() and beacons.empty()
+        and removedBeacons.empty() and beaconOrder.empty() and cards.empty()
+        and zones.empty();
+}
+
+GamePatch diffGames(const GameState& from, const GameState& to)
+{
+    if (ids(from.players) != ids(to.players)) {
+        throw invalid_argument("Can't diff games with different players");
+    }
+
+    GamePatch patch;
+    if (from.turnInfo.whoseTurn != to.turnInfo.whoseTurn
+            or from.turnInfo.activePlayer != to.turnInfo.activePlayer
+            or from.turnInfo.phase != to.turnInfo.phase) {
+        patch.turnInfo = to.turnInfo;
+    }
+    if (from.nextObjectId != to.nextObjectId) {
+        patch.nextObjectId = to.nextObjectId;
+    }
+
+    for (auto a = from.players.begin(), b = to.players.begin(); b != to.players.end(); a++, b++) {
+        PlayerPatch p = {.id = b->id, .resourceDelta = {}, .resourcesRemoved = {},
+            .flagshipId = b->flagshipId,
+            .playedResourceShipThisTurn = b->playedResourceShipThisTurn, .name = {}};
+        for (auto [type, amount] : b->resources) {
+            auto it = a->resources.find(type);
+            if (it == a->resources.end() or it->second != amount) {
+                p.resourceDelta[type] = amount - (it == a->resources.end() ? 0 : it->second);
+            }
+        }
+        for (auto [type, amount] : a->resources) {
+            if (not b->resources.count(type)) {
+                p.resourcesRemoved.push_back(type);
+            }
+        }
+        if (a->name != b->name) {
+            p.name = b->name;
+        }
+        if (p.resourceDelta.size() or p.resourcesRemoved.size() or p.name
+                or a->flagshipId != b->flagshipId
+                or a->playedResourceShipThisTurn != b->playedResourceShipThisTurn) {
+            patch.players.push_back(move(p));
+        }
+    }
+
+    diffObjects(from.ships, to.ships, sameShip, patch.ships, patch.removedShips, patch.shipOrder);
+    diffObjects(from.systems, to.systems, sameSystem,
+            patch.systems, patch.removedSystems, patch.systemOrder);
+    diffObjects(from.beacons, to.beacons, sameBeacon,
+            patch.beacons, patch.removedBeacons, patch.beaconOrder);
+
+    // Cards are sent if they're new or changed, wherever they are now
+    unordered_map<int, const Card*> before;
+    for (auto zone : cardZones(from)) {
+        for (auto& card : *zone) {
+            before[card.id] = &card;
+        }
+    }
+    auto fromZones = cardZones(from);
+    auto toZones = cardZones(to);
+    for (size_t z = 0; z < toZones.size(); z++) {
+        for (auto& card : *toZones[z]) {
+            auto it = before.find(card.id);
+            if (it == before.end() or not sameCard(*it->second, card)) {
+                patch.cards.push_back(card);
+            }
+        }
+
+        auto a = ids(*fromZones[z]);
+        auto b = ids(*toZones[z]);
+        if (a == b) {
+            continue;
+        }
+        ZoneEdit edit = {.zone = int(z), .middle = {}};
+        int common = min(a.size(), b.size());
+        while (edit.keepFront < common and a[edit.keepFront] == b[edit.keepFront]) {
+            edit.keepFront++;
+        }
+        while (edit.keepFront + edit.keepBack < common
+                and a[a.size() - edit.keepBack - 1] == b[b.size() - edit.keepBack - 1]) {
+            edit.keepBack++;
+        }
+        edit.middle.assign(b.begin() + edit.keepFront, b.end() - edit.keepBack);
+        patch.zones.push_back(move(edit));
+    }
+    return patch;
+}
+
+bool applyPatch(GameState& state, const GamePatch& patch)
+{
+    if (patch.turnInfo) {
+        state.turnInfo = *patch.turnInfo;
+    }
+    if (patch.nextObjectId) {
+        state.nextObjectId = *patch.nextObjectId;
+    }
+    for (auto& p : patch.players) {
+        auto player = state.getPlayerById(p.id);
+        if (not player) {
+            return false;
+        }
+        for (auto [type, delta] : p.resourceDelta) {
+            player->resources[type] += delta;
+        }
+        for (auto type : p.resourcesRemoved) {
+            player->resources.erase(type);
+        }
+        player->flagshipId = p.flagshipId;
+        player->playedResourceShipThisTurn = p.playedResourceShipThisTurn;
+        if (p.name) {
+            player->name = *p.name;
+        }
+    }
+
+    if (not patchObjects(state.ships, patch.ships, patch.removedShips, patch.shipOrder)
+            or not patchObjects(state.systems, patch.systems, patch.removedSystems, patch.systemOrder)
+            or not patchObjects(state.beacons, patch.beacons, patch.removedBeacons, patch.beaconOrder)) {
+        return false;
+    }
+
+    // Take every card out, then put them back in the zones' new order
+    auto zones = cardZones(state);
+    vector<vector<int>> zoneIds;
+    unordered_map<int, Card> cards;
+    for (auto zone : zones) {
+        zoneIds.push_back(ids(*zone));
+        for (auto& card : *zone) {
+            cards[card.id] = move(card);
+        }
+        zone->clear();
+    }
+    for (auto& card : patch.cards) {
+        cards[card.id] = card;
+    }
+    for (auto& edit : patch.zones) {
+        if (edit.zone < 0 or edit.zone >= (int) zones.size() or edit.keepFront < 0
+                or edit.keepBack < 0
+                or edit.keepFront + edit.keepBack > (int) zoneIds[edit.zone].size()) {
+            return false;
+        }
+        auto& old = zoneIds[edit.zone];
+        vector<int> now(old.begin(), old.begin() + edit.keepFront);
+        now.insert(now.end(), edit.middle.begin(), edit.middle.end());
+        now.insert(now.end(), old.end() - edit.keepBack, old.end());
+        old = move(now);
+    }
+    for (size_t z = 0; z < zones.size(); z++) {
+        for (int id : zoneIds[z]) {
+            auto it = cards.find(id);
+            if (it == cards.end()) {
+                return false;
+            }
+            zones[z]->push_back(move(it->second));
+            cards.erase(it);
+        }
+    }
+
+    bindCallbacks(state);
+    return true;
+}
+
+string encodePatch(const GamePatch& patch)
+{
+    WireWriter w;
+    w.boolean(patch.turnInfo.has_value());
+    if (patch.turnInfo) {
+        w.integer(patch.turnInfo->whoseTurn);
+        w.integer(patch.turnInfo->activePlayer);
+        w.varint(patch.turnInfo->phase.size());
+        for (auto phase : patch.turnInfo->phase) {
+            w.varint(phase);
+        }
+    }
+    w.boolean(patch.nextObjectId.has_value());
+    if (patch.nextObjectId) {
+        w.integer(*patch.nextObjectId);
+    }
+
+    writeList(w, patch.players, [](WireWriter& w, const PlayerPatch& p) {
+        w.integer(p.id);
+        w.varint(p.resourceDelta.size());
+        for (auto [type, delta] : p.resourceDelta) {
+            w.varint(type);
+            w.integer(delta);
+        }
+        w.varint(p.resourcesRemoved.size());
+        for (auto type : p.resourcesRemoved) {
+            w.varint(type);
+        }
+        w.integer(p.flagshipId);
+        w.boolean(p.playedResourceShipThisTurn);
+        w.boolean(p.name.has_value());
+        if (p.name) {
+            w.str(*p.name);
+        }
+    });
+
+    writeList(w, patch.ships, [](WireWriter& w, const Ship& ship) {
+        writeShip(w, ship);
+        w.integer(ship.owner);
+        w.varint(ship.kind);
+    });
+    writeIds(w, patch.removedShips);
+    writeIds(w, patch.shipOrder);
+    writeList(w, patch.systems, [](WireWriter& w, const System& system) {
+        w.integer(system.id);
+        w.integer(system.controllerId);
+        w.boolean(system.home);
+        w.integer(system.i);
+        w.integer(system.j);
+        writeIds(w, system.adjacent);
+    });
+    writeIds(w, patch.removedSystems);
+    writeIds(w, patch.systemOrder);
+    writeList(w, patch.beacons, [](WireWriter& w, const WarpBeacon& beacon) {
+        w.integer(beacon.id);
+        w.integer(beacon.ownerId);
+        w.integer(beacon.systemId);
+    });
+    writeIds(w, patch.removedBeacons);
+    writeIds(w, patch.beaconOrder);
+
+    writeList(w, patch.cards, [](WireWriter& w, const Card& card) {
+        writeCard(w, card);
+    });
+    writeList(w, patch.zones, [](WireWriter& w, const ZoneEdit& edit) {
+        w.varint(edit.zone);
+        w.varint(edit.keepFront);
+        w.varint(edit.keepBack);
+        writeIds(w, edit.middle);
+    });
+    return move(w.data);
+}
+
+GamePatch decodePatch(const string& data)
+{
+    WireReader r(data);
+    GamePatch patch;
+    if (r.boolean()) {
+        TurnInfo turnInfo;
+        turnInfo.whoseTurn = r.integer();
+        turnInfo.activePlayer = r.integer();
+        int n = r.count();
+        for (int i = 0; i < n; i++) {
+            turnInfo.phase.push_back((TurnPhases) r.varint());
+        }
+        patch.turnInfo = turnInfo;
+    }
+    if (r.boolean()) {
+        patch.nextObjectId = r.integer();
+    }
+
+    patch.players = readList<PlayerPatch>(r, [](WireReader& r) {
+        PlayerPatch p;
+        p.id = r.integer();
+        int n = r.count();
+        for (int i = 0; i < n; i++) {
+            auto type = (ResourceType) r.varint();
+            p.resourceDelta[type] = r.integer();
+        }
+        n = r.count();
+        for (int i = 0; i < n; i++) {
+            p.resourcesRemoved.push_back((ResourceType) r.varint());
+        }
+        p.flagshipId = r.integer();
+        p.playedResourceShipThisTurn = r.boolean();
+        if (r.boolean()) {
+            p.name = r.str();
+        }
+        return p;
+    });
+
+    patch.ships = readList<Ship>(r, [](WireReader& r) {
+        Ship ship = readShip(r);
+        ship.owner = r.integer();
+        ship.kind = (ShipKind) r.varint();
+        return ship;
+    });
+    patch.removedShips = readIds(r);
+    patch.shipOrder = readIds(r);
+    patch.systems = readList<System>(r, [](WireReader& r) {
+        System system;
+        system.id = r.integer();
+        system.controllerId = r.integer();
+        system.home = r.boolean();
+        system.i = r.integer();
+        system.j = r.integer();
+        system.adjacent = readIds(r);
+        return system;
+    });
+    patch.removedSystems = readIds(r);
+    patch.systemOrder = readIds(r);
+    patch.beacons = readList<WarpBeacon>(r, [](WireReader& r) {
+        WarpBeacon beacon;
+        beacon.id = r.integer();
+        beacon.ownerId = r.integer();
+        beacon.systemId = r.integer();
+        return beacon;
+    });
+    patch.removedBeacons = readIds(r);
+    patch.beaconOrder = readIds(r);
+
+    patch.cards = readList<Card>(r, readCard);
+    patch.zones = readList<ZoneEdit>(r, [](WireReader& r) {
+        ZoneEdit edit;
+        edit.zone = r.varint();
+        edit.keepFront = r.varint();
+        edit.keepBack = r.varint();
+        edit.middle = readIds(r);
+        return edit;
+    });
+    if (not r.done()) {
+        throw runtime_error("Patch has bytes left over");
+    }
+    return patch;
+}
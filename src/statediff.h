@@ -0,0 +1,85 @@
+#ifndef STATEDIFF_H
+#define STATEDIFF_H
+
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "logic.h"
+
+/* What it takes to turn one copy of a game into another, so a copy that has
+ * gone wrong can be put right by sending what differs rather than the whole
+ * game. Patching makes the copy the same as the game it was diffed against
+ * as far as stateChecksum goes, and also fixes ship owners and kinds, but
+ * leaves the change log alone, as GameState::apply does.
+ *
+ * Ships, systems and beacons that were added or changed are sent whole and
+ * removed ones by id. Cards are sent whole only if they're new or changed,
+ * moving between zones (deck, hand, discard, stack) is an edit of the ids in
+ * each zone that changed. Player resources are sent as the difference.
+ * Lists that end up in a different order from the target's also carry the
+ * target's order of ids.
+ *
+ * Both copies must be of the same game, with the same players.
+ */
+
+// Ids from position keepFront to keepBack from the end are replaced by middle
+struct ZoneEdit
+{
+    // Each player's deck, hand and discard in turn, then the stack
+    int zone;
+    int keepFront = 0;
+    int keepBack = 0;
+    std::vector<int> middle;
+};
+
+struct PlayerPatch
+{
+    int id;
+    // Added to the amounts, types that are gone are in resourcesRemoved
+    ResourceAmount resourceDelta;
+    std::vector<ResourceType> resourcesRemoved;
+    int flagshipId;
+    bool playedResourceShipThisTurn;
+    std::optional<std::string> name;
+};
+
+struct GamePatch
+{
+    std::optional<logic::TurnInfo> turnInfo;
+    std::optional<int> nextObjectId;
+    std::vector<PlayerPatch> players;
+
+    // Added or changed objects, removed ones and, if it changed, the order
+    std::vector<logic::Ship> ships;
+    std::vector<int> removedShips;
+    std::vector<int> shipOrder;
+    std::vector<logic::System> systems;
+    std::vector<int> removedSystems;
+    std::vector<int> systemOrder;
+    std::vector<logic::WarpBeacon> beacons;
+    std::vector<int> removedBeacons;
+    std::vector<int> beaconOrder;
+
+    // New or changed cards, wherever they are
+    std::vector<logic::Card> cards;
+    std::vector<ZoneEdit> zones;
+
+    bool empty() const;
+};
+
+/* The patch that turns from into to. Throws std::invalid_argument if they
+ * don't have the same players */
+GamePatch diffGames(const logic::GameState& from, const logic::GameState& to);
+
+/* Patch state, returning false if the patch doesn't fit it (it refers to
+ * something state doesn't have), in which case state may be half patched */
+bool applyPatch(logic::GameState& state, const GamePatch& patch);
+
+/* A compact encoding of patches, with ships and cards as in the compact
+ * wire format (wireformat.h). decodePatch throws std::runtime_error on
+ * malformed input */
+std::string encodePatch(const GamePatch& patch);
+GamePatch decodePatch(const std::string& data);
+
+#endif
@@ -13,12 +13,16 @@ inline float rand_float_between(float LO, float HI)
     return LO + static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/(HI-LO)));
 }
 
+// Seeded from random_device, so unlike rand() it differs between runs even
+// if nothing calls srand. Used for game ids and login tokens
 inline std::string randString(int n)
 {
+    thread_local std::mt19937 rng{std::random_device{}()};
     std::string charset = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    std::uniform_int_distribution<int> pick(0, charset.size() - 1);
     std::string ret;
     for (int i = 0; i < n; i++) {
-        ret.push_back(charset[rand() % charset.size()]);
+        ret.push_back(charset[pick(rng)]);
     }
     return ret;
 };
@@ -0,0 +1,136 @@
+#include "logic.h"
+#include "actionlog.h"
+#include "randomplay.h"
+
+#include <cxxopts.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+
+using namespace std;
+using namespace logic;
+
+/* Measures what the action log costs the server. Several threads play random
+ * actions in many games at once, the way request threads do, with the log
+ * off, written but not synced, and synced with group commit. Then times
+ * rebuilding every game from the synced log
+ */
+
+struct BenchGame
+{
+    mutex m;
+    GameState state;
+    mt19937 rng;
+};
+
+double run(ActionLog* log, int nGames, int nActions, int nThreads)
+{
+    vector<BenchGame> games(nGames);
+    for (int i = 0; i < nGames; i++) {
+        games[i].rng.seed(i);
+        games[i].state.startGame();
+        if (log) {
+            log->appendCreateGame(to_string(i));
+        }
+    }
+
+    atomic<int> performed{0};
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < nThreads; t++) {
+        // Each thread takes turns between its share of the games
+        threads.emplace_back([&, t]{
+            for (int i = 0; i < nActions; i++) {
+                for (int gameNo = t; gameNo < nGames; gameNo += nThreads) {
+                    auto& game = games[gameNo];
+                    uint64_t seq = 0;
+                    {
+                        lock_guard<mutex> lk(game.m);
+                        auto actions = game.state.getPossibleActions();
+                        if (not actions.size()) {
+                            continue;
+                        }
+                        auto action = randomAction(actions, game.rng);
+                        game.state.performAction(action);
+                        if (log) {
+                            seq = log->appendAction(to_string(gameNo), action);
+                        }
+                    }
+                    if (log) {
+                        log->waitDurable(seq);
+                    }
+                    performed++;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return performed / elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+    cxxopts::Options opts("walbench", "Throughput with and without the action log, and recovery time");
+    opts.add_options()
+        ("g,games", "Games played at once", cxxopts::value<int>()->default_value("1000"))
+        ("a,actions", "Actions per game", cxxopts::value<int>()->default_value("20"))
+        ("t,threads", "Threads performing actions", cxxopts::value<int>()->default_value("8"))
+        ("f,file", "Where to put the log", cxxopts::value<string>()->default_value("walbench.wal"))
+        ;
+    auto result = opts.parse(argc, argv);
+    int nGames = result["games"].as<int>();
+    int nActions = result["actions"].as<int>();
+    int nThreads = result["threads"].as<int>();
+    string path = result["file"].as<string>();
+
+    cout << left << setw(28) << "log" << right << setw(14) << "actions/s"
+         << setw(16) << "actions/fsync" << endl;
+    auto report = [&](string name, double rate, ActionLog* log) {
+        cout << left << setw(28) << name << right << fixed << setprecision(0)
+             << setw(14) << rate;
+        if (log) {
+            cout << setw(16) << setprecision(1)
+                 << double(log->recordsWritten()) / max<uint64_t>(log->batchesWritten(), 1);
+        }
+        cout << endl;
+    };
+
+    report("off", run(nullptr, nGames, nActions, nThreads), nullptr);
+    remove(path.c_str());
+    {
+        ActionLog log(path, false);
+        report("written, no fsync", run(&log, nGames, nActions, nThreads), &log);
+    }
+    remove(path.c_str());
+    {
+        ActionLog log(path, true);
+        report("fsync, 1 thread", run(&log, nGames / nThreads, nActions, 1), &log);
+    }
+    remove(path.c_str());
+    {
+        ActionLog log(path, true);
+        report("fsync, group commit", run(&log, nGames, nActions, nThreads), &log);
+    }
+
+    auto start = chrono::steady_clock::now();
+    auto recovered = ActionLog::recover(path);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    int nRecovered = 0;
+    for (auto& game : recovered) {
+        nRecovered += game.actions;
+    }
+    cout << "Recovered " << recovered.size() << " games (" << nRecovered << " actions) in "
+         << setprecision(3) << elapsed.count() << "s, "
+         << elapsed.count() * 1000 / max<size_t>(recovered.size(), 1) << "s per 1000 games" << endl;
+    remove(path.c_str());
+    return 0;
+}
@@ -0,0 +1,569 @@
+#include "wireformat.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+
+using namespace std;
+using namespace logic;
+
+void WireWriter::varint(uint64_t value)
+{
+    while (value >= 0x80) {
+        data.push_back((char) (value | 0x80));
+        value >>= 7;
+    }
+    data.push_back((char) value);
+}
+
+// Zigzag so that small negative numbers stay small
+void WireWriter::integer(int64_t value)
+{
+    varint(((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+void WireWriter::str(const string& s)
+{
+    varint(s.size());
+    data += s;
+}
+
+uint64_t WireReader::varint()
+{
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= data.size()) {
+            throw runtime_error("Compact message ended inside a varint");
+        }
+        uint8_t byte = data[pos++];
+        value |= (uint64_t) (byte & 0x7f) << shift;
+        if (not (byte & 0x80)) {
+            return value;
+        }
+    }
+    throw runtime_error("Compact message has a varint that is too long");
+}
+
+int64_t WireReader::integer()
+{
+    uint64_t value = varint();
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+uint64_t WireReader::count()
+{
+    uint64_t n = varint();
+    // Every item takes at least a byte
+    if (n > data.size() - pos) {
+        throw runtime_error("Compact message has more items than bytes left");
+    }
+    return n;
+}
+
+string WireReader::str()
+{
+    uint64_t size = count();
+    string s = data.substr(pos, size);
+    pos += size;
+    return s;
+}
+
+namespace {
+
+    // Position of the definition with the given name (or ship type), or -1
+    template <class T, class F>
+    int findDefinition(const vector<T>& definitions, const string& name, F getName)
+    {
+        static unordered_map<string, int> byName = [&]{
+            unordered_map<string, int> m;
+            for (size_t i = 0; i < definitions.size(); i++) {
+                m[getName(definitions[i])] = i;
+            }
+            return m;
+        }();
+        auto it = byName.find(name);
+        return it == byName.end() ? -1 : it->second;
+    }
+
+    int shipDefinitionIndex(const string& type)
+    {
+        return findDefinition(allShipDefinitions(), type,
+                [](const Ship& s) {return s.type;});
+    }
+
+    bool sameResources(const ResourceAmount& a, const ResourceAmount& b)
+    {
+        return a.size() == b.size() and equal(a.begin(), a.end(), b.begin());
+    }
+
+    // Compares the fields that are sent to clients
+    bool sameShip(const Ship& a, const Ship& b)
+    {
+        return a.id == b.id and a.type == b.type and a.attack == b.attack
+            and a.shield == b.shield and a.armour == b.armour
+            and a.movement == b.movement and a.controller == b.controller
+            and a.curSystemId == b.curSystemId;
+    }
+
+    /* Position of the definition the card was made from, or -1 if there
+     * isn't one or the card has been changed from it */
+    int cardDefinitionIndex(const Card& card)
+    {
+        auto& definitions = allCardDefinitions();
+        int i = findDefinition(definitions, card.name,
+                [](const Card& c) {return c.name;});
+        if (i < 0) {
+            return -1;
+        }
+        auto& d = definitions[i];
+        bool same = d.cardText == card.cardText and sameResources(d.cost, card.cost)
+            and sameResources(d.provides, card.provides) and d.type == card.type
+            and d.howManyCreated == card.howManyCreated
+            and d.creates.has_value() == card.creates.has_value()
+            and (not d.creates or sameShip(*d.creates, *card.creates));
+        return same ? i : -1;
+    }
+
+    void writeResources(WireWriter& w, const ResourceAmount& amount)
+    {
+        w.varint(amount.size());
+        for (auto [type, n] : amount) {
+            w.varint(type);
+            w.integer(n);
+        }
+    }
+
+    ResourceAmount readResources(WireReader& r)
+    {
+        ResourceAmount amount;
+        int n = r.count();
+        for (int i = 0; i < n; i++) {
+            auto type = (ResourceType) r.varint();
+            amount[type] = r.integer();
+        }
+        return amount;
+    }
+
+    void writeIds(WireWriter& w, const vector<int>& ids)
+    {
+        w.varint(ids.size());
+        for (auto id : ids) {
+            w.integer(id);
+        }
+    }
+
+    vector<int> readIds(WireReader& r)
+    {
+        vector<int> ids(r.count());
+        for (auto& id : ids) {
+            id = r.integer();
+        }
+        return ids;
+    }
+}
+
+// Stats are sent as the difference from the definition of the same type
+void writeShip(WireWriter& w, const Ship& ship)
+{
+    w.integer(ship.id);
+    int i = shipDefinitionIndex(ship.type);
+    Ship base;
+    base.attack = base.shield = base.armour = base.movement = 0;
+    if (i >= 0) {
+        base = allShipDefinitions()[i];
+    }
+    w.varint(i + 1);
+    if (i < 0) {
+        w.str(ship.type);
+    }
+    w.integer(ship.attack - base.attack);
+    w.integer(ship.shield - base.shield);
+    w.integer(ship.armour - base.armour);
+    w.integer(ship.movement - base.movement);
+    w.integer(ship.controller);
+    w.integer(ship.curSystemId);
+}
+
+Ship readShip(WireReader& r)
+{
+    int id = r.integer();
+    uint64_t i = r.varint();
+    Ship ship;
+    ship.attack = ship.shield = ship.armour = ship.movement = 0;
+    if (i > allShipDefinitions().size()) {
+        throw runtime_error("Compact message has an unknown ship definition");
+    } else if (i > 0) {
+        ship = allShipDefinitions()[i - 1];
+    } else {
+        ship.type = r.str();
+    }
+    ship.id = id;
+    ship.attack += r.integer();
+    ship.shield += r.integer();
+    ship.armour += r.integer();
+    ship.movement += r.integer();
+    ship.controller = r.integer();
+    ship.curSystemId = r.integer();
+    return ship;
+}
+
+void writeCard(WireWriter& w, const Card& card)
+{
+    int i = cardDefinitionIndex(card);
+    w.varint(i + 1);
+    if (i < 0) {
+        w.str(card.name);
+        w.str(card.cardText);
+        writeResources(w, card.cost);
+        w.varint(card.type);
+        writeResources(w, card.provides);
+        w.boolean(card.creates.has_value());
+        if (card.creates) {
+            writeShip(w, *card.creates);
+        }
+        w.integer(card.howManyCreated);
+    }
+    w.integer(card.id);
+    w.integer(card.playedBy);
+    w.integer(card.ownerId);
+    writeIds(w, card.targets);
+}
+
+Card readCard(WireReader& r)
+{
+    uint64_t i = r.varint();
+    Card card;
+    if (i > allCardDefinitions().size()) {
+        throw runtime_error("Compact message has an unknown card definition");
+    } else if (i > 0) {
+        card = allCardDefinitions()[i - 1];
+    } else {
+        card.name = r.str();
+        card.cardText = r.str();
+        card.cost = readResources(r);
+        card.type = (CardType) r.varint();
+        card.provides = readResources(r);
+        if (r.boolean()) {
+            card.creates = readShip(r);
+        }
+        card.howManyCreated = r.integer();
+    }
+    card.id = r.integer();
+    card.playedBy = r.integer();
+    card.ownerId = r.integer();
+    card.targets = readIds(r);
+    return card;
+}
+
+namespace {
+    void writeCards(WireWriter& w, const list<Card>& cards)
+    {
+        w.varint(cards.size());
+        for (auto& card : cards) {
+            writeCard(w, card);
+        }
+    }
+
+    list<Card> readCards(WireReader& r)
+    {
+        list<Card> cards;
+        int n = r.count();
+        for (int i = 0; i < n; i++) {
+            cards.push_back(readCard(r));
+        }
+        return cards;
+    }
+
+    void writeData(WireWriter& w, const Ship& ship)
+    {
+        writeShip(w, ship);
+    }
+
+    void writeData(WireWriter& w, int n)
+    {
+        w.integer(n);
+    }
+
+    void writeData(WireWriter& w, const Card& card)
+    {
+        writeCard(w, card);
+    }
+
+    void writeData(WireWriter& w, const Player& player)
+    {
+        w.integer(player.id);
+        w.str(player.name);
+        writeResources(w, player.resources);
+        writeCards(w, player.deck);
+        writeCards(w, player.hand);
+        writeCards(w, player.discard);
+        w.integer(player.flagshipId);
+        w.boolean(player.playedResourceShipThisTurn);
+    }
+
+    void writeData(WireWriter& w, const TurnInfo& turnInfo)
+    {
+        w.integer(turnInfo.whoseTurn);
+        w.integer(turnInfo.activePlayer);
+        w.varint(turnInfo.phase.size());
+        for (auto phase : turnInfo.phase) {
+            w.varint(phase);
+        }
+    }
+
+    void writeData(WireWriter& w, const pair<int, Card>& p)
+    {
+        w.integer(p.first);
+        writeCard(w, p.second);
+    }
+
+    void writeData(WireWriter& w, const WarpBeacon& beacon)
+    {
+        w.integer(beacon.id);
+        w.integer(beacon.ownerId);
+        w.integer(beacon.systemId);
+    }
+
+    void writeData(WireWriter& w, const pair<int, ResourceAmount>& p)
+    {
+        w.integer(p.first);
+        writeResources(w, p.second);
+    }
+
+    void writeData(WireWriter& w, const pair<int, int>& p)
+    {
+        w.integer(p.first);
+        w.integer(p.second);
+    }
+
+    void writeData(WireWriter& w, const vector<pair<int, int>>& pairs)
+    {
+        w.varint(pairs.size());
+        for (auto& p : pairs) {
+            writeData(w, p);
+        }
+    }
+}
+
+void writeChange(WireWriter& w, const Change& change)
+{
+    w.varint(change.changeNo);
+    // The low bit says whether a checksum follows the data
+    w.varint((uint64_t) change.type << 1 | change.checksum.has_value());
+    w.varint(change.data.index());
+    visit([&w](auto& data) {writeData(w, data);}, change.data);
+    if (change.checksum) {
+        w.varint(*change.checksum);
+    }
+}
+
+Change readChange(WireReader& r)
+{
+    Change change;
+    change.changeNo = r.varint();
+    uint64_t type = r.varint();
+    change.type = (ChangeType) (type >> 1);
+    switch (r.varint()) {
+        case 0:
+            change.data = readShip(r);
+            break;
+        case 1:
+            change.data = (int) r.integer();
+            break;
+        case 2:
+            change.data = readCard(r);
+            break;
+        case 3: {
+            Player player;
+            player.id = r.integer();
+            player.name = r.str();
+            player.resources = readResources(r);
+            player.deck = readCards(r);
+            player.hand = readCards(r);
+            player.discard = readCards(r);
+            player.flagshipId = r.integer();
+            player.playedResourceShipThisTurn = r.boolean();
+            change.data = player;
+            break;
+        }
+        case 4: {
+            TurnInfo turnInfo;
+            turnInfo.whoseTurn = r.integer();
+            turnInfo.activePlayer = r.integer();
+            turnInfo.phase.resize(r.count());
+            for (auto& phase : turnInfo.phase) {
+                phase = (TurnPhases) r.varint();
+            }
+            change.data = turnInfo;
+            break;
+        }
+        case 5: {
+            int playerId = r.integer();
+            change.data = pair<int, Card>(playerId, readCard(r));
+            break;
+        }
+        case 6: {
+            WarpBeacon beacon;
+            beacon.id = r.integer();
+            beacon.ownerId = r.integer();
+            beacon.systemId = r.integer();
+            change.data = beacon;
+            break;
+        }
+        case 7: {
+            int playerId = r.integer();
+            change.data = pair<int, ResourceAmount>(playerId, readResources(r));
+            break;
+        }
+        case 8: {
+            int a = r.integer();
+            change.data = pair<int, int>(a, r.integer());
+            break;
+        }
+        case 9: {
+            vector<pair<int, int>> pairs(r.count());
+            for (auto& p : pairs) {
+                p.first = r.integer();
+                p.second = r.integer();
+            }
+            change.data = pairs;
+            break;
+        }
+        default:
+            throw runtime_error("Compact message has an unknown change data type");
+    }
+    if (type & 1) {
+        change.checksum = (uint32_t) r.varint();
+    }
+    return change;
+}
+
+void writeAction(WireWriter& w, const Action& action)
+{
+    w.varint(action.type);
+    w.integer(action.playerId);
+    w.integer(action.id);
+    writeIds(w, action.targets);
+    w.integer(action.minTargets);
+    w.integer(action.maxTargets);
+    w.str(action.description);
+    writeResources(w, action.payWith);
+    w.boolean(action.needToPickCost);
+}
+
+Action readAction(WireReader& r)
+{
+    Action action;
+    action.type = (ActionType) r.varint();
+    action.playerId = r.integer();
+    action.id = r.integer();
+    action.targets = readIds(r);
+    action.minTargets = r.integer();
+    action.maxTargets = r.integer();
+    action.description = r.str();
+    action.payWith = readResources(r);
+    action.needToPickCost = r.boolean();
+    return action;
+}
+
+void writeBriefAction(WireWriter& w, const Action& action)
+{
+    w.varint(action.type);
+    w.integer(action.playerId);
+    w.integer(action.id);
+    writeIds(w, action.targets);
+    writeResources(w, action.payWith);
+}
+
+Action readBriefAction(WireReader& r)
+{
+    Action action;
+    action.type = (ActionType) r.varint();
+    action.playerId = r.integer();
+    action.id = r.integer();
+    action.targets = readIds(r);
+    action.payWith = readResources(r);
+    return action;
+}
+
+namespace {
+    template <class T, class F>
+    void writeVector(WireWriter& w, const vector<T>& v, F write)
+    {
+        w.varint(v.size());
+        for (auto& x : v) {
+            write(w, x);
+        }
+    }
+
+    template <class T>
+    vector<T> readVector(WireReader& r, T (*read)(WireReader&))
+    {
+        vector<T> v;
+        uint64_t n = r.count();
+        for (uint64_t i = 0; i < n; i++) {
+            v.push_back(read(r));
+        }
+        return v;
+    }
+}
+
+string encodeChanges(const vector<Change>& changes)
+{
+    string out;
+    encodeChanges(out, changes);
+    return out;
+}
+
+void encodeChanges(string& out, const vector<Change>& changes)
+{
+    WireWriter w(out);
+    writeVector(w, changes, writeChange);
+}
+
+vector<Change> decodeChanges(const string& data)
+{
+    WireReader r(data);
+    return readVector(r, readChange);
+}
+
+string encodeActions(const vector<Action>& actions)
+{
+    string out;
+    encodeActions(out, actions);
+    return out;
+}
+
+void encodeActions(string& out, const vector<Action>& actions)
+{
+    WireWriter w(out);
+    writeVector(w, actions, writeAction);
+}
+
+vector<Action> decodeActions(const string& data)
+{
+    WireReader r(data);
+    return readVector(r, readAction);
+}
+
+string encodeChangesAndActions(const vector<Change>& changes, const vector<Action>& actions)
+{
+    string out;
+    encodeChangesAndActions(out, changes, actions);
+    return out;
+}
+
+void encodeChangesAndActions(string& out, const vector<Change>& changes,
+        const vector<Action>& actions)
+{
+    WireWriter w(out);
+    writeVector(w, changes, writeChange);
+    writeVector(w, actions, writeAction);
+}
+
+pair<vector<Change>, vector<Action>> decodeChangesAndActions(const string& data)
+{
+    WireReader r(data);
+    auto changes = readVector(r, readChange);
+    return {changes, readVector(r, readAction)};
+}
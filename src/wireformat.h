@@ -0,0 +1,100 @@
+#ifndef WIREFORMAT_H
+#define WIREFORMAT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "logic.h"
+#include "nocopy.h"
+
+/* A compact encoding for the changes and actions sent to clients, used
+ * instead of cereal when the client asks for it with the X-Wire-Format
+ * request header. The server says which encoding it used in the same header
+ * on the reply, so clients still understand servers that don't know about
+ * it.
+ *
+ * Integers are varints (zigzag encoded when signed), cards and ships refer to
+ * their definition by position in allCardDefinitions / allShipDefinitions
+ * rather than carrying names and card text, and ship stats are sent as the
+ * difference from the definition. Anything that doesn't match a definition
+ * is written out in full.
+ */
+
+#define WIRE_FORMAT_HEADER "X-Wire-Format"
+#define WIRE_FORMAT_COMPACT "compact"
+
+class WireWriter : non_copyable
+{
+    public:
+        WireWriter() : data(own) {};
+        // Append to out rather than to a string of its own
+        WireWriter(std::string& out) : data(out) {};
+
+        void varint(uint64_t value);
+        void integer(int64_t value);
+        void boolean(bool value) {varint(value);};
+        void str(const std::string& s);
+
+        std::string& data;
+
+    private:
+        std::string own;
+};
+
+/* Reads what WireWriter wrote, throws std::runtime_error on truncated or
+ * malformed input */
+class WireReader
+{
+    public:
+        WireReader(const std::string& data) : data(data) {};
+
+        uint64_t varint();
+        int64_t integer();
+        bool boolean() {return varint();};
+        std::string str();
+        // A varint giving the number of items that follow
+        uint64_t count();
+
+        bool done() {return pos == data.size();};
+
+    private:
+        const std::string& data;
+        size_t pos = 0;
+};
+
+/* Ships and cards as they appear in changes. Ships leave out their owner
+ * and kind, like the cereal encoding */
+void writeShip(WireWriter& w, const logic::Ship& ship);
+logic::Ship readShip(WireReader& r);
+void writeCard(WireWriter& w, const logic::Card& card);
+logic::Card readCard(WireReader& r);
+
+void writeChange(WireWriter& w, const logic::Change& change);
+logic::Change readChange(WireReader& r);
+void writeAction(WireWriter& w, const logic::Action& action);
+logic::Action readAction(WireReader& r);
+/* Only what performAction looks at: the type, player, id, targets and
+ * payment. A few bytes, for lockstep games (see lockstep.h) where the peers
+ * don't need the rest */
+void writeBriefAction(WireWriter& w, const logic::Action& action);
+logic::Action readBriefAction(WireReader& r);
+
+/* The encode functions either return a new string or append to out, which
+ * lets a buffer be reused */
+std::string encodeChanges(const std::vector<logic::Change>& changes);
+void encodeChanges(std::string& out, const std::vector<logic::Change>& changes);
+std::vector<logic::Change> decodeChanges(const std::string& data);
+std::string encodeActions(const std::vector<logic::Action>& actions);
+void encodeActions(std::string& out, const std::vector<logic::Action>& actions);
+std::vector<logic::Action> decodeActions(const std::string& data);
+
+// Changes followed by actions, the body of a sync reply
+std::string encodeChangesAndActions(const std::vector<logic::Change>& changes,
+        const std::vector<logic::Action>& actions);
+void encodeChangesAndActions(std::string& out, const std::vector<logic::Change>& changes,
+        const std::vector<logic::Action>& actions);
+std::pair<std::vector<logic::Change>, std::vector<logic::Action>>
+    decodeChangesAndActions(const std::string& data);
+
+#endif
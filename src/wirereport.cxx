@@ -0,0 +1,140 @@
+#include "logic.h"
+#include "randomplay.h"
+#include "wireformat.h"
+
+#include <cxxopts.hpp>
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+
+using namespace std;
+using namespace logic;
+
+/* Compares the size of changes and actions in the cereal and compact wire
+ * formats. Uses the change logs of states saved with writeStateToFile, or
+ * plays random games if none are given
+ */
+
+const vector<string> CHANGE_NAMES = {
+    "ADD_SHIP", "SHIP_CHANGE", "REMOVE_SHIP", "PLAY_CARD", "RESOLVE_CARD",
+    "DRAW_CARD", "PHASE_CHANGE", "PLACE_BEACON", "PLAYER_RESOURCES",
+    "MOVE_SHIP", "SHIP_TARGETS", "COMBAT_START", "COMBAT_ROUND_END",
+    "COMBAT_END", "RETURN_CARD_STACK_TO_HAND",
+};
+
+struct Sizes
+{
+    int count = 0;
+    size_t cereal = 0;
+    size_t compact = 0;
+};
+
+template <class T>
+size_t cerealSize(const T& obj)
+{
+    stringstream ss;
+    {
+        cereal::PortableBinaryOutputArchive oarchive(ss);
+        oarchive(obj);
+    }
+    return ss.str().size();
+}
+
+void addChanges(map<string, Sizes>& byType, const vector<Change>& changes)
+{
+    for (auto& change : changes) {
+        WireWriter w;
+        writeChange(w, change);
+        string name = change.type < CHANGE_NAMES.size()
+            ? CHANGE_NAMES[change.type] : to_string(change.type);
+        auto& sizes = byType[name];
+        sizes.count++;
+        sizes.cereal += cerealSize(change);
+        sizes.compact += w.data.size();
+    }
+}
+
+void printRow(string name, const Sizes& sizes)
+{
+    double n = max(sizes.count, 1);
+    cout << left << setw(28) << name << right
+         << setw(8) << sizes.count
+         << fixed << setprecision(1)
+         << setw(12) << sizes.cereal / n
+         << setw(12) << sizes.compact / n
+         << setw(9) << 100.0 * sizes.compact / max<size_t>(sizes.cereal, 1) << "%"
+         << endl;
+}
+
+int main(int argc, char **argv)
+{
+    cxxopts::Options opts("wirereport", "Bytes per change in the cereal and compact wire formats");
+    opts.add_options()
+        ("state", "Saved game state (JSON) to read the change log from", cxxopts::value<vector<string>>())
+        ("g,games", "Random games to play if no states are given", cxxopts::value<int>()->default_value("50"))
+        ("a,actions", "Actions to play in each random game", cxxopts::value<int>()->default_value("300"))
+        ;
+    auto result = opts.parse(argc, argv);
+
+    map<string, Sizes> byType;
+    Sizes actionSizes;
+    Sizes logSizes;
+
+    auto addState = [&](GameState& state) {
+        auto changes = state.getChangesAfter(0);
+        addChanges(byType, changes);
+        logSizes.count++;
+        logSizes.cereal += cerealSize(changes);
+        logSizes.compact += encodeChanges(changes).size();
+    };
+
+    if (result.count("state")) {
+        for (auto& filename : result["state"].as<vector<string>>()) {
+            GameState state;
+            ifstream ifs(filename);
+            cereal::JSONInputArchive iarchive(ifs);
+            iarchive(state);
+            addState(state);
+        }
+    } else {
+        int nActions = result["actions"].as<int>();
+        for (int game = 0; game < result["games"].as<int>(); game++) {
+            GameState state;
+            state.startGame();
+            mt19937 rng(game);
+            for (int i = 0; i < nActions; i++) {
+                auto actions = state.getPossibleActions();
+                if (not actions.size()) {
+                    break;
+                }
+                actionSizes.count++;
+                actionSizes.cereal += cerealSize(actions);
+                actionSizes.compact += encodeActions(actions).size();
+                state.performAction(randomAction(actions, rng));
+            }
+            addState(state);
+        }
+    }
+
+    cout << left << setw(28) << "change type" << right << setw(8) << "count"
+         << setw(12) << "cereal B" << setw(12) << "compact B" << setw(10) << "ratio"
+         << endl;
+    Sizes allChanges;
+    for (auto& [name, sizes] : byType) {
+        printRow(name, sizes);
+        allChanges.count += sizes.count;
+        allChanges.cereal += sizes.cereal;
+        allChanges.compact += sizes.compact;
+    }
+    cout << endl;
+    printRow("all changes", allChanges);
+    printRow("whole change logs", logSizes);
+    if (actionSizes.count) {
+        printRow("getactions replies", actionSizes);
+    }
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include "catch.hpp"
+
+#include "actionlog.h"
+#include "bytestream.h"
+#include "randomplay.h"
+#include "logic.h"
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+const string TEST_LOG = "actionlog_test.wal";
+
+TEST_CASE("Games are rebuilt from the action log", "[ActionLog]")
+{
+    remove(TEST_LOG.c_str());
+
+    // Two games played in turn, so each sees the other's objects being
+    // created in between its own
+    GameState a, b;
+    {
+        ActionLog log(TEST_LOG);
+        a.startGame();
+        log.appendCreateGame("a");
+        b.startGame();
+        log.appendCreateGame("b");
+
+        mt19937 rng(3);
+        uint64_t seq = 0;
+        for (int i = 0; i < 100; i++) {
+            for (auto [id, state] : {make_pair("a", &a), make_pair("b", &b)}) {
+                auto actions = state->getPossibleActions();
+                if (not actions.size()) {
+                    continue;
+                }
+                auto action = randomAction(actions, rng);
+                state->performAction(action);
+                seq = log.appendAction(id, action);
+            }
+        }
+        log.waitDurable(seq);
+        REQUIRE(log.recordsWritten() == seq);
+    }
+
+    auto recovered = ActionLog::recover(TEST_LOG);
+    REQUIRE(recovered.size() == 2);
+    REQUIRE(recovered[0].gameId == "a");
+    REQUIRE(serialize(recovered[0].state) == serialize(a));
+    REQUIRE(recovered[1].gameId == "b");
+    REQUIRE(serialize(recovered[1].state) == serialize(b));
+
+    remove(TEST_LOG.c_str());
+}
+
+TEST_CASE("A torn record at the end of the log is dropped", "[ActionLog]")
+{
+    remove(TEST_LOG.c_str());
+
+    GameState state;
+    state.startGame();
+    {
+        ActionLog log(TEST_LOG, false);
+        log.appendCreateGame("game");
+        auto action = state.getPossibleActions().front();
+        state.performAction(action);
+        log.waitDurable(log.appendAction("game", action));
+    }
+    size_t goodSize;
+    {
+        ifstream ifs(TEST_LOG, ios::binary | ios::ate);
+        goodSize = ifs.tellg();
+    }
+    {
+        // Half of a record, as if the server died while writing it
+        ofstream ofs(TEST_LOG, ios::binary | ios::app);
+        ofs.write("\x40\x00\x00\x00\x12\x34", 6);
+    }
+
+    auto recovered = ActionLog::recover(TEST_LOG);
+    REQUIRE(recovered.size() == 1);
+    REQUIRE(recovered[0].actions == 1);
+    REQUIRE(serialize(recovered[0].state) == serialize(state));
+    {
+        ifstream ifs(TEST_LOG, ios::binary | ios::ate);
+        REQUIRE((size_t) ifs.tellg() == goodSize);
+    }
+
+    // New records go after the last good one
+    {
+        ActionLog log(TEST_LOG, false);
+        auto action = state.getPossibleActions().front();
+        state.performAction(action);
+        log.waitDurable(log.appendAction("game", action));
+    }
+    recovered = ActionLog::recover(TEST_LOG);
+    REQUIRE(recovered[0].actions == 2);
+    REQUIRE(serialize(recovered[0].state) == serialize(state));
+
+    remove(TEST_LOG.c_str());
+}
+
+TEST_CASE("Compacting the log keeps the games and their seats", "[ActionLog]")
+{
+    remove(TEST_LOG.c_str());
+
+    GameState a, b;
+    size_t fullSize;
+    bool called = false;
+    {
+        ActionLog log(TEST_LOG);
+        mt19937 rng(4);
+        auto play = [&log, &rng](const string& id, GameState& state) {
+            auto actions = state.getPossibleActions();
+            if (actions.size()) {
+                auto action = randomAction(actions, rng);
+                state.performAction(action);
+                log.appendAction(id, action);
+            }
+        };
+
+        a.startGame();
+        log.appendCreateGame("a");
+        log.appendJoinGame("a", "alice");
+        log.appendJoinGame("a", "", 250);
+        b.startGame();
+        log.appendCreateGame("b");
+        log.appendJoinGame("b", "bob");
+        for (int i = 0; i < 30; i++) {
+            play("a", a);
+            play("b", b);
+        }
+
+        // As the server does when it brings a hibernated game back
+        log.appendHibernated("a");
+        log.appendSnapshot("a", a);
+        for (int i = 0; i < 5; i++) {
+            play("a", a);
+        }
+        log.appendHibernated("b");
+        log.waitDurable(log.appendJoinGame("b", "carol"));
+        {
+            ifstream ifs(TEST_LOG, ios::binary | ios::ate);
+            fullSize = ifs.tellg();
+        }
+
+        log.compact();
+        REQUIRE(log.compactions() == 1);
+
+        // Records after compacting go on the end of the new log
+        play("a", a);
+        log.whenDurable(log.appendJoinGame("a", "dave"), [&called](bool durable) {called = durable;});
+    }
+    REQUIRE(called);
+    {
+        ifstream ifs(TEST_LOG, ios::binary | ios::ate);
+        REQUIRE((size_t) ifs.tellg() < fullSize);
+    }
+
+    auto recovered = ActionLog::recover(TEST_LOG);
+    REQUIRE(recovered.size() == 2);
+    REQUIRE(recovered[0].gameId == "a");
+    REQUIRE(serialize(recovered[0].state) == serialize(a));
+    REQUIRE(recovered[0].seats == vector<string>{"alice", "", "dave"});
+    REQUIRE(recovered[0].botThinkMs == 250);
+    REQUIRE(not recovered[0].hibernated);
+    REQUIRE(recovered[1].gameId == "b");
+    REQUIRE(recovered[1].hibernated);
+    REQUIRE(recovered[1].seats == vector<string>{"bob", "carol"});
+
+    remove(TEST_LOG.c_str());
+}
+
+TEST_CASE("Action numbers and auto-pass policies are kept", "[ActionLog]")
+{
+    remove(TEST_LOG.c_str());
+
+    GameState a, b;
+    a.startGame();
+    b.startGame();
+    int player = a.players.front().id;
+    {
+        ActionLog log(TEST_LOG);
+        log.appendCreateGame("a");
+        log.appendCreateGame("b");
+        uint64_t seq = 1;
+        for (int i = 0; i < 10; i++) {
+            auto action = a.getPossibleActions().front();
+            a.performAction(action);
+            log.appendAction("a", action, "client-perform", seq++);
+        }
+        log.appendAutoPass("a", player, AUTO_PASS_PRIORITY);
+        log.appendAutoPass("b", player, AUTO_PASS_FORCED);
+        log.appendAction("b", b.getPossibleActions().front(), "other-sync", 7);
+        b.performAction(b.getPossibleActions().front());
+        log.appendHibernated("b");
+        log.waitDurable(log.appendSnapshot("a", a));
+    }
+    auto check = [&](uint64_t lastSeq) {
+        auto recovered = ActionLog::recover(TEST_LOG);
+        REQUIRE(recovered.size() == 2);
+        REQUIRE(serialize(recovered[0].state) == serialize(a));
+        REQUIRE(recovered[0].actionSeqs == map<string, uint64_t>{{"client-perform", lastSeq}});
+        REQUIRE(recovered[0].autoPass == map<int, AutoPass>{{player, AUTO_PASS_PRIORITY}});
+        REQUIRE(recovered[1].hibernated);
+        REQUIRE(recovered[1].actionSeqs == map<string, uint64_t>{{"other-sync", 7}});
+        REQUIRE(recovered[1].autoPass == map<int, AutoPass>{{player, AUTO_PASS_FORCED}});
+    };
+    check(10);
+
+    // The keyed actions before the snapshot are compacted away
+    {
+        ActionLog log(TEST_LOG);
+        log.compact();
+        REQUIRE(log.compactions() == 1);
+    }
+    check(10);
+    {
+        ActionLog log(TEST_LOG);
+        auto action = a.getPossibleActions().front();
+        a.performAction(action);
+        log.waitDurable(log.appendAction("a", action, "client-perform", 11));
+    }
+    check(11);
+
+    remove(TEST_LOG.c_str());
+}
+
+TEST_CASE("Records that can't be written are reported, not fatal", "[ActionLog]")
+{
+    // Every write to /dev/full fails with ENOSPC
+    ActionLog log("/dev/full");
+    REQUIRE(not log.waitDurable(log.appendCreateGame("a")));
+
+    bool called = false, durable = true;
+    log.whenDurable(log.appendJoinGame("a", "alice"), [&](bool ok) {
+        called = true;
+        durable = ok;
+    });
+    REQUIRE(called);
+    REQUIRE(not durable);
+    REQUIRE(log.recordsWritten() == 0);
+    REQUIRE_THROWS_AS(log.compact(), runtime_error);
+}
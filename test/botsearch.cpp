@@ -0,0 +1,61 @@
+#include "catch.hpp"
+
+#include "botsearch.h"
+#include "randomplay.h"
+#include "logic.h"
+
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+TEST_CASE("Bots choose an action they are allowed to take", "[BotSearch]")
+{
+    for (int seed = 0; seed < 5; seed++) {
+        GameState state = randomGame(seed, seed * 3);
+        mt19937 rng(seed);
+
+        for (auto& player : state.players) {
+            auto possible = state.getPossibleActions(player.id);
+            SearchLimits limits;
+            limits.budget = chrono::milliseconds(20);
+            auto start = chrono::steady_clock::now();
+            auto result = searchAction(state, player.id, limits, rng);
+            REQUIRE(chrono::steady_clock::now() - start < chrono::milliseconds(500));
+
+            if (not possible.size()) {
+                REQUIRE(not result.action);
+                continue;
+            }
+            REQUIRE(result.action);
+            REQUIRE(not result.cancelled);
+            GameState copy = state;
+            copy.performAction(*result.action);
+            REQUIRE(copy.changes.size() > state.changes.size());
+
+            double score = evaluate(copy, player.id);
+            REQUIRE(score >= 0);
+            REQUIRE(score <= 1);
+        }
+    }
+}
+
+TEST_CASE("Bots stop searching when cancelled", "[BotSearch]")
+{
+    GameState state;
+    state.startGame();
+    mt19937 rng(1);
+    int playerId = state.players.front().id;
+
+    SearchLimits limits;
+    limits.budget = chrono::seconds(10);
+    int checks = 0;
+    limits.cancelled = [&]{return ++checks > 3;};
+    auto start = chrono::steady_clock::now();
+    auto result = searchAction(state, playerId, limits, rng);
+    REQUIRE(chrono::steady_clock::now() - start < chrono::seconds(2));
+    REQUIRE(result.cancelled);
+    // Still has an answer from the playouts done before
+    REQUIRE(result.action);
+    REQUIRE(result.playouts == 3);
+}
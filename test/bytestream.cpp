@@ -0,0 +1,42 @@
+#include "catch.hpp"
+
+#include "bytestream.h"
+#include "logic.h"
+
+using namespace std;
+using namespace logic;
+
+TEST_CASE("Serialize to strings and read back from spans", "[ByteStream]")
+{
+    GameState state;
+    state.startGame();
+    auto actions = state.getPossibleActions();
+
+    auto data = serialize(actions);
+    auto decoded = deserialize<vector<Action>>(data);
+    REQUIRE(serialize(decoded) == data);
+
+    // Reading only part of a buffer
+    string padded = data + "trailing bytes";
+    decoded = deserialize<vector<Action>>(padded.data(), data.size());
+    REQUIRE(decoded.size() == actions.size());
+
+    REQUIRE_THROWS(deserialize<vector<Action>>(data.data(), data.size() / 2));
+}
+
+TEST_CASE("Thread buffers keep their capacity", "[ByteStream]")
+{
+    GameState state;
+    state.startGame();
+
+    auto& buffer = threadBuffer();
+    serializeInto(buffer, state);
+    auto size = buffer.size();
+    auto capacity = buffer.capacity();
+    REQUIRE(size == serialize(state).size());
+
+    auto& again = threadBuffer();
+    REQUIRE(&again == &buffer);
+    REQUIRE(again.size() == 0);
+    REQUIRE(again.capacity() == capacity);
+}
@@ -8,6 +8,7 @@
 
 #include <subprocess.hpp>
 
+#include <random>
 #include <string>
 
 using namespace logic;
@@ -22,6 +23,10 @@ class GameClientTester : public GameClient
 
         string getGameId() {return gameId;};
         string getLoginToken() {return loginToken;};
+        string getStateETag() {return stateETag;};
+        HttpResponse request(string path, string data, list<string> headers) {
+            return makeHttpRequest(path, data, headers);
+        };
 };
 
 TEST_CASE("Basic Game Client Tests", "[GameClient]") {
@@ -140,3 +145,229 @@ TEST_CASE("Join by username", "[GameClient]")
     REQUIRE(client1.getMyPlayerId() != client2.getMyPlayerId());
 }
 
+
+TEST_CASE("Perform action and sync in one request", "[GameClient]")
+{
+    LocalServerStarter server;
+
+    GameClientTester client("localhost", 40000);
+    client.login("player1");
+    client.startGame();
+
+    auto response = client.sync(0);
+    while (not response) {
+        response = client.sync(0);
+    }
+    REQUIRE(response->changes.size() > 0);
+    REQUIRE(response->actions.size() > 0);
+    REQUIRE(response->actions.front().type == ACTION_NONE);
+
+    int lastChangeNo = response->changes.back().changeNo;
+
+    // Passing the main phase should come back with the phase change and the
+    // actions for the end phase
+    client.queueAction(response->actions.front());
+    response = client.sync(lastChangeNo);
+    while (not response) {
+        response = client.sync(lastChangeNo);
+    }
+    REQUIRE(response->changes.size() == 1);
+    REQUIRE(response->changes.front().type == CHANGE_PHASE_CHANGE);
+    REQUIRE(response->actions.size() == 1);
+    REQUIRE(response->actions.front().type == ACTION_NONE);
+}
+
+TEST_CASE("State is only resent after the game changes", "[GameClient]")
+{
+    LocalServerStarter server;
+
+    GameClientTester client("localhost", 40000);
+    client.login("player1");
+    client.startGame();
+
+    auto state = client.getState();
+    auto etag = client.getStateETag();
+    REQUIRE(etag.size() > 0);
+    REQUIRE(state.changes.size() == 0);
+    REQUIRE(client.getStateChangeNo() > 0);
+
+    // Nothing changed so the kept copy is used
+    state = client.getState();
+    REQUIRE(client.getStateETag() == etag);
+    REQUIRE(state.players.size() == 2);
+
+    auto withHistory = client.getState(true);
+    REQUIRE(withHistory.changes.size() == client.getStateChangeNo());
+
+    auto actions = client.getActions();
+    while (not actions.size()) {
+        actions = client.getActions();
+    }
+    client.performAction(actions.front());
+    usleep(2e5);
+
+    state = client.getState();
+    REQUIRE(client.getStateETag() != etag);
+    REQUIRE(state.turnInfo.phase.back() == PHASE_END);
+}
+
+TEST_CASE("Spectators follow a game without joining", "[GameClient]")
+{
+    LocalServerStarter server;
+
+    GameClientTester client("localhost", 40000);
+    client.login("player1");
+    client.startGame();
+
+    GameClientTester spectator1("localhost", 40000);
+    spectator1.spectateGame(client.getGameId());
+    GameClientTester spectator2("localhost", 40000);
+    spectator2.spectateGame(client.getGameId());
+
+    auto changes = spectator1.getSpectatorChanges(0);
+    REQUIRE(changes.size() > 0);
+    REQUIRE(spectator2.getSpectatorChanges(0).size() == changes.size());
+    int lastChangeNo = changes.back().changeNo;
+    REQUIRE(spectator1.getSpectatorChanges(lastChangeNo).size() == 0);
+
+    auto actions = client.getActions();
+    while (not actions.size()) {
+        actions = client.getActions();
+    }
+    client.performAction(actions.front());
+    usleep(2e5);
+
+    changes = spectator2.getSpectatorChanges(lastChangeNo);
+    REQUIRE(changes.size() == 1);
+    REQUIRE(changes.front().type == CHANGE_PHASE_CHANGE);
+    REQUIRE(changes.front().changeNo == lastChangeNo + 1);
+}
+
+TEST_CASE("Requests share kept-alive connections", "[GameClient]")
+{
+    LocalServerStarter server;
+
+    auto client = make_unique<GameClientTester>("localhost", 40000);
+    client->login("player1");
+    client->startGame();
+    for (int i = 0; i < 10; i++) {
+        client->getState();
+    }
+    auto actions = client->getActions();
+    while (not actions.size()) {
+        actions = client->getActions();
+    }
+    REQUIRE(client->connectionsOpened() <= 2);
+
+    // A request still in flight doesn't hold up shutting down
+    client->performAction(actions.front());
+    Timer timer;
+    client.reset();
+    REQUIRE(timer.get() < 0.1);
+}
+
+TEST_CASE("Actions sent again are only performed once", "[GameClient]")
+{
+    LocalServerStarter server;
+
+    GameClientTester client("localhost", 40000);
+    client.login("player1");
+    client.startGame();
+
+    auto state = client.getState(true);
+    auto actions = state.getPossibleActions(client.getMyPlayerId());
+    REQUIRE(actions.front().type == ACTION_NONE);
+
+    // As if the reply to the first request was lost
+    string path = "localhost/game/" + client.getGameId() + "/sync/0";
+    auto body = serialize(vector<Action>{actions.front()});
+    list<string> key = {string(IDEMPOTENCY_KEY_HEADER) + ": test:1"};
+    REQUIRE(client.request(path, body, key).code == 200);
+    REQUIRE(client.request(path, body, key).code == 200);
+
+    auto after = client.getState(true);
+    REQUIRE(after.changes.size() == state.changes.size() + 1);
+    REQUIRE(after.turnInfo.phase.back() == PHASE_END);
+}
+
+TEST_CASE("Actions sent again through the router are only performed once", "[GameClient]")
+{
+    LocalRouterStarter router(40100, 2);
+
+    GameClientTester client("localhost", 40100);
+    client.login("player1");
+    client.startGame();
+
+    auto state = client.getState(true);
+    auto actions = state.getPossibleActions(client.getMyPlayerId());
+    REQUIRE(actions.front().type == ACTION_NONE);
+
+    // The key has to reach the shard for it to notice
+    string gamePath = "localhost/game/" + client.getGameId();
+    list<string> key = {string(IDEMPOTENCY_KEY_HEADER) + ": test-perform:1"};
+    auto body = serialize(actions.front());
+    REQUIRE(client.request(gamePath + "/performaction", body, key).code == 200);
+    REQUIRE(client.request(gamePath + "/performaction", body, key).code == 200);
+
+    auto after = client.getState(true);
+    REQUIRE(after.changes.size() == state.changes.size() + 1);
+    REQUIRE(after.turnInfo.phase.back() == PHASE_END);
+}
+
+TEST_CASE("Retries back off and hedges wait for slow requests", "[GameClient]")
+{
+    HttpRequest request;
+    request.backoffMs = 50;
+    request.maxBackoffMs = 1000;
+    mt19937 rng(1);
+    long longest[4] = {};
+    for (int i = 0; i < 1000; i++) {
+        for (int failures = 1; failures <= 4; failures++) {
+            long delay = backoffDelayMs(request, failures, rng);
+            REQUIRE(delay >= 0);
+            REQUIRE(delay <= min(1000L, 50L << (failures - 1)));
+            longest[failures - 1] = max(longest[failures - 1], delay);
+        }
+    }
+    REQUIRE(longest[3] > longest[0]);
+    REQUIRE(backoffDelayMs(request, 30, rng) <= 1000);
+
+    LatencyWindow window(20);
+    for (int i = 1; i < 20; i++) {
+        window.add(i / 100.0);
+    }
+    // Not enough to go on yet
+    REQUIRE(window.percentile(0.95) == 0);
+    window.add(0.2);
+    REQUIRE(window.percentile(0.95) == Approx(0.2));
+    REQUIRE(window.percentile(0.5) == Approx(0.11));
+}
+
+TEST_CASE("The server takes forced actions for players who ask", "[GameClient]")
+{
+    LocalServerStarter server;
+
+    GameClientTester client("localhost", 40000);
+    client.login("player1");
+    client.startGame();
+    client.setAutoPass(AUTO_PASS_FORCED);
+
+    auto response = client.sync(0);
+    while (not response) {
+        response = client.sync(0);
+    }
+    int lastChangeNo = response->changes.back().changeNo;
+    REQUIRE(response->actions.front().type == ACTION_NONE);
+
+    // Passing the main phase also passes the end phase, which has nothing
+    // else to do, so the turn goes straight to the other player
+    client.queueAction(response->actions.front());
+    response = client.sync(lastChangeNo);
+    while (not response) {
+        response = client.sync(lastChangeNo);
+    }
+    REQUIRE(response->actions.size() == 0);
+    auto state = client.getState();
+    REQUIRE(state.turnInfo.whoseTurn != client.getMyPlayerId());
+    REQUIRE(state.turnInfo.phase.back() == PHASE_UPKEEP);
+}
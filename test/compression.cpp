@@ -0,0 +1,45 @@
+#include "catch.hpp"
+
+#include "compression.h"
+#include "bytestream.h"
+#include "logic.h"
+
+using namespace std;
+using namespace logic;
+
+TEST_CASE("Compressed states decompress to the same bytes", "[Compression]")
+{
+    GameState state;
+    state.startGame();
+    auto data = serialize(state);
+
+    auto compressed = compress(data);
+    REQUIRE(compressed.size() < data.size() / 2);
+    REQUIRE(decompress(compressed) == data);
+
+    // Streams made without the dictionary can still be read
+    REQUIRE(decompress(compress(data, 6, false)) == data);
+}
+
+TEST_CASE("The dictionary helps small replies", "[Compression]")
+{
+    GameState state;
+    state.startGame();
+    auto card = state.players.front().hand.front();
+    auto data = serialize(card);
+
+    REQUIRE(compress(data).size() < compress(data, 6, false).size());
+    REQUIRE(compress(data).size() < data.size() / 2);
+}
+
+TEST_CASE("Bad compressed data is rejected", "[Compression]")
+{
+    GameState state;
+    state.startGame();
+    auto data = serialize(state);
+    auto compressed = compress(data);
+
+    REQUIRE_THROWS(decompress(compressed.substr(0, compressed.size() / 2)));
+    REQUIRE_THROWS(decompress("not compressed at all"));
+    REQUIRE_THROWS(decompress(compressed, data.size() / 2));
+}
@@ -0,0 +1,48 @@
+#include "catch.hpp"
+
+#include "localgame.h"
+#include "logic.h"
+#include "timer.h"
+
+using namespace std;
+using namespace logic;
+
+TEST_CASE("Offline games are played against a bot in process", "[LocalGame]")
+{
+    LocalGameService service(1);
+    int me = service.getMyPlayerId();
+    auto copy = service.getState();
+    int changeNo = service.getStateChangeNo();
+    REQUIRE(copy.players.size() == 2);
+    REQUIRE(copy.changes.size() == 0);
+
+    // The first sync always replies, later ones only once something happened
+    auto response = service.sync(changeNo);
+    REQUIRE(response);
+
+    Timer timer;
+    int moves = 0;
+    // Either of us can lose our flagship early on, leaving nothing to do
+    while (moves < 3 and timer.get() < 2) {
+        if (response) {
+            for (auto& change : response->changes) {
+                REQUIRE(copy.apply(change));
+            }
+            changeNo += response->changes.size();
+            if (response->actions.size()) {
+                REQUIRE(response->actions.front().playerId == me);
+                service.queueAction(response->actions.front());
+                moves++;
+            }
+        }
+        response = service.sync(changeNo);
+    }
+    REQUIRE(moves > 0);
+
+    // The bot may have moved since the last sync
+    auto state = service.getState(true);
+    for (auto& change : state.getChangesAfter(changeNo)) {
+        REQUIRE(copy.apply(change));
+    }
+    REQUIRE(stateChecksum(copy) == stateChecksum(state));
+}
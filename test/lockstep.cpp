@@ -0,0 +1,144 @@
+#include "catch.hpp"
+
+#include "lockstep.h"
+#include "randomplay.h"
+#include "logic.h"
+
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+// Send a peer's actions and checksums through the encodings as a client would
+static LockstepReply exchange(LockstepLog& log, LockstepPeer& peer, int playerId,
+        vector<Action> actions)
+{
+    auto request = decodeLockstepRequest(encodeLockstepRequest({
+                .actions = actions,
+                .checksums = peer.takeChecksums(),
+                }));
+    bool rejected = request.actions.size()
+        and not log.append(playerId, peer.getActionNo(), request.actions);
+    log.check(request.checksums);
+    string reply;
+    log.writeReply(reply, peer.getActionNo(), rejected);
+    auto ret = decodeLockstepReply(reply);
+    for (auto& action : ret.actions) {
+        peer.perform(action);
+    }
+    return ret;
+}
+
+TEST_CASE("Lockstep peers stay in step with the server's game", "[Lockstep]")
+{
+    for (int seed = 0; seed < 10; seed++) {
+        GameState server;
+        server.startGame();
+        LockstepLog log(server, seed % 2);
+        LockstepPeer a(server), b(server);
+        int playerA = server.players.front().id;
+        mt19937 rng(seed);
+
+        int step = playRandomActions(server, 200, rng, [&](const Action& action, int) {
+            auto& mover = action.playerId == playerA ? a : b;
+            auto& other = action.playerId == playerA ? b : a;
+            REQUIRE(mover.canPerform(action));
+            auto reply = exchange(log, mover, action.playerId, {action});
+            REQUIRE(not reply.rejected);
+            REQUIRE(reply.actions.size() == 1);
+            exchange(log, other, 0, {});
+            REQUIRE(stateChecksum(a.getState()) == stateChecksum(server));
+            REQUIRE(stateChecksum(b.getState()) == stateChecksum(server));
+        });
+        exchange(log, a, 0, {});
+        auto reply = exchange(log, b, 0, {});
+        REQUIRE(reply.desyncTurn == 0);
+        REQUIRE(log.getActionCount() == step);
+        REQUIRE(a.getActionNo() == step);
+    }
+}
+
+TEST_CASE("Actions are brief", "[Lockstep]")
+{
+    GameState state;
+    state.startGame();
+    Action pass = {.type = ACTION_NONE, .playerId = state.turnInfo.activePlayer};
+    pass.description = "A long description that isn't sent";
+    auto encoded = encodeLockstepRequest({.actions = {pass, pass}});
+    REQUIRE(encoded.size() <= 12);
+    auto decoded = decodeLockstepRequest(encoded);
+    REQUIRE(decoded.actions.size() == 2);
+    REQUIRE(decoded.actions[0].type == ACTION_NONE);
+    REQUIRE(decoded.actions[0].playerId == pass.playerId);
+    REQUIRE(decoded.checksums.size() == 0);
+    REQUIRE_THROWS(decodeLockstepRequest(encoded.substr(0, encoded.size() - 1)));
+}
+
+TEST_CASE("Lockstep actions that can't be taken are refused", "[Lockstep]")
+{
+    GameState state;
+    state.startGame();
+    int active = state.turnInfo.activePlayer;
+    int other = state.otherPlayer(active);
+    Action pass = {.type = ACTION_NONE, .playerId = active};
+    // Placing a beacon needs one to place
+    Action beacon = {.type = ACTION_PLACE_BEACON, .playerId = active, .id = -1};
+
+    LockstepLog validated(state, true);
+    LockstepLog relayed(state, false);
+    for (auto log : {&validated, &relayed}) {
+        // Only the player's own actions
+        REQUIRE(not log->append(other, 0, {pass}));
+        REQUIRE(log->getActionCount() == 0);
+        REQUIRE(log->append(active, 0, {pass}));
+        // Someone has to have seen every action before adding more
+        REQUIRE(not log->append(active, 0, {pass}));
+        REQUIRE(log->getActionCount() == 1);
+    }
+    REQUIRE(not validated.append(active, 1, {beacon}));
+    REQUIRE(validated.getActionCount() == 1);
+    // Only games run on the server can tell
+    REQUIRE(relayed.append(active, 1, {beacon}));
+
+    string reply;
+    relayed.writeReply(reply, 0, false);
+    REQUIRE(decodeLockstepReply(reply).actions.size() == 2);
+    reply.clear();
+    relayed.writeReply(reply, 5, false);
+    REQUIRE(decodeLockstepReply(reply).actions.size() == 0);
+}
+
+TEST_CASE("Peers out of step are found from their checksums", "[Lockstep]")
+{
+    GameState state;
+    state.startGame();
+
+    SECTION("Between peers") {
+        LockstepLog log(state, false);
+        log.check({{1, 100}, {2, 200}});
+        log.check({{1, 100}});
+        REQUIRE(log.getDesyncTurn() == 0);
+        log.check({{2, 201}, {3, 300}});
+        REQUIRE(log.getDesyncTurn() == 2);
+        log.check({{3, 301}});
+        REQUIRE(log.getDesyncTurn() == 2);
+    }
+
+    SECTION("With the server's game") {
+        LockstepLog log(state, true);
+        LockstepPeer peer(state);
+        int turnEnded = 0;
+        for (int i = 0; i < 2; i++) {
+            Action pass = {.type = ACTION_NONE, .playerId = peer.getState().turnInfo.activePlayer};
+            REQUIRE(log.append(pass.playerId, peer.getActionNo(), {pass}));
+            peer.perform(pass);
+            turnEnded = peer.getTurn();
+        }
+        REQUIRE(turnEnded == 1);
+        auto checksums = peer.takeChecksums();
+        REQUIRE(checksums.size() == 1);
+        checksums[0].checksum++;
+        log.check(checksums);
+        REQUIRE(log.getDesyncTurn() == 1);
+    }
+}
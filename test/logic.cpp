@@ -1,9 +1,14 @@
 #include "catch.hpp"
 
 #include <optional>
+#include <sstream>
+#include <random>
 #include <prettyprint.hpp>
 
 #include "logic.h"
+#include "bytestream.h"
+#include "randomplay.h"
+#include "wireformat.h"
 
 using namespace logic;
 using namespace std;
@@ -74,6 +79,33 @@ TEST_CASE("Basic Game Logic Tests", "[GameState]") {
     }
 }
 
+TEST_CASE("Combat between ships that can't deal damage ends in a draw", "[GameState]")
+{
+    GameState state;
+    state.startGame();
+    REQUIRE(state.ships.size() == 2);
+    auto& first = state.ships.front();
+    auto& second = state.ships.back();
+    second.curSystemId = first.curSystemId;
+
+    // Resource ships never attack, without the draw this wouldn't return
+    first.kind = SHIP_RESOURCE;
+    second.kind = SHIP_RESOURCE;
+    state.changes.clear();
+    state.resolveCombats();
+    REQUIRE(state.ships.size() == 2);
+    REQUIRE(count_if(state.changes.begin(), state.changes.end(),
+                [](Change c) {return c.type == CHANGE_COMBAT_ROUND_END;}) == 1);
+    REQUIRE(getChangeOfType(CHANGE_COMBAT_END, state.changes));
+
+    // As long as one side can hurt the other it is fought to the end
+    second.kind = SHIP_NORMAL;
+    int winner = second.id;
+    state.resolveCombats();
+    REQUIRE(state.ships.size() == 1);
+    REQUIRE(state.ships.front().id == winner);
+}
+
 TEST_CASE("ResourceAmount arithmatic", "[ResourceAmount]")
 {
     SECTION("Simple tests") {
@@ -174,3 +206,120 @@ TEST_CASE("ResourceAmount arithmatic", "[ResourceAmount]")
         REQUIRE(*payment == correctPayment);
     }
 }
+
+static string withoutChanges(GameState state)
+{
+    state.changes.clear();
+    return serialize(state);
+}
+
+TEST_CASE("A copy kept up to date with apply matches the game", "[GameState]")
+{
+    for (int seed = 0; seed < 50; seed++) {
+        GameState game;
+        game.startGame();
+        // The copy starts from the state as a client gets it
+        auto copy = deserialize<GameState>(withoutChanges(game));
+        bindCallbacks(copy);
+        mt19937 rng(seed);
+        bool compact = seed % 2;
+
+        int step = 0;
+        playRandomActions(game, 300, rng, [&](const Action&, int before) {
+            auto changes = game.getChangesAfter(before);
+            changes = compact ? decodeChanges(encodeChanges(changes))
+                : deserialize<vector<Change>>(serialize(changes));
+            for (auto& change : changes) {
+                INFO("seed " << seed << " step " << step << " " << change);
+                REQUIRE(copy.apply(change));
+            }
+            INFO("seed " << seed << " step " << step);
+            REQUIRE(stateChecksum(copy) == stateChecksum(game));
+            REQUIRE(withoutChanges(copy) == withoutChanges(game));
+            step++;
+        });
+    }
+}
+
+TEST_CASE("Changes that don't fit the copy are refused", "[GameState]")
+{
+    GameState game;
+    game.startGame();
+    auto checksum = stateChecksum(game);
+
+    REQUIRE(not game.apply({.type = CHANGE_REMOVE_SHIP, .data = -1}));
+    REQUIRE(not game.apply({.type = CHANGE_PLAY_CARD, .data = -1}));
+    REQUIRE(not game.apply({.type = CHANGE_MOVE_SHIP, .data = 5}));
+    REQUIRE(stateChecksum(game) == checksum);
+
+    REQUIRE(game.apply({.type = CHANGE_OBJECT_IDS, .data = game.nextObjectId + 1}));
+    REQUIRE(stateChecksum(game) != checksum);
+}
+
+TEST_CASE("Changes carry their version through cereal", "[GameState]")
+{
+    Change change = {.changeNo = 3, .type = CHANGE_OBJECT_IDS, .data = 7, .checksum = 12345};
+    auto decoded = deserialize<Change>(serialize(change));
+    REQUIRE(decoded.changeNo == 3);
+    REQUIRE(decoded.checksum == 12345u);
+
+    stringstream json;
+    {
+        cereal::JSONOutputArchive archive(json);
+        archive(change);
+    }
+    auto readJson = [](const string& text) {
+        stringstream ss(text);
+        cereal::JSONInputArchive archive(ss);
+        Change read;
+        archive(read);
+        return read;
+    };
+    REQUIRE(readJson(json.str()).checksum == 12345u);
+
+    // As a state saved before changes were versioned has them
+    string old = json.str();
+    auto start = old.find("\"cereal_class_version\"");
+    REQUIRE(start != string::npos);
+    old.erase(start, old.find('\n', start) + 1 - start);
+    REQUIRE_THROWS_AS(readJson(old), cereal::Exception);
+}
+
+TEST_CASE("Actions are only taken for players who have no choice", "[GameState]")
+{
+    GameState state;
+    state.startGame();
+    int active = state.turnInfo.activePlayer;
+    REQUIRE(state.getPossibleActions(active).size() > 1);
+    REQUIRE(not state.autoAction(active, AUTO_PASS_FORCED));
+
+    // Nothing to do at the end of the turn but pass
+    state.performAction({.type = ACTION_NONE, .playerId = active});
+    REQUIRE(state.turnInfo.phase.back() == PHASE_END);
+    REQUIRE(not state.autoAction(active, AUTO_PASS_NEVER));
+    REQUIRE(not state.autoAction(active, AUTO_PASS_PRIORITY));
+    auto forced = state.autoAction(active, AUTO_PASS_FORCED);
+    REQUIRE(forced);
+    REQUIRE(forced->type == ACTION_NONE);
+    REQUIRE(not state.autoAction(state.otherPlayer(active), AUTO_PASS_FORCED));
+
+    for (int seed = 0; seed < 20; seed++) {
+        GameState game;
+        game.startGame();
+        mt19937 rng(seed);
+        auto checkAutoActions = [&game](auto&&...) {
+            for (auto& player : game.players) {
+                if (auto action = game.autoAction(player.id, AUTO_PASS_PRIORITY)) {
+                    REQUIRE(game.turnInfo.phase.back() == PHASE_RESOLVE_STACK);
+                    REQUIRE(action->type == ACTION_NONE);
+                }
+                if (auto action = game.autoAction(player.id, AUTO_PASS_FORCED)) {
+                    REQUIRE(game.getPossibleActions(player.id).size() == 1);
+                    REQUIRE(game.canPerform(*action));
+                }
+            }
+        };
+        checkAutoActions();
+        playRandomActions(game, 200, rng, checkAutoActions);
+    }
+}
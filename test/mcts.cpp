@@ -0,0 +1,113 @@
+#include "catch.hpp"
+
+#include "mcts.h"
+#include "randomplay.h"
+#include "logic.h"
+
+#include <algorithm>
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+static vector<string> cardNames(const list<Card>& a, const list<Card>& b = {})
+{
+    vector<string> names;
+    for (auto& card : a) {
+        names.push_back(card.name);
+    }
+    for (auto& card : b) {
+        names.push_back(card.name);
+    }
+    sort(names.begin(), names.end());
+    return names;
+}
+
+TEST_CASE("Determinizing only deals out cards the observer can't see", "[Mcts]")
+{
+    GameState state = randomGame(3, 10);
+    int observer = state.players.front().id;
+    mt19937 rng(1);
+    bool changed = false;
+    for (int i = 0; i < 20; i++) {
+        GameState copy = state;
+        determinize(copy, observer, rng);
+        auto before = state.players.begin();
+        for (auto& player : copy.players) {
+            REQUIRE(player.hand.size() == before->hand.size());
+            REQUIRE(player.deck.size() == before->deck.size());
+            REQUIRE(cardNames(player.hand, player.deck) == cardNames(before->hand, before->deck));
+            if (player.id == observer) {
+                REQUIRE(cardNames(player.hand) == cardNames(before->hand));
+            } else if (cardNames(player.hand) != cardNames(before->hand)) {
+                changed = true;
+            }
+            before++;
+        }
+    }
+    REQUIRE(changed);
+}
+
+TEST_CASE("Searches pick an action the player can take", "[Mcts]")
+{
+    auto parallelism = GENERATE(MCTS_ROOT_PARALLEL, MCTS_TREE_PARALLEL);
+    auto threads = GENERATE(1, 3);
+    auto playout = GENERATE(PLAYOUT_RANDOM, PLAYOUT_EAGER);
+
+    GameState state = randomGame(5, 6);
+    int playerId = state.turnInfo.activePlayer;
+    auto candidates = concreteActions(state.getPossibleActions(playerId));
+    REQUIRE(candidates.size() > 1);
+
+    MctsSearch search(500);
+    MctsConfig config;
+    config.budget = chrono::seconds(10);
+    config.maxIterations = 200;
+    config.threads = threads;
+    config.parallelism = parallelism;
+    config.playout = playout;
+    mt19937 rng(2);
+    auto result = search.search(state, playerId, config, rng);
+
+    REQUIRE(result.action);
+    REQUIRE(any_of(candidates.begin(), candidates.end(), [&](const Action& a) {
+                return actionKey(a) == actionKey(*result.action);}));
+    REQUIRE(result.iterations == 200);
+    REQUIRE(result.steps >= result.iterations);
+    REQUIRE(result.treeNodes > 1);
+    REQUIRE(result.treeNodes <= (parallelism == MCTS_TREE_PARALLEL ? 500u : 500u * threads));
+    REQUIRE(not result.cancelled);
+}
+
+TEST_CASE("Single threaded searches are repeatable", "[Mcts]")
+{
+    GameState state = randomGame(8, 12);
+    int playerId = state.turnInfo.activePlayer;
+    MctsConfig config;
+    config.budget = chrono::seconds(10);
+    config.maxIterations = 100;
+
+    MctsSearch search;
+    mt19937 rng1(4), rng2(4);
+    auto first = search.search(state, playerId, config, rng1);
+    // Reuses the pool from the first search
+    auto second = search.search(state, playerId, config, rng2);
+    REQUIRE(first.action);
+    REQUIRE(actionKey(*first.action) == actionKey(*second.action));
+    REQUIRE(first.steps == second.steps);
+    REQUIRE(first.treeNodes == second.treeNodes);
+}
+
+TEST_CASE("Searches stop when the node pool is full", "[Mcts]")
+{
+    GameState state = randomGame(5, 6);
+    MctsSearch search(10);
+    MctsConfig config;
+    config.budget = chrono::seconds(10);
+    config.maxIterations = 300;
+    mt19937 rng(3);
+    auto result = search.search(state, state.turnInfo.activePlayer, config, rng);
+    REQUIRE(result.action);
+    REQUIRE(result.iterations == 300);
+    REQUIRE(result.treeNodes == 10);
+}
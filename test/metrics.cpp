@@ -0,0 +1,60 @@
+#include "catch.hpp"
+
+#include "metrics.h"
+
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+TEST_CASE("Counters sum updates from all threads", "[Metrics]")
+{
+    Counter counter;
+    vector<thread> threads;
+    for (int i = 0; i < 8; i++) {
+        threads.push_back(thread([&counter]{
+            for (int j = 0; j < 1000; j++) {
+                counter.add();
+            }
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    REQUIRE(counter.get() == 8000);
+
+    Gauge gauge;
+    gauge.add(5);
+    gauge.add(-2);
+    REQUIRE(gauge.get() == 3);
+}
+
+TEST_CASE("Histogram buckets", "[Metrics]")
+{
+    Histogram histogram({1, 2, 3});
+    histogram.observe(0.5);
+    histogram.observe(1.5);
+    histogram.observe(1.5);
+    histogram.observe(10);
+
+    auto snapshot = histogram.get();
+    REQUIRE(snapshot.count == 4);
+    REQUIRE(snapshot.sum == Approx(13.5));
+    REQUIRE(snapshot.cumulativeCounts == vector<uint64_t>({1, 3, 3, 4}));
+}
+
+TEST_CASE("Prometheus text output", "[Metrics]")
+{
+    MetricsRegistry registry;
+    registry.counter("requests_total", "route=\"/state\"").add(3);
+    registry.histogram("latency_seconds", "route=\"/state\"", "", {0.5}).observe(0.1);
+    registry.gaugeFunction("users", []{return 7;});
+
+    auto text = registry.render();
+    REQUIRE(text.find("# TYPE requests_total counter") != string::npos);
+    REQUIRE(text.find("requests_total{route=\"/state\"} 3") != string::npos);
+    REQUIRE(text.find("latency_seconds_bucket{route=\"/state\",le=\"0.5\"} 1") != string::npos);
+    REQUIRE(text.find("latency_seconds_bucket{route=\"/state\",le=\"+Inf\"} 1") != string::npos);
+    REQUIRE(text.find("latency_seconds_count{route=\"/state\"} 1") != string::npos);
+    REQUIRE(text.find("users 7") != string::npos);
+}
@@ -0,0 +1,153 @@
+#include "catch.hpp"
+
+#include "prediction.h"
+#include "rollingchecksum.h"
+#include "bytestream.h"
+#include "randomplay.h"
+#include "logic.h"
+
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+// The state as a client gets it from the server
+static GameState received(GameState& server)
+{
+    auto state = deserialize<GameState>(serialize(server));
+    bindCallbacks(state);
+    return state;
+}
+
+TEST_CASE("Predicted actions match what the server does", "[Prediction]")
+{
+    for (int seed = 0; seed < 20; seed++) {
+        GameState server;
+        server.startGame();
+        mt19937 rng(seed);
+        int me = server.players.front().id;
+        RollingChecksum checksum;
+        checksum.reset(server);
+
+        Prediction prediction;
+        prediction.reset(received(server), server.changes.size());
+        for (int step = 0; step < 100; step++) {
+            auto actions = server.getPossibleActions();
+            if (not actions.size()) {
+                break;
+            }
+            auto action = randomAction(actions, rng);
+            int before = server.changes.size();
+            if (action.playerId == me) {
+                auto predicted = prediction.predict(action);
+                server.performAction(action);
+                checksum.stamp(server, before);
+                auto check = prediction.reconcile(server.getChangesAfter(before));
+                REQUIRE(predicted.size() == server.changes.size() - before);
+                REQUIRE(not check.mispredicted);
+                REQUIRE(check.unpredicted.size() == 0);
+            } else {
+                server.performAction(action);
+                checksum.stamp(server, before);
+                auto check = prediction.reconcile(server.getChangesAfter(before));
+                REQUIRE(check.unpredicted.size() == server.changes.size() - before);
+            }
+            // Only changes are used to keep up with the other player, and
+            // the checksums on them all match
+            REQUIRE(prediction.canPredict());
+        }
+        REQUIRE(stateChecksum(*prediction.getState()) == stateChecksum(server));
+        REQUIRE(prediction.getMispredicted() == 0);
+        REQUIRE(prediction.getDiverged() == 0);
+    }
+}
+
+TEST_CASE("Mispredictions are reported and the server's game kept", "[Prediction]")
+{
+    GameState server;
+    server.startGame();
+    int me = server.turnInfo.activePlayer;
+
+    Prediction prediction;
+    prediction.reset(received(server), server.changes.size());
+    Action pass = {.type = ACTION_NONE, .playerId = me};
+    auto predicted = prediction.predict(pass);
+    REQUIRE(predicted.size());
+    REQUIRE(predicted.front().changeNo == (int) server.changes.size() + 1);
+
+    // The server does something else, eg. the client was out of date
+    Action other = pass;
+    for (auto& action : server.getPossibleActions()) {
+        if (action.type != ACTION_NONE) {
+            other = action;
+            break;
+        }
+    }
+    REQUIRE(other.type != ACTION_NONE);
+    int before = server.changes.size();
+    server.performAction(other);
+    auto check = prediction.reconcile(server.getChangesAfter(before));
+    REQUIRE(check.mispredicted);
+    REQUIRE(not check.diverged);
+    REQUIRE(prediction.getMispredicted() == 1);
+    REQUIRE(prediction.getChangeNo() == (int) server.changes.size());
+    // What's shown is rebuilt from the copy, which has none of the prediction
+    REQUIRE(prediction.getState());
+    REQUIRE(stateChecksum(*prediction.getState()) == stateChecksum(server));
+    REQUIRE(prediction.canPredict());
+}
+
+TEST_CASE("A copy that stops matching the server is dropped", "[Prediction]")
+{
+    GameState server;
+    server.startGame();
+    RollingChecksum checksum;
+    checksum.reset(server);
+    Prediction prediction;
+    prediction.reset(received(server), server.changes.size());
+    int start = server.changes.size();
+
+    Action pass = {.type = ACTION_NONE, .playerId = server.turnInfo.activePlayer};
+    server.performAction(pass);
+    checksum.stamp(server, start);
+    auto changes = server.getChangesAfter(start);
+    REQUIRE(prediction.reconcile(changes).unpredicted.size() == changes.size());
+    // Changes already received are ignored
+    REQUIRE(prediction.reconcile(changes).unpredicted.size() == 0);
+
+    // Checks the checksum on a change once it's applied
+    auto passWithChecksum = [&server, &checksum](uint32_t wrongBy) {
+        int before = server.changes.size();
+        server.performAction({.type = ACTION_NONE, .playerId = server.turnInfo.activePlayer});
+        auto changes = server.getChangesAfter(before);
+        for (auto& change : changes) {
+            checksum.mark(change);
+        }
+        changes.back().checksum = checksum.get(server) + wrongBy;
+        return changes;
+    };
+    REQUIRE(not prediction.reconcile(passWithChecksum(0)).diverged);
+    REQUIRE(prediction.canPredict());
+
+    SECTION("Checksum doesn't match") {
+        auto check = prediction.reconcile(passWithChecksum(1));
+        REQUIRE(check.diverged);
+        REQUIRE(not prediction.canPredict());
+        REQUIRE(not prediction.getState());
+        REQUIRE(prediction.getDiverged() == 1);
+    }
+
+    SECTION("Some changes were missed") {
+        int before = server.changes.size();
+        server.performAction({.type = ACTION_NONE, .playerId = server.turnInfo.activePlayer});
+        server.performAction({.type = ACTION_NONE, .playerId = server.turnInfo.activePlayer});
+        auto check = prediction.reconcile(server.getChangesAfter(before + 1));
+        REQUIRE(check.diverged);
+        REQUIRE(not prediction.canPredict());
+    }
+
+    // A fresh state from the server starts it again
+    prediction.reset(received(server), server.changes.size());
+    REQUIRE(prediction.canPredict());
+    REQUIRE(prediction.predict({.type = ACTION_NONE, .playerId = server.turnInfo.activePlayer}).size());
+}
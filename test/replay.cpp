@@ -0,0 +1,117 @@
+#include "catch.hpp"
+
+#include "replay.h"
+#include "randomplay.h"
+#include "logic.h"
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+const string TEST_REPLAY = "replay_test.replay";
+
+// The checksum of the game after each action, from none to all of them
+vector<uint32_t> recordRandomGame(const string& path, int seed, int nActions, int interval)
+{
+    GameState state;
+    state.startGame();
+    ReplayWriter writer(path, state, interval);
+    vector<uint32_t> checksums = {stateChecksum(state)};
+    mt19937 rng(seed);
+    playRandomActions(state, nActions, rng, [&](const Action& action, int before) {
+        writer.add(action, state.changes.size() - before, state);
+        checksums.push_back(stateChecksum(state));
+    });
+    REQUIRE(writer.getChangeCount() == (int) state.changes.size());
+    return checksums;
+}
+
+TEST_CASE("Replays go to any point from the nearest snapshot", "[Replay]")
+{
+    auto checksums = recordRandomGame(TEST_REPLAY, 1, 200, 7);
+    auto replay = ReplayPlayer::load(TEST_REPLAY);
+    REQUIRE(replay.getActionCount() == (int) checksums.size() - 1);
+    REQUIRE(replay.getSnapshotCount() == replay.getActionCount() / 7 + 1);
+    REQUIRE(replay.verify() == -1);
+    REQUIRE(stateChecksum(replay.getState()) == checksums[0]);
+
+    // Forwards, backwards, past a snapshot and back to the start
+    int n = replay.getActionCount();
+    for (int to : {n / 2, n / 3, n / 3 + 2, n, 0, n + 5}) {
+        replay.seekToAction(to);
+        int expected = min(to, n);
+        REQUIRE(replay.getActionNo() == expected);
+        REQUIRE(stateChecksum(replay.getState()) == checksums[expected]);
+    }
+
+    // Stepping gives the changes as the game made them
+    replay.seekToAction(0);
+    GameState copy = replay.getState();
+    int changeNo = replay.getChangeNo();
+    while (not replay.atEnd()) {
+        for (auto& change : replay.step()) {
+            REQUIRE(change.changeNo == ++changeNo);
+            REQUIRE(copy.apply(change));
+        }
+        REQUIRE(replay.getChangeNo() == changeNo);
+    }
+    REQUIRE(stateChecksum(copy) == checksums.back());
+
+    // Going to a change ends up just after the action that made it
+    int middle = (replay.getFirstChangeNo() + replay.getLastChangeNo()) / 2;
+    replay.seekToChange(middle);
+    REQUIRE(replay.getChangeNo() >= middle);
+    REQUIRE(replay.getActionNo() > 0);
+    int actionNo = replay.getActionNo();
+    replay.seekToAction(actionNo - 1);
+    REQUIRE(replay.getChangeNo() < middle);
+
+    remove(TEST_REPLAY.c_str());
+}
+
+TEST_CASE("Replays carry on after a torn record", "[Replay]")
+{
+    GameState state;
+    state.startGame();
+    mt19937 rng(2);
+    {
+        ReplayWriter writer(TEST_REPLAY, state, 5);
+        REQUIRE(playRandomActions(state, 12, rng, [&](const Action& action, int before) {
+            writer.add(action, state.changes.size() - before, state);
+        }) == 12);
+    }
+    {
+        ofstream ofs(TEST_REPLAY, ios::binary | ios::app);
+        ofs.write("\x30\0\0\0torn", 8);
+    }
+    REQUIRE(ReplayPlayer::load(TEST_REPLAY).getActionCount() == 12);
+
+    auto writer = ReplayWriter::resume(TEST_REPLAY, 5);
+    REQUIRE(writer);
+    REQUIRE(writer->getActionCount() == 12);
+    REQUIRE(writer->getChangeCount() == (int) state.changes.size());
+    uint32_t carriedOn = 0;
+    REQUIRE(playRandomActions(state, 2, rng, [&](const Action& action, int before) {
+        if (not carriedOn) {
+            writer->add(action, state.changes.size() - before, state);
+            carriedOn = stateChecksum(state);
+        } else {
+            // A wrong count of changes is caught when verifying
+            writer->add(action, state.changes.size() - before + 1, state);
+        }
+    }) == 2);
+    writer.reset();
+
+    auto replay = ReplayPlayer::load(TEST_REPLAY);
+    REQUIRE(replay.getActionCount() == 14);
+    REQUIRE(replay.verify() == 14);
+    replay.seekToAction(13);
+    REQUIRE(stateChecksum(replay.getState()) == carriedOn);
+
+    REQUIRE_FALSE(ReplayWriter::resume("no_such_replay.replay"));
+    REQUIRE_THROWS(ReplayPlayer(string("SGSNAP\r\n not a replay")));
+    remove(TEST_REPLAY.c_str());
+}
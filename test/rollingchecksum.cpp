@@ -0,0 +1,89 @@
+#include "catch.hpp"
+
+#include "rollingchecksum.h"
+#include "bytestream.h"
+#include "randomplay.h"
+#include "logic.h"
+
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+static uint32_t freshChecksum(const GameState& state)
+{
+    RollingChecksum checksum;
+    checksum.reset(state);
+    return checksum.get(state);
+}
+
+TEST_CASE("Rolling checksums keep up with the game", "[RollingChecksum]")
+{
+    for (int seed = 0; seed < 20; seed++) {
+        GameState server;
+        server.startGame();
+        RollingChecksum checksum;
+        checksum.reset(server);
+
+        // A copy kept up to date with the changes, as a client does
+        auto copy = deserialize<GameState>(serialize(server));
+        bindCallbacks(copy);
+        copy.changes.clear();
+        RollingChecksum copyChecksum;
+        copyChecksum.reset(copy);
+
+        mt19937 rng(seed);
+        int stamped = 0;
+        playRandomActions(server, 300, rng, [&](const Action&, int before) {
+            checksum.stamp(server, before);
+            REQUIRE(checksum.get(server) == freshChecksum(server));
+
+            for (auto& change : server.getChangesAfter(before)) {
+                REQUIRE(copy.apply(change));
+                REQUIRE(copyChecksum.check(copy, change));
+                stamped += change.checksum.has_value();
+            }
+        });
+        int nChanges = server.changes.size();
+        REQUIRE(stamped > 0);
+        REQUIRE(stamped <= nChanges / ROLLING_CHECKSUM_INTERVAL);
+    }
+}
+
+TEST_CASE("Rolling checksums tell games apart", "[RollingChecksum]")
+{
+    GameState a = randomGame(5, 30);
+    REQUIRE(a.ships.size());
+    uint32_t original = freshChecksum(a);
+
+    // Objects are found by id, not by where they are in the lists
+    GameState reordered = a;
+    reordered.ships.reverse();
+    reordered.systems.reverse();
+    REQUIRE(freshChecksum(reordered) == original);
+
+    vector<function<void(GameState&)>> edits = {
+        [](GameState& s) {s.ships.front().armour++;},
+        [](GameState& s) {s.ships.pop_back();},
+        [](GameState& s) {s.systems.front().controllerId = -1;},
+        [](GameState& s) {s.players.front().resources[RESOURCE_AI]++;},
+        [](GameState& s) {s.players.back().hand.push_back(s.players.back().deck.front());},
+        [](GameState& s) {s.players.front().deck.reverse();},
+        [](GameState& s) {s.turnInfo.phase.push_back(PHASE_END);},
+        [](GameState& s) {s.nextObjectId++;},
+    };
+    for (auto& edit : edits) {
+        GameState b = a;
+        edit(b);
+        REQUIRE(freshChecksum(b) != original);
+    }
+
+    // A part that is marked is hashed again
+    GameState b = a;
+    RollingChecksum checksum;
+    checksum.reset(b);
+    b.ships.front().armour++;
+    REQUIRE(checksum.get(b) == original);
+    checksum.mark({.type = CHANGE_SHIP_CHANGE, .data = b.ships.front()});
+    REQUIRE(checksum.get(b) == freshChecksum(b));
+}
@@ -0,0 +1,68 @@
+#include "catch.hpp"
+
+#include "sessions.h"
+
+using namespace std;
+
+TEST_CASE("Session lookups", "[SessionService]")
+{
+    SessionService sessions;
+
+    auto a = sessions.login("player1", "TOKENAAA");
+    auto b = sessions.login("player2", "TOKENBBB");
+    REQUIRE(a.sessionId != b.sessionId);
+    REQUIRE(sessions.size() == 2);
+
+    auto byToken = sessions.getByToken("TOKENBBB");
+    REQUIRE(byToken);
+    REQUIRE(byToken->username == "player2");
+    REQUIRE(not sessions.getByToken("NOTATOKN"));
+
+    sessions.joinedGame(a.sessionId, "GAMEID01", 3);
+    auto byUsername = sessions.getByUsername("player1");
+    REQUIRE(byUsername);
+    REQUIRE(byUsername->currentGame == "GAMEID01");
+    REQUIRE(byUsername->playerId == 3);
+    REQUIRE(not sessions.getByUsername("player3"));
+
+    SECTION("Logging in again") {
+        auto again = sessions.login("player1", "TOKENCCC");
+        REQUIRE(sessions.getByUsername("player1")->sessionId == again.sessionId);
+        // Still in the same game, so others can still join by username
+        REQUIRE(again.currentGame == "GAMEID01");
+        REQUIRE(again.playerId == 3);
+        // Old token is still usable
+        REQUIRE(sessions.getByToken("TOKENAAA"));
+    }
+}
+
+TEST_CASE("Session expiry", "[SessionService]")
+{
+    auto now = chrono::steady_clock::time_point{};
+    SessionService sessions(chrono::minutes(40), [&now]() {return now;});
+
+    sessions.login("idle", "TOKENAAA");
+    sessions.login("active", "TOKENBBB");
+    sessions.login("rejoining", "TOKENCCC");
+
+    for (int i = 0; i < 4; i++) {
+        now += chrono::minutes(15);
+        sessions.getByToken("TOKENBBB");
+        sessions.getByUsername("rejoining");
+    }
+    sessions.collectExpired();
+
+    REQUIRE(sessions.size() == 2);
+    REQUIRE(not sessions.getByToken("TOKENAAA"));
+    REQUIRE(not sessions.getByUsername("idle"));
+    REQUIRE(sessions.getByUsername("active"));
+    REQUIRE(sessions.getByToken("TOKENCCC"));
+
+    // Only expires once it has been idle for the whole timeout
+    now += chrono::minutes(39);
+    sessions.collectExpired();
+    REQUIRE(sessions.size() == 2);
+    now += chrono::minutes(1);
+    sessions.collectExpired();
+    REQUIRE(sessions.size() == 0);
+}
@@ -0,0 +1,35 @@
+#include "catch.hpp"
+
+#include "sharding.h"
+
+#include <map>
+
+using namespace std;
+
+TEST_CASE("Game ids are spread over shards consistently", "[ShardRing]")
+{
+    ShardRing three(3);
+    ShardRing four(4);
+
+    map<int, int> counts;
+    int moved = 0;
+    int n = 10000;
+    for (int i = 0; i < n; i++) {
+        string gameId = "GAME" + to_string(i);
+        int shard = three.shardFor(gameId);
+        REQUIRE(shard == three.shardFor(gameId));
+        counts[shard]++;
+        // Adding a shard only moves games onto the new shard
+        int newShard = four.shardFor(gameId);
+        if (newShard != shard) {
+            REQUIRE(newShard == 3);
+            moved++;
+        }
+    }
+
+    for (int shard = 0; shard < 3; shard++) {
+        REQUIRE(counts[shard] > n / 6);
+    }
+    REQUIRE(moved < n / 2);
+    REQUIRE(ShardRing(1).shardFor("ANYTHING") == 0);
+}
@@ -0,0 +1,97 @@
+#include "catch.hpp"
+
+#include "snapshot.h"
+#include "bytestream.h"
+#include "randomplay.h"
+#include "logic.h"
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+const string TEST_SNAPSHOT = "snapshot_test.snap";
+
+TEST_CASE("Games load from a snapshot as they were saved", "[Snapshot]")
+{
+    vector<GameState> states = {randomGame(1, 0), randomGame(2, 15), randomGame(3, 24)};
+    {
+        SnapshotWriter writer;
+        writer.add("c", states[2]);
+        writer.add("a", states[0]);
+        writer.add("b", randomGame(4, 5));
+        // Replaces the game added before it
+        writer.add("b", states[1]);
+        writer.write(TEST_SNAPSHOT);
+    }
+
+    SnapshotArchive archive(TEST_SNAPSHOT);
+    REQUIRE(archive.size() == 3);
+    REQUIRE(archive.gameId(0) == "a");
+    REQUIRE_FALSE(archive.find("d"));
+
+    for (int i = 0; i < 3; i++) {
+        auto& saved = states[i];
+        auto loaded = archive.load(string(1, 'a' + i));
+        REQUIRE(loaded);
+        REQUIRE(serialize(*loaded) == serialize(saved));
+        REQUIRE(loaded->nextObjectId == saved.nextObjectId);
+        auto ship = saved.ships.begin();
+        for (auto& s : loaded->ships) {
+            REQUIRE(s.kind == ship->kind);
+            REQUIRE(s.owner == ship->owner);
+            ship++;
+        }
+
+        // Play on from both, which needs the card and ship callbacks back
+        mt19937 rngA(i), rngB(i);
+        playRandomActions(saved, 5, rngA);
+        playRandomActions(*loaded, 5, rngB);
+        REQUIRE(serialize(*loaded) == serialize(saved));
+    }
+
+    auto withoutHistory = archive.load("c", false);
+    REQUIRE(withoutHistory->changes.empty());
+
+    remove(TEST_SNAPSHOT.c_str());
+}
+
+TEST_CASE("Damaged snapshots are rejected", "[Snapshot]")
+{
+    {
+        SnapshotWriter writer;
+        writer.add("game", randomGame(5, 10));
+        writer.write(TEST_SNAPSHOT);
+    }
+    string data;
+    {
+        ifstream ifs(TEST_SNAPSHOT, ios::binary);
+        data.assign(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+    }
+    auto writeFile = [](const string& bytes) {
+        ofstream ofs(TEST_SNAPSHOT, ios::binary | ios::trunc);
+        ofs.write(bytes.data(), bytes.size());
+    };
+
+    // A flipped bit inside the game is found when the game is read
+    string damaged = data;
+    damaged[200] ^= 1;
+    writeFile(damaged);
+    {
+        SnapshotArchive archive(TEST_SNAPSHOT);
+        REQUIRE_THROWS_AS(archive.find("game"), runtime_error);
+    }
+
+    // A cut off file doesn't open at all
+    writeFile(data.substr(0, data.size() - 10));
+    REQUIRE_THROWS_AS(SnapshotArchive(TEST_SNAPSHOT), runtime_error);
+
+    damaged = data;
+    damaged[0] = 'X';
+    writeFile(damaged);
+    REQUIRE_THROWS_AS(SnapshotArchive(TEST_SNAPSHOT), runtime_error);
+
+    remove(TEST_SNAPSHOT.c_str());
+}
@@ -0,0 +1,121 @@
+#include "catch.hpp"
+
+#include "statediff.h"
+#include "snapshot.h"
+#include "randomplay.h"
+#include "logic.h"
+
+#include <random>
+
+using namespace std;
+using namespace logic;
+
+namespace {
+    // Turn from into to through the compact encoding, checking it worked
+    void requirePatches(const GameState& from, const GameState& to)
+    {
+        auto patch = diffGames(from, to);
+        auto decoded = decodePatch(encodePatch(patch));
+        GameState patched = from;
+        REQUIRE(applyPatch(patched, decoded));
+        REQUIRE(stateChecksum(patched) == stateChecksum(to));
+        REQUIRE(diffGames(patched, to).empty());
+
+        // The patched copy plays on just like the original
+        GameState original = to;
+        mt19937 rng1(7), rng2(7);
+        playRandomActions(patched, 10, rng1);
+        playRandomActions(original, 10, rng2);
+        REQUIRE(stateChecksum(patched) == stateChecksum(original));
+    }
+
+    // Changes a game couldn't get to by playing, to reach the odd cases
+    void scramble(GameState& state, mt19937& rng)
+    {
+        auto pick = [&rng](auto& items) {
+            return next(items.begin(), uniform_int_distribution<int>(0, items.size() - 1)(rng));
+        };
+        auto& player = *pick(state.players);
+        if (state.ships.empty()) {
+            state.ships.push_back(allShipDefinitions().front());
+        }
+        switch (uniform_int_distribution<int>(0, 6)(rng)) {
+            case 0:
+                pick(state.ships)->armour += 3;
+                break;
+            case 1:
+                state.ships.erase(pick(state.ships));
+                break;
+            case 2:
+                state.ships.reverse();
+                break;
+            case 3:
+                if (player.deck.size()) {
+                    player.discard.splice(player.discard.begin(), player.deck, pick(player.deck));
+                }
+                break;
+            case 4:
+                player.resources.erase(RESOURCE_MATERIALS);
+                player.resources[RESOURCE_AI] += 2;
+                break;
+            case 5:
+                pick(state.systems)->controllerId = player.id;
+                state.beacons.clear();
+                break;
+            case 6:
+                player.hand.reverse();
+                state.turnInfo.phase.push_back(PHASE_END);
+                break;
+        }
+    }
+}
+
+TEST_CASE("Patches turn one copy of a game into another", "[StateDiff]")
+{
+    GameState start;
+    start.startGame();
+    REQUIRE(diffGames(start, start).empty());
+
+    for (int seed = 0; seed < 20; seed++) {
+        mt19937 rng(seed);
+        GameState a = start;
+        playRandomActions(a, uniform_int_distribution<int>(0, 40)(rng), rng);
+
+        // A little behind
+        GameState b = a;
+        playRandomActions(b, uniform_int_distribution<int>(1, 5)(rng), rng);
+        requirePatches(a, b);
+        requirePatches(b, a);
+
+        // Played differently from the same start
+        GameState c = start;
+        mt19937 other(seed + 1000);
+        playRandomActions(c, uniform_int_distribution<int>(0, 40)(other), other);
+        requirePatches(a, c);
+
+        // Gone wrong in ways playing wouldn't
+        GameState d = a;
+        for (int i = 0; i < 3; i++) {
+            scramble(d, rng);
+        }
+        requirePatches(d, a);
+        requirePatches(a, d);
+    }
+}
+
+TEST_CASE("Patches are as small as what changed", "[StateDiff]")
+{
+    GameState a = randomGame(3, 20);
+    mt19937 rng(3);
+    GameState b = a;
+    playRandomActions(b, 1, rng);
+
+    auto encoded = encodePatch(diffGames(a, b));
+    REQUIRE(encoded.size() < flattenGame(b, false).size() / 10);
+
+    // A patch for some other game doesn't fit
+    auto patch = diffGames(a, b);
+    patch.removedShips.push_back(-1);
+    REQUIRE_FALSE(applyPatch(a, patch));
+    REQUIRE_THROWS(decodePatch(encoded + "x"));
+}
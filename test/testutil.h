@@ -3,6 +3,10 @@
 
 #include <subprocess.hpp>
 
+#include <csignal>
+#include <string>
+#include <unistd.h>
+
 class LocalServerStarter
 {
     public:
@@ -19,4 +23,24 @@ class LocalServerStarter
 
 };
 
+// A router on port with nShards servers of its own on the ports after it
+class LocalRouterStarter
+{
+    public:
+        LocalRouterStarter(int port, int nShards) {
+            p = new subprocess::Popen("./router --spawn --port " + std::to_string(port)
+                    + " --shards " + std::to_string(nShards) 
+                    + " --shard-port " + std::to_string(port + 1));
+            usleep(3e5);
+        }
+        ~LocalRouterStarter() {
+            // Not SIGKILL, the router stops its shards on SIGTERM
+            p->kill(SIGTERM);
+            p->wait();
+            delete p;
+        }
+    private:
+        subprocess::Popen *p;
+};
+
 #endif
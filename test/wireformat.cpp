@@ -0,0 +1,96 @@
+#include "catch.hpp"
+
+#include "wireformat.h"
+#include "randomplay.h"
+
+#include <climits>
+#include <sstream>
+
+using namespace std;
+using namespace logic;
+
+template <class T>
+string cerealBytes(const T& obj)
+{
+    stringstream ss;
+    {
+        cereal::PortableBinaryOutputArchive oarchive(ss);
+        oarchive(obj);
+    }
+    return ss.str();
+}
+
+TEST_CASE("Varints and zigzag integers", "[WireFormat]")
+{
+    vector<uint64_t> unsignedValues = {0, 1, 127, 128, 300, 1ull << 35, UINT64_MAX};
+    vector<int64_t> signedValues = {0, 1, -1, 63, -64, 64, INT_MAX, INT_MIN};
+
+    WireWriter w;
+    for (auto v : unsignedValues) {
+        w.varint(v);
+    }
+    for (auto v : signedValues) {
+        w.integer(v);
+    }
+    w.str("Drone Swarm");
+
+    WireReader r(w.data);
+    for (auto v : unsignedValues) {
+        REQUIRE(r.varint() == v);
+    }
+    for (auto v : signedValues) {
+        REQUIRE(r.integer() == v);
+    }
+    REQUIRE(r.str() == "Drone Swarm");
+    REQUIRE(r.done());
+
+    WireWriter small;
+    small.integer(-1);
+    small.varint(127);
+    REQUIRE(small.data.size() == 2);
+}
+
+TEST_CASE("Changes and actions survive the compact encoding", "[WireFormat]")
+{
+    for (int seed = 0; seed < 20; seed++) {
+        GameState state = randomGame(seed, 200);
+
+        auto changes = state.getChangesAfter(0);
+        for (size_t i = 0; i < changes.size(); i += 3) {
+            changes[i].checksum = (uint32_t) (i * 2654435761u);
+        }
+        auto encoded = encodeChanges(changes);
+        auto decoded = decodeChanges(encoded);
+        REQUIRE(decoded.size() == changes.size());
+        REQUIRE(cerealBytes(decoded) == cerealBytes(changes));
+        REQUIRE(encoded.size() < cerealBytes(changes).size());
+
+        auto actions = state.getPossibleActions();
+        auto both = decodeChangesAndActions(encodeChangesAndActions(changes, actions));
+        REQUIRE(cerealBytes(both.first) == cerealBytes(changes));
+        REQUIRE(cerealBytes(both.second) == cerealBytes(actions));
+    }
+}
+
+TEST_CASE("Cards that don't match a definition are sent in full", "[WireFormat]")
+{
+    Card card = allCardDefinitions().front();
+    card.cardText = "Something else entirely";
+    card.ownerId = 3;
+    Change change = {.type = CHANGE_DRAW_CARD, .data = pair<int, Card>(3, card)};
+
+    auto decoded = decodeChanges(encodeChanges({change}));
+    auto& drawn = get<pair<int, Card>>(decoded.front().data).second;
+    REQUIRE(drawn.cardText == "Something else entirely");
+    REQUIRE(drawn.ownerId == 3);
+    REQUIRE(cerealBytes(decoded.front()) == cerealBytes(change));
+}
+
+TEST_CASE("Truncated compact messages are rejected", "[WireFormat]")
+{
+    GameState state;
+    state.startGame();
+    auto encoded = encodeChanges(state.getChangesAfter(0));
+    REQUIRE_THROWS(decodeChanges(encoded.substr(0, encoded.size() / 2)));
+    REQUIRE_THROWS(decodeChanges(string(10, '\xff')));
+}